@@ -0,0 +1,449 @@
+// Micro benchmarks for server hot paths.
+// Usage: ./benchmark [players] [ticks] [recorded traffic]
+// The traffic file is what a client saw, captured with RECORD_TRAFFIC=path.
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include <zlib.h>
+#include "libs/world.hpp"
+#include "libs/enemy.hpp"
+#include "libs/spatial_hash.hpp"
+#include "libs/wire.hpp"
+#include "libs/frame_parser.hpp"
+
+using json = nlohmann::json;
+
+double timeIt(const std::string &label, int iterations, const std::function<void()> &fn)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        fn();
+    }
+    auto end = std::chrono::steady_clock::now();
+    double usPerIteration = std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+    std::cout << "  " << label << ": " << usPerIteration << " us/tick" << std::endl;
+    return usPerIteration;
+}
+
+// Builds the same document the old server kept in `json game`
+json buildJsonGame(int playerCount)
+{
+    json game = {
+        {"room1", {{"roomID", 1}, {"players", json::array()}, {"objects", json::array()}, {"enemies", json::array()}}},
+        {"room2", {{"roomID", 2}, {"players", json::array()}, {"objects", json::array()}, {"enemies", json::array()}}}};
+    for (int i = 0; i < playerCount; i++)
+    {
+        PlayerRecord p;
+        p.socket = 100 + i;
+        p.name = "player" + std::to_string(i);
+        p.room = (i % 2) + 1;
+        p.x = i % 600;
+        p.y = i % 300;
+        game[roomName(p.room)]["players"].push_back(p.toJson());
+    }
+    return game;
+}
+
+// What a room actor holds: its tables, and which row each of its players is in
+struct BenchRoom
+{
+    Room room;
+    std::unordered_map<int, EntityHandle> handles;
+};
+
+void buildRooms(std::vector<BenchRoom> &rooms, int playerCount)
+{
+    rooms.resize(2);
+    rooms[0].room.roomID = 1;
+    rooms[1].room.roomID = 2;
+    for (int i = 0; i < playerCount; i++)
+    {
+        PlayerRecord p;
+        p.socket = 100 + i;
+        p.name = "player" + std::to_string(i);
+        p.room = (i % 2) + 1;
+        p.x = i % 600;
+        p.y = i % 300;
+        BenchRoom &r = rooms[p.room - 1];
+        r.handles[p.socket] = r.room.players.add(p);
+    }
+}
+
+void benchWorldModel(int playerCount, int ticks)
+{
+    std::cout << "world model vs json model, " << playerCount << " players" << std::endl;
+
+    json game = buildJsonGame(playerCount);
+    std::vector<BenchRoom> rooms;
+    buildRooms(rooms, playerCount);
+
+    // Every player sends one position update per tick (handleMessage path)
+    double jsonUpdate = timeIt("json   position updates", ticks, [&]()
+                               {
+        for (int i = 0; i < playerCount; i++) {
+            int sockID = 100 + i;
+            for (auto &room : game.items()) {
+                bool found = false;
+                for (auto &p : room.value()["players"]) {
+                    if (p["socket"].get<int>() == sockID) {
+                        p["x"] = p["x"].get<int>() + 1;
+                        p["y"] = p["y"].get<int>() + 1;
+                        found = true;
+                        break;
+                    }
+                }
+                if (found) break;
+            }
+        } });
+    // Each update reaches the actor of the player's room, which finds its row
+    double worldUpdate = timeIt("world  position updates", ticks, [&]()
+                                {
+        for (int i = 0; i < playerCount; i++) {
+            BenchRoom &r = rooms[i % 2];
+            auto it = r.handles.find(100 + i);
+            int index = it != r.handles.end() ? r.room.players.handles.indexOf(it->second) : -1;
+            if (index >= 0) {
+                r.room.players.x[index]++;
+                r.room.players.y[index]++;
+            }
+        } });
+
+    // Serialization is unchanged in cost: it now only happens at the edge
+    timeIt("json   getGame dump", ticks, [&]()
+           { volatile size_t n = json{{"getGame", game}}.dump().size(); (void)n; });
+    timeIt("world  getGame dump", ticks, [&]()
+           {
+        json out = json::object();
+        for (const BenchRoom &r : rooms) {
+            out[roomName(r.room.roomID)] = r.room.toJson();
+        }
+        volatile size_t n = json{{"getGame", out}}.dump().size(); (void)n; });
+
+    std::cout << "  position update speedup: " << jsonUpdate / worldUpdate << "x" << std::endl;
+}
+
+// One tick of position updates, the most frequent message, in each wire format
+void benchWireFormats(int playerCount, int ticks)
+{
+    std::cout << "wire formats, one tick of " << playerCount << " position updates" << std::endl;
+
+    json updates = json::array();
+    for (int i = 0; i < playerCount; i++)
+    {
+        updates.push_back({{"updatePosition", {{"socket", 100 + i}, {"x", i % 600}, {"y", i % 300}, {"width", 32}, {"height", 32}, {"spriteState", 1}}}});
+    }
+    json tick = {{"tick", 12345}, {"updates", updates}};
+
+    for (WireFormat format : {WireFormat::Json, WireFormat::Cbor, WireFormat::MsgPack})
+    {
+        std::string encoded = encodeWire(tick, format);
+        std::cout << "  " << wireFormatName(format) << ": " << encoded.size() << " bytes" << std::endl;
+        timeIt(std::string(wireFormatName(format)) + " encode", ticks, [&]()
+               { volatile size_t n = encodeWire(tick, format).size(); (void)n; });
+        timeIt(std::string(wireFormatName(format)) + " decode", ticks, [&]()
+               {
+            WireReader reader;
+            reader.append(encoded.data(), encoded.size());
+            json out;
+            reader.next(out); });
+    }
+}
+
+// A room's enemy step: the nearest-player search one player at a time against
+// four at a time, then the whole kernel with its move events
+void benchEnemyStep(int playerCount, int ticks)
+{
+    const int enemyCount = 500;
+    std::cout << "enemy step, " << enemyCount << " enemies chasing " << playerCount << " players" << std::endl;
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> coord(0, 2000);
+    PlayerTable players;
+    for (int i = 0; i < playerCount; i++)
+    {
+        PlayerRecord p;
+        p.socket = 100 + i;
+        p.x = coord(rng);
+        p.y = coord(rng);
+        players.add(p);
+    }
+    EnemyTable enemies;
+    for (int i = 0; i < enemyCount; i++)
+    {
+        enemies.add(EnemyRecord{i, static_cast<float>(coord(rng)), static_cast<float>(coord(rng))});
+    }
+    TargetSet targets;
+    targets.assign(players);
+
+    double scalar = timeIt("scalar nearest player", ticks, [&]()
+                           {
+        int sum = 0;
+        for (size_t i = 0; i < enemies.size(); i++) {
+            sum += nearestTargetScalar(targets, enemies.x[i], enemies.y[i]).index;
+        }
+        volatile int n = sum; (void)n; });
+    double vector = timeIt("vector nearest player", ticks, [&]()
+                           {
+        int sum = 0;
+        for (size_t i = 0; i < enemies.size(); i++) {
+            sum += nearestTarget(targets, enemies.x[i], enemies.y[i]).index;
+        }
+        volatile int n = sum; (void)n; });
+    std::vector<EnemyMoved> moved;
+    timeIt("whole step", ticks, [&]()
+           {
+        moved.clear();
+        targets.assign(players);
+        stepEnemyKernel(enemies, targets, 1.0f / 60, moved); });
+    // Room 2's wall; players stand still, so after the first tick the fields are reused
+    RoomNavigation navigation;
+    navigation.rebuild({{410, 0, 93, 260}}, 64, 64);
+    timeIt("whole step, flow fields", ticks, [&]()
+           {
+        moved.clear();
+        targets.assign(players);
+        stepEnemyKernel(enemies, targets, 1.0f / 60, moved, &navigation); });
+    std::cout << "  flow field searches: " << navigation.searches() << " for " << ticks << " ticks" << std::endl;
+
+    std::cout << "  nearest player speedup: " << scalar / vector << "x" << std::endl;
+}
+
+// Every entity asking what it touches, as spawn checks and hits do: a scan of
+// the whole room against a grid query. The grid also pays for keeping up with
+// everything moving a little each tick.
+void benchSpatialHash(int ticks)
+{
+    const int entityCount = 2000;
+    std::cout << "collision queries, " << entityCount << " 64px boxes in a 4000px room" << std::endl;
+
+    std::mt19937 rng(2);
+    std::uniform_int_distribution<int> coord(0, 4000);
+    std::vector<SpatialBox> boxes;
+    SpatialHash grid;
+    for (int i = 0; i < entityCount; i++)
+    {
+        boxes.push_back({coord(rng), coord(rng), 64, 64});
+        grid.update(i, boxes.back());
+    }
+
+    double scan = timeIt("linear scan", ticks, [&]()
+                         {
+        int hits = 0;
+        for (const SpatialBox &a : boxes) {
+            for (const SpatialBox &b : boxes) {
+                hits += rectsOverlap(a.x, a.y, a.width, a.height, b.x, b.y, b.width, b.height);
+            }
+        }
+        volatile int n = hits; (void)n; });
+    std::vector<int> found;
+    double hashed = timeIt("grid query", ticks, [&]()
+                           {
+        int hits = 0;
+        for (const SpatialBox &a : boxes) {
+            grid.queryAabb(a, found);
+            hits += static_cast<int>(found.size());
+        }
+        volatile int n = hits; (void)n; });
+    int step = 0;
+    timeIt("grid update, all moving", ticks, [&]()
+           {
+        step = (step + 1) % 8;
+        for (int i = 0; i < entityCount; i++) {
+            SpatialBox moved = boxes[i];
+            moved.x += step;
+            grid.update(i, moved);
+        } });
+
+    std::cout << "  query speedup: " << scan / hashed << "x" << std::endl;
+}
+
+// zlib at its default level, which is what permessage-deflate does to a WebSocket message
+std::string deflateBytes(const std::string &in)
+{
+    uLongf size = compressBound(static_cast<uLong>(in.size()));
+    std::string out(size, '\0');
+    compress2(reinterpret_cast<Bytef *>(&out[0]), &size, reinterpret_cast<const Bytef *>(in.data()), static_cast<uLong>(in.size()), Z_DEFAULT_COMPRESSION);
+    out.resize(size);
+    return out;
+}
+
+// Bytes saved against CPU spent: LZ4 frames (TCP) and deflate (WebSockets) on
+// the login getGame and on one busy tick. Compression is done once per message
+// and shared by every session, decompression once per client.
+void benchCompression(int playerCount, int ticks)
+{
+    std::cout << "compression, getGame and one tick with " << playerCount << " players" << std::endl;
+
+    json updates = json::array();
+    for (int i = 0; i < playerCount; i += 4)
+    {
+        updates.push_back({{"updatePosition", {{"socket", 100 + i}, {"x", i % 600}, {"y", i % 300}}}});
+    }
+    std::vector<std::pair<std::string, json>> messages = {
+        {"getGame", {{"getGame", buildJsonGame(playerCount)}, {"gameVersion", 1}}},
+        {"tick", {{"tick", 12345}, {"updates", updates}}}};
+
+    for (const auto &[name, message] : messages)
+    {
+        for (WireFormat format : {WireFormat::Json, WireFormat::Cbor})
+        {
+            std::string label = name + " " + wireFormatName(format);
+            std::string plain = encodeWire(message, format);
+            std::string lz4 = encodeCompressedWire(message, format, WireCompression::Lz4);
+            std::string deflated = deflateBytes(plain);
+            std::cout << "  " << label << ": " << plain.size() << " bytes, lz4 " << lz4.size() << " ("
+                      << 100.0 * lz4.size() / plain.size() << "%), deflate " << deflated.size() << " ("
+                      << 100.0 * deflated.size() / plain.size() << "%)" << std::endl;
+
+            double encode = timeIt(label + " encode", ticks, [&]()
+                                   { volatile size_t n = encodeWire(message, format).size(); (void)n; });
+            double compressLz4 = timeIt(label + " encode + lz4", ticks, [&]()
+                                        { volatile size_t n = encodeCompressedWire(message, format, WireCompression::Lz4).size(); (void)n; });
+            double compressDeflate = timeIt(label + " deflate (after encode)", ticks, [&]()
+                                            { volatile size_t n = deflateBytes(plain).size(); (void)n; });
+            timeIt(label + " lz4 decode", ticks, [&]()
+                   { volatile bool ok = decodeWireFrame(lz4.data(), lz4.size()).is_object(); (void)ok; });
+            if (lz4.size() < plain.size())
+            {
+                std::cout << "  lz4 costs " << 1000 * (compressLz4 - encode) / (plain.size() - lz4.size())
+                          << " ns per byte saved, deflate " << 1000 * compressDeflate / (plain.size() - deflated.size())
+                          << std::endl;
+            }
+        }
+    }
+}
+
+// Stand-in for a capture: a full game, then ticks, with names that contain braces
+std::string synthesizeTraffic(int playerCount, int ticks)
+{
+    json game = buildJsonGame(playerCount);
+    for (auto &room : game.items())
+    {
+        for (auto &player : room.value()["players"])
+        {
+            player["name"] = player["name"].get<std::string>() + " {x}";
+        }
+    }
+    std::string traffic = json{{"getGame", game}, {"gameVersion", 1}}.dump() + "\n";
+    for (int t = 0; t < ticks; t++)
+    {
+        json updates = json::array();
+        for (int i = 0; i < playerCount; i += 4)
+        {
+            updates.push_back({{"updatePosition", {{"socket", 100 + i}, {"x", (i + t) % 600}, {"y", i % 300}, {"width", 32}, {"height", 32}, {"spriteState", 1}}}});
+        }
+        traffic += json{{"tick", t}, {"updates", updates}}.dump() + "\n";
+    }
+    return traffic;
+}
+
+// The client's old handleRead: find('{'), count braces, substr, erase(0, ...)
+size_t legacyBraceParse(const std::string &traffic, size_t chunkSize)
+{
+    std::string messageBuffer;
+    size_t messages = 0;
+    for (size_t offset = 0; offset < traffic.size(); offset += chunkSize)
+    {
+        messageBuffer.append(traffic, offset, chunkSize);
+        while (true)
+        {
+            size_t start = messageBuffer.find('{');
+            if (start == std::string::npos)
+            {
+                break;
+            }
+            int braceCount = 0;
+            size_t endPos = std::string::npos;
+            for (size_t i = start; i < messageBuffer.size(); i++)
+            {
+                if (messageBuffer[i] == '{') braceCount++;
+                else if (messageBuffer[i] == '}') braceCount--;
+                if (braceCount == 0 && i > start)
+                {
+                    endPos = i;
+                    break;
+                }
+            }
+            if (endPos == std::string::npos)
+            {
+                break;
+            }
+            std::string jsonStr = messageBuffer.substr(start, endPos - start + 1);
+            messageBuffer.erase(0, endPos + 1);
+            try
+            {
+                json parsed = json::parse(jsonStr);
+                messages += parsed.is_object();
+            }
+            catch (const json::parse_error &)
+            {
+                break;
+            }
+        }
+    }
+    return messages;
+}
+
+size_t frameParse(const std::string &traffic, size_t chunkSize)
+{
+    FrameParser parser;
+    size_t messages = 0;
+    json out;
+    for (size_t offset = 0; offset < traffic.size(); offset += chunkSize)
+    {
+        parser.append(traffic.data() + offset, std::min(chunkSize, traffic.size() - offset));
+        while (parser.next(out))
+        {
+            messages++;
+        }
+    }
+    return messages;
+}
+
+void benchClientParser(const std::string &traffic, const std::string &source)
+{
+    std::cout << "client stream parsing, " << traffic.size() << " bytes of " << source << std::endl;
+    for (size_t chunkSize : {size_t(512), size_t(4096)})
+    {
+        size_t legacyMessages = 0, parserMessages = 0;
+        double legacy = timeIt("legacy brace parser, " + std::to_string(chunkSize) + "-byte reads", 3, [&]()
+                               { legacyMessages = legacyBraceParse(traffic, chunkSize); });
+        double parser = timeIt("frame parser,        " + std::to_string(chunkSize) + "-byte reads", 3, [&]()
+                               { parserMessages = frameParse(traffic, chunkSize); });
+        std::cout << "  " << parserMessages << " messages (legacy saw " << legacyMessages << "), "
+                  << traffic.size() / parser << " MB/s vs " << traffic.size() / legacy << " MB/s" << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int players = argc > 1 ? std::atoi(argv[1]) : 300;
+    int ticks = argc > 2 ? std::atoi(argv[2]) : 100;
+
+    benchWorldModel(players, ticks);
+    benchWireFormats(players, ticks);
+    benchCompression(players, ticks);
+    benchEnemyStep(players, ticks);
+    benchSpatialHash(ticks);
+
+    if (argc > 3)
+    {
+        std::ifstream recording(argv[3], std::ios::binary);
+        std::string traffic((std::istreambuf_iterator<char>(recording)), std::istreambuf_iterator<char>());
+        benchClientParser(traffic, argv[3]);
+    }
+    else
+    {
+        benchClientParser(synthesizeTraffic(players, ticks), "synthetic traffic");
+    }
+    return 0;
+}
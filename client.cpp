@@ -2,6 +2,7 @@
 #include <string>
 #include <random>
 #include <thread>
+#include <atomic>
 #include <boost/asio.hpp>
 #include <nlohmann/json.hpp>
 #include <fstream>
@@ -11,6 +12,14 @@
 #include <cerrno>
 #include <cstring>
 #include "coolfunctions.hpp"
+#include "libs/snapshot.hpp"
+#include "libs/wire.hpp"
+#include "libs/frame_parser.hpp"
+#include "libs/udp_transport.hpp"
+#include "libs/movement.hpp"
+#include "libs/interpolation.hpp"
+#include "libs/clock_sync.hpp"
+#include "libs/spatial_hash.hpp"
 #include <raylib.h>
 #include <vector>
 
@@ -27,6 +36,7 @@ using SocketHandle = int;
 using namespace std;
 using namespace boost::asio;
 using ip::tcp;
+using ip::udp;
 using json = nlohmann::json;
 namespace fs = std::filesystem;
 fs::path root = fs::current_path();
@@ -39,6 +49,53 @@ json game = {
     }}
 };
 
+// Version of `game` last received from the server; acked so it can send deltas against it
+uint32_t gameVersion = 0;
+
+// WIRE_FORMAT=cbor|msgpack switches to binary frames after connecting; json keeps text for debugging
+WireFormat wireFormat = parseWireFormat(getEnvVar<std::string>("WIRE_FORMAT", "json"));
+
+void writeMessage(tcp::socket& socket, const json& message) {
+    boost::asio::write(socket, boost::asio::buffer(encodeWire(message, wireFormat)));
+}
+
+// WIRE_COMPRESSION=lz4 asks the server to compress big messages (getGame, whole rooms); none turns it off
+WireCompression wireCompression = parseWireCompression(getEnvVar<std::string>("WIRE_COMPRESSION", "lz4"));
+
+// Sent as text before anything else, since the server reads text until told otherwise
+void negotiateWireFormat(tcp::socket& socket) {
+    if (wireFormat != WireFormat::Json || wireCompression != WireCompression::None) {
+        json hello = {{"wire", wireFormatName(wireFormat)}, {"compress", wireCompressionName(wireCompression)}};
+        boost::asio::write(socket, boost::asio::buffer(hello.dump() + "\n"));
+    }
+}
+
+// USE_UDP=false keeps everything on TCP even when the server offers UDP
+const bool useUdp = getEnvVar<bool>("USE_UDP", true);
+// Made on the first {"udp": ...} offer and kept across reconnects; the server is peer 0
+std::unique_ptr<UdpEndpoint> udpLink;
+
+// Set when the server says an enemy got us; the main loop plays the death and respawns
+std::atomic<bool> deathPending{false};
+
+// Movement goes over UDP once the server can hear us there. A checklist that
+// changes the room or items has to arrive, so it takes the reliable channel.
+void sendChecklist(tcp::socket& socket, const json& checklist, const json& previous) {
+    if (udpLink && udpLink->established(0)) {
+        bool mustArrive = false;
+        for (const char* key : {"room", "shieldTouched", "quitGame"}) {
+            if (checklist.value(key, json()) != previous.value(key, json())) {
+                mustArrive = true;
+            }
+        }
+        auto frame = std::make_shared<const std::string>(encodeWireFrame(checklist, WireFormat::Cbor));
+        if (udpLink->send(0, frame, mustArrive ? UdpChannel::Reliable : UdpChannel::Sequenced)) {
+            return;
+        }
+    }
+    writeMessage(socket, checklist);
+}
+
 json checklist = {
     {"goingup", false},
     {"goingleft", false},
@@ -46,7 +103,6 @@ json checklist = {
     {"goingdown", false},
     {"quitGame", false},
     {"requestGame", false},
-    {"enemyTouched", 0},
     {"shieldTouched", false},
     {"x", 0},
     {"y", 0},
@@ -54,7 +110,6 @@ json checklist = {
     {"height", 64},
     {"currentGame", ""},
     {"currentPlayer", ""},
-    {"shieldCount", 0},
     {"spriteState", 1},
     {"room", 1},
     {"playerCount", 0},
@@ -63,6 +118,24 @@ json checklist = {
 
 json canMove = {{"w", true}, {"a", true}, {"s", true}, {"d", true}};
 
+// Our own movement, predicted from the commands we send (see libs/movement.hpp)
+InputPredictor movementPredictor;
+// Frame time not yet turned into input commands
+float inputStepAccumulator = 0.0f;
+
+std::vector<MoveBox> solidsIn(const json& room) {
+    std::vector<MoveBox> solids;
+    if (!room.is_object() || !room.contains("objects")) {
+        return solids;
+    }
+    for (const auto& object : room["objects"]) {
+        if (object.contains("objID") && isSolidObject(object["objID"].get<int>())) {
+            solids.push_back({object["x"].get<int>(), object["y"].get<int>(), object["width"].get<int>(), object["height"].get<int>()});
+        }
+    }
+    return solids;
+}
+
 bool checkCollision(const json& object1, const json& object2) {
     if (!object1.contains("x") || !object1.contains("y") || 
         !object2.contains("x") || !object2.contains("y") ||
@@ -142,13 +215,48 @@ bool checkWallCollision(const json& object1, const json& object2, int& wall) {
     return true;
 }
 
+// Cell size of the grids below (see libs/spatial_hash.hpp), in pixels
+const int spatialCellSize = getEnvVar<int>("SPATIAL_CELL_SIZE", SpatialHash::defaultCellSize);
+
+// The local room's objects by their index in game[room]["objects"]. Rebuilt
+// only when the objects change (objectsChanged) or we change rooms.
+struct ObjectGrid {
+    SpatialHash grid{spatialCellSize};
+    std::string room;
+    std::vector<int> found;
+
+    // Indexes of the objects touching the box
+    const std::vector<int>& touching(const json& objects, const std::string& roomName, int x, int y, int width, int height) {
+        if (objectsChanged || roomName != room) {
+            grid.clear();
+            for (size_t i = 0; i < objects.size(); i++) {
+                const json& o = objects[i];
+                if (o.contains("x") && o.contains("y") && o.contains("width") && o.contains("height")) {
+                    grid.update(static_cast<int>(i), {o["x"].get<int>(), o["y"].get<int>(), o["width"].get<int>(), o["height"].get<int>()});
+                }
+            }
+            room = roomName;
+            objectsChanged = false;
+        }
+        grid.queryAabb({x, y, width, height}, found);
+        std::sort(found.begin(), found.end());
+        return found;
+    }
+
+    // Set whenever anything adds or removes objects
+    bool objectsChanged = true;
+};
+ObjectGrid objectGrid;
+
 struct personalSpaceBubble {
     //10 inch increments in all directions
     int x;
     int y;
     int width;
     int height;
-    json playerslist;
+    // Everyone else in the room, by socket, moved along with them every frame
+    SpatialHash players{spatialCellSize};
+    std::vector<int> inside;
     json construct_bubble() {
         return {
             {"x", x-10},
@@ -165,20 +273,29 @@ struct personalSpaceBubble {
         height = height_;
         //you'll need to call constructBubble() to get the json object
     }
-    void add_player(json player) {
-        playerslist.push_back(player);
+    // Brings the grid up to date with this frame's players; only players who
+    // crossed into other cells touch it. Anyone who left the room since the
+    // last frame shows up as a size mismatch, and the grid starts over.
+    void track_players(const json& roomPlayers, int self) {
+        size_t count = 0;
+        for (const auto& p : roomPlayers) {
+            if (p["socket"].get<int>() != self) {
+                players.update(p["socket"].get<int>(), {p["x"].get<int>(), p["y"].get<int>(), p["width"].get<int>(), p["height"].get<int>()});
+                count++;
+            }
+        }
+        if (players.size() != count) {
+            players.clear();
+            track_players(roomPlayers, self);
+        }
     }
-    void clear_players() {
-        playerslist.clear();
+    // Sockets of the players in the bubble
+    const std::vector<int>& burst() {
+        players.queryAabb({x - 10, y - 10, width + 10, height + 10}, inside);
+        return inside;
     }
     bool check_burst() {
-        json bubbleJson = construct_bubble();
-        for (auto& p : playerslist.items()) {
-            if (checkCollision(bubbleJson, p)) {
-                return true;
-            }
-        }
-        return false;
+        return !burst().empty();
     }
     bool check_specific_burst(json player) {
         json bubbleJson = construct_bubble();
@@ -299,53 +416,108 @@ struct Position {
         : x(x_), y(y_), width(width_), height(height_) {}
 };
 
+// INTERPOLATION_DELAY_MS: how far behind the server others are drawn; more hides more jitter.
+// EXTRAPOLATION_LIMIT_MS: how long they keep moving once samples stop arriving.
+const InterpolationSettings interpolation{
+    getEnvVar<double>("INTERPOLATION_DELAY_MS", 100) / 1000.0,
+    getEnvVar<double>("EXTRAPOLATION_LIMIT_MS", 250) / 1000.0
+};
+// The server's clock: from timeSync exchanges, or from the ticks' "time" until the first reply
+ClockSync clockSync;
+SnapshotClock serverClock;
+// Server time of the message being handled, which its positions are stamped with
+double messageServerTime = 0;
+bool handlingTick = false;
+
+double localSeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double estimatedServerTime(double localNow) {
+    return clockSync.synced() ? clockSync.serverNow(localNow) : serverClock.now(localNow);
+}
+
+// The moment others are drawn at this frame
+double renderServerTime() {
+    return estimatedServerTime(localSeconds()) - interpolation.delay;
+}
+
+inline Snapshot toSnapshot(const Position& position, double time) {
+    return Snapshot{time, position.x, position.y, position.width, position.height};
+}
+
 struct PlayerState {
+    // Where it is drawn; for the local player, the prediction
     Position current;
-    Position target;
-    float interpolation = 0;
+    SnapshotBuffer samples;
     int spriteState = 0;
     std::string name;
     int socketId;
     int room = 1;  // Add room tracking, default to room1
-    
-    void update(float dt) {
-        if (interpolation < 1.0f) {
-            interpolation += dt * 10.0f; // Adjust this multiplier to control smoothing speed
-            if (interpolation > 1.0f) interpolation = 1.0f;
-            
-            current.x = current.x + (target.x - current.x) * interpolation;
-            current.y = current.y + (target.y - current.y) * interpolation;
-            current.width = current.width + (target.width - current.width) * interpolation;
-            current.height = current.height + (target.height - current.height) * interpolation;
-        }
+
+    // The newest known position, for partial updates
+    Position latest() const {
+        if (samples.empty()) return current;
+        const Snapshot& last = samples.newest();
+        return Position(last.x, last.y, last.width, last.height);
+    }
+    void record(const Position& position) { samples.push(toSnapshot(position, messageServerTime)); }
+    void place(const Position& position) {
+        current = position;
+        samples.reset(toSnapshot(position, messageServerTime));
+    }
+
+    void update(double renderTime) {
+        if (samples.empty()) return;
+        Snapshot s = samples.sample(renderTime, interpolation.maxExtrapolation);
+        current = Position(s.x, s.y, s.width, s.height);
     }
 };
 
 std::map<int, PlayerState> playerStates;
 
-// Add this after PlayerState struct and before client_main()
+// Drawn from these, like players; game[...]["enemies"] keeps the raw server state
 struct EnemyState {
     Position current;
-    Position target;
-    float interpolation = 0;
+    SnapshotBuffer samples;
     int id;
     int room = 1;
-    
-    void update(float dt) {
-        if (interpolation < 1.0f) {
-            interpolation += dt * 10.0f;
-            if (interpolation > 1.0f) interpolation = 1.0f;
-            
-            current.x = current.x + (target.x - current.x) * interpolation;
-            current.y = current.y + (target.y - current.y) * interpolation;
-            current.width = current.width + (target.width - current.width) * interpolation;
-            current.height = current.height + (target.height - current.height) * interpolation;
-        }
+
+    Position latest() const {
+        if (samples.empty()) return current;
+        const Snapshot& last = samples.newest();
+        return Position(last.x, last.y, last.width, last.height);
+    }
+    void record(const Position& position) { samples.push(toSnapshot(position, messageServerTime)); }
+    void place(const Position& position) {
+        current = position;
+        samples.reset(toSnapshot(position, messageServerTime));
+    }
+
+    void update(double renderTime) {
+        if (samples.empty()) return;
+        Snapshot s = samples.sample(renderTime, interpolation.maxExtrapolation);
+        current = Position(s.x, s.y, s.width, s.height);
     }
 };
 
 std::map<int, EnemyState> enemyStates;
 
+// After `game` is replaced wholesale; the enemies start where the server has them
+void resetEnemyStates() {
+    enemyStates.clear();
+    for (auto& [roomName, roomData] : game.items()) {
+        if (!roomData.contains("enemies")) continue;
+        for (auto& enemy : roomData["enemies"]) {
+            EnemyState& es = enemyStates[enemy["id"].get<int>()];
+            es.id = enemy["id"].get<int>();
+            es.room = enemy.value("room", roomName.size() > 4 ? std::stoi(roomName.substr(4)) : 1);
+            es.place(Position(enemy["x"].get<float>(), enemy["y"].get<float>(),
+                              enemy.value("width", 64.0f), enemy.value("height", 64.0f)));
+        }
+    }
+}
+
 json lookForEnemy(int id) {
     for (auto& [roomName, roomData] : game.items()) {
         if (roomData.contains("enemies")) {
@@ -372,24 +544,19 @@ void updateEPosition(const json& updateData) {
     }
     int enemyId = updateData["enemyId"].get<int>();
 
-    if (enemyStates.find(enemyId) == enemyStates.end()) {
-        enemyStates[enemyId] = EnemyState();
-        enemyStates[enemyId].id = enemyId;
-        // Initialize current position to match target for smooth initial state
-        enemyStates[enemyId].current = Position(
-            static_cast<float>(updateData["x"].get<int>()),
-            static_cast<float>(updateData["y"].get<int>()),
-            static_cast<float>(updateData["width"].get<int>()),
-            static_cast<float>(updateData["height"].get<int>())
-        );
-    }
-
-    enemyStates[enemyId].target = Position(
+    Position position(
         static_cast<float>(updateData["x"].get<int>()),
         static_cast<float>(updateData["y"].get<int>()),
         static_cast<float>(updateData["width"].get<int>()),
         static_cast<float>(updateData["height"].get<int>())
     );
+    if (enemyStates.find(enemyId) == enemyStates.end()) {
+        enemyStates[enemyId] = EnemyState();
+        enemyStates[enemyId].id = enemyId;
+        enemyStates[enemyId].place(position);
+    } else {
+        enemyStates[enemyId].record(position);
+    }
 
     json enemyPointerRaw = lookForEnemy(enemyId);
     int room;
@@ -399,7 +566,6 @@ void updateEPosition(const json& updateData) {
         enemy = enemyPointerRaw["enemy"].get<int>();
 
         enemyStates[enemyId].room = room;
-        enemyStates[enemyId].interpolation = 0;
 
         game["room" + std::to_string(room)]["enemies"][enemy]["x"] = updateData["x"];
         game["room" + std::to_string(room)]["enemies"][enemy]["y"] = updateData["y"];
@@ -409,348 +575,573 @@ void updateEPosition(const json& updateData) {
     }
 }
 
-void handleRead(const boost::system::error_code& error, std::size_t bytes_transferred, 
-                boost::asio::streambuf& buffer, 
-                json& localPlayer, bool& initGameFully, 
-                bool& gameRunning, tcp::socket& socket, bool& localPlayerSet) 
-{
-    if (error) {
-        std::cerr << "Read error: " << error.message() << std::endl;
-        return;
-    }
+// What a message from the server is, decided once from its main key
+enum class ServerMessageType {
+    Unknown,
+    Tick,
+    QuitGame,
+    LocalPlayer,
+    RemotePlayer,
+    UpdateShield,
+    PlayerItems,
+    PlayerLeft,
+    SwitchRoom,
+    GameDelta,
+    GetGame,
+    GetEnemy,
+    GetRoom,
+    UpdatePosition,
+    UpdateEPosition,
+    UdpOffer,
+    Ping,
+    TimeSync,
+    PlayerDead
+};
 
-    static std::string messageBuffer;
-    {
-        std::istream input_stream(&buffer);
-        std::string line;
-        // Read all lines from this operation
-        while (std::getline(input_stream, line)) {
-            messageBuffer += line;
+ServerMessageType classifyServerMessage(const json& messageJson) {
+    static const std::pair<const char*, ServerMessageType> keys[] = {
+        {"updates", ServerMessageType::Tick},
+        {"quitGame", ServerMessageType::QuitGame},
+        {"local", ServerMessageType::LocalPlayer},
+        {"updateShield", ServerMessageType::UpdateShield},
+        {"playerItems", ServerMessageType::PlayerItems},
+        {"playerLeft", ServerMessageType::PlayerLeft},
+        {"switchRoom", ServerMessageType::SwitchRoom},
+        {"gameDelta", ServerMessageType::GameDelta},
+        {"getGame", ServerMessageType::GetGame},
+        {"getEnemy", ServerMessageType::GetEnemy},
+        {"getRoom", ServerMessageType::GetRoom},
+        {"updatePosition", ServerMessageType::UpdatePosition},
+        {"updateEPosition", ServerMessageType::UpdateEPosition},
+        {"udp", ServerMessageType::UdpOffer},
+        {"ping", ServerMessageType::Ping},
+        {"timeSync", ServerMessageType::TimeSync},
+        {"playerDead", ServerMessageType::PlayerDead}
+    };
+    if (!messageJson.is_object()) {
+        return ServerMessageType::Unknown;
+    }
+    for (const auto& [key, type] : keys) {
+        auto it = messageJson.find(key);
+        if (it == messageJson.end()) {
+            continue;
+        }
+        if (type == ServerMessageType::LocalPlayer) {
+            return it->get<bool>() ? ServerMessageType::LocalPlayer : ServerMessageType::RemotePlayer;
+        }
+        if ((type == ServerMessageType::QuitGame || type == ServerMessageType::UpdateEPosition) && !it->get<bool>()) {
+            return ServerMessageType::Unknown;
         }
+        return type;
     }
+    return ServerMessageType::Unknown;
+}
 
-    bool parsedSomething = true;
-    while (parsedSomething) {
-        parsedSomething = false;
-        // Look for the start of a JSON object
-        size_t start = messageBuffer.find('{');
-        if (start == std::string::npos) {
-            // No opening brace found, no complete JSON here yet
-            break;
-        }
-
-        int braceCount = 0;
-        size_t endPos = std::string::npos;
-        for (size_t i = start; i < messageBuffer.size(); i++) {
-            if (messageBuffer[i] == '{') braceCount++;
-            else if (messageBuffer[i] == '}') braceCount--;
-
-            if (braceCount == 0 && i > start) {
-                // Found a complete JSON object from start to i
-                endPos = i;
-                break;
+// Applies one message from the server to the local game state.
+// Returns false once the server has told us to quit.
+bool handleServerMessage(ServerMessageType type, json& messageJson, json& localPlayer, bool& initGameFully,
+                         bool& gameRunning, tcp::socket& socket, bool& localPlayerSet) {
+    // The simulation sends each tick as {"tick": n, "time": s, "updates": [...]}: its events,
+    // then where everything in the room is.
+    // Anything sent outside a tick is stamped with our estimate of the server's time.
+    if (type == ServerMessageType::Tick) {
+        double localNow = localSeconds();
+        if (messageJson.contains("time")) {
+            messageServerTime = messageJson["time"].get<double>();
+            serverClock.observe(messageServerTime, localNow);
+            clockSync.arrived(messageServerTime, localNow);
+        } else {
+            messageServerTime = estimatedServerTime(localNow);
+        }
+        handlingTick = true;
+        for (auto& update : messageJson["updates"]) {
+            if (!handleServerMessage(classifyServerMessage(update), update, localPlayer, initGameFully, gameRunning, socket, localPlayerSet)) {
+                handlingTick = false;
+                return false;
             }
         }
+        handlingTick = false;
+        return true;
+    }
+    if (!handlingTick) {
+        double localNow = localSeconds();
+        if (messageJson.contains("time") && messageJson["time"].is_number()) {
+            messageServerTime = messageJson["time"].get<double>();
+            clockSync.arrived(messageServerTime, localNow);
+        } else {
+            messageServerTime = estimatedServerTime(localNow);
+        }
+    }
 
-        if (endPos == std::string::npos) {
-            // We found a '{' but never returned to braceCount == 0,
-            // meaning we don't have a full JSON object yet.
-            break;
+    // Answered straight away; the server measures our round trip from it and
+    // drops us if it stops hearing from us
+    if (type == ServerMessageType::Ping) {
+        json pong = {{"pong", messageJson["ping"]}};
+        writeMessage(socket, pong);
+        return true;
+    }
+
+    // Enemy hits are decided by the server; a hit with shields left only shows as playerItems
+    if (type == ServerMessageType::PlayerDead) {
+        if (localPlayer.contains("socket") && messageJson["playerDead"]["socket"] == localPlayer["socket"]) {
+            deathPending = true;
         }
+        return true;
+    }
 
-        // Extract the JSON substring
-        std::string jsonStr = messageBuffer.substr(start, endPos - start + 1);
+    if (type == ServerMessageType::TimeSync) {
+        if (clockSync.reply(messageJson["timeSync"], localSeconds())) {
+            ClockSync::Stats stats = clockSync.takeStats();
+            logToFile("Clock offset " + std::to_string(stats.offset * 1000) + " ms, drift " +
+                      std::to_string(stats.drift * 1e6) + " ppm, round trip " + std::to_string(stats.roundTrip * 1000) +
+                      " ms, one-way " + std::to_string(stats.oneWayMean * 1000) + " ms (max " +
+                      std::to_string(stats.oneWayMax * 1000) + ")", INFO);
+        }
+        return true;
+    }
 
-        // Erase this object from the buffer
-        messageBuffer.erase(0, endPos + 1);
+    if (type == ServerMessageType::QuitGame) {
+        std::cout << "Received quitGame from server." << std::endl;
+        gameRunning = false;
+        return false;
+    }
 
+    if (type == ServerMessageType::LocalPlayer) {
+        // Local player setup
+        messageJson["spriteState"] = messageJson.value("spriteState", 1);
+        messageJson["x"] = messageJson.value("x", 0);
+        messageJson["y"] = messageJson.value("y", 0);
+        messageJson["room"] = messageJson.value("room", 1);
+        messageJson["width"] = messageJson.value("width", 32);
+        messageJson["height"] = messageJson.value("height", 32);
+
+        checklist["x"] = messageJson["x"].get<int>();
+        checklist["y"] = messageJson["y"].get<int>();
+        checklist["spriteState"] = messageJson["spriteState"].get<int>();
+
+        std::string roomName = "room" + std::to_string(messageJson["room"].get<int>());
+        if (!game.contains(roomName)) {
+            game[roomName] = {{"players", json::array()}};
+        }
+        game[roomName]["players"].push_back(messageJson);
+        localPlayer = messageJson;
+        localPlayerSet = true;
+
+        MoveState spawn;
+        spawn.x = messageJson["x"].get<int>();
+        spawn.y = messageJson["y"].get<int>();
+        spawn.width = messageJson["width"].get<int>();
+        spawn.height = messageJson["height"].get<int>();
+        movementPredictor.reset(spawn);
+        std::cout << "Local player set: " << localPlayer.dump() << std::endl;
+
+        if (!initGameFully) {
+            json gameRequest = {{"requestGame", true}};
+            writeMessage(socket, gameRequest);
+        }
+    } 
+    else if (type == ServerMessageType::RemotePlayer) {
+        // Non-local player
         try {
-            json messageJson = json::parse(jsonStr);
-            std::cout << "Client received: " << messageJson.dump() << std::endl;
-
-            // Handle the message as before
-            if (messageJson.contains("quitGame") && messageJson["quitGame"].get<bool>() == true) {
-                std::cout << "Received quitGame from server." << std::endl;
-                gameRunning = false;
-                return;
+            int socketId = messageJson["socket"].get<int>();
+            if (playerStates.find(socketId) == playerStates.end()) {
+                playerStates[socketId] = PlayerState();
             }
 
-            if (messageJson.contains("local") && messageJson["local"].get<bool>()) {
-                // Local player setup
-                messageJson["spriteState"] = messageJson.value("spriteState", 1);
-                messageJson["x"] = messageJson.value("x", 0);
-                messageJson["y"] = messageJson.value("y", 0);
-                messageJson["room"] = messageJson.value("room", 1);
-                messageJson["width"] = messageJson.value("width", 32);
-                messageJson["height"] = messageJson.value("height", 32);
-
-                checklist["x"] = messageJson["x"].get<int>();
-                checklist["y"] = messageJson["y"].get<int>();
-                checklist["spriteState"] = messageJson["spriteState"].get<int>();
-
-                std::string roomName = "room" + std::to_string(messageJson["room"].get<int>());
-                if (!game.contains(roomName)) {
-                    game[roomName] = {{"players", json::array()}};
-                }
-                game[roomName]["players"].push_back(messageJson);
-                localPlayer = messageJson;
-                localPlayerSet = true;
-                std::cout << "Local player set: " << localPlayer.dump() << std::endl;
-
-                if (!initGameFully) {
-                    json gameRequest = {{"requestGame", true}};
-                    boost::asio::write(socket, boost::asio::buffer(gameRequest.dump() + "\n"));
-                }
-            } 
-            else if (messageJson.contains("local") && !messageJson["local"].get<bool>()) {
-                // Non-local player
-                try {
-                    int socketId = messageJson["socket"].get<int>();
-                    if (playerStates.find(socketId) == playerStates.end()) {
-                        playerStates[socketId] = PlayerState();
-                    }
+            playerStates[socketId].record(Position(
+                messageJson["x"].get<float>(),
+                messageJson["y"].get<float>(),
+                messageJson.value("width", 64.0f),
+                messageJson.value("height", 64.0f)
+            ));
+            playerStates[socketId].name = messageJson["name"].get<std::string>();
+            playerStates[socketId].spriteState = messageJson.value("spriteState", 1);
+            playerStates[socketId].room = messageJson.value("room", 1);
+            playerStates[socketId].socketId = socketId;
+
+            std::string roomName = "room" + std::to_string(playerStates[socketId].room);
+            if (!game.contains(roomName)) {
+                game[roomName] = {{"players", json::array()}};
+            }
+            game[roomName]["players"].push_back(messageJson);
+        } catch (const std::exception& e) {
+            std::cerr << "Error processing non-local player: " << e.what() << std::endl;
+            logToFile("Non-local player processing error: " + std::string(e.what()), ERROR);
+        }
+    }
 
-                    playerStates[socketId].target = Position(
-                        messageJson["x"].get<float>(),
-                        messageJson["y"].get<float>(),
-                        messageJson.value("width", 64.0f),
-                        messageJson.value("height", 64.0f)
-                    );
-                    playerStates[socketId].name = messageJson["name"].get<std::string>();
-                    playerStates[socketId].spriteState = messageJson.value("spriteState", 1);
-                    playerStates[socketId].room = messageJson.value("room", 1);
-                    playerStates[socketId].interpolation = 0;
-                    playerStates[socketId].socketId = socketId;
-
-                    std::string roomName = "room" + std::to_string(playerStates[socketId].room);
-                    if (!game.contains(roomName)) {
-                        game[roomName] = {{"players", json::array()}};
-                    }
-                    game[roomName]["players"].push_back(messageJson);
-                } catch (const std::exception& e) {
-                    std::cerr << "Error processing non-local player: " << e.what() << std::endl;
-                    logToFile("Non-local player processing error: " + std::string(e.what()), ERROR);
+    if (type == ServerMessageType::UpdateShield) {
+        //get action: delete/add, shield, room
+        std::string action = messageJson["action"];
+        if (action == "delete") {
+            checklist["shieldTouched"] = false;
+            int shieldRoom = messageJson["room"].get<int>();
+            auto& objects = game["room" + std::to_string(shieldRoom)]["objects"];
+
+            for (auto it = objects.begin(); it != objects.end(); ++it) {
+                if (it->contains("objID") && (*it)["objID"] == 10) {
+                    objects.erase(it);
+                    objectGrid.objectsChanged = true;
+                    break;
                 }
             }
+        } else if (action == "add") {
+            int shieldRoom = messageJson["room"].get<int>();
+            game["room" + std::to_string(shieldRoom)]["objects"].push_back(messageJson["shield"]);
+            objectGrid.objectsChanged = true;
+        }
+    }
 
-            if (messageJson.contains("updateShield")) {
-                //get action: delete/add, shield, room
-                std::string action = messageJson["action"];
-                if (action == "delete") {
-                    checklist["shieldTouched"] = false;
-                    int shieldRoom = messageJson["room"].get<int>();
-                    auto& objects = game["room" + std::to_string(shieldRoom)]["objects"];
-
-                    for (auto it = objects.begin(); it != objects.end(); ++it) {
-                        if (it->contains("objID") && (*it)["objID"] == 10) {
-                            objects.erase(it);
+    if (type == ServerMessageType::PlayerItems) {
+        int socketId = messageJson["playerItems"]["socket"].get<int>();
+        int get = messageJson["playerItems"]["get"].get<int>(); // 0 for bananas, 1 for shields
+        for (auto& r : game) {
+            for (auto& p : r["players"]) {
+                if (p["socket"] == socketId) {
+                    switch (get) {
+                        case 0:
+                            p["bananas"] = messageJson["playerItems"]["bananas"];
+                            break;
+                        case 1:
+                            p["shields"] = messageJson["playerItems"]["shields"];
                             break;
-                        }
                     }
-                } else if (action == "add") {
-                    int shieldRoom = messageJson["room"].get<int>();
-                    game["room" + std::to_string(shieldRoom)]["objects"].push_back(messageJson["shield"]);
                 }
             }
+        }
+    }
 
-            if (messageJson.contains("playerItems")) {
-                int socketId = messageJson["playerItems"]["socket"].get<int>();
-                int get = messageJson["playerItems"]["get"].get<int>(); // 0 for bananas, 1 for shields
-                for (auto& r : game) {
-                    for (auto& p : r["players"]) {
-                        if (p["socket"] == socketId) {
-                            switch (get) {
-                                case 0:
-                                    p["bananas"] = messageJson["playerItems"]["bananas"];
-                                    break;
-                                case 1:
-                                    p["shields"] = messageJson["playerItems"]["shields"];
-                                    break;
-                            }
-                        }
-                    }
-                }
+    if (type == ServerMessageType::PlayerLeft) {
+        int socketId = messageJson["playerLeft"].get<int>();
+        if (playerStates.find(socketId) != playerStates.end()) {
+            playerStates.erase(socketId);
+        }
+        //delete player from game
+        for (auto& room : game.items()) {
+            if (room.value().contains("players")) {
+                auto& players = room.value()["players"];
+                auto it = std::remove_if(players.begin(), players.end(),
+                    [&socketId](const json& p) {
+                        cout << "farewell, " << p["name"] << endl;
+                        return p["socket"] == socketId;
+                    });
+                players.erase(it, players.end());
             }
+        }
+    }
 
-            if (messageJson.contains("playerLeft")) {
-                int socketId = messageJson["playerLeft"].get<int>();
-                if (playerStates.find(socketId) != playerStates.end()) {
-                    playerStates.erase(socketId);
-                }
-                //delete player from game
-                for (auto& room : game.items()) {
-                    if (room.value().contains("players")) {
-                        auto& players = room.value()["players"];
-                        auto it = std::remove_if(players.begin(), players.end(),
-                            [&socketId](const json& p) {
-                                cout << "farewell, " << p["name"] << endl;
-                                return p["socket"] == socketId;
-                            });
-                        players.erase(it, players.end());
-                    }
-                }
+    if (type == ServerMessageType::SwitchRoom) {
+        int socketId = messageJson["switchRoom"]["socket"].get<int>();
+        int newRoom = messageJson["switchRoom"]["room"].get<int>();
+        if (playerStates.find(socketId) != playerStates.end()) {
+            playerStates[socketId].room = newRoom;
+        }
+        std::string oldRoomName = "room" + std::to_string(playerStates[socketId].room);
+        std::string newRoomName = "room" + std::to_string(newRoom);
+        for (auto& p : game[oldRoomName]["players"]) {
+            if (p["socket"] == socketId) {
+                p["room"] = newRoom;
+                game[newRoomName]["players"].push_back(p);
+                game[oldRoomName]["players"].erase(p);
             }
+        }
+    }
 
-            if (messageJson.contains("switchRoom")) {
-                int socketId = messageJson["switchRoom"]["socket"].get<int>();
-                int newRoom = messageJson["switchRoom"]["room"].get<int>();
-                if (playerStates.find(socketId) != playerStates.end()) {
-                    playerStates[socketId].room = newRoom;
-                }
-                std::string oldRoomName = "room" + std::to_string(playerStates[socketId].room);
-                std::string newRoomName = "room" + std::to_string(newRoom);
-                for (auto& p : game[oldRoomName]["players"]) {
-                    if (p["socket"] == socketId) {
-                        p["room"] = newRoom;
-                        game[newRoomName]["players"].push_back(p);
-                        game[oldRoomName]["players"].erase(p);
-                    }
+    if (type == ServerMessageType::GameDelta) {
+        const json& delta = messageJson["gameDelta"];
+        if (initGameFully && !deltaAppliesTo(delta, gameVersion) && delta["to"].get<uint32_t>() <= gameVersion) {
+            // Sent before the server heard our last ack; we are already past it
+            return true;
+        }
+        if (!initGameFully || !deltaAppliesTo(delta, gameVersion)) {
+            // Our copy isn't the server's baseline, start over from a full game
+            json gameRequest = {{"requestGame", true}, {"full", true}};
+            writeMessage(socket, gameRequest);
+            return true;
+        }
+        if (!applyGameDelta(game, delta)) {
+            // Something changed that we no longer have; the full game brings it back
+            json gameRequest = {{"requestGame", true}, {"full", true}};
+            writeMessage(socket, gameRequest);
+        }
+        objectGrid.objectsChanged = true;
+
+        for (auto& roomEntry : delta["rooms"].items()) {
+            int roomID = roomEntry.value()["roomID"].get<int>();
+            for (auto& removed : roomEntry.value()["removedPlayers"]) {
+                auto it = playerStates.find(removed.get<int>());
+                if (it != playerStates.end() && it->second.room == roomID) {
+                    playerStates.erase(it);
                 }
             }
+            for (auto& player : roomEntry.value()["players"]) {
+                int socketId = player["socket"].get<int>();
+                PlayerState& ps = playerStates[socketId];
+                ps.socketId = socketId;
+                ps.room = roomID;
+                if (player.contains("name")) ps.name = player["name"].get<std::string>();
+                if (player.contains("spriteState")) ps.spriteState = player["spriteState"].get<int>();
+                Position position = ps.latest();
+                if (player.contains("x")) position.x = player["x"].get<float>();
+                if (player.contains("y")) position.y = player["y"].get<float>();
+                if (player.contains("width")) position.width = player["width"].get<float>();
+                if (player.contains("height")) position.height = player["height"].get<float>();
+                ps.record(position);
+            }
+            for (auto& removed : roomEntry.value()["removedEnemies"]) {
+                enemyStates.erase(removed.get<int>());
+            }
+            for (auto& enemy : roomEntry.value()["enemies"]) {
+                EnemyState& es = enemyStates[enemy["id"].get<int>()];
+                es.id = enemy["id"].get<int>();
+                es.room = roomID;
+                Position position = es.latest();
+                if (enemy.contains("x")) position.x = enemy["x"].get<float>();
+                if (enemy.contains("y")) position.y = enemy["y"].get<float>();
+                if (enemy.contains("width")) position.width = enemy["width"].get<float>();
+                if (enemy.contains("height")) position.height = enemy["height"].get<float>();
+                es.record(position);
+            }
+        }
 
-            if (messageJson.contains("getGame")) {
-                game = messageJson["getGame"];
-                initGameFully = true;
-                std::cout << "Game state fully initialized" << std::endl;
+        gameVersion = std::max(gameVersion, delta["to"].get<uint32_t>());
+        json ack = {{"ackGame", gameVersion}};
+        writeMessage(socket, ack);
+    }
 
-                for (auto& roomEntry : game.items()) {
-                    for (auto& player : roomEntry.value()["players"]) {
-                        int socketId = player["socket"].get<int>();
-                        if (playerStates.find(socketId) == playerStates.end()) {
-                            playerStates[socketId] = PlayerState();
-                        }
-                        playerStates[socketId].current = Position(
-                            player["x"].get<float>(),
-                            player["y"].get<float>(),
-                            player.value("width", 64.0f),
-                            player.value("height", 64.0f)
-                        );
-                        playerStates[socketId].target = playerStates[socketId].current;
-                        playerStates[socketId].name = player["name"].get<std::string>();
-                        playerStates[socketId].socketId = socketId;
-                        playerStates[socketId].spriteState = player["spriteState"].get<int>();
-                        playerStates[socketId].room = player["room"].get<int>();
-                        playerStates[socketId].interpolation = 0;
-                    }
-                }
-            }
+    if (type == ServerMessageType::GetGame) {
+        game = messageJson["getGame"];
+        objectGrid.objectsChanged = true;
+        initGameFully = true;
+        std::cout << "Game state fully initialized" << std::endl;
 
-            if (messageJson.contains("getEnemy")) {
-                auto enemyData = messageJson["getEnemy"];
-                int enemyId = enemyData["id"].get<int>();
-
-                EnemyState& es = enemyStates[enemyId];
-                es.current = Position(
-                    enemyData["x"].get<float>(),
-                    enemyData["y"].get<float>(),
-                    enemyData["width"].get<float>(),
-                    enemyData["height"].get<float>()
-                );
-                es.target = es.current;
-                es.id = enemyId;
-                es.room = enemyData["room"].get<int>();
-                es.interpolation = 0;
-
-                std::string roomName = "room" + std::to_string(es.room);
-                if (!game.contains(roomName)) {
-                    game[roomName] = {{"enemies", json::array()}};
-                }
+        if (messageJson.contains("gameVersion")) {
+            gameVersion = messageJson["gameVersion"].get<uint32_t>();
+            json ack = {{"ackGame", gameVersion}};
+            writeMessage(socket, ack);
+        }
 
-                bool enemyExists = false;
-                for (auto& ene : game[roomName]["enemies"]) {
-                    if (ene["id"].get<int>() == enemyId) {
-                        ene = enemyData;
-                        enemyExists = true;
-                        break;
-                    }
-                }
-                if (!enemyExists) {
-                    game[roomName]["enemies"].push_back(enemyData);
+        for (auto& roomEntry : game.items()) {
+            for (auto& player : roomEntry.value()["players"]) {
+                int socketId = player["socket"].get<int>();
+                if (playerStates.find(socketId) == playerStates.end()) {
+                    playerStates[socketId] = PlayerState();
                 }
+                playerStates[socketId].place(Position(
+                    player["x"].get<float>(),
+                    player["y"].get<float>(),
+                    player.value("width", 64.0f),
+                    player.value("height", 64.0f)
+                ));
+                playerStates[socketId].name = player["name"].get<std::string>();
+                playerStates[socketId].socketId = socketId;
+                playerStates[socketId].spriteState = player["spriteState"].get<int>();
+                playerStates[socketId].room = player["room"].get<int>();
             }
+        }
+        resetEnemyStates();
+    }
 
-            if (messageJson.contains("getRoom")) {
-                std::string roomName = messageJson["room"].get<std::string>();
-                game[roomName] = messageJson["getRoom"];
-
-                if (localPlayerSet && localPlayer.contains("socket")) {
-                    localPlayer["room"] = std::stoi(roomName.substr(4));
-
-                    playerStates.clear();
-                    for (auto& player : game[roomName]["players"]) {
-                        int socketId = player["socket"].get<int>();
-                        playerStates[socketId] = PlayerState();
-                        playerStates[socketId].current = Position(
-                            player["x"].get<float>(),
-                            player["y"].get<float>(),
-                            64.0f,
-                            64.0f
-                        );
-                        playerStates[socketId].target = playerStates[socketId].current;
-                        playerStates[socketId].name = player["name"].get<std::string>();
-                        playerStates[socketId].socketId = socketId;
-                        playerStates[socketId].spriteState = player["spriteState"].get<int>();
-                        playerStates[socketId].room = player["room"].get<int>();
-                        playerStates[socketId].interpolation = 0;
-                    }
-
-                    canMove = {{"w", true}, {"a", true}, {"s", true}, {"d", true}};
-                    if (!game[roomName].contains("objects")) {
-                        game[roomName]["objects"] = json::array();
-                    }
+    if (type == ServerMessageType::GetEnemy) {
+        auto enemyData = messageJson["getEnemy"];
+        int enemyId = enemyData["id"].get<int>();
+
+        EnemyState& es = enemyStates[enemyId];
+        es.place(Position(
+            enemyData["x"].get<float>(),
+            enemyData["y"].get<float>(),
+            enemyData["width"].get<float>(),
+            enemyData["height"].get<float>()
+        ));
+        es.id = enemyId;
+        es.room = enemyData["room"].get<int>();
+
+        std::string roomName = "room" + std::to_string(es.room);
+        if (!game.contains(roomName)) {
+            game[roomName] = {{"enemies", json::array()}};
+        }
 
-                    std::cout << "Room transition complete, now in " << roomName << std::endl;
-                }
+        bool enemyExists = false;
+        for (auto& ene : game[roomName]["enemies"]) {
+            if (ene["id"].get<int>() == enemyId) {
+                ene = enemyData;
+                enemyExists = true;
+                break;
             }
+        }
+        if (!enemyExists) {
+            game[roomName]["enemies"].push_back(enemyData);
+        }
+    }
 
-            if (messageJson.contains("updatePosition")) {
-                auto& updateData = messageJson["updatePosition"];
-                int socketId = updateData["socket"].get<int>();
-                if (playerStates.find(socketId) == playerStates.end()) {
-                    playerStates[socketId] = PlayerState();
-                    playerStates[socketId].socketId = socketId;
-                }
+    if (type == ServerMessageType::GetRoom) {
+        std::string roomName = messageJson["room"].get<std::string>();
+        game[roomName] = messageJson["getRoom"];
+        objectGrid.objectsChanged = true;
+
+        // The server only keeps us up to date on the room we are in, so this
+        // version is our new delta baseline
+        if (messageJson.contains("gameVersion")) {
+            gameVersion = messageJson["gameVersion"].get<uint32_t>();
+            json ack = {{"ackGame", gameVersion}};
+            writeMessage(socket, ack);
+        }
 
-                playerStates[socketId].target = Position(
-                    updateData["x"].get<float>(),
-                    updateData["y"].get<float>(),
+        if (localPlayerSet && localPlayer.contains("socket")) {
+            localPlayer["room"] = std::stoi(roomName.substr(4));
+
+            playerStates.clear();
+            for (auto& player : game[roomName]["players"]) {
+                int socketId = player["socket"].get<int>();
+                playerStates[socketId] = PlayerState();
+                playerStates[socketId].place(Position(
+                    player["x"].get<float>(),
+                    player["y"].get<float>(),
                     64.0f,
                     64.0f
-                );
-                playerStates[socketId].interpolation = 0;
+                ));
+                playerStates[socketId].name = player["name"].get<std::string>();
+                playerStates[socketId].socketId = socketId;
+                playerStates[socketId].spriteState = player["spriteState"].get<int>();
+                playerStates[socketId].room = player["room"].get<int>();
+            }
+            resetEnemyStates();
 
-                if (updateData.contains("spriteState")) {
-                    playerStates[socketId].spriteState = updateData["spriteState"].get<int>();
-                }
-                if (updateData.contains("room")) {
-                    playerStates[socketId].room = updateData["room"].get<int>();
-                }
+            canMove = {{"w", true}, {"a", true}, {"s", true}, {"d", true}};
+            if (!game[roomName].contains("objects")) {
+                game[roomName]["objects"] = json::array();
             }
+            objectGrid.objectsChanged = true;
 
-            if (messageJson.contains("updateEPosition") && messageJson["updateEPosition"].get<bool>()) {
-                updateEPosition(messageJson);
+            std::cout << "Room transition complete, now in " << roomName << std::endl;
+        }
+    }
+
+    if (type == ServerMessageType::UpdatePosition) {
+        auto& updateData = messageJson["updatePosition"];
+        int socketId = updateData["socket"].get<int>();
+        if (playerStates.find(socketId) == playerStates.end()) {
+            playerStates[socketId] = PlayerState();
+            playerStates[socketId].socketId = socketId;
+        }
+
+        // Where the server has us after our command "seq"; the ones it hasn't
+        // seen yet are replayed on top, and that is what we draw
+        if (updateData.contains("seq") && localPlayer.contains("socket") && socketId == localPlayer["socket"].get<int>()) {
+            MoveState authoritative = movementPredictor.predicted();
+            authoritative.x = updateData["x"].get<int>();
+            authoritative.y = updateData["y"].get<int>();
+            authoritative.crouched = updateData.value("spriteState", 1) == crouchSpriteState;
+            int room = updateData.value("room", localPlayer.value("room", 1));
+            const MoveState& predicted = movementPredictor.reconcile(authoritative, updateData["seq"].get<uint32_t>(),
+                                                                    solidsIn(game["room" + std::to_string(room)]));
+            checklist["x"] = predicted.x;
+            checklist["y"] = predicted.y;
+            playerStates[socketId].current.x = static_cast<float>(predicted.x);
+            playerStates[socketId].current.y = static_cast<float>(predicted.y);
+            return true;
+        }
+
+        // A room change is a jump, not a walk
+        Position position(updateData["x"].get<float>(), updateData["y"].get<float>(), 64.0f, 64.0f);
+        if (updateData.contains("room") && updateData["room"].get<int>() != playerStates[socketId].room) {
+            playerStates[socketId].place(position);
+        } else {
+            playerStates[socketId].record(position);
+        }
+
+        if (updateData.contains("spriteState")) {
+            playerStates[socketId].spriteState = updateData["spriteState"].get<int>();
+        }
+        if (updateData.contains("room")) {
+            playerStates[socketId].room = updateData["room"].get<int>();
+        }
+    }
+
+    if (type == ServerMessageType::UpdateEPosition) {
+        updateEPosition(messageJson);
+    }
+
+    // The server takes datagrams from us once they carry this token
+    if (type == ServerMessageType::UdpOffer && useUdp) {
+        try {
+            udp::endpoint server(socket.remote_endpoint().address(), messageJson["udp"]["port"].get<uint16_t>());
+            if (!udpLink) {
+                udpLink = std::make_unique<UdpEndpoint>(socket.get_executor(), udp::endpoint(udp::v4(), 0));
+                udpLink->start([&localPlayer, &initGameFully, &gameRunning, &socket, &localPlayerSet](int, UdpChannel, json message) {
+                    handleServerMessage(classifyServerMessage(message), message, localPlayer, initGameFully, gameRunning, socket, localPlayerSet);
+                });
             }
+            udpLink->removePeer(0);
+            udpLink->addPeer(0, messageJson["udp"]["token"].get<uint32_t>(), server);
+            std::cout << "Using UDP port " << server.port() << " for movement" << std::endl;
+        } catch (const std::exception& e) {
+            logToFile("Could not set up UDP: " + std::string(e.what()), ERROR);
+        }
+    }
+
+    return true;
+}
+
+const size_t readChunkSize = 4096;
+
+// RECORD_TRAFFIC=path saves everything the server sends, e.g. as input for the parser benchmark
+std::ofstream trafficRecording;
+
+// Free space in the stream's ring for the next read; at most two pieces
+std::array<boost::asio::mutable_buffer, 2> readBuffers(FrameParser& stream) {
+    std::array<RingBuffer::Span, 2> spans = stream.prepare(readChunkSize);
+    return {boost::asio::buffer(spans[0].data, spans[0].size), boost::asio::buffer(spans[1].data, spans[1].size)};
+}
+
+void handleRead(const boost::system::error_code& error, std::size_t bytes_transferred, 
+                FrameParser& stream, 
+                json& localPlayer, bool& initGameFully, 
+                bool& gameRunning, tcp::socket& socket, bool& localPlayerSet) 
+{
+    if (error) {
+        std::cerr << "Read error: " << error.message() << std::endl;
+        return;
+    }
+
+    // The bytes were read straight into the ring; every complete message in
+    // it is parsed where it lies (text and binary frames, see libs/frame_parser.hpp)
+    stream.commit(bytes_transferred, trafficRecording.is_open() ? &trafficRecording : nullptr);
 
-            parsedSomething = true;
-        } 
-        catch (const json::parse_error& e) {
+    while (true) {
+        json messageJson;
+        try {
+            if (!stream.next(messageJson)) {
+                break;
+            }
+        }
+        catch (const json::exception& e) {
+            // Only that message was bad; the parser is already past it
             std::cerr << "JSON parse error: " << e.what() << "\n";
-            // Since we are now using a brace-matching approach, this should be rare
-            // If this happens, we likely got invalid or partial data
-            // We can break here and wait for more data to arrive
-            break;
-        } 
+            continue;
+        }
+        catch (const std::exception& e) {
+            // A bad frame length means we can't find the next message boundary
+            logToFile("Lost wire framing: " + std::string(e.what()), ERROR);
+            socket.close();
+            return;
+        }
+
+        try {
+            if (!handleServerMessage(classifyServerMessage(messageJson), messageJson, localPlayer, initGameFully, gameRunning, socket, localPlayerSet)) {
+                return;
+            }
+        }
         catch (const std::exception& e) {
             std::cerr << "Error handling message: " << e.what() << "\n";
             logToFile("Error handling message: " + std::string(e.what()), ERROR);
-            parsedSomething = true;
         }
     }
 
     // Re-arm the async read
-    boost::asio::async_read_until(socket, buffer, "\n",
+    socket.async_read_some(readBuffers(stream),
         [&](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-            handleRead(ec, bytes_transferred, buffer, localPlayer, initGameFully, gameRunning, socket, localPlayerSet);
+            handleRead(ec, bytes_transferred, stream, localPlayer, initGameFully, gameRunning, socket, localPlayerSet);
         }
     );
 }
@@ -798,16 +1189,6 @@ void handleStuckState() {
     notsendingugh = true;
 }
 
-int castWinsock(boost::asio::ip::tcp::socket& socket) {
-    SocketHandle nativeHandle = socket.native_handle();
-    int intHandle;
-#ifdef _WIN32
-    intHandle = static_cast<int>(reinterpret_cast<intptr_t>(nativeHandle));
-#else
-    intHandle = nativeHandle;
-#endif
-    return intHandle;
-}
 std::atomic<bool> shouldQuit{false};
 std::atomic<bool> debugRequested{false};
 
@@ -1139,7 +1520,6 @@ int client_main() {
         json previousChecklist = checklist; 
         std::map<std::string, bool> keys = DetectKeyPress();
         bool gameRunning = true;
-        int moveSpeed = 5; 
 
         try {
             io_context io_context;
@@ -1171,7 +1551,11 @@ int client_main() {
             strncpy(ipBox.text, ip.c_str(), 255);
             strncpy(portBox.text, std::to_string(port).c_str(), 255);
 
-            boost::asio::streambuf buffer;
+            FrameParser serverStream;
+            std::string recordPath = getEnvVar<std::string>("RECORD_TRAFFIC", "");
+            if (!recordPath.empty()) {
+                trafficRecording.open(recordPath, std::ios::binary | std::ios::trunc);
+            }
             bool initGameFully = false;
             json localPlayer;
             bool localPlayerSet = false;
@@ -1215,10 +1599,10 @@ int client_main() {
                 io_context.reset();
                 
                 // Start async read first
-                boost::asio::async_read_until(socket, buffer, "\n",
+                socket.async_read_some(readBuffers(serverStream),
                     [&](const boost::system::error_code& ec, std::size_t bytes_transferred) {
                         if (!ec) {
-                            handleRead(ec, bytes_transferred, buffer, localPlayer, 
+                            handleRead(ec, bytes_transferred, serverStream, localPlayer, 
                                       initGameFully, gameRunning, socket, localPlayerSet);
                         } else {
                             std::cerr << "Read error: " << ec.message() << std::endl;
@@ -1238,9 +1622,9 @@ int client_main() {
                 };
                 
                 try {
-                    std::string messageStr = newMessage.dump() + "\n";
-                    boost::asio::write(socket, boost::asio::buffer(messageStr));
-                    std::cout << "Sent initial message: " << messageStr << std::endl;
+                    negotiateWireFormat(socket);
+                    writeMessage(socket, newMessage);
+                    std::cout << "Sent initial message: " << newMessage.dump() << std::endl;
                 } catch (const std::exception& e) {
                     std::cerr << "Failed to send initial message: " << e.what() << std::endl;
                     reconnecting = true;
@@ -1334,11 +1718,15 @@ int client_main() {
                             initGame = false;
                             initGameFully = false;
                             localPlayerSet = false;
+                            // Anything half-read belonged to the old connection
+                            serverStream = FrameParser();
+                            clockSync = ClockSync();
+                            negotiateWireFormat(socket);
                             
                             // Restart async read
-                            boost::asio::async_read_until(socket, buffer, "\n",
+                            socket.async_read_some(readBuffers(serverStream),
                                 [&](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-                                    handleRead(ec, bytes_transferred, buffer, localPlayer, 
+                                    handleRead(ec, bytes_transferred, serverStream, localPlayer, 
                                              initGameFully, gameRunning, socket, localPlayerSet);
                                 });
                         }
@@ -1363,12 +1751,16 @@ int client_main() {
                     json newMessage = {
                         {"currentName", LocalName}
                     };
-                    std::string messageStr = newMessage.dump() + "\n";
-                    boost::asio::write(socket, boost::asio::buffer(messageStr));
+                    writeMessage(socket, newMessage);
                     std::cout << "Sent player creation request" << std::endl;
                     initGame = true;
                 }
 
+                // A burst of clock syncs after connecting, then one now and then
+                if (clockSync.due(localSeconds())) {
+                    writeMessage(socket, clockSync.request(localSeconds()));
+                }
+
                 BeginDrawing();
                 ClearBackground(RAYWHITE);
                 Button buttonW = {{static_cast<float>(screenWidth) - 180, static_cast<float>(screenHeight) - 240, 60, 60}, "W", false};
@@ -1397,7 +1789,8 @@ int client_main() {
                 // Only handle game logic after initialization
                 if (localPlayerSet && initGameFully) {
                     localRoomName = "room" + std::to_string(localPlayer["room"].get<int>());
-                    int socketHandle = castWinsock(socket);
+                    // The server's session id, which has nothing to do with our end of the socket
+                    int socketHandle = localPlayer["socket"].get<int>();
 
                     for (const auto& room : game.items()) {
                         if (room.value().contains("players")) {
@@ -1425,61 +1818,33 @@ int client_main() {
                         canMove["d"] = true;                    
 
                         //get players in bubble
-                        bubble.clear_players();
                         bubble.set_bubble(localPlayerInterpolatedPos["x"].get<float>(), localPlayerInterpolatedPos["y"].get<float>(), localPlayerInterpolatedPos["width"].get<float>(), localPlayerInterpolatedPos["height"].get<float>());
-                        for (const auto& player : game[localRoomName]["players"]) {
-                            if (player["socket"] != socketHandle) {
-                                bubble.add_player(player);
-                            }
-                            if (bubble.check_burst() && bubble.check_specific_burst(player)) {
+                        bubble.track_players(game[localRoomName]["players"], socketHandle);
+                        const std::vector<int>& bubbled = bubble.burst();
+                        if (!bubbled.empty()) {
+                            json pushbackables = json::array();
+                            for (const auto& player : game[localRoomName]["players"]) {
+                                if (std::find(bubbled.begin(), bubbled.end(), player["socket"].get<int>()) == bubbled.end()) {
+                                    continue;
+                                }
                                 //add player to objects so no going through
                                 if (player["room"] == localRoomName) {
                                     json pushbackable = player;
                                     pushbackable["objID"] = 0;
-                                    game[localRoomName]["objects"].push_back(pushbackable);
+                                    pushbackables.push_back(pushbackable);
                                 }
                             }
-                        }
-                        for (const auto& object : game[localRoomName]["objects"]) {
-                            json predictedPos = localPlayerInterpolatedPos;
-                            int wall = 0;                   
-
-                            // Check for collisions in all directions
-                            // Up
-                            predictedPos["y"] = localPlayerInterpolatedPos["y"].get<float>() - moveSpeed;
-                            if (checkWallCollision(predictedPos, object, wall)) {
-                                if (wall == 1) {
-                                    canMove["w"] = false;
-                                    checklist["y"] = object["y"].get<float>() + object["height"].get<float>(); // Stop at top boundary
-                                }
-                            }                   
-
-                            // Down
-                            predictedPos["y"] = localPlayerInterpolatedPos["y"].get<float>() + moveSpeed;
-                            if (checkWallCollision(predictedPos, object, wall)) {
-                                if (wall == 3) {
-                                    canMove["s"] = false;
-                                    checklist["y"] = object["y"].get<float>() - localPlayerInterpolatedPos["height"].get<float>(); // Stop at bottom boundary
-                                }
-                            }                   
-
-                            // Left
-                            predictedPos["x"] = localPlayerInterpolatedPos["x"].get<float>() - moveSpeed;
-                            if (checkWallCollision(predictedPos, object, wall)) {
-                                if (wall == 4) {
-                                    canMove["a"] = false;
-                                    checklist["x"] = object["x"].get<float>() + object["width"].get<float>(); // Stop at left boundary
-                                }
-                            }                   
-
-                            // Right
-                            predictedPos["x"] = localPlayerInterpolatedPos["x"].get<float>() + moveSpeed;
-                            if (checkWallCollision(predictedPos, object, wall)) {
-                                if (wall == 2) {
-                                    canMove["d"] = false;
-                                    checklist["x"] = object["x"].get<float>() - localPlayerInterpolatedPos["width"].get<float>(); // Stop at right boundary
-                                }
+                            for (auto& pushbackable : pushbackables) {
+                                game[localRoomName]["objects"].push_back(pushbackable);
+                                objectGrid.objectsChanged = true;
                             }
+                        }
+                        // Walls are handled by stepMovement, the same way the server does
+                        const json& roomObjects = game[localRoomName]["objects"];
+                        for (int objectIndex : objectGrid.touching(roomObjects, localRoomName,
+                                                                   localPlayerInterpolatedPos["x"].get<int>(), localPlayerInterpolatedPos["y"].get<int>(),
+                                                                   localPlayerInterpolatedPos["width"].get<int>(), localPlayerInterpolatedPos["height"].get<int>())) {
+                            const json& object = roomObjects[objectIndex];
                             //special collisions
                             if ((object["objID"] == 2 || object["objID"] == 4) && checkCollision(localPlayerInterpolatedPos, object)) {
                                 int newRoom;
@@ -1491,6 +1856,7 @@ int client_main() {
                                 checklist["room"] = newRoom;
                                 checklist["x"] = 90;  // Reset position on room change
                                 checklist["y"] = 90;
+                                movementPredictor.teleport(90, 90);
                                 
                                 localPlayer["room"] = newRoom;
                                 localPlayer["x"] = checklist["x"];
@@ -1498,10 +1864,8 @@ int client_main() {
                                 
                                 // Update player state for smooth transition
                                 int localSocketId = localPlayer["socket"].get<int>();
-                                playerStates[localSocketId].target = Position(90, 90, 64, 64);
                                 playerStates[localSocketId].current = Position(90, 90, 64, 64);
                                 playerStates[localSocketId].room = newRoom;
-                                playerStates[localSocketId].interpolation = 0;
                                 
                                 canMove = {{"w", true}, {"a", true}, {"s", true}, {"d", true}};
                                 notsendingugh = false;
@@ -1518,7 +1882,7 @@ int client_main() {
                                     }}
                                 };
                                 
-                                boost::asio::write(socket, boost::asio::buffer(roomChangeMessage.dump() + "\n"));
+                                writeMessage(socket, roomChangeMessage);
                                 
                                 std::this_thread::sleep_for(std::chrono::milliseconds(100));
                                 
@@ -1540,39 +1904,47 @@ int client_main() {
                     bool send = false;
 
                     // Store previous position
-                    int prevX = checklist["x"].get<int>();
                     int prevY = checklist["y"].get<int>();
                     if (switchr) send = true; switchr = false;
-                    
-                    if (keys["shift"] || IsButtonPressed(buttonShift, mousePoint)) {
-                        if (checklist["spriteState"].get<int>() != 5) {
-                            checklist["prevState"] = checklist["spriteState"]; 
-                            checklist["spriteState"] = 5;  
-                            send = true;
-                        }
-                        moveSpeed = 2;  // Slower while crouched
-                    } else if (checklist["spriteState"].get<int>() == 5) {
 
-                        if (checklist.contains("prevState")) {
-                            checklist["spriteState"] = checklist["prevState"];
-                            moveSpeed = 5; 
-                        } else {
-                            checklist["spriteState"] = 3; 
-                            moveSpeed = 5;
-                        }
-                        moveSpeed = 5; 
-                        send = true;
+                    // Controls are sampled inputStepsPerSecond times a second whatever the
+                    // frame rate; each sample is predicted here and sent as a command
+                    bool crouching = keys["shift"] || IsButtonPressed(buttonShift, mousePoint);
+                    bool goingUp = keys["w"] || IsButtonPressed(buttonW, mousePoint);
+                    bool goingDown = keys["s"] || IsButtonPressed(buttonS, mousePoint);
+                    bool goingLeft = keys["a"] || IsButtonPressed(buttonA, mousePoint);
+                    bool goingRight = keys["d"] || IsButtonPressed(buttonD, mousePoint);
+                    uint8_t moveBits = (goingUp ? MoveUp : 0) | (goingDown ? MoveDown : 0) | (goingLeft ? MoveLeft : 0) |
+                                       (goingRight ? MoveRight : 0) | (crouching ? MoveCrouch : 0);
+                    checklist["goingup"] = goingUp;
+                    checklist["goingdown"] = goingDown;
+                    checklist["goingleft"] = goingLeft;
+                    checklist["goingright"] = goingRight;
+
+                    const float inputStep = 1.0f / inputStepsPerSecond;
+                    // After a long stall, don't replay seconds of held keys
+                    inputStepAccumulator = std::min(inputStepAccumulator + GetFrameTime(), 0.25f);
+                    std::vector<MoveBox> solids = solidsIn(game[localRoomName]);
+                    while (inputStepAccumulator >= inputStep) {
+                        inputStepAccumulator -= inputStep;
+                        movementPredictor.apply(moveBits, solids);
                     }
-
-                    if ((keys["w"] || IsButtonPressed(buttonW, mousePoint)) && canMove["w"]) {
-                        checklist["goingup"] = true;
-                        checklist["y"] = prevY - moveSpeed;
-                        checklist["spriteState"] = 1; // North facing
+                    const MoveState& predicted = movementPredictor.predicted();
+                    if (moveBits != 0 || checklist["spriteState"].get<int>() != predicted.spriteState()) {
                         send = true;
+                    }
+                    checklist["x"] = predicted.x;
+                    checklist["y"] = predicted.y;
+                    checklist["spriteState"] = predicted.spriteState();
+                    playerStates[localSocketId].current.x = static_cast<float>(predicted.x);
+                    playerStates[localSocketId].current.y = static_cast<float>(predicted.y);
+                    playerStates[localSocketId].spriteState = predicted.spriteState();
+
+                    if (goingUp && predicted.y != prevY) {
                         wKeyStuck = false;
                         wKeyPressed = true;
                         wKeyPressStart = std::chrono::steady_clock::now();
-                    } else if (keys["w"] || IsButtonPressed(buttonW, mousePoint)) {
+                    } else if (goingUp) {
                         // W is pressed but can't move
                         if (!wKeyPressed) {
                             wKeyPressed = true;
@@ -1586,105 +1958,64 @@ int client_main() {
                             }
                         }
                     } else {
-                        checklist["goingup"] = false;
                         wKeyPressed = false;
                         wKeyStuck = false;
                     }
-                    if ((keys["s"] || IsButtonPressed(buttonS, mousePoint)) && canMove["s"]) {
-                        checklist["goingdown"] = true; 
-                        checklist["y"] = prevY + moveSpeed;
-                        checklist["spriteState"] = 3; // South facing
-                        send = true;
-                    } else {
-                        checklist["goingdown"] = false;
-                    }
-
-                    if ((keys["a"] || IsButtonPressed(buttonA, mousePoint)) && canMove["a"]) {
-                        checklist["goingleft"] = true;
-                        checklist["x"] = prevX - moveSpeed;
-                        checklist["spriteState"] = 4; // West facing
-                        send = true;
-                    } else {
-                        checklist["goingleft"] = false;
-                    }
-
-                    if ((keys["d"] || IsButtonPressed(buttonD, mousePoint)) && canMove["d"]) {
-                        checklist["goingright"] = true;
-                        checklist["x"] = prevX + moveSpeed;
-                        checklist["spriteState"] = 2; // East facing
-                        send = true;
-                    } else {
-                        checklist["goingright"] = false;
-                    }
 
                     if (keys["q"] || IsButtonPressed(buttonQuit, mousePoint)) {
                         gameRunning = false;
                         shouldQuit = true;
                         json quitMessage = {{"quitGame", true}};
-                        boost::asio::write(socket, boost::asio::buffer(quitMessage.dump() + "\n"));
+                        writeMessage(socket, quitMessage);
                         socket.close();
                         break;
                     }
 
-                    //check collision with enemies
-                    for (const auto& enemy : game[localRoomName]["enemies"]) {
-                        if (checkCollision(checklist, enemy)) {
-                            checklist["enemyTouched"] = enemy["id"].get<int>();
-                            // Check if player has shields
-                            bool hasShields = false;
-                            for (const auto& player : game[localRoomName]["players"]) {
-                                if (player["socket"] == localPlayer["socket"]) {
-                                    if (player.contains("shields") && player["shields"].get<int>() > 0) {
-                                        hasShields = true;
-                                        checklist["shieldCount"] = player["shields"].get<int>() - 1;
-                                    }
-                                    break;
-                                }
-                            }
+                    // The server checks us against the enemies as we saw them and tells us when we die
+                    if (deathPending.exchange(false) && !isDeathAnimating) {
+                        // Clean up previous thread if it exists
+                        if (deathAnimationThread && deathAnimationThread->joinable()) {
+                            deathAnimationThread->join();
+                        }
+                        
+                        // Start new death animation thread
+                        deathAnimationThread = std::make_unique<std::thread>([&]() {
+                            int newRoom = 1;
+                            float newX = 90;
+                            float newY = 90;
+                            handleDeathAnimation(newRoom, newX, newY, isDeathAnimating);
                             
-                            if (!hasShields && !isDeathAnimating) {
-                                // Clean up previous thread if it exists
-                                if (deathAnimationThread && deathAnimationThread->joinable()) {
-                                    deathAnimationThread->join();
-                                }
-                                
-                                // Start new death animation thread
-                                deathAnimationThread = std::make_unique<std::thread>([&]() {
-                                    int newRoom = 1;
-                                    float newX = 90;
-                                    float newY = 90;
-                                    handleDeathAnimation(newRoom, newX, newY, isDeathAnimating);
-                                    
-                                    // Update player position and room
-                                    checklist["room"] = newRoom;
-                                    checklist["x"] = newX;
-                                    checklist["y"] = newY;
-                                    localPlayer["room"] = newRoom;
-                                    
-                                    // Force an immediate position update to server
-                                    json updateMessage = {
-                                        {"x", newX},
-                                        {"y", newY},
-                                        {"room", newRoom},
-                                        {"socket", localPlayer["socket"]},
-                                        {"spriteState", checklist["spriteState"]}
-                                    };
-                                    try {
-                                        boost::asio::write(socket, boost::asio::buffer(updateMessage.dump() + "\n"));
-                                    } catch (const std::exception& e) {
-                                        logToFile("Failed to send death position update: " + std::string(e.what()), ERROR);
-                                    }
-                                });
+                            // Update player position and room
+                            checklist["room"] = newRoom;
+                            checklist["x"] = newX;
+                            checklist["y"] = newY;
+                            movementPredictor.teleport(static_cast<int>(newX), static_cast<int>(newY));
+                            localPlayer["room"] = newRoom;
+                            
+                            // Force an immediate position update to server
+                            json updateMessage = {
+                                {"x", newX},
+                                {"y", newY},
+                                {"room", newRoom},
+                                {"socket", localPlayer["socket"]},
+                                {"spriteState", checklist["spriteState"]}
+                            };
+                            try {
+                                writeMessage(socket, updateMessage);
+                            } catch (const std::exception& e) {
+                                logToFile("Failed to send death position update: " + std::string(e.what()), ERROR);
                             }
-                            break;
-                        }
+                        });
                     }
 
                     //get if touched shield
                     try {
                         int localSocketId = localPlayer["socket"].get<int>();
-                        for (const auto& object : game[localRoomName]["objects"]) {
-                            json posjson = {{"x", static_cast<int>(playerStates[localSocketId].current.x)}, {"y", static_cast<int>(playerStates[localSocketId].current.y)}, {"width", checklist["width"]}, {"height", checklist["height"]}};
+                        json posjson = {{"x", static_cast<int>(playerStates[localSocketId].current.x)}, {"y", static_cast<int>(playerStates[localSocketId].current.y)}, {"width", checklist["width"]}, {"height", checklist["height"]}};
+                        const json& roomObjects = game[localRoomName]["objects"];
+                        for (int objectIndex : objectGrid.touching(roomObjects, localRoomName, posjson["x"].get<int>(), posjson["y"].get<int>(),
+                                                                   posjson["width"].get<int>(), posjson["height"].get<int>())) {
+                            const json& object = roomObjects[objectIndex];
                             if (object["objID"] == 10 && checkCollision(posjson, object)) {
                                 checklist["shieldTouched"] = true;
                                 break;
@@ -1695,13 +2026,7 @@ int client_main() {
                         logToFile("Error: " + std::string(e.what()), ERROR);
                     }
 
-                    // Add bounds checking
-                    int screenWidth = GetScreenWidth();
-                    int screenHeight = GetScreenHeight();
-                    
-                    checklist["x"] = std::max(0, std::min(screenWidth - 32, checklist["x"].get<int>()));
-                    checklist["y"] = std::max(0, std::min(screenHeight - 32, checklist["y"].get<int>()));
-                    
+                    // Bounds are part of stepMovement
                     auto now = std::chrono::steady_clock::now();
                     //if spawned in new room set x and y to 90
                     if (checklist["room"].get<int>() != localPlayer["room"].get<int>()) {
@@ -1709,20 +2034,18 @@ int client_main() {
                         checklist["y"] = 90;
                     }
 
-                    if (send && (now - lastSendTime) >= sendInterval && checklist != previousChecklist) {
-                        int localSocketId = localPlayer["socket"].get<int>();
-                        playerStates[localSocketId].target = Position(
-                            checklist["x"].get<float>(),
-                            checklist["y"].get<float>(),
-                            checklist["width"].get<float>(),
-                            checklist["height"].get<float>()
-                        );
-                        playerStates[localSocketId].spriteState = checklist["spriteState"].get<int>();
+                    // Commands the server hasn't acked are repeated until it does
+                    bool unacked = movementPredictor.hasUnacked();
+                    if ((send || unacked) && (now - lastSendTime) >= sendInterval && (checklist != previousChecklist || unacked)) {
                         playerStates[localSocketId].room = checklist["room"].get<int>();
-                        playerStates[localSocketId].interpolation = 0;
 
-                        std::string messageStr = checklist.dump() + "\n";
-                        boost::asio::write(socket, boost::asio::buffer(messageStr));
+                        // The server works out where we are from the commands; positions stay local
+                        json outgoing = checklist;
+                        for (const char* key : {"x", "y", "spriteState", "prevState", "goingup", "goingdown", "goingleft", "goingright"}) {
+                            outgoing.erase(key);
+                        }
+                        outgoing["input"] = movementPredictor.message();
+                        sendChecklist(socket, outgoing, previousChecklist);
                         lastSendTime = now;
                         previousChecklist = checklist;  
                     }
@@ -1741,8 +2064,6 @@ int client_main() {
                     }
                     DrawButton(buttonW);DrawButton(buttonA);DrawButton(buttonS);DrawButton(buttonD); DrawButton(buttonShift); DrawButton(buttonQuit); if (notsendingugh) {DrawText("You are stuck! You probably got kicked though...", 10, 10, 20, BLACK);}
 
-                    float deltaTime = GetFrameTime();
-                    
                     //draw shield
                     for (auto& o : game[localRoomName]["objects"]) {
                         if (o["objID"] == 10) {
@@ -1750,9 +2071,15 @@ int client_main() {
                         }
                     }
 
+                    // Everyone but us is drawn a little in the past, between the server's samples
+                    double renderTime = renderServerTime();
+                    int localSocket = localPlayer.value("socket", -1);
+
                     for (auto& [socketId, state] : playerStates) {
                         if (state.room == localPlayer["room"].get<int>()) {  // Only draw players in same room
-                            state.update(deltaTime);  // Updates interpolation for smooth movement
+                            if (socketId != localSocket) {
+                                state.update(renderTime);
+                            }
 
                             // Draw player sprite based on interpolated position
                             if (spriteSheet.find(std::to_string(state.spriteState)) != spriteSheet.end()) {
@@ -1806,14 +2133,15 @@ int client_main() {
                     float closestDist = maxEffectDistance;
                     
                     // Update and draw all enemies
-                    for (auto& enemy : game[localRoomName]["enemies"]) {
-                        if (enemy["room"] == localPlayer["room"].get<int>()) {
+                    for (auto& [enemyId, enemy] : enemyStates) {
+                        if (enemy.room == localPlayer["room"].get<int>()) {
+                            enemy.update(renderTime);
                             Rectangle sourceRect = { 0, 0, static_cast<float>(enemyTexture.width), static_cast<float>(enemyTexture.height) };
                             Rectangle destRect = { 
-                                enemy["x"].get<float>(),
-                                enemy["y"].get<float>(),
-                                enemy["width"].get<float>(),
-                                enemy["height"].get<float>()
+                                enemy.current.x,
+                                enemy.current.y,
+                                enemy.current.width,
+                                enemy.current.height
                             };
                             DrawTexturePro(
                                 enemyTexture,
@@ -1827,8 +2155,8 @@ int client_main() {
                             float dist = getDistance(
                                 playerStates[localPlayer["socket"].get<int>()].current.x,
                                 playerStates[localPlayer["socket"].get<int>()].current.y,
-                                enemy["x"].get<float>(),
-                                enemy["y"].get<float>()
+                                enemy.current.x,
+                                enemy.current.y
                             );
                             if (dist <= maxEffectDistance) {
                                 enemyNearby = true;
@@ -1869,7 +2197,7 @@ int client_main() {
             }
             gameRunning = false;
             json quitMessage = {{"quitGame", true}};
-            boost::asio::write(socket, boost::asio::buffer(quitMessage.dump() + "\n"));
+            writeMessage(socket, quitMessage);
             socket.close();
             staticGif.unload();
         } catch (const std::exception& e) {
@@ -9,6 +9,21 @@ export NAME="TEST: James5" # put your desired name here
 export IP=127.0.0.1 # put your server's IP here, for runServer put 127.0.1.1
 export CLI=true # put true if you want to run the server in CLI mode
 export PREFERRED_LATENCY=1 # put your preferred latency here; not guarenteed to work
+export WIRE_FORMAT=json # json, cbor or msgpack; binary formats send less, json is easier to debug
+export WIRE_COMPRESSION=lz4 # lz4 or none; the server compresses big messages like getGame, and on the server none turns it off
+export COMPRESS_MIN_BYTES=512 # server only: messages smaller than this are never compressed
+export USE_UDP=true # if the server offers UDP (its UDP_PORT), send movement over it; false keeps everything on TCP
+export INTERPOLATION_DELAY_MS=100 # how far behind the server other players and enemies are drawn; raise it if they stutter
+export EXTRAPOLATION_LIMIT_MS=250 # how long others keep moving when updates stop coming before they freeze
+export MAX_REWIND_MS=300 # server only: the furthest back enemy hits are checked for a laggy player
+export ENEMY_CAP_ROOM2=3 # server only: most enemies alive in room 2 at once (ENEMY_CAP_ROOM<n> for any room; only room 2 has any by default)
+export ENEMY_SPAWN_INTERVAL_ROOM2=1 # server only: seconds between enemy spawns in room 2
+export ENEMY_WAVES_ROOM2= # server only: waves instead of a steady rate, as count:interval:pause,... e.g. 5:0.5:10,10:0.25:20
+export ENEMY_STRESS=0 # server only: fill room 2 with this many enemies (up to 65535) for load testing, players or not
+export SPATIAL_CELL_SIZE=128 # grid cell size, in pixels, for collision and proximity checks; about the size of a player or enemy
+export SIM_SEED= # server only: seed for everything random in the rooms; empty picks one, which the server prints at startup
+export RECORD_SIMULATION= # server only: file to record the seed and every room event to, for replaying the session later
+export REPLAY_SIMULATION= # server only: replay a recorded session offline instead of serving, checking every tick's state hash (same build and settings)
 
 # Settings will be saved in this file, but you have to change them here so the 
 # game won't have a bug (except for the port)
@@ -0,0 +1,85 @@
+#ifndef ACTOR_HPP
+#define ACTOR_HPP
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <boost/asio.hpp>
+
+/**
+ * Owns one piece of state and only ever touches it from its own strand.
+ *
+ * The strand is the actor's inbox: post() queues a message (a function of
+ * the state) and returns immediately, and messages run one at a time in the
+ * order they were posted. Different actors run in parallel on whatever
+ * threads run the io_context. Nothing outside the actor holds a reference to
+ * its state, so no lock is needed; talking to another actor is done by
+ * posting to it.
+ */
+template <typename State>
+class Actor {
+public:
+    using Executor = boost::asio::io_context::executor_type;
+
+    template <typename... Args>
+    explicit Actor(boost::asio::io_context& io, Args&&... args)
+        : strand_(boost::asio::make_strand(io.get_executor())), state_(std::forward<Args>(args)...) {}
+
+    Actor(const Actor&) = delete;
+    Actor& operator=(const Actor&) = delete;
+
+    template <typename Fn>
+    void post(Fn fn) {
+        boost::asio::post(strand_, [this, fn = std::move(fn)]() mutable { fn(state_); });
+    }
+
+    /**
+     * For periodic work such as the simulation step: the message is dropped
+     * if the previous one posted this way has not run yet, so a slow actor
+     * does not build up a backlog of ticks. Returns false when dropped.
+     */
+    template <typename Fn>
+    bool postIfIdle(Fn fn) {
+        if (periodicPending_.exchange(true)) {
+            return false;
+        }
+        boost::asio::post(strand_, [this, fn = std::move(fn)]() mutable {
+            periodicPending_ = false;
+            fn(state_);
+        });
+        return true;
+    }
+
+    /**
+     * Posts and waits for the result. Only for callers outside the io_context
+     * threads (CLI, tests); calling it from a handler can deadlock the pool.
+     */
+    template <typename Fn>
+    auto ask(Fn fn) -> std::invoke_result_t<Fn&, State&> {
+        using Result = std::invoke_result_t<Fn&, State&>;
+        auto promise = std::make_shared<std::promise<Result>>();
+        std::future<Result> result = promise->get_future();
+        post([promise, fn = std::move(fn)](State& state) mutable {
+            try {
+                if constexpr (std::is_void_v<Result>) {
+                    fn(state);
+                    promise->set_value();
+                } else {
+                    promise->set_value(fn(state));
+                }
+            } catch (...) {
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return result.get();
+    }
+
+private:
+    boost::asio::strand<Executor> strand_;
+    State state_;
+    std::atomic<bool> periodicPending_{false};
+};
+
+#endif // ACTOR_HPP
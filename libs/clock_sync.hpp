@@ -0,0 +1,198 @@
+#ifndef CLOCK_SYNC_HPP
+#define CLOCK_SYNC_HPP
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * One timeline for client and server: the server's clock, in seconds since
+ * it started. Ticks, snapshots and the replies below are stamped with it.
+ *
+ * The client asks with its own clock reading and the server answers
+ * straight away with when it got the request and when it replied:
+ *
+ *   client: {"timeSync": {"c": t0}}
+ *   server: {"timeSync": {"c": t0, "s": t1, "r": t2}}
+ *
+ * With t3 the client's clock when the answer arrives, NTP's formulas give
+ * the offset of the server's clock from the client's and the round trip
+ * spent on the network:
+ *
+ *   offset = ((t1 - t0) + (t2 - t3)) / 2
+ *   delay  = (t3 - t0) - (t2 - t1)
+ */
+inline json clockSyncReply(const json& request, double received, double replied) {
+    return {{"timeSync", {{"c", request.value("c", 0.0)}, {"s", received}, {"r", replied}}}};
+}
+
+/**
+ * The client's side. A burst of requests right after connecting, then one
+ * every `interval` seconds.
+ *
+ * Like NTP's clock filter, only the sample with the smallest round trip among
+ * the last few is trusted: queueing only ever adds delay, and it adds it
+ * unevenly to the two directions, so the fastest exchange has the least
+ * error. The offset moves part of the way to each new filtered sample. The
+ * drift between the two clocks is measured between filtered samples at least
+ * minDriftSpan apart, so a few milliseconds of noise in each don't swamp it,
+ * and carries the estimate forward between exchanges.
+ *
+ * All times are in seconds; local times from any monotonic clock.
+ */
+class ClockSync {
+public:
+    static constexpr size_t window = 8;
+    static constexpr double offsetGain = 0.5;
+    static constexpr double driftGain = 0.5;
+    static constexpr double minDriftSpan = 60.0;
+    // NTP's bound on a sane clock's frequency error
+    static constexpr double maxDrift = 500e-6;
+    // Further off than this is a different server (restart, reconnect); start over
+    static constexpr double resyncAfter = 1.0;
+
+    struct Stats {
+        uint64_t requests = 0;
+        uint64_t replies = 0;
+        double offset = 0;
+        double drift = 0;
+        // Smallest round trip in the window
+        double roundTrip = 0;
+        // Server to client, from the stamps on server messages
+        double oneWayMean = 0;
+        double oneWayMax = 0;
+    };
+
+    explicit ClockSync(double interval = 10.0, size_t burst = 5, double burstInterval = 0.5)
+        : interval_(interval), burst_(burst), burstInterval_(burstInterval) {}
+
+    bool synced() const { return synced_; }
+
+    bool due(double localNow) const {
+        if (stats_.requests == 0) {
+            return true;
+        }
+        double wait = stats_.requests < burst_ ? burstInterval_ : interval_;
+        return localNow - lastRequest_ >= wait;
+    }
+
+    json request(double localNow) {
+        lastRequest_ = localNow;
+        stats_.requests++;
+        return {{"timeSync", {{"c", localNow}}}};
+    }
+
+    // `reply` is the object under "timeSync"; false if it was unusable
+    bool reply(const json& reply, double localNow) {
+        if (!reply.is_object() || !reply.contains("c") || !reply.contains("s") || !reply.contains("r")) {
+            return false;
+        }
+        double t0 = reply["c"].get<double>();
+        double t1 = reply["s"].get<double>();
+        double t2 = reply["r"].get<double>();
+        if (t0 > localNow || t2 < t1) {
+            return false;
+        }
+        stats_.replies++;
+
+        Sample sample{((t1 - t0) + (t2 - localNow)) / 2, std::max(0.0, (localNow - t0) - (t2 - t1)), localNow};
+        if (synced_ && std::fabs(sample.offset - offsetAt(localNow)) > resyncAfter) {
+            synced_ = false;
+            count_ = 0;
+            next_ = 0;
+        }
+        samples_[next_] = sample;
+        next_ = (next_ + 1) % window;
+        count_ = std::min(count_ + 1, window);
+
+        const Sample* best = &samples_[0];
+        for (size_t i = 1; i < count_; i++) {
+            if (samples_[i].delay < best->delay) {
+                best = &samples_[i];
+            }
+        }
+        stats_.roundTrip = best->delay;
+        // A filtered sample is only used once; reusing it would pull the drift back towards it
+        if (synced_ && best->localTime <= used_) {
+            return true;
+        }
+        used_ = best->localTime;
+
+        if (!synced_) {
+            offset_ = best->offset;
+            drift_ = 0;
+            base_ = best->localTime;
+            driftBase_ = *best;
+            synced_ = true;
+            return true;
+        }
+        double predicted = offsetAt(best->localTime);
+        offset_ = predicted + offsetGain * (best->offset - predicted);
+        base_ = best->localTime;
+
+        double span = best->localTime - driftBase_.localTime;
+        if (span >= minDriftSpan) {
+            double measured = (best->offset - driftBase_.offset) / span;
+            drift_ = std::clamp(drift_ + driftGain * (measured - drift_), -maxDrift, maxDrift);
+            driftBase_ = *best;
+        }
+        return true;
+    }
+
+    // The server's clock now, by ours
+    double serverNow(double localNow) const { return localNow + offsetAt(localNow); }
+
+    // Notes how long a message stamped `serverTime` took to arrive
+    void arrived(double serverTime, double localNow) {
+        if (!synced_) {
+            return;
+        }
+        double delay = serverNow(localNow) - serverTime;
+        oneWays_++;
+        stats_.oneWayMean += (delay - stats_.oneWayMean) / static_cast<double>(std::min<uint64_t>(oneWays_, 64));
+        stats_.oneWayMax = std::max(stats_.oneWayMax, delay);
+    }
+
+    // The figures so far; the one-way maximum starts over after each read
+    Stats takeStats() {
+        Stats out = stats_;
+        out.offset = offset_;
+        out.drift = drift_;
+        stats_.oneWayMax = 0;
+        return out;
+    }
+
+private:
+    struct Sample {
+        double offset = 0;
+        double delay = 0;
+        double localTime = 0;
+    };
+
+    double offsetAt(double localNow) const { return offset_ + drift_ * (localNow - base_); }
+
+    double interval_;
+    size_t burst_;
+    double burstInterval_;
+
+    std::array<Sample, window> samples_{};
+    size_t next_ = 0;
+    size_t count_ = 0;
+    bool synced_ = false;
+    double offset_ = 0;
+    double drift_ = 0;
+    // Local time the offset was last set at
+    double base_ = 0;
+    double used_ = 0;
+    Sample driftBase_;
+    double lastRequest_ = 0;
+    uint64_t oneWays_ = 0;
+    Stats stats_;
+};
+
+#endif // CLOCK_SYNC_HPP
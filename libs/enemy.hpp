@@ -1,105 +1,213 @@
 #ifndef ENEMY_HPP
 #define ENEMY_HPP
 
-#include <raylib.h>
-#include <iostream>
-#include "pathfinding.hpp"
-#include <nlohmann/json.hpp>
-#include <vector>
 #include <cmath>
-
-using json = nlohmann::json;
+#include <cstddef>
+#include <limits>
+#include <vector>
+#include "pathfinding.hpp"
+#include "world.hpp"
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ENEMY_KERNEL_SSE2 1
+#endif
 
 /**
- * Collision check for enemy vs. player.
+ * Enemies chase the nearest player, all of a room's enemies in one pass over
+ * its tables. Player positions are copied once per step into float arrays
+ * (TargetSet) so the nearest-player search runs four players at a time; the
+ * moves come back as a list of typed events, which the server turns into
+ * messages only at the edge.
+ *
+ * Distances are between top-left corners, as they always have been. Given a
+ * room's navigation (pathfinding.hpp), enemies walk the flow field toward
+ * their player around walls, and straight at them only where there is no
+ * flow to follow. Hits are resolved separately, against where each player
+ * saw the enemy (lag_compensation.hpp).
  */
-inline bool CheckECollision(const json& enemy, const json& player) {
-    if (!enemy.contains("x") || !enemy.contains("y") || 
-        !player.contains("x") || !player.contains("y") ||
-        !enemy.contains("width") || !enemy.contains("height") ||
-        !player.contains("width") || !player.contains("height")) {
-        return false;
-    }
 
-    int left1   = enemy["x"].get<int>();
-    int right1  = left1 + enemy["width"].get<int>();
-    int top1    = enemy["y"].get<int>();
-    int bottom1 = top1 + enemy["height"].get<int>();
+// Inside this many whole pixels an enemy jumps onto its player instead of walking
+constexpr float enemySnapDistance = 30.0f;
 
-    int left2   = player["x"].get<int>();
-    int right2  = left2 + player["width"].get<int>();
-    int top2    = player["y"].get<int>();
-    int bottom2 = top2 + player["height"].get<int>();
+/**
+ * The players enemies can chase, as parallel float arrays. The arrays are
+ * padded to a multiple of `lanes` with targets far enough away never to be
+ * the nearest, so the search has no tail to handle.
+ */
+class TargetSet {
+public:
+    static constexpr size_t lanes = 4;
+
+    void assign(const PlayerTable& players) {
+        count_ = players.size();
+        size_t padded = (count_ + lanes - 1) / lanes * lanes;
+        x_.assign(padded, farAway);
+        y_.assign(padded, farAway);
+        ids_.assign(players.socket.begin(), players.socket.end());
+        for (size_t i = 0; i < count_; i++) {
+            x_[i] = static_cast<float>(players.x[i]);
+            y_[i] = static_cast<float>(players.y[i]);
+        }
+    }
 
-    return !(left1 > right2 || right1 < left2 || top1 > bottom2 || bottom1 < top2);
+    size_t size() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    size_t paddedSize() const { return x_.size(); }
+    const float* x() const { return x_.data(); }
+    const float* y() const { return y_.data(); }
+    // The player's socket
+    int id(size_t i) const { return ids_[i]; }
+
+private:
+    // Squares to ~1e36, still finite as a float
+    static constexpr float farAway = 1e18f;
+
+    std::vector<float> x_;
+    std::vector<float> y_;
+    std::vector<int> ids_;
+    size_t count_ = 0;
+};
+
+struct NearestTarget {
+    // -1 when there are no targets
+    int index = -1;
+    float distanceSquared = std::numeric_limits<float>::infinity();
+};
+
+// The first of the nearest targets to (x, y), one at a time
+inline NearestTarget nearestTargetScalar(const TargetSet& targets, float x, float y) {
+    NearestTarget best;
+    for (size_t i = 0; i < targets.size(); i++) {
+        float dx = targets.x()[i] - x;
+        float dy = targets.y()[i] - y;
+        float d2 = dx * dx + dy * dy;
+        if (d2 < best.distanceSquared) {
+            best.distanceSquared = d2;
+            best.index = static_cast<int>(i);
+        }
+    }
+    return best;
 }
 
-inline json updateEnemy(json& playersArray, json& enemy) {
-    int speed = enemy["speed"].get<int>();
-    float ex = static_cast<float>(enemy["x"].get<int>());
-    float ey = static_cast<float>(enemy["y"].get<int>());
-
-    //find the closest player:
-    if (playersArray.empty()) {
-        // No players: no movement, no collisions
-        return {{"noCollision", true}};
+// Same answer as nearestTargetScalar, ties included: each lane keeps its own
+// first minimum, and the lanes are merged lowest index first
+inline NearestTarget nearestTarget(const TargetSet& targets, float x, float y) {
+#ifdef ENEMY_KERNEL_SSE2
+    if (targets.empty()) {
+        return {};
     }
-
-    json closestPlayer = playersArray[0];
-    float minDistance = static_cast<float>(calculateDistance(enemy, playersArray[0]));
-    for (int i = 1; i < static_cast<int>(playersArray.size()); ++i) {
-        float dist = static_cast<float>(calculateDistance(enemy, playersArray[i]));
-        if (dist < minDistance) {
-            minDistance = dist;
-            closestPlayer = playersArray[i];
-        }
+    const __m128 ex = _mm_set1_ps(x);
+    const __m128 ey = _mm_set1_ps(y);
+    __m128 bestD2 = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    __m128i bestIndex = _mm_set1_epi32(-1);
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    const __m128i step = _mm_set1_epi32(static_cast<int>(TargetSet::lanes));
+    for (size_t i = 0; i < targets.paddedSize(); i += TargetSet::lanes) {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(targets.x() + i), ex);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(targets.y() + i), ey);
+        __m128 d2 = _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy));
+        __m128 closer = _mm_cmplt_ps(d2, bestD2);
+        bestD2 = _mm_or_ps(_mm_and_ps(closer, d2), _mm_andnot_ps(closer, bestD2));
+        __m128i closerInt = _mm_castps_si128(closer);
+        bestIndex = _mm_or_si128(_mm_and_si128(closerInt, index), _mm_andnot_si128(closerInt, bestIndex));
+        index = _mm_add_epi32(index, step);
     }
 
-    // If within 30 pixels of player, snap to their position
-    if (minDistance <= 30.0f) {
-        ex = static_cast<float>(closestPlayer["x"].get<int>());
-        ey = static_cast<float>(closestPlayer["y"].get<int>());
-    } else {
-        // 2) Vector from enemy to closest player
-        float dx = static_cast<float>(closestPlayer["x"].get<int>()) - ex;
-        float dy = static_cast<float>(closestPlayer["y"].get<int>()) - ey;
-
-        // 3) Normalize if distance > 0 (avoid divide by zero)
-        float length = std::sqrt(dx * dx + dy * dy);
-        if (length > 0.0001f) {
-            dx /= length; 
-            dy /= length; 
-            ex += dx * speed;
-            ey += dy * speed;
+    alignas(16) float laneD2[TargetSet::lanes];
+    alignas(16) int laneIndex[TargetSet::lanes];
+    _mm_store_ps(laneD2, bestD2);
+    _mm_store_si128(reinterpret_cast<__m128i*>(laneIndex), bestIndex);
+    NearestTarget best;
+    for (size_t lane = 0; lane < TargetSet::lanes; lane++) {
+        if (laneIndex[lane] < 0) {
+            continue;
+        }
+        if (laneD2[lane] < best.distanceSquared ||
+            (laneD2[lane] == best.distanceSquared && laneIndex[lane] < best.index)) {
+            best.distanceSquared = laneD2[lane];
+            best.index = laneIndex[lane];
         }
     }
+    return best;
+#else
+    return nearestTargetScalar(targets, x, y);
+#endif
+}
 
-    if (ex < 0.0f) ex = 0.0f;
-    if (ey < 0.0f) ey = 0.0f;
-
-    // Update JSON with new position
-    enemy["x"] = static_cast<int>(ex);
-    enemy["y"] = static_cast<int>(ey);
+// An enemy that moved this step, with its new whole-pixel position
+struct EnemyMoved {
+    int enemyId;
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// A player an enemy got to; what it costs them is up to the server
+struct EnemyHit {
+    int socket;
+    int enemyId;
+};
 
-    int collidedPlayerIndex = -1;
-    for (int i = 0; i < static_cast<int>(playersArray.size()); ++i) {
-        if (CheckECollision(enemy, playersArray[i])) {
-            collidedPlayerIndex = i;
-            break;
-        }
+/**
+ * Moves every enemy toward its nearest target. `speed` is in pixels per
+ * second and `dt` is the length of the simulation step in seconds; positions
+ * stay floats so short steps do not get truncated away. Enemies whose
+ * whole-pixel position changed are appended to `moved`.
+ *
+ * Without `navigation`, or before its grid is built, every enemy walks in a
+ * straight line.
+ */
+inline void stepEnemyKernel(EnemyTable& enemies, const TargetSet& targets, float dt, std::vector<EnemyMoved>& moved,
+                            RoomNavigation* navigation = nullptr) {
+    if (targets.empty()) {
+        return;
     }
-
-    if (collidedPlayerIndex < 0) {
-        return {{"noCollision", true}};
+    if (navigation && !navigation->built()) {
+        navigation = nullptr;
     }
-    else {
-        auto& p = playersArray[collidedPlayerIndex];
-        if (p["inventory"]["shields"].get<int>() <= 0) {
-            return {{"playerDead", p["id"]}};
+    if (navigation) {
+        navigation->beginStep(targets.size());
+    }
+    const float snap = (enemySnapDistance + 1) * (enemySnapDistance + 1);
+    for (size_t i = 0; i < enemies.size(); i++) {
+        float ex = enemies.x[i];
+        float ey = enemies.y[i];
+        int beforeX = static_cast<int>(ex);
+        int beforeY = static_cast<int>(ey);
+
+        NearestTarget nearest = nearestTarget(targets, ex, ey);
+        float tx = targets.x()[nearest.index];
+        float ty = targets.y()[nearest.index];
+        float stride = static_cast<float>(enemies.speed[i]) * dt;
+        float dx = 0;
+        float dy = 0;
+        if (nearest.distanceSquared < snap) {
+            ex = tx;
+            ey = ty;
+        } else if (navigation &&
+                   navigation->towards(nearest.index, targets.id(nearest.index), tx, ty).direction(navigation->grid(), ex, ey, dx, dy)) {
+            ex += dx * stride;
+            ey += dy * stride;
         } else {
-            return {{"playerHit", p["id"]}};
+            float scale = stride / std::sqrt(nearest.distanceSquared);
+            ex += (tx - ex) * scale;
+            ey += (ty - ey) * scale;
+        }
+        ex = std::fmax(ex, 0.0f);
+        ey = std::fmax(ey, 0.0f);
+        enemies.x[i] = ex;
+        enemies.y[i] = ey;
+
+        int afterX = static_cast<int>(ex);
+        int afterY = static_cast<int>(ey);
+        if (afterX != beforeX || afterY != beforeY) {
+            moved.push_back({enemies.id[i], afterX, afterY, enemies.width[i], enemies.height[i]});
         }
     }
+    if (navigation) {
+        navigation->endStep();
+    }
 }
 
 #endif // ENEMY_HPP
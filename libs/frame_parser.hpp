@@ -0,0 +1,269 @@
+#ifndef FRAME_PARSER_HPP
+#define FRAME_PARSER_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "wire.hpp"
+
+using json = nlohmann::json;
+
+/**
+ * Byte ring with a power-of-two capacity. Positions are absolute stream
+ * offsets; only their low bits index the storage, so they never need to be
+ * rebased while the ring is in use.
+ */
+class RingBuffer {
+public:
+    struct Span {
+        char* data;
+        size_t size;
+    };
+
+    class const_iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = char;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const char*;
+        using reference = const char&;
+
+        const_iterator() = default;
+        const_iterator(const RingBuffer* ring, size_t pos) : ring_(ring), pos_(pos) {}
+
+        reference operator*() const { return ring_->at(pos_); }
+        const_iterator& operator++() { ++pos_; return *this; }
+        const_iterator operator++(int) { const_iterator old = *this; ++pos_; return old; }
+        bool operator==(const const_iterator& other) const { return pos_ == other.pos_; }
+        bool operator!=(const const_iterator& other) const { return pos_ != other.pos_; }
+
+    private:
+        const RingBuffer* ring_ = nullptr;
+        size_t pos_ = 0;
+    };
+
+    explicit RingBuffer(size_t capacity = 4096) : storage_(roundUp(capacity)), mask_(storage_.size() - 1) {}
+
+    size_t begin() const { return head_; }
+    size_t end() const { return tail_; }
+    size_t size() const { return tail_ - head_; }
+    size_t capacity() const { return storage_.size(); }
+
+    const char& at(size_t pos) const { return storage_[pos & mask_]; }
+    const_iterator iter(size_t pos) const { return const_iterator(this, pos); }
+
+    // Free space, in at most two pieces since it can wrap; fill them, then commit()
+    std::array<Span, 2> prepare(size_t wanted) {
+        reserve(wanted);
+        size_t free = capacity() - size();
+        size_t start = tail_ & mask_;
+        size_t first = std::min(free, capacity() - start);
+        return {{{storage_.data() + start, first}, {storage_.data(), free - first}}};
+    }
+
+    void commit(size_t bytes) { tail_ += bytes; }
+
+    void append(const char* data, size_t size) {
+        std::array<Span, 2> spans = prepare(size);
+        size_t first = std::min(size, spans[0].size);
+        std::memcpy(spans[0].data, data, first);
+        std::memcpy(spans[1].data, data + first, size - first);
+        commit(size);
+    }
+
+    void consume(size_t upTo) { head_ = upTo; }
+
+private:
+    static size_t roundUp(size_t n) {
+        size_t capacity = 16;
+        while (capacity < n) capacity <<= 1;
+        return capacity;
+    }
+
+    // Grows by doubling; live bytes keep their stream positions
+    void reserve(size_t wanted) {
+        if (capacity() - size() >= wanted) {
+            return;
+        }
+        std::vector<char> grown(roundUp(size() + wanted));
+        size_t newMask = grown.size() - 1;
+        for (size_t pos = head_; pos != tail_; ++pos) {
+            grown[pos & newMask] = storage_[pos & mask_];
+        }
+        storage_.swap(grown);
+        mask_ = newMask;
+    }
+
+    std::vector<char> storage_;
+    size_t mask_;
+    size_t head_ = 0;
+    size_t tail_ = 0;
+};
+
+/**
+ * Splits the client's inbound stream into messages without copying them out:
+ * JSON text objects and binary wire frames (see wire.hpp) are parsed straight
+ * from the ring.
+ *
+ * Text objects are delimited by a small scanner that tracks string and escape
+ * state, so braces inside strings (player names) don't end an object early.
+ * The scanner keeps its state between reads, so every byte is looked at once
+ * no matter how many pieces a large getGame arrives in.
+ *
+ * Like WireReader, next() consumes a message before decoding it: a
+ * json::exception only loses that message, anything else means the framing
+ * is lost.
+ */
+class FrameParser {
+public:
+    struct Stats {
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+        uint64_t skippedBytes = 0; // junk between messages
+    };
+
+    explicit FrameParser(size_t initialCapacity = 64 * 1024) : ring_(initialCapacity) {}
+
+    // For reading straight from the socket into the ring. `record`, if given,
+    // gets a copy of the new bytes (a traffic capture).
+    std::array<RingBuffer::Span, 2> prepare(size_t wanted) { return ring_.prepare(wanted); }
+    void commit(size_t bytes, std::ostream* record = nullptr) {
+        if (record) {
+            std::copy(ring_.iter(ring_.end()), ring_.iter(ring_.end() + bytes), std::ostreambuf_iterator<char>(*record));
+        }
+        ring_.commit(bytes);
+        stats_.bytes += bytes;
+    }
+
+    void append(const char* data, size_t size) {
+        ring_.append(data, size);
+        stats_.bytes += size;
+    }
+
+    // False when no whole message is buffered
+    bool next(json& out) {
+        if (!inObject_ && !startMessage()) {
+            return false;
+        }
+        if (isWireFrameStart(ring_.at(ring_.begin()))) {
+            return nextFrame(out);
+        }
+        return nextObject(out);
+    }
+
+    size_t buffered() const { return ring_.size(); }
+    const Stats& stats() const { return stats_; }
+
+private:
+    // Skips to the first byte of the next message; false if there is none yet
+    bool startMessage() {
+        size_t pos = ring_.begin();
+        while (pos != ring_.end()) {
+            char c = ring_.at(pos);
+            if (c == '{' || isWireFrameStart(c)) {
+                break;
+            }
+            if (c != '\n' && c != '\r' && c != ' ' && c != '\t') {
+                stats_.skippedBytes++;
+            }
+            ++pos;
+        }
+        ring_.consume(pos);
+        return pos != ring_.end();
+    }
+
+    bool nextFrame(json& out) {
+        size_t start = ring_.begin();
+        if (ring_.size() < wireHeaderSize) {
+            return false;
+        }
+        char header[wireHeaderSize];
+        for (size_t i = 0; i < wireHeaderSize; i++) {
+            header[i] = ring_.at(start + i);
+        }
+        size_t frameSize = wireFrameSizeFromHeader(header);
+        if (ring_.size() < frameSize) {
+            return false;
+        }
+
+        size_t end = start + frameSize;
+        ring_.consume(end);
+        stats_.messages++;
+        auto first = ring_.iter(start + wireHeaderSize);
+        auto last = ring_.iter(end);
+        uint8_t tag = static_cast<uint8_t>(header[4]);
+        if (tag & wireCompressedFlag) {
+            // LZ4 wants the input in one piece; compressed frames are the big, rare ones
+            std::string body(first, last);
+            std::string raw = decompressWireBody(body.data(), body.size());
+            out = decodeWireBody(tag & ~wireCompressedFlag, raw.begin(), raw.end());
+        } else {
+            out = decodeWireBody(tag, first, last);
+        }
+        return true;
+    }
+
+    bool nextObject(json& out) {
+        size_t start = ring_.begin();
+        if (!inObject_) {
+            inObject_ = true;
+            scanPos_ = start;
+            depth_ = 0;
+            inString_ = false;
+            escaped_ = false;
+        }
+
+        for (; scanPos_ != ring_.end(); ++scanPos_) {
+            char c = ring_.at(scanPos_);
+            if (inString_) {
+                if (escaped_) {
+                    escaped_ = false;
+                } else if (c == '\\') {
+                    escaped_ = true;
+                } else if (c == '"') {
+                    inString_ = false;
+                }
+            } else if (c == '"') {
+                inString_ = true;
+            } else if (c == '{' || c == '[') {
+                depth_++;
+            } else if (c == '}' || c == ']') {
+                if (--depth_ == 0) {
+                    break;
+                }
+            }
+        }
+
+        if (scanPos_ == ring_.end()) {
+            if (ring_.size() > maxWireFrame) {
+                throw std::length_error("text message too long");
+            }
+            return false;
+        }
+
+        size_t end = scanPos_ + 1;
+        inObject_ = false;
+        ring_.consume(end);
+        stats_.messages++;
+        out = json::parse(ring_.iter(start), ring_.iter(end));
+        return true;
+    }
+
+    RingBuffer ring_;
+    Stats stats_;
+
+    // Text scanner state, kept while an object is only partly buffered
+    bool inObject_ = false;
+    size_t scanPos_ = 0;
+    int depth_ = 0;
+    bool inString_ = false;
+    bool escaped_ = false;
+};
+
+#endif // FRAME_PARSER_HPP
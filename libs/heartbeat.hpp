@@ -0,0 +1,125 @@
+#ifndef HEARTBEAT_HPP
+#define HEARTBEAT_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <mutex>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * Keeping track of whether a client is still there, and how far away it is.
+ *
+ * The server pings every session on a timer:
+ *
+ *   {"ping": {"id": n, "t": <server ms>}}
+ *
+ * and the client echoes the object back as {"pong": {...}}. Pongs are matched
+ * to pings by id against the server's own send times, so a client can't make
+ * itself look closer than it is by rewriting "t". Anything a client sends
+ * counts as hearing from it; one that stays silent for idleTimeout is
+ * disconnected.
+ */
+struct HeartbeatSettings {
+    std::chrono::milliseconds interval{2000};
+    std::chrono::milliseconds idleTimeout{15000};
+};
+
+struct RttStats {
+    uint64_t samples = 0;
+    double lastMs = 0;
+    // Smoothed like TCP's SRTT (RFC 6298); what lag compensation should use
+    double smoothedMs = 0;
+    double minMs = 0;
+    // Mean difference between consecutive samples (RFC 3550)
+    double jitterMs = 0;
+};
+
+class RttEstimator {
+public:
+    void add(double ms) {
+        if (stats_.samples == 0) {
+            stats_.smoothedMs = ms;
+            stats_.minMs = ms;
+        } else {
+            stats_.smoothedMs += (ms - stats_.smoothedMs) / 8;
+            stats_.minMs = std::min(stats_.minMs, ms);
+            stats_.jitterMs += (std::fabs(ms - stats_.lastMs) - stats_.jitterMs) / 16;
+        }
+        stats_.lastMs = ms;
+        stats_.samples++;
+    }
+
+    const RttStats& stats() const { return stats_; }
+
+private:
+    RttStats stats_;
+};
+
+/**
+ * One connection's heartbeat. Pings and pongs go through the connection's
+ * strand; heard() may be called from anywhere and rtt() read from anywhere.
+ */
+class Heartbeat {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Pings older than the last few are forgotten; their pongs no longer count
+    static constexpr size_t maxOutstanding = 4;
+
+    explicit Heartbeat(Clock::time_point now = Clock::now()) : lastHeard_(now.time_since_epoch().count()) {}
+
+    void heard(Clock::time_point now) { lastHeard_.store(now.time_since_epoch().count(), std::memory_order_relaxed); }
+
+    Clock::duration silentFor(Clock::time_point now) const {
+        return now - Clock::time_point(Clock::duration(lastHeard_.load(std::memory_order_relaxed)));
+    }
+
+    json ping(Clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint32_t id = ++lastId_;
+        outstanding_[id % maxOutstanding] = {id, now};
+        double t = std::chrono::duration<double, std::milli>(now.time_since_epoch()).count();
+        return {{"ping", {{"id", id}, {"t", t}}}};
+    }
+
+    // True if the pong answered one of our outstanding pings
+    bool pong(const json& echo, Clock::time_point now) {
+        if (!echo.is_object() || !echo.contains("id") || !echo["id"].is_number_unsigned()) {
+            return false;
+        }
+        uint32_t id = echo["id"].get<uint32_t>();
+        std::lock_guard<std::mutex> lock(mutex_);
+        Pending& pending = outstanding_[id % maxOutstanding];
+        if (id == 0 || pending.id != id) {
+            return false;
+        }
+        pending.id = 0;
+        rtt_.add(std::chrono::duration<double, std::milli>(now - pending.sentAt).count());
+        return true;
+    }
+
+    RttStats rtt() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return rtt_.stats();
+    }
+
+private:
+    struct Pending {
+        uint32_t id = 0;
+        Clock::time_point sentAt{};
+    };
+
+    std::atomic<Clock::rep> lastHeard_;
+    mutable std::mutex mutex_;
+    std::array<Pending, maxOutstanding> outstanding_{};
+    uint32_t lastId_ = 0;
+    RttEstimator rtt_;
+};
+
+#endif // HEARTBEAT_HPP
@@ -0,0 +1,58 @@
+#ifndef INTEREST_HPP
+#define INTEREST_HPP
+
+#include <map>
+#include <set>
+#include <unordered_map>
+
+/**
+ * Which sessions receive a room's events. Each subscriber is in at most one
+ * room, mirroring the room its player is in.
+ */
+class RoomSubscriptions {
+public:
+    // Moves the subscriber out of whatever room it was in before
+    void subscribe(int subscriber, int roomID) {
+        unsubscribe(subscriber);
+        roomOf_[subscriber] = roomID;
+        rooms_[roomID].insert(subscriber);
+    }
+
+    void unsubscribe(int subscriber) {
+        auto it = roomOf_.find(subscriber);
+        if (it == roomOf_.end()) {
+            return;
+        }
+        auto room = rooms_.find(it->second);
+        if (room != rooms_.end()) {
+            room->second.erase(subscriber);
+            if (room->second.empty()) {
+                rooms_.erase(room);
+            }
+        }
+        roomOf_.erase(it);
+    }
+
+    // 0 when not subscribed anywhere
+    int roomOf(int subscriber) const {
+        auto it = roomOf_.find(subscriber);
+        return it != roomOf_.end() ? it->second : 0;
+    }
+
+    const std::set<int>& subscribers(int roomID) const {
+        static const std::set<int> none;
+        auto it = rooms_.find(roomID);
+        return it != rooms_.end() ? it->second : none;
+    }
+
+    void clear() {
+        roomOf_.clear();
+        rooms_.clear();
+    }
+
+private:
+    std::unordered_map<int, int> roomOf_;
+    std::map<int, std::set<int>> rooms_;
+};
+
+#endif // INTEREST_HPP
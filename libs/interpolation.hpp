@@ -0,0 +1,159 @@
+#ifndef INTERPOLATION_HPP
+#define INTERPOLATION_HPP
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+
+/**
+ * Drawing other players and enemies from timestamped server samples.
+ *
+ * Every position the server sends is stamped with the server's clock (the
+ * "time" of the tick it came in; see clock_sync.hpp). Clients draw each
+ * entity as it was `delay` seconds before the server's time now, interpolating
+ * between the two samples around that moment, so motion keeps the server's
+ * pace however unevenly the packets arrive. When samples stop coming (a lost
+ * packet, a stall) the entity carries on along its last velocity for at most
+ * `maxExtrapolation` seconds and then holds still.
+ */
+struct InterpolationSettings {
+    // A couple of ticks at the default 20 Hz, so one late packet doesn't starve the buffer
+    double delay = 0.1;
+    double maxExtrapolation = 0.25;
+};
+
+struct Snapshot {
+    double time = 0;
+    float x = 0;
+    float y = 0;
+    float width = 64;
+    float height = 64;
+};
+
+/**
+ * The last few samples of one entity, oldest first. Samples may arrive out of
+ * order (TCP and UDP interleave); one older than everything kept is dropped
+ * and one with the time of a kept sample replaces it.
+ */
+class SnapshotBuffer {
+public:
+    static constexpr size_t capacity = 16;
+
+    bool empty() const { return count_ == 0; }
+    size_t size() const { return count_; }
+    const Snapshot& newest() const { return at(count_ - 1); }
+
+    void clear() { count_ = 0; }
+
+    // Forgets the history: for jumps (room changes, respawns) that must not be slid across
+    void reset(const Snapshot& sample) {
+        count_ = 0;
+        push(sample);
+    }
+
+    void push(const Snapshot& sample) {
+        size_t pos = count_;
+        while (pos > 0 && at(pos - 1).time > sample.time) {
+            pos--;
+        }
+        if (pos > 0 && at(pos - 1).time == sample.time) {
+            at(pos - 1) = sample;
+            return;
+        }
+        if (count_ == capacity) {
+            if (pos == 0) {
+                return;
+            }
+            head_ = (head_ + 1) % capacity;
+            count_--;
+            pos--;
+        }
+        for (size_t i = count_; i > pos; i--) {
+            at(i) = at(i - 1);
+        }
+        at(pos) = sample;
+        count_++;
+    }
+
+    // Where the entity was at `time`; an empty buffer gives a default Snapshot
+    Snapshot sample(double time, double maxExtrapolation) const {
+        if (count_ == 0) {
+            return Snapshot{};
+        }
+        if (time <= at(0).time) {
+            return at(0);
+        }
+        for (size_t i = 1; i < count_; i++) {
+            if (time <= at(i).time) {
+                return lerp(at(i - 1), at(i), time);
+            }
+        }
+
+        const Snapshot& last = newest();
+        if (count_ < 2 || maxExtrapolation <= 0) {
+            return last;
+        }
+        double ahead = std::fmin(time, last.time + maxExtrapolation);
+        Snapshot out = lerp(at(count_ - 2), last, ahead);
+        out.width = last.width;
+        out.height = last.height;
+        return out;
+    }
+
+private:
+    // Interpolates for `time` inside [a, b], extrapolates past b
+    static Snapshot lerp(const Snapshot& a, const Snapshot& b, double time) {
+        double span = b.time - a.time;
+        float t = span > 0 ? static_cast<float>((time - a.time) / span) : 1.0f;
+        Snapshot out;
+        out.time = time;
+        out.x = a.x + (b.x - a.x) * t;
+        out.y = a.y + (b.y - a.y) * t;
+        out.width = a.width + (b.width - a.width) * t;
+        out.height = a.height + (b.height - a.height) * t;
+        return out;
+    }
+
+    Snapshot& at(size_t i) { return samples_[(head_ + i) % capacity]; }
+    const Snapshot& at(size_t i) const { return samples_[(head_ + i) % capacity]; }
+
+    std::array<Snapshot, capacity> samples_{};
+    size_t head_ = 0;
+    size_t count_ = 0;
+};
+
+/**
+ * A rough estimate of the server's clock from the times on the ticks it
+ * receives, for when there is nothing better (a server that doesn't answer
+ * clock syncs, or before the first answer). The least delayed tick is the
+ * best estimate, so the offset jumps up to any tick that arrives early and
+ * only drifts down slowly after late ones. A jump of more than `resyncAfter` seconds (a server
+ * restart, a long stall) starts over.
+ */
+class SnapshotClock {
+public:
+    static constexpr double resyncAfter = 1.0;
+    static constexpr double driftRate = 0.05;
+
+    bool synced() const { return synced_; }
+
+    void observe(double serverTime, double localTime) {
+        double offset = serverTime - localTime;
+        if (!synced_ || std::fabs(offset - offset_) > resyncAfter) {
+            offset_ = offset;
+            synced_ = true;
+        } else if (offset > offset_) {
+            offset_ = offset;
+        } else {
+            offset_ += (offset - offset_) * driftRate;
+        }
+    }
+
+    double now(double localTime) const { return localTime + offset_; }
+
+private:
+    double offset_ = 0;
+    bool synced_ = false;
+};
+
+#endif // INTERPOLATION_HPP
@@ -0,0 +1,175 @@
+#ifndef LAG_COMPENSATION_HPP
+#define LAG_COMPENSATION_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include "world.hpp"
+
+/**
+ * Resolving enemy hits against what each player actually saw.
+ *
+ * A client draws enemies interpolation-delay behind the server's clock (see
+ * interpolation.hpp), and what it does reaches the server half a round trip
+ * later. So when the server checks a player against the enemies, it checks
+ * the player where they are now against the enemies where that player saw
+ * them: rewound by half their RTT plus the render delay, capped at
+ * maxRewind so a slow connection can't buy unlimited slack.
+ */
+struct LagCompensationSettings {
+    // What clients render at; INTERPOLATION_DELAY_MS on both sides
+    double interpolationDelay = 0.1;
+    double maxRewind = 0.3;
+};
+
+inline double viewTime(double now, double rttMs, const LagCompensationSettings& settings) {
+    double rewind = std::max(0.0, rttMs) / 2000.0 + settings.interpolationDelay;
+    return now - std::min(rewind, settings.maxRewind);
+}
+
+struct TrackedBox {
+    int id = 0;
+    float x = 0;
+    float y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+// Touching counts, as it always has for enemies
+inline bool touches(const TrackedBox& a, const TrackedBox& b) {
+    return !(a.x > b.x + b.width || a.x + a.width < b.x || a.y > b.y + b.height || a.y + a.height < b.y);
+}
+
+/**
+ * Where a room's enemies and players were at the end of each of the last few
+ * ticks, on the server's clock. Frames are reused, so recording doesn't
+ * allocate once the room has settled. Only used on the room's actor.
+ */
+class PositionHistory {
+public:
+    explicit PositionHistory(size_t frames = 16) : frames_(std::max<size_t>(frames, 2)) {}
+
+    // Enough frames to rewind `seconds` at `tickRate`, plus one on each side to interpolate with
+    static size_t framesFor(double seconds, int tickRate) {
+        return static_cast<size_t>(std::ceil(seconds * std::max(tickRate, 1))) + 2;
+    }
+
+    size_t size() const { return count_; }
+    void clear() { count_ = 0; }
+
+    void record(double time, const EnemyTable& enemies, const PlayerTable& players) {
+        Frame& frame = frames_[next_];
+        next_ = (next_ + 1) % frames_.size();
+        count_ = std::min(count_ + 1, frames_.size());
+
+        frame.time = time;
+        frame.enemies.clear();
+        for (size_t i = 0; i < enemies.size(); i++) {
+            frame.enemies.push_back({enemies.id[i], enemies.x[i], enemies.y[i], enemies.width[i], enemies.height[i]});
+        }
+        frame.players.clear();
+        for (size_t i = 0; i < players.size(); i++) {
+            frame.players.push_back({players.socket[i], static_cast<float>(players.x[i]), static_cast<float>(players.y[i]),
+                                     players.width[i], players.height[i]});
+        }
+        auto byId = [](const TrackedBox& a, const TrackedBox& b) { return a.id < b.id; };
+        std::sort(frame.enemies.begin(), frame.enemies.end(), byId);
+        std::sort(frame.players.begin(), frame.players.end(), byId);
+    }
+
+    // Enemies as they were at `time`, interpolated between the frames around
+    // it. Before the oldest frame, the oldest; after the newest, the newest.
+    void enemiesAt(double time, std::vector<TrackedBox>& out) const { at(time, &Frame::enemies, out); }
+    void playersAt(double time, std::vector<TrackedBox>& out) const { at(time, &Frame::players, out); }
+
+    // One enemy as it was at `time`, the same way enemiesAt() places it; false
+    // if it wasn't there then. For checking a few enemies instead of all of them.
+    bool enemyAt(double time, int id, TrackedBox& out) const {
+        if (count_ == 0) {
+            return false;
+        }
+        size_t later = laterFrame(time);
+        if (later == 0 || later == count_) {
+            return find(frame(later == 0 ? 0 : count_ - 1).enemies, id, out);
+        }
+        const Frame& a = frame(later - 1);
+        const Frame& b = frame(later);
+        TrackedBox before;
+        if (!find(a.enemies, id, before) || !find(b.enemies, id, out)) {
+            return false;
+        }
+        float t = static_cast<float>((time - a.time) / (b.time - a.time));
+        out.x = before.x + (out.x - before.x) * t;
+        out.y = before.y + (out.y - before.y) * t;
+        return true;
+    }
+
+private:
+    struct Frame {
+        double time = 0;
+        std::vector<TrackedBox> enemies;
+        std::vector<TrackedBox> players;
+    };
+
+    // i = 0 is the oldest frame
+    const Frame& frame(size_t i) const { return frames_[(next_ + frames_.size() - count_ + i) % frames_.size()]; }
+
+    // The first frame at or after `time`; count_ if there is none
+    size_t laterFrame(double time) const {
+        size_t later = 0;
+        while (later < count_ && frame(later).time < time) {
+            later++;
+        }
+        return later;
+    }
+
+    // Frames are sorted by id
+    static bool find(const std::vector<TrackedBox>& boxes, int id, TrackedBox& out) {
+        auto it = std::lower_bound(boxes.begin(), boxes.end(), id,
+                                   [](const TrackedBox& candidate, int wanted) { return candidate.id < wanted; });
+        if (it == boxes.end() || it->id != id) {
+            return false;
+        }
+        out = *it;
+        return true;
+    }
+
+    void at(double time, std::vector<TrackedBox> Frame::*boxes, std::vector<TrackedBox>& out) const {
+        out.clear();
+        if (count_ == 0) {
+            return;
+        }
+        size_t later = laterFrame(time);
+        if (later == 0 || later == count_) {
+            const Frame& nearest = frame(later == 0 ? 0 : count_ - 1);
+            out = nearest.*boxes;
+            return;
+        }
+
+        // Entities in both frames, between where they were in each; one that
+        // only appears in the later frame didn't exist yet at `time`
+        const Frame& a = frame(later - 1);
+        const Frame& b = frame(later);
+        float t = static_cast<float>((time - a.time) / (b.time - a.time));
+        const std::vector<TrackedBox>& before = a.*boxes;
+        auto match = before.begin();
+        for (const TrackedBox& box : b.*boxes) {
+            match = std::lower_bound(match, before.end(), box.id,
+                                     [](const TrackedBox& candidate, int id) { return candidate.id < id; });
+            if (match == before.end() || match->id != box.id) {
+                continue;
+            }
+            TrackedBox blended = box;
+            blended.x = match->x + (box.x - match->x) * t;
+            blended.y = match->y + (box.y - match->y) * t;
+            out.push_back(blended);
+        }
+    }
+
+    std::vector<Frame> frames_;
+    size_t next_ = 0;
+    size_t count_ = 0;
+};
+
+#endif // LAG_COMPENSATION_HPP
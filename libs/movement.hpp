@@ -0,0 +1,217 @@
+#ifndef MOVEMENT_HPP
+#define MOVEMENT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * Player movement as input commands.
+ *
+ * The client samples its controls inputStepsPerSecond times a second and
+ * sends the resulting commands, numbered, instead of positions. The server
+ * runs every command through stepMovement() and reports the last one it
+ * applied with the player's position; the client runs the same function to
+ * predict, and on each report starts again from the server's position and
+ * replays the commands the server has not seen yet.
+ *
+ * Commands travel run-length encoded, newest last:
+ *
+ *   {"input": {"seq": <number of the last command>, "runs": [[bits, count], ...]}}
+ *
+ * Every message repeats all unacknowledged commands, so a lost one (UDP) is
+ * covered by the next; the server skips numbers it has already applied.
+ */
+enum MoveBits : uint8_t {
+    MoveUp = 1,
+    MoveDown = 2,
+    MoveLeft = 4,
+    MoveRight = 8,
+    MoveCrouch = 16
+};
+
+constexpr int inputStepsPerSecond = 60;
+constexpr int walkSpeed = 5;
+constexpr int crouchSpeed = 2;
+constexpr int crouchSpriteState = 5;
+// The default client window (SCREEN_WIDTH/SCREEN_HEIGHT); players stay 32px inside its right and bottom edges
+constexpr int movementBoundsWidth = 1600;
+constexpr int movementBoundsHeight = 1000;
+// More than this many commands in one message are ignored (two seconds of input)
+constexpr size_t maxInputBacklog = 2 * inputStepsPerSecond;
+
+struct MoveBox {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+struct MoveState {
+    int x = 0;
+    int y = 0;
+    int width = 64;
+    int height = 64;
+    // Last direction walked (1 N, 2 E, 3 S, 4 W); shown unless crouching
+    int facing = 3;
+    bool crouched = false;
+
+    int spriteState() const { return crouched ? crouchSpriteState : facing; }
+};
+
+// Walls and doors block; shields (10) are picked up and personal-space bubbles (0) are the client's own business
+inline bool isSolidObject(int objID) {
+    return objID != 0 && objID != 10;
+}
+
+inline bool overlaps(const MoveState& state, const MoveBox& box) {
+    return state.x < box.x + box.width && state.x + state.width > box.x &&
+           state.y < box.y + box.height && state.y + state.height > box.y;
+}
+
+/**
+ * One command's worth of movement. Each axis moves separately and stops flush
+ * against anything solid, so sliding along a wall works.
+ */
+inline MoveState stepMovement(MoveState state, uint8_t bits, const std::vector<MoveBox>& solids) {
+    state.crouched = (bits & MoveCrouch) != 0;
+    int speed = state.crouched ? crouchSpeed : walkSpeed;
+
+    // Later directions win the sprite, as they always have on the client
+    int dx = 0, dy = 0;
+    if (bits & MoveUp) { dy -= speed; state.facing = 1; }
+    if (bits & MoveDown) { dy += speed; state.facing = 3; }
+    if (bits & MoveLeft) { dx -= speed; state.facing = 4; }
+    if (bits & MoveRight) { dx += speed; state.facing = 2; }
+
+    if (dx != 0) {
+        state.x += dx;
+        for (const MoveBox& box : solids) {
+            if (overlaps(state, box)) {
+                state.x = dx > 0 ? box.x - state.width : box.x + box.width;
+            }
+        }
+        state.x = std::max(0, std::min(movementBoundsWidth - 32, state.x));
+    }
+    if (dy != 0) {
+        state.y += dy;
+        for (const MoveBox& box : solids) {
+            if (overlaps(state, box)) {
+                state.y = dy > 0 ? box.y - state.height : box.y + box.height;
+            }
+        }
+        state.y = std::max(0, std::min(movementBoundsHeight - 32, state.y));
+    }
+    return state;
+}
+
+struct InputCommand {
+    uint32_t sequence;
+    uint8_t bits;
+};
+
+inline json encodeInputCommands(const std::deque<InputCommand>& commands) {
+    json runs = json::array();
+    for (const InputCommand& command : commands) {
+        if (!runs.empty() && runs.back()[0].get<int>() == command.bits) {
+            runs.back()[1] = runs.back()[1].get<int>() + 1;
+        } else {
+            runs.push_back({command.bits, 1});
+        }
+    }
+    return {{"seq", commands.empty() ? 0 : commands.back().sequence}, {"runs", std::move(runs)}};
+}
+
+/**
+ * Calls fn(command) for each command numbered after `after`, oldest first.
+ * Returns false (calling nothing) if the message is malformed or too long.
+ */
+template <typename Fn>
+bool forEachInputCommand(const json& input, uint32_t after, Fn fn) {
+    if (!input.is_object() || !input.contains("seq") || !input.contains("runs") || !input["runs"].is_array()) {
+        return false;
+    }
+    uint32_t last = input["seq"].get<uint32_t>();
+    size_t total = 0;
+    for (const json& run : input["runs"]) {
+        if (!run.is_array() || run.size() != 2 || run[1].get<int>() <= 0) {
+            return false;
+        }
+        total += run[1].get<size_t>();
+    }
+    if (total > maxInputBacklog || total > last) {
+        return false;
+    }
+    uint32_t sequence = last - static_cast<uint32_t>(total);
+    for (const json& run : input["runs"]) {
+        uint8_t bits = static_cast<uint8_t>(run[0].get<int>());
+        int count = run[1].get<int>();
+        for (int i = 0; i < count; i++) {
+            ++sequence;
+            if (sequence > after) {
+                fn(InputCommand{sequence, bits});
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * The client's side: numbers commands, keeps the ones the server has not
+ * acknowledged, and rebuilds the predicted state when a report arrives.
+ */
+class InputPredictor {
+public:
+    const MoveState& predicted() const { return predicted_; }
+    void reset(const MoveState& state) {
+        predicted_ = state;
+        pending_.clear();
+    }
+
+    // Runs one command locally. Idle steps after an idle step are not sent: they change nothing.
+    const MoveState& apply(uint8_t bits, const std::vector<MoveBox>& solids) {
+        if (bits != 0 || lastBits_ != 0) {
+            pending_.push_back({++sequence_, bits});
+            // A server that stopped acking gets only the newest commands
+            while (pending_.size() > maxInputBacklog) {
+                pending_.pop_front();
+            }
+        }
+        lastBits_ = bits;
+        predicted_ = stepMovement(predicted_, bits, solids);
+        return predicted_;
+    }
+
+    // The server's state after command `acked`; anything newer is replayed on top
+    const MoveState& reconcile(const MoveState& authoritative, uint32_t acked, const std::vector<MoveBox>& solids) {
+        while (!pending_.empty() && pending_.front().sequence <= acked) {
+            pending_.pop_front();
+        }
+        predicted_ = authoritative;
+        for (const InputCommand& command : pending_) {
+            predicted_ = stepMovement(predicted_, command.bits, solids);
+        }
+        return predicted_;
+    }
+
+    // A jump the server makes on its own (room change, respawn); the next report confirms it
+    void teleport(int x, int y) {
+        predicted_.x = x;
+        predicted_.y = y;
+    }
+
+    bool hasUnacked() const { return !pending_.empty(); }
+    json message() const { return encodeInputCommands(pending_); }
+
+private:
+    MoveState predicted_;
+    std::deque<InputCommand> pending_;
+    uint32_t sequence_ = 0;
+    uint8_t lastBits_ = 0;
+};
+
+#endif // MOVEMENT_HPP
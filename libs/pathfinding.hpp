@@ -1,102 +1,237 @@
 #ifndef PATHFINDING_HPP
 #define PATHFINDING_HPP
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
 #include <vector>
-#include <string>
-#include <algorithm>
-#include <raylib.h>
-#include <nlohmann/json.hpp>
-
-using json = nlohmann::json;
+#include "movement.hpp"
 
 /**
- * Calculate the Euclidean distance between two objects that have x,y.
+ * Enemy navigation around a room's solid objects, as flow fields.
+ *
+ * NavGrid cuts the room into square cells and marks the ones an enemy's
+ * top-left corner can't be anywhere in without the enemy overlapping
+ * something solid (isSolidObject, the same walls players stop at). It is
+ * only rebuilt when the room's solid objects change.
+ *
+ * A FlowField is one breadth-first search outward from a target's cell:
+ * every open cell that can reach the target points at the neighbour one step
+ * closer. Every enemy chasing that target reads the same field, one lookup
+ * each, so a tick costs one search per chased target that moved to another
+ * cell instead of one search per enemy. Diagonal steps are never taken past
+ * a blocked corner, so an enemy following the flow from anywhere in an open
+ * cell can't clip a wall.
  */
-inline int calculateDistance(const json& object, const json& other_object) {
-    int dx = object.at("x").get<int>() - other_object.at("x").get<int>();
-    int dy = object.at("y").get<int>() - other_object.at("y").get<int>();
-    return static_cast<int>(std::sqrt(dx * dx + dy * dy));
-}
 
-/**
- * Calculate the angle in degrees from 'object' to 'other_object'.
- * 
- * Here we use atan2(-dy, dx) so that:
- *   - angle = 0   => north (i.e., up)
- *   - angle = 90  => east
- *   - angle = 180 => south
- *   - angle = 270 => west
- */
-inline float calculateDirectionDegrees(const json& object, const json& other_object) {
-    float dx = static_cast<float>(other_object.at("x").get<int>() - object.at("x").get<int>());
-    float dy = static_cast<float>(other_object.at("y").get<int>() - object.at("y").get<int>());
-    
-    // We negate `dy` so that 0 degrees is "north" (i.e. up).
-    float angleRadians = std::atan2f(-dy, dx);
-    float angleDegrees = angleRadians * RAD2DEG;
-    if (angleDegrees < 0.0f) {
-        angleDegrees += 360.0f;
+// Half a player; small enough for the gaps in the rooms to stay open
+constexpr int navCellSize = 32;
+
+class NavGrid {
+public:
+    // Cells over the movement bounds for a `agentWidth` x `agentHeight` box
+    void build(const std::vector<MoveBox>& solids, int agentWidth, int agentHeight, int cellSize = navCellSize) {
+        cellSize_ = std::max(cellSize, 1);
+        columns_ = (movementBoundsWidth + cellSize_ - 1) / cellSize_;
+        rows_ = (movementBoundsHeight + cellSize_ - 1) / cellSize_;
+        blocked_.assign(static_cast<size_t>(columns_) * rows_, 0);
+        for (const MoveBox& solid : solids) {
+            // Top-left corners that put the agent over this solid
+            int left = solid.x - agentWidth;
+            int top = solid.y - agentHeight;
+            int right = solid.x + solid.width;
+            int bottom = solid.y + solid.height;
+            int c0 = std::max(0, floorDiv(left));
+            int r0 = std::max(0, floorDiv(top));
+            int c1 = std::min(columns_ - 1, floorDiv(right));
+            int r1 = std::min(rows_ - 1, floorDiv(bottom));
+            for (int r = r0; r <= r1; r++) {
+                for (int c = c0; c <= c1; c++) {
+                    int cellLeft = c * cellSize_;
+                    int cellTop = r * cellSize_;
+                    if (cellLeft < right && cellLeft + cellSize_ > left && cellTop < bottom && cellTop + cellSize_ > top) {
+                        blocked_[static_cast<size_t>(r) * columns_ + c] = 1;
+                    }
+                }
+            }
+        }
+        version_++;
     }
-    return angleDegrees;
-}
 
-/**
- * Given a number (an angle) and a list of "standard angles," find the closest angle.
- */
-inline int findClosestNumber(int number, const std::vector<int>& numbers) {
-    return *std::min_element(numbers.begin(), numbers.end(),
-        [number](int a, int b) {
-            return std::abs(number - a) < std::abs(number - b);
-        });
-}
+    // 0 until the first build; fields remember which build they were searched on
+    uint64_t version() const { return version_; }
+    int cellSize() const { return cellSize_; }
+    int columns() const { return columns_; }
+    int rows() const { return rows_; }
+    size_t cellCount() const { return blocked_.size(); }
+    bool blocked(int cell) const { return blocked_[cell] != 0; }
+
+    // -1 outside the grid
+    int cellAt(float x, float y) const {
+        if (x < 0 || y < 0) {
+            return -1;
+        }
+        int c = static_cast<int>(x) / cellSize_;
+        int r = static_cast<int>(y) / cellSize_;
+        if (c >= columns_ || r >= rows_) {
+            return -1;
+        }
+        return r * columns_ + c;
+    }
+
+private:
+    int floorDiv(int v) const {
+        return v >= 0 ? v / cellSize_ : -((-v + cellSize_ - 1) / cellSize_);
+    }
+
+    int cellSize_ = navCellSize;
+    int columns_ = 0;
+    int rows_ = 0;
+    std::vector<uint8_t> blocked_;
+    uint64_t version_ = 0;
+};
+
+class FlowField {
+public:
+    // Orthogonal first, so equally short paths prefer straight steps
+    static constexpr int directions = 8;
+    static constexpr int dc[directions] = {0, 1, 0, -1, 1, 1, -1, -1};
+    static constexpr int dr[directions] = {-1, 0, 1, 0, -1, 1, 1, -1};
+
+    // Searches outward from `targetCell`. The target's own cell counts as
+    // open even if it's marked blocked: whoever is there fits there.
+    void compute(const NavGrid& grid, int targetCell) {
+        gridVersion_ = grid.version();
+        targetCell_ = targetCell;
+        next_.assign(grid.cellCount(), -1);
+        if (targetCell < 0) {
+            return;
+        }
+        queue_.clear();
+        queue_.push_back(targetCell);
+        visited_.assign(grid.cellCount(), 0);
+        visited_[targetCell] = 1;
+        for (size_t head = 0; head < queue_.size(); head++) {
+            int cell = queue_[head];
+            int c = cell % grid.columns();
+            int r = cell / grid.columns();
+            for (int d = 0; d < directions; d++) {
+                int nc = c + dc[d];
+                int nr = r + dr[d];
+                if (nc < 0 || nr < 0 || nc >= grid.columns() || nr >= grid.rows()) {
+                    continue;
+                }
+                int neighbour = nr * grid.columns() + nc;
+                if (visited_[neighbour] || grid.blocked(neighbour)) {
+                    continue;
+                }
+                // Diagonals only between two open orthogonal cells
+                if (d >= 4 && (grid.blocked(r * grid.columns() + nc) || grid.blocked(nr * grid.columns() + c))) {
+                    continue;
+                }
+                visited_[neighbour] = 1;
+                // The neighbour walks back the way the search came
+                next_[neighbour] = static_cast<int8_t>((d + 2) % 4 + (d >= 4 ? 4 : 0));
+                queue_.push_back(neighbour);
+            }
+        }
+    }
+
+    uint64_t gridVersion() const { return gridVersion_; }
+    int targetCell() const { return targetCell_; }
+
+    /**
+     * The way to walk from (x, y), as a unit vector. False when there is no
+     * flow to follow there: in the target's own cell, in a blocked cell,
+     * outside the grid, or somewhere the target can't be reached from.
+     */
+    bool direction(const NavGrid& grid, float x, float y, float& dx, float& dy) const {
+        int cell = grid.cellAt(x, y);
+        if (cell < 0 || static_cast<size_t>(cell) >= next_.size() || next_[cell] < 0) {
+            return false;
+        }
+        static constexpr float diagonal = 0.70710678f;
+        int d = next_[cell];
+        float scale = d >= 4 ? diagonal : 1.0f;
+        dx = static_cast<float>(dc[d]) * scale;
+        dy = static_cast<float>(dr[d]) * scale;
+        return true;
+    }
+
+private:
+    std::vector<int8_t> next_;
+    std::vector<uint8_t> visited_;
+    std::vector<int> queue_;
+    uint64_t gridVersion_ = 0;
+    int targetCell_ = -1;
+};
+
+// The diagonal pairs above are laid out so that reversing direction d is
+// (d + 2) % 4 within its group of four
+static_assert(FlowField::dc[4] == -FlowField::dc[6] && FlowField::dr[4] == -FlowField::dr[6], "NE/SW must reverse");
+static_assert(FlowField::dc[5] == -FlowField::dc[7] && FlowField::dr[5] == -FlowField::dr[7], "SE/NW must reverse");
 
 /**
- * Find which "direction label" to move toward so the enemy can go toward
- * the closest player, snapping angles to 45-degree increments.
- *
- * Returns one of:
- *   "north", "north-east", "east", "south-east",
- *   "south", "south-west", "west", "north-west"
- * or an empty string if playersArray is empty.
+ * A room's grid and the flow fields toward whoever is being chased. A step
+ * asks for fields by the target's index in that step's target list; the
+ * first ask searches (or reuses the field from last step if the target
+ * hasn't changed cells), later asks in the same step are an array lookup.
+ * Fields nobody asked for in a step are dropped at the end of it.
  */
-inline std::string findPixelToGoTo(const json& playersArray, const json& enemy) {
-    if (playersArray.empty()) {
-        return "";
+class RoomNavigation {
+public:
+    void rebuild(const std::vector<MoveBox>& solids, int agentWidth, int agentHeight, int cellSize = navCellSize) {
+        grid_.build(solids, agentWidth, agentHeight, cellSize);
     }
 
-    // Find the closest player to this enemy
-    auto closestPlayerIt = std::min_element(playersArray.begin(), playersArray.end(),
-        [&enemy](const json& a, const json& b) {
-            return calculateDistance(enemy, a) < calculateDistance(enemy, b);
-        });
-
-    // Calculate direction from enemy -> closest player
-    int degrees = static_cast<int>(calculateDirectionDegrees(enemy, *closestPlayerIt));
-
-    // Snap to nearest 45-degree increment
-    std::vector<int> standardDirections = {0, 45, 90, 135, 180, 225, 270, 315, 360};
-    int dirToGo = findClosestNumber(degrees, standardDirections);
-
-    // Map those angles to direction strings
-    static const std::vector<std::pair<int, std::string>> directionMap = {
-        {0,   "north"},      // 0 degrees => up
-        {45,  "north-east"},
-        {90,  "east"},
-        {135, "south-east"},
-        {180, "south"},
-        {225, "south-west"},
-        {270, "west"},
-        {315, "north-west"},
-        {360, "north"}  // Snap 360 back to "north"
-    };
+    bool built() const { return grid_.version() != 0; }
+    const NavGrid& grid() const { return grid_; }
 
-    auto it = std::find_if(directionMap.begin(), directionMap.end(),
-        [dirToGo](const std::pair<int, std::string>& pair) {
-            return pair.first == dirToGo;
-        });
+    void beginStep(size_t targetCount) {
+        byIndex_.assign(targetCount, nullptr);
+        for (auto& [id, entry] : fields_) {
+            entry.used = false;
+        }
+    }
+
+    const FlowField& towards(size_t index, int targetId, float x, float y) {
+        if (byIndex_[index]) {
+            return *byIndex_[index];
+        }
+        Entry& entry = fields_[targetId];
+        entry.used = true;
+        int cell = grid_.cellAt(x, y);
+        if (entry.field.gridVersion() != grid_.version() || entry.field.targetCell() != cell) {
+            entry.field.compute(grid_, cell);
+            searches_++;
+        }
+        byIndex_[index] = &entry.field;
+        return entry.field;
+    }
+
+    void endStep() {
+        for (auto it = fields_.begin(); it != fields_.end();) {
+            it = it->second.used ? std::next(it) : fields_.erase(it);
+        }
+    }
+
+    size_t fieldCount() const { return fields_.size(); }
+    // Searches run so far; a step where no target changed cells adds none
+    uint64_t searches() const { return searches_; }
+
+private:
+    struct Entry {
+        FlowField field;
+        bool used = false;
+    };
 
-    return (it != directionMap.end()) ? it->second : "";
-}
+    NavGrid grid_;
+    std::map<int, Entry> fields_;
+    std::vector<const FlowField*> byIndex_;
+    uint64_t searches_ = 0;
+};
 
 #endif // PATHFINDING_HPP
@@ -0,0 +1,193 @@
+#ifndef RATE_LIMIT_HPP
+#define RATE_LIMIT_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+/**
+ * Refills at `rate` tokens per second up to `burst`. A rate of 0 means no
+ * limit.
+ */
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(double rate, double burst)
+        : rate_(rate), burst_(std::max(burst, rate > 0 ? 1.0 : 0.0)), tokens_(burst_) {}
+
+    bool unlimited() const { return rate_ <= 0; }
+
+    bool available(double cost, Clock::time_point now) {
+        refill(now);
+        return unlimited() || tokens_ >= std::min(cost, burst_);
+    }
+
+    // Costs above the burst are charged as a full bucket, so huge messages
+    // still get through once the bucket is full (and then empty it)
+    void take(double cost) {
+        if (!unlimited()) {
+            tokens_ -= std::min(cost, burst_);
+        }
+    }
+
+    // How long until `cost` is available
+    Clock::duration waitFor(double cost, Clock::time_point now) {
+        refill(now);
+        double missing = std::min(cost, burst_) - tokens_;
+        if (unlimited() || missing <= 0) {
+            return Clock::duration::zero();
+        }
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(missing / rate_));
+    }
+
+private:
+    void refill(Clock::time_point now) {
+        if (last_ != Clock::time_point{} && now > last_) {
+            tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+        }
+        last_ = now;
+    }
+
+    double rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point last_{};
+};
+
+// Zero rates mean no limit
+struct InboundLimits {
+    double messagesPerSecond = 0;
+    double messageBurst = 0;
+    double bytesPerSecond = 0;
+    double byteBurst = 0;
+};
+
+/**
+ * Budget for what one client sends, checked on the raw message before it is
+ * parsed.
+ *
+ * Accept: within both budgets.
+ * Defer:  out of message tokens. The message is kept (copied) and handled in
+ *         arrival order as tokens free up. The caller says which messages are
+ *         coalescible: only the newest of those is kept, replacing any
+ *         waiting one (which counts as coalesced) and going to the back. The
+ *         rest wait in turn, up to maxDeferred of them.
+ * Reject: out of message tokens with maxDeferred messages already waiting
+ *         that can't be coalesced; counted as dropped.
+ * Drop:   out of byte budget; the bytes themselves are the problem.
+ *
+ * Used from the session's strand only; stats() may be read from anywhere.
+ */
+class InboundLimiter {
+public:
+    using Clock = TokenBucket::Clock;
+
+    enum class Verdict {
+        Accept,
+        Defer,
+        Reject,
+        Drop
+    };
+
+    // Messages that can't be coalesced held back at once
+    static constexpr size_t maxDeferred = 32;
+
+    struct Stats {
+        uint64_t accepted = 0;
+        uint64_t coalesced = 0;
+        uint64_t dropped = 0;
+        uint64_t droppedBytes = 0;
+    };
+
+    explicit InboundLimiter(const InboundLimits& limits = {})
+        : messages_(limits.messagesPerSecond, limits.messageBurst),
+          bytes_(limits.bytesPerSecond, limits.byteBurst) {}
+
+    // `coalescible(data, size)` is only asked about messages that have to wait
+    template <typename Coalescible>
+    Verdict admit(const char* data, size_t size, Clock::time_point now, Coalescible&& coalescible) {
+        if (!bytes_.available(static_cast<double>(size), now)) {
+            dropped_++;
+            droppedBytes_ += size;
+            return Verdict::Drop;
+        }
+        bytes_.take(static_cast<double>(size));
+        if (deferred_.empty() && messages_.available(1, now)) {
+            messages_.take(1);
+            accepted_++;
+            return Verdict::Accept;
+        }
+        bool merge = coalescible(data, size);
+        if (merge) {
+            auto waiting = std::find_if(deferred_.begin(), deferred_.end(), [](const Deferred& d) { return d.coalescible; });
+            if (waiting != deferred_.end()) {
+                deferred_.erase(waiting);
+                coalesced_++;
+            }
+        } else if (deferred_.size() - coalescibleWaiting() >= maxDeferred) {
+            dropped_++;
+            droppedBytes_ += size;
+            return Verdict::Reject;
+        }
+        deferred_.push_back({std::string(data, size), merge});
+        return Verdict::Defer;
+    }
+
+    // For messages that arrive already decoded (UDP), which can't be held back:
+    // a coalescible one over the message budget is dropped, anything else is
+    // let through and paid for out of the tokens that come after it
+    bool admitDecoded(size_t size, Clock::time_point now, bool coalescible) {
+        bool overBudget = !messages_.available(1, now);
+        if (!bytes_.available(static_cast<double>(size), now) || (overBudget && coalescible)) {
+            dropped_++;
+            droppedBytes_ += size;
+            return false;
+        }
+        bytes_.take(static_cast<double>(size));
+        messages_.take(1);
+        accepted_++;
+        return true;
+    }
+
+    bool hasPending() const { return !deferred_.empty(); }
+
+    // The oldest deferred message, once a token has freed up for it
+    bool takePending(std::string& out, Clock::time_point now) {
+        if (deferred_.empty() || !messages_.available(1, now)) {
+            return false;
+        }
+        messages_.take(1);
+        accepted_++;
+        out.swap(deferred_.front().data);
+        deferred_.pop_front();
+        return true;
+    }
+
+    Clock::duration untilPending(Clock::time_point now) { return messages_.waitFor(1, now); }
+
+    Stats stats() const { return {accepted_, coalesced_, dropped_, droppedBytes_}; }
+
+private:
+    struct Deferred {
+        std::string data;
+        bool coalescible;
+    };
+
+    size_t coalescibleWaiting() const {
+        return static_cast<size_t>(std::count_if(deferred_.begin(), deferred_.end(), [](const Deferred& d) { return d.coalescible; }));
+    }
+
+    TokenBucket messages_;
+    TokenBucket bytes_;
+    std::deque<Deferred> deferred_;
+    std::atomic<uint64_t> accepted_{0};
+    std::atomic<uint64_t> coalesced_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<uint64_t> droppedBytes_{0};
+};
+
+#endif // RATE_LIMIT_HPP
@@ -0,0 +1,226 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "world.hpp"
+
+/**
+ * Reproducible runs of the simulation.
+ *
+ * Each room draws its randomness from its own SimRandom, seeded from one
+ * server-wide seed. Everything else that changes a room arrives as an event
+ * on the room's actor (a login, a command batch, a tick with its dt and
+ * time), and the actor runs them one at a time. With the seed and each
+ * room's events in the order its actor ran them, a room can be stepped
+ * again to the same state, and hashRoom() says whether it got there.
+ *
+ * The step is strictly ordered rather than fixed-point: positions are still
+ * floats, so a replay matches bit for bit on the same build of the server,
+ * not across compilers or platforms.
+ */
+
+/**
+ * SplitMix64. Unlike the standard distributions, uniform() gives the same
+ * numbers on every standard library, so a seed means the same room anywhere.
+ */
+class SimRandom {
+public:
+    explicit SimRandom(uint64_t seed = 0) : state_(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    // Between lo and hi, both included. The modulo bias is far below
+    // anything a spawn position could show for spans this small.
+    int uniform(int lo, int hi) {
+        if (hi <= lo) {
+            return lo;
+        }
+        uint64_t span = static_cast<uint64_t>(static_cast<int64_t>(hi) - lo) + 1;
+        return static_cast<int>(lo + static_cast<int64_t>(next() % span));
+    }
+
+    uint64_t state() const { return state_; }
+
+private:
+    uint64_t state_;
+};
+
+// A room's own stream, so rooms don't share draws and a new room doesn't
+// shift the numbers the others get
+inline uint64_t roomSeed(uint64_t seed, int roomID) {
+    SimRandom mix(seed ^ (0xd1b54a32d192ed03ULL * static_cast<uint64_t>(static_cast<uint32_t>(roomID))));
+    return mix.next();
+}
+
+// 64-bit FNV-1a. Floats go in by bit pattern, so the smallest change shows.
+class StateHash {
+public:
+    void add(uint64_t v) {
+        for (int i = 0; i < 8; i++) {
+            hash_ = (hash_ ^ ((v >> (8 * i)) & 0xff)) * prime;
+        }
+    }
+    void add(int v) { add(static_cast<uint64_t>(static_cast<uint32_t>(v))); }
+    void add(bool v) { add(static_cast<uint64_t>(v)); }
+    void add(float v) {
+        uint32_t bits;
+        std::memcpy(&bits, &v, sizeof bits);
+        add(static_cast<uint64_t>(bits));
+    }
+    void add(double v) {
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof bits);
+        add(bits);
+    }
+    void add(const std::string& s) {
+        add(static_cast<uint64_t>(s.size()));
+        for (unsigned char c : s) {
+            hash_ = (hash_ ^ c) * prime;
+        }
+    }
+
+    uint64_t value() const { return hash_; }
+
+private:
+    static constexpr uint64_t prime = 0x100000001b3ULL;
+    uint64_t hash_ = 0xcbf29ce484222325ULL;
+};
+
+// Row indices of `keys` in key order
+inline std::vector<size_t> orderBy(const std::vector<int>& keys) {
+    std::vector<size_t> order(keys.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+    return order;
+}
+
+/**
+ * Everything in a room's tables, players by socket, enemies by id and objects
+ * by uid: two rooms that hold the same things hash the same whatever order
+ * their rows were swapped into.
+ */
+inline void hashRoom(const Room& room, StateHash& h) {
+    h.add(room.roomID);
+
+    const PlayerTable& players = room.players;
+    h.add(static_cast<uint64_t>(players.size()));
+    for (size_t i : orderBy(players.socket)) {
+        h.add(players.socket[i]);
+        h.add(players.name[i]);
+        h.add(players.x[i]);
+        h.add(players.y[i]);
+        h.add(players.speed[i]);
+        h.add(players.score[i]);
+        h.add(players.width[i]);
+        h.add(players.height[i]);
+        h.add(players.shields[i]);
+        h.add(players.bananas[i]);
+        h.add(players.spriteState[i]);
+        h.add(players.skin[i]);
+    }
+
+    const EnemyTable& enemies = room.enemies;
+    h.add(static_cast<uint64_t>(enemies.size()));
+    for (size_t i : orderBy(enemies.id)) {
+        h.add(enemies.id[i]);
+        h.add(enemies.x[i]);
+        h.add(enemies.y[i]);
+        h.add(enemies.width[i]);
+        h.add(enemies.height[i]);
+        h.add(enemies.speed[i]);
+    }
+
+    const ObjectTable& objects = room.objects;
+    h.add(static_cast<uint64_t>(objects.size()));
+    for (size_t i : orderBy(objects.uid)) {
+        h.add(objects.uid[i]);
+        h.add(objects.objID[i]);
+        h.add(objects.x[i]);
+        h.add(objects.y[i]);
+        h.add(objects.width[i]);
+        h.add(objects.height[i]);
+    }
+}
+
+inline uint64_t hashRoom(const Room& room) {
+    StateHash h;
+    hashRoom(room, h);
+    return h.value();
+}
+
+/**
+ * A session as JSON lines: a header (the seed and the settings the rooms were
+ * built with), then one event per line. Rooms record from their own actors;
+ * lines don't interleave, and each room's lines are in the order it ran them.
+ */
+class SimulationRecorder {
+public:
+    bool open(const std::string& path, const json& header) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        file_.open(path, std::ios::trunc);
+        if (!file_) {
+            return false;
+        }
+        file_ << header.dump() << '\n';
+        recording_ = true;
+        return true;
+    }
+
+    bool recording() const { return recording_; }
+
+    void record(const json& event) {
+        std::string line = event.dump();
+        std::lock_guard<std::mutex> lock(mutex_);
+        file_ << line << '\n';
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        recording_ = false;
+        file_.close();
+    }
+
+private:
+    std::mutex mutex_;
+    std::ofstream file_;
+    std::atomic<bool> recording_{false};
+};
+
+// False if the file can't be read or has no header. A line cut off by a
+// crash ends the events instead of failing the whole log.
+inline bool readSimulationLog(const std::string& path, json& header, std::vector<json>& events) {
+    std::ifstream file(path);
+    std::string line;
+    if (!file || !std::getline(file, line)) {
+        return false;
+    }
+    header = json::parse(line, nullptr, false);
+    if (header.is_discarded() || !header.is_object()) {
+        return false;
+    }
+    events.clear();
+    while (std::getline(file, line)) {
+        json event = json::parse(line, nullptr, false);
+        if (event.is_discarded()) {
+            break;
+        }
+        events.push_back(std::move(event));
+    }
+    return true;
+}
+
+#endif // REPLAY_HPP
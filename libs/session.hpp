@@ -0,0 +1,345 @@
+#ifndef SESSION_HPP
+#define SESSION_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include "wire.hpp"
+#include "rate_limit.hpp"
+#include "heartbeat.hpp"
+
+/**
+ * What a session does with new messages once its queue is past the high-water mark.
+ *
+ * Coalesce: a message with a coalesce key replaces the queued message with the
+ *           same key (newer positions or game state supersede the old ones).
+ *           Only give a key to messages that are whole on their own, never
+ *           to a delta of what changed since the one before;
+ *           unkeyed messages still queue, up to twice the mark, then the
+ *           client is kicked.
+ * Drop:     keyed messages are discarded until the queue drains; unkeyed
+ *           ones can't be sent again, so they queue as under Coalesce.
+ * Kick:     the connection is closed.
+ */
+enum class BackpressurePolicy {
+    Coalesce,
+    Drop,
+    Kick
+};
+
+inline BackpressurePolicy parseBackpressurePolicy(const std::string& name) {
+    if (name == "drop") return BackpressurePolicy::Drop;
+    if (name == "kick") return BackpressurePolicy::Kick;
+    return BackpressurePolicy::Coalesce;
+}
+
+inline const char* backpressurePolicyName(BackpressurePolicy policy) {
+    switch (policy) {
+        case BackpressurePolicy::Drop: return "drop";
+        case BackpressurePolicy::Kick: return "kick";
+        default: return "coalesce";
+    }
+}
+
+enum class SessionTransport {
+    Tcp,
+    WebSocket
+};
+
+inline const char* sessionTransportName(SessionTransport transport) {
+    return transport == SessionTransport::WebSocket ? "websocket" : "tcp";
+}
+
+/**
+ * One connected client, whatever it connected over.
+ *
+ * The id is handed out by the server when the connection is accepted and is
+ * never reused, so it can name the player in messages and tables for as long
+ * as the connection lives. Everything received from the client is handled on
+ * the session's strand, one message at a time; send() may be called from any
+ * thread and never blocks on the network. How messages are queued and written
+ * is up to the transport (TcpSession below, WebSocketSession in
+ * websocket_session.hpp), but all of them apply the same backpressure policy.
+ *
+ * Closing only starts the shutdown; the transport's read side then fails and
+ * the normal disconnect path (eraseUser) runs.
+ */
+class Session : public std::enable_shared_from_this<Session> {
+public:
+    using Payload = std::shared_ptr<const std::string>;
+    using Strand = boost::asio::strand<boost::asio::any_io_executor>;
+
+    struct Stats {
+        size_t queuedBytes = 0;
+        uint64_t sent = 0;
+        uint64_t dropped = 0;
+        uint64_t coalesced = 0;
+        uint64_t writes = 0; // writes handed to the transport; sent / writes is the batching achieved
+    };
+
+    virtual ~Session() = default;
+
+    int id() const { return id_; }
+    virtual SessionTransport transport() const = 0;
+    // Reads and writes of this session are serialized here; different sessions run in parallel
+    Strand& strand() { return strand_; }
+    bool open() const { return !closed_; }
+    // What the client may send; only used on the strand
+    InboundLimiter& inbound() { return inbound_; }
+    InboundLimiter::Stats inboundStats() const { return inbound_.stats(); }
+    // Pings, pongs and when the client was last heard from (see heartbeat.hpp)
+    Heartbeat& heartbeat() { return heartbeat_; }
+    RttStats rtt() const { return heartbeat_.rtt(); }
+
+    // Encoding of everything sent as a WireMessage; JSON text until the client asks otherwise
+    WireFormat wireFormat() const { return wireFormat_; }
+    void setWireFormat(WireFormat format) { wireFormat_ = format; }
+
+    bool send(std::string message, const std::string& coalesceKey = "") {
+        return send(std::make_shared<const std::string>(std::move(message)), coalesceKey);
+    }
+
+    // Compression the client asked for, applied to messages of at least
+    // minBytes (see wire.hpp); WebSocket sessions use minBytes for permessage-deflate
+    WireCompression compression() const { return compression_; }
+    size_t compressMinBytes() const { return compressMinBytes_; }
+    void setCompression(WireCompression codec, size_t minBytes) {
+        compressMinBytes_ = minBytes;
+        compression_ = codec;
+    }
+
+    bool send(const std::shared_ptr<const WireMessage>& message, const std::string& coalesceKey = "") {
+        WireFormat format = wireFormat_;
+        WireCompression codec = compression_;
+        const Payload& plain = message->encoded(format);
+        if (codec != WireCompression::None && plain->size() >= compressMinBytes_) {
+            return send(message->compressed(format, codec), coalesceKey);
+        }
+        return send(plain, coalesceKey);
+    }
+
+    // Returns false if the message was not queued (dropped, or the session is closed)
+    bool send(const Payload& message, const std::string& coalesceKey = "") { return enqueue(message, coalesceKey); }
+
+    // Lets whatever is queued go out (e.g. a final quitGame), then closes
+    virtual void closeAfterFlush() = 0;
+    virtual void close() = 0;
+    virtual Stats stats() const = 0;
+
+protected:
+    Session(boost::asio::any_io_executor executor, int id, const InboundLimits& inboundLimits)
+        : strand_(boost::asio::make_strand(executor)), id_(id), inbound_(inboundLimits) {}
+
+    virtual bool enqueue(const Payload& message, const std::string& coalesceKey) = 0;
+
+    Strand strand_;
+    int id_;
+    InboundLimiter inbound_;
+    Heartbeat heartbeat_;
+    std::atomic<WireFormat> wireFormat_{WireFormat::Json};
+    std::atomic<WireCompression> compression_{WireCompression::None};
+    std::atomic<size_t> compressMinBytes_{0};
+    std::atomic<bool> closed_{false};
+};
+
+/**
+ * One TCP client with its own outbound queue.
+ *
+ * A single async_write chain on the session's strand drains the queue, so a
+ * stalled client only ever delays itself. Payloads are shared so a broadcast
+ * serializes once no matter how many sessions it goes to. Whatever has queued
+ * up while a write was in flight goes out together as one gather write.
+ */
+class TcpSession : public Session {
+public:
+    using tcp = boost::asio::ip::tcp;
+
+    // Buffers per gather write; well under IOV_MAX
+    static constexpr size_t maxBatch = 64;
+
+    TcpSession(std::shared_ptr<tcp::socket> socket, int id, size_t highWaterBytes, BackpressurePolicy policy,
+               const InboundLimits& inboundLimits = {})
+        : Session(socket->get_executor(), id, inboundLimits),
+          socket_(std::move(socket)),
+          highWater_(highWaterBytes),
+          policy_(policy) {}
+
+    SessionTransport transport() const override { return SessionTransport::Tcp; }
+    tcp::socket& socket() { return *socket_; }
+
+    void closeAfterFlush() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closing_ = true;
+        if (!writing_) {
+            closeLocked();
+        }
+    }
+
+    void close() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closeLocked();
+    }
+
+    Stats stats() const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return {queuedBytes_, sent_, dropped_, coalesced_, writes_};
+    }
+
+private:
+    std::shared_ptr<TcpSession> shared() { return std::static_pointer_cast<TcpSession>(shared_from_this()); }
+
+    bool enqueue(const Payload& message, const std::string& coalesceKey) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_ || closing_) {
+            return false;
+        }
+
+        if (queuedBytes_ + message->size() > highWater_) {
+            switch (policy_) {
+                case BackpressurePolicy::Drop:
+                    if (!coalesceKey.empty()) {
+                        dropped_++;
+                        return false;
+                    }
+                    break;
+                case BackpressurePolicy::Kick:
+                    closeLocked();
+                    return false;
+                case BackpressurePolicy::Coalesce:
+                    if (replaceQueued(message, coalesceKey)) {
+                        coalesced_++;
+                        return true;
+                    }
+                    break;
+            }
+            if (queuedBytes_ + message->size() > 2 * highWater_) {
+                closeLocked();
+                return false;
+            }
+        }
+
+        queue_.push_back({message, coalesceKey});
+        queuedBytes_ += message->size();
+        startWriteLocked();
+        return true;
+    }
+
+    struct Outbound {
+        Payload data;
+        std::string key;
+    };
+
+    // Takes the place of every queued message with the key. It goes to the
+    // back, so it still follows whatever was queued after the ones it replaces.
+    bool replaceQueued(const Payload& message, const std::string& key) {
+        if (key.empty()) {
+            return false;
+        }
+        bool replaced = false;
+        for (auto it = queue_.begin(); it != queue_.end();) {
+            if (it->key == key) {
+                queuedBytes_ -= it->data->size();
+                it = queue_.erase(it);
+                replaced = true;
+            } else {
+                ++it;
+            }
+        }
+        if (replaced) {
+            queue_.push_back({message, key});
+            queuedBytes_ += message->size();
+        }
+        return replaced;
+    }
+
+    void startWriteLocked() {
+        if (writing_) {
+            return;
+        }
+        writing_ = true;
+        boost::asio::post(strand_, [self = shared()]() { self->writeNext(); });
+    }
+
+    // Runs on the strand; only one write is ever in flight, carrying
+    // everything queued so far (up to maxBatch messages)
+    void writeNext() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (queue_.empty() || closed_) {
+                writing_ = false;
+                if (closing_) {
+                    closeLocked();
+                }
+                return;
+            }
+            inFlight_.clear();
+            buffers_.clear();
+            inFlightBytes_ = 0;
+            while (!queue_.empty() && inFlight_.size() < maxBatch) {
+                inFlight_.push_back(std::move(queue_.front().data));
+                queue_.pop_front();
+                buffers_.push_back(boost::asio::buffer(*inFlight_.back()));
+                inFlightBytes_ += inFlight_.back()->size();
+            }
+        }
+
+        boost::asio::async_write(*socket_, buffers_,
+                                 boost::asio::bind_executor(strand_,
+                                     [self = shared()](boost::system::error_code ec, std::size_t) {
+            {
+                std::lock_guard<std::mutex> lock(self->mutex_);
+                self->queuedBytes_ -= self->inFlightBytes_;
+                size_t messages = self->inFlight_.size();
+                self->inFlight_.clear();
+                self->inFlightBytes_ = 0;
+                if (ec) {
+                    self->writing_ = false;
+                    self->closeLocked();
+                    return;
+                }
+                self->sent_ += messages;
+                self->writes_++;
+            }
+            self->writeNext();
+        }));
+    }
+
+    void closeLocked() {
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        queue_.clear();
+        queuedBytes_ = inFlightBytes_;
+        boost::asio::post(strand_, [self = shared()]() {
+            boost::system::error_code ec;
+            self->socket_->shutdown(tcp::socket::shutdown_both, ec);
+            self->socket_->close(ec);
+        });
+    }
+
+    std::shared_ptr<tcp::socket> socket_;
+    size_t highWater_;
+    BackpressurePolicy policy_;
+
+    mutable std::mutex mutex_;
+    std::deque<Outbound> queue_;
+    // The batch being written; kept alive until the write completes
+    std::vector<Payload> inFlight_;
+    std::vector<boost::asio::const_buffer> buffers_;
+    size_t inFlightBytes_ = 0;
+    size_t queuedBytes_ = 0;
+    bool writing_ = false;
+    bool closing_ = false;
+    uint64_t sent_ = 0;
+    uint64_t dropped_ = 0;
+    uint64_t coalesced_ = 0;
+    uint64_t writes_ = 0;
+};
+
+#endif // SESSION_HPP
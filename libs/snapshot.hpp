@@ -0,0 +1,278 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "world.hpp"
+
+using json = nlohmann::json;
+
+/**
+ * Immutable copy of the world taken whenever the server publishes game state.
+ *
+ * Entities are keyed by the id clients already use for them (player socket,
+ * enemy id, object uid) so two snapshots can be diffed without handles.
+ */
+struct RoomSnapshot {
+    std::map<int, PlayerRecord> players;
+    std::map<int, EnemyRecord> enemies;
+    std::map<int, ObjectRecord> objects;
+};
+
+struct WorldSnapshot {
+    uint32_t version = 0;
+    std::map<int, RoomSnapshot> rooms;
+};
+
+inline void captureRoom(const Room& room, RoomSnapshot& out) {
+    for (size_t i = 0; i < room.players.size(); i++) {
+        out.players.emplace(room.players.socket[i], room.players.record(i, room.roomID));
+    }
+    for (size_t i = 0; i < room.enemies.size(); i++) {
+        out.enemies.emplace(room.enemies.id[i], room.enemies.record(i, room.roomID));
+    }
+    for (size_t i = 0; i < room.objects.size(); i++) {
+        out.objects.emplace(room.objects.uid[i], room.objects.record(i));
+    }
+}
+
+// A snapshot holding just one room, for state that is versioned per room
+inline std::shared_ptr<const WorldSnapshot> captureRoomSnapshot(const Room& room, uint32_t version) {
+    auto snapshot = std::make_shared<WorldSnapshot>();
+    snapshot->version = version;
+    captureRoom(room, snapshot->rooms[room.roomID]);
+    return snapshot;
+}
+
+// Only the fields that changed, plus the key; inventory is sent as a unit
+inline json diffPlayer(const PlayerRecord& a, const PlayerRecord& b) {
+    json out;
+    if (a.name != b.name) out["name"] = b.name;
+    if (a.x != b.x) out["x"] = b.x;
+    if (a.y != b.y) out["y"] = b.y;
+    if (a.speed != b.speed) out["speed"] = b.speed;
+    if (a.score != b.score) out["score"] = b.score;
+    if (a.width != b.width) out["width"] = b.width;
+    if (a.height != b.height) out["height"] = b.height;
+    if (a.spriteState != b.spriteState) out["spriteState"] = b.spriteState;
+    if (a.skin != b.skin) out["skin"] = b.skin;
+    if (a.shields != b.shields || a.bananas != b.bananas) {
+        out["inventory"] = {{"shields", b.shields}, {"bananas", b.bananas}};
+    }
+    if (!out.empty()) out["socket"] = b.socket;
+    return out;
+}
+
+inline json diffEnemy(const EnemyRecord& a, const EnemyRecord& b) {
+    json out;
+    if (static_cast<int>(a.x) != static_cast<int>(b.x)) out["x"] = static_cast<int>(b.x);
+    if (static_cast<int>(a.y) != static_cast<int>(b.y)) out["y"] = static_cast<int>(b.y);
+    if (a.width != b.width) out["width"] = b.width;
+    if (a.height != b.height) out["height"] = b.height;
+    if (a.speed != b.speed) out["speed"] = b.speed;
+    if (!out.empty()) out["id"] = b.id;
+    return out;
+}
+
+inline json diffObject(const ObjectRecord& a, const ObjectRecord& b) {
+    json out;
+    if (a.objID != b.objID) out["objID"] = b.objID;
+    if (a.x != b.x) out["x"] = b.x;
+    if (a.y != b.y) out["y"] = b.y;
+    if (a.width != b.width) out["width"] = b.width;
+    if (a.height != b.height) out["height"] = b.height;
+    if (!out.empty()) out["uid"] = b.uid;
+    return out;
+}
+
+/**
+ * Walks two keyed maps in order: entities only in `to` are sent whole,
+ * entities in both are sent as field diffs, entities only in `from` are
+ * listed by key for removal.
+ */
+template <typename Record, typename DiffFn>
+inline void diffTable(const std::map<int, Record>& from, const std::map<int, Record>& to,
+                      DiffFn diff, json& upserts, json& removed) {
+    auto a = from.begin();
+    auto b = to.begin();
+    while (a != from.end() || b != to.end()) {
+        if (b == to.end() || (a != from.end() && a->first < b->first)) {
+            removed.push_back(a->first);
+            ++a;
+        } else if (a == from.end() || b->first < a->first) {
+            upserts.push_back(b->second.toJson());
+            ++b;
+        } else {
+            json changed = diff(a->second, b->second);
+            if (!changed.empty()) upserts.push_back(std::move(changed));
+            ++a;
+            ++b;
+        }
+    }
+}
+
+/**
+ * Describes how to get from `from` to `to`, and only from `from`: removals are
+ * listed for entities `from` had, so on a newer copy something added and
+ * removed again since `from` would be left behind (see deltaAppliesTo).
+ * Entities in both are sent as their changed fields only.
+ *
+ * Layout: {"from": v, "to": v, "rooms": {"room1": {"roomID", "players",
+ * "removedPlayers", "enemies", "removedEnemies", "objects", "removedObjects"}}}
+ * where a room only appears if something in it changed. With onlyRoom set,
+ * the other rooms are left out entirely.
+ */
+inline json diffSnapshots(const WorldSnapshot& from, const WorldSnapshot& to, int onlyRoom = 0) {
+    static const RoomSnapshot emptyRoom;
+    json rooms = json::object();
+
+    std::map<int, std::pair<const RoomSnapshot*, const RoomSnapshot*>> pairs;
+    for (const auto& [id, room] : from.rooms) pairs[id].first = &room;
+    for (const auto& [id, room] : to.rooms) pairs[id].second = &room;
+
+    for (const auto& [id, pair] : pairs) {
+        if (onlyRoom != 0 && id != onlyRoom) continue;
+        const RoomSnapshot& a = pair.first ? *pair.first : emptyRoom;
+        const RoomSnapshot& b = pair.second ? *pair.second : emptyRoom;
+
+        json players = json::array(), removedPlayers = json::array();
+        json enemies = json::array(), removedEnemies = json::array();
+        json objects = json::array(), removedObjects = json::array();
+        diffTable(a.players, b.players, diffPlayer, players, removedPlayers);
+        diffTable(a.enemies, b.enemies, diffEnemy, enemies, removedEnemies);
+        diffTable(a.objects, b.objects, diffObject, objects, removedObjects);
+
+        bool newRoom = !pair.first;
+        if (!newRoom && players.empty() && removedPlayers.empty() && enemies.empty() &&
+            removedEnemies.empty() && objects.empty() && removedObjects.empty()) {
+            continue;
+        }
+        rooms[roomName(id)] = {
+            {"roomID", id},
+            {"players", std::move(players)}, {"removedPlayers", std::move(removedPlayers)},
+            {"enemies", std::move(enemies)}, {"removedEnemies", std::move(removedEnemies)},
+            {"objects", std::move(objects)}, {"removedObjects", std::move(removedObjects)}};
+    }
+
+    return {{"from", from.version}, {"to", to.version}, {"rooms", std::move(rooms)}};
+}
+
+// Whether a client whose copy is at `version` can apply `delta`. Only a copy at
+// exactly its baseline can; one already at `to` or later can ignore it, and
+// any other needs the full game.
+inline bool deltaAppliesTo(const json& delta, uint32_t version) {
+    return delta.value("from", uint32_t{0}) == version;
+}
+
+// Whether `entry` has every field of `whole`, a record's full JSON
+inline bool isWholeRecord(const json& entry, const json& whole) {
+    for (const auto& [field, value] : whole.items()) {
+        if (!entry.contains(field)) return false;
+    }
+    return true;
+}
+
+// False if an upsert for an entity the table doesn't have was only a partial
+// one; it is skipped rather than added with fields missing
+inline bool applyTableDelta(json& table, const json& upserts, const json& removed, const char* key, const json& whole) {
+    bool complete = true;
+    if (!table.is_array()) table = json::array();
+    for (const auto& gone : removed) {
+        for (auto it = table.begin(); it != table.end(); ++it) {
+            if (it->contains(key) && (*it)[key] == gone) {
+                table.erase(it);
+                break;
+            }
+        }
+    }
+    for (const auto& entry : upserts) {
+        bool found = false;
+        for (auto& existing : table) {
+            if (existing.contains(key) && existing[key] == entry[key]) {
+                existing.merge_patch(entry);
+                found = true;
+                break;
+            }
+        }
+        if (found) continue;
+        if (isWholeRecord(entry, whole)) {
+            table.push_back(entry);
+        } else {
+            complete = false;
+        }
+    }
+    return complete;
+}
+
+/**
+ * Applies a diffSnapshots() result to the json layout clients keep the game
+ * in: each room's Room::toJson() under its roomName(). The copy must be at
+ * the delta's baseline (deltaAppliesTo). Upserts merge into existing entries
+ * so fields the client keeps locally (e.g. "local") survive.
+ *
+ * Returns false if the delta changed an entity the game doesn't have without
+ * sending it whole. The rest is applied, but the copy is missing that entity
+ * and only a full game will bring it back.
+ */
+inline bool applyGameDelta(json& game, const json& delta) {
+    static const json wholePlayer = PlayerRecord{}.toJson();
+    static const json wholeEnemy = EnemyRecord{}.toJson();
+    static const json wholeObject = ObjectRecord{}.toJson();
+    bool complete = true;
+    if (!game.is_object()) game = json::object();
+    for (const auto& [name, room] : delta["rooms"].items()) {
+        json& target = game[name];
+        if (!target.is_object()) {
+            target = {{"roomID", room["roomID"]}, {"players", json::array()},
+                      {"objects", json::array()}, {"enemies", json::array()}};
+        }
+        complete = applyTableDelta(target["players"], room["players"], room["removedPlayers"], "socket", wholePlayer) && complete;
+        complete = applyTableDelta(target["enemies"], room["enemies"], room["removedEnemies"], "id", wholeEnemy) && complete;
+        complete = applyTableDelta(target["objects"], room["objects"], room["removedObjects"], "uid", wholeObject) && complete;
+    }
+    return complete;
+}
+
+/**
+ * The last few published snapshots, oldest first. A client's acked version is
+ * only usable as a delta baseline while it is still in here.
+ */
+class SnapshotHistory {
+public:
+    explicit SnapshotHistory(size_t capacity) : capacity_(capacity > 0 ? capacity : 1) {}
+
+    void push(std::shared_ptr<const WorldSnapshot> snapshot) {
+        snapshots_.push_back(std::move(snapshot));
+        while (snapshots_.size() > capacity_) {
+            snapshots_.pop_front();
+        }
+    }
+
+    std::shared_ptr<const WorldSnapshot> find(uint32_t version) const {
+        // Versions are pushed in increasing order
+        if (snapshots_.empty() || version < snapshots_.front()->version || version > snapshots_.back()->version) {
+            return nullptr;
+        }
+        for (const auto& snapshot : snapshots_) {
+            if (snapshot->version == version) return snapshot;
+        }
+        return nullptr;
+    }
+
+    std::shared_ptr<const WorldSnapshot> latest() const {
+        return snapshots_.empty() ? nullptr : snapshots_.back();
+    }
+
+    size_t size() const { return snapshots_.size(); }
+
+private:
+    size_t capacity_;
+    std::deque<std::shared_ptr<const WorldSnapshot>> snapshots_;
+};
+
+#endif // SNAPSHOT_HPP
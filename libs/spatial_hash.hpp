@@ -0,0 +1,291 @@
+#ifndef SPATIAL_HASH_HPP
+#define SPATIAL_HASH_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+/**
+ * A uniform grid over one room, for "what is near this" questions.
+ *
+ * Every box is filed under each cell it covers, keyed by whatever id the
+ * caller uses (an enemy id, an object uid, a socket). Moving a box only
+ * touches the grid when it crosses into other cells, so keeping the grid
+ * current as things move costs next to nothing. A query looks at the cells
+ * around it and nothing else: its cost follows how crowded that part of the
+ * room is, not how many things are in the room.
+ *
+ * Overlap is edge-inclusive, like rectsOverlap() and the client's
+ * checkCollision. Distances are to the nearest point of a box, 0 inside it.
+ *
+ * The cell size should be about the size of the things in the grid: much
+ * smaller and big boxes are filed in many cells, much larger and a query
+ * sifts through things that aren't near it.
+ */
+struct SpatialBox {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+};
+
+class SpatialHash {
+public:
+    static constexpr int defaultCellSize = 128;
+
+    explicit SpatialHash(int cellSize = defaultCellSize) : cellSize_(std::max(cellSize, 1)) {}
+
+    int cellSize() const { return cellSize_; }
+    size_t size() const { return entries_.size(); }
+    bool empty() const { return entries_.empty(); }
+    bool contains(int key) const { return entries_.count(key) != 0; }
+
+    // nullptr if the key isn't in the grid
+    const SpatialBox* find(int key) const {
+        auto it = entries_.find(key);
+        return it != entries_.end() ? &it->second.box : nullptr;
+    }
+
+    // Adds the key, or moves it if it's already there
+    void update(int key, const SpatialBox& box) {
+        CellRange range = cellsOf(box);
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            entries_.emplace(key, Entry{box, range});
+            file(key, range);
+            return;
+        }
+        it->second.box = box;
+        if (it->second.cells != range) {
+            unfile(key, it->second.cells);
+            file(key, range);
+            it->second.cells = range;
+        }
+    }
+
+    bool remove(int key) {
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            return false;
+        }
+        unfile(key, it->second.cells);
+        entries_.erase(it);
+        return true;
+    }
+
+    void clear() {
+        entries_.clear();
+        cells_.clear();
+    }
+
+    // Room for `count` boxes without rehashing
+    void reserve(size_t count) {
+        entries_.reserve(count);
+    }
+
+    // Keys of the boxes overlapping `area`, each once, in no particular order
+    void queryAabb(const SpatialBox& area, std::vector<int>& out) const {
+        out.clear();
+        forEachOverlap(area, [&out](int key) {
+            out.push_back(key);
+            return true;
+        });
+    }
+
+    // Whether anything overlaps `area`; stops at the first
+    bool anyOverlap(const SpatialBox& area) const {
+        bool found = false;
+        forEachOverlap(area, [&found](int) {
+            found = true;
+            return false;
+        });
+        return found;
+    }
+
+    // Keys of the boxes within `radius` of (x, y), each once, in no particular order
+    void queryRange(float x, float y, float radius, std::vector<int>& out) const {
+        out.clear();
+        if (radius < 0) {
+            return;
+        }
+        SpatialBox area{static_cast<int>(std::floor(x - radius)), static_cast<int>(std::floor(y - radius)),
+                        static_cast<int>(std::ceil(2 * radius)) + 1, static_cast<int>(std::ceil(2 * radius)) + 1};
+        float limit = radius * radius;
+        forEachOverlap(area, [&](int key) {
+            if (distanceSquared(entries_.at(key).box, x, y) <= limit) {
+                out.push_back(key);
+            }
+            return true;
+        });
+    }
+
+    /**
+     * The (up to) `k` keys nearest (x, y), nearest first; equally near ones
+     * lowest key first. Searches outward ring by ring and stops once nothing
+     * further out can be nearer; when the rings have covered more cells than
+     * there are boxes, it finishes with a plain scan instead.
+     */
+    void queryNearest(float x, float y, size_t k, std::vector<int>& out) const {
+        out.clear();
+        if (k == 0 || entries_.empty()) {
+            return;
+        }
+        std::vector<std::pair<float, int>> found;
+        std::unordered_set<int> seen;
+        auto consider = [&](int key) {
+            if (seen.insert(key).second) {
+                found.push_back({distanceSquared(entries_.at(key).box, x, y), key});
+            }
+        };
+
+        const int cx = cellOf(static_cast<int>(std::floor(x)));
+        const int cy = cellOf(static_cast<int>(std::floor(y)));
+        size_t visited = 0;
+        for (int ring = 0;; ring++) {
+            for (int gy = cy - ring; gy <= cy + ring; gy++) {
+                bool edgeRow = gy == cy - ring || gy == cy + ring;
+                for (int gx = cx - ring; gx <= cx + ring; gx += edgeRow ? 1 : 2 * ring) {
+                    auto cell = cells_.find(cellKey(gx, gy));
+                    if (cell != cells_.end()) {
+                        for (int key : cell->second) {
+                            consider(key);
+                        }
+                    }
+                    visited++;
+                    if (ring == 0) {
+                        break;
+                    }
+                }
+            }
+
+            if (seen.size() == entries_.size()) {
+                break;
+            }
+            // Anything not seen yet is entirely outside these rings, at least this far away
+            float reach = static_cast<float>(ring) * static_cast<float>(cellSize_);
+            if (found.size() >= k) {
+                std::nth_element(found.begin(), found.begin() + (k - 1), found.end());
+                if (found[k - 1].first <= reach * reach) {
+                    break;
+                }
+            }
+            if (visited > entries_.size() + cells_.size()) {
+                for (const auto& [key, entry] : entries_) {
+                    consider(key);
+                }
+                break;
+            }
+        }
+
+        size_t count = std::min(k, found.size());
+        std::partial_sort(found.begin(), found.begin() + count, found.end());
+        for (size_t i = 0; i < count; i++) {
+            out.push_back(found[i].second);
+        }
+    }
+
+    // Squared distance from (x, y) to the nearest point of `box`
+    static float distanceSquared(const SpatialBox& box, float x, float y) {
+        float dx = std::max({static_cast<float>(box.x) - x, 0.0f, x - static_cast<float>(box.x + box.width)});
+        float dy = std::max({static_cast<float>(box.y) - y, 0.0f, y - static_cast<float>(box.y + box.height)});
+        return dx * dx + dy * dy;
+    }
+
+private:
+    // Inclusive cell coordinates a box covers
+    struct CellRange {
+        int x0;
+        int y0;
+        int x1;
+        int y1;
+
+        bool operator!=(const CellRange& other) const {
+            return x0 != other.x0 || y0 != other.y0 || x1 != other.x1 || y1 != other.y1;
+        }
+    };
+
+    struct Entry {
+        SpatialBox box;
+        CellRange cells;
+    };
+
+    // Rounds toward negative infinity so cells left of and above 0 don't share cell 0
+    int cellOf(int v) const {
+        return v >= 0 ? v / cellSize_ : -((-v + cellSize_ - 1) / cellSize_);
+    }
+
+    CellRange cellsOf(const SpatialBox& box) const {
+        return {cellOf(box.x), cellOf(box.y), cellOf(box.x + box.width), cellOf(box.y + box.height)};
+    }
+
+    static uint64_t cellKey(int gx, int gy) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(gx)) << 32) | static_cast<uint32_t>(gy);
+    }
+
+    void file(int key, const CellRange& range) {
+        for (int gy = range.y0; gy <= range.y1; gy++) {
+            for (int gx = range.x0; gx <= range.x1; gx++) {
+                cells_[cellKey(gx, gy)].push_back(key);
+            }
+        }
+    }
+
+    void unfile(int key, const CellRange& range) {
+        for (int gy = range.y0; gy <= range.y1; gy++) {
+            for (int gx = range.x0; gx <= range.x1; gx++) {
+                auto cell = cells_.find(cellKey(gx, gy));
+                if (cell == cells_.end()) {
+                    continue;
+                }
+                std::vector<int>& keys = cell->second;
+                auto it = std::find(keys.begin(), keys.end(), key);
+                if (it != keys.end()) {
+                    *it = keys.back();
+                    keys.pop_back();
+                }
+                if (keys.empty()) {
+                    cells_.erase(cell);
+                }
+            }
+        }
+    }
+
+    // Calls visit(key) for each box overlapping `area` until it returns false.
+    // A box filed in several of the cells searched is only reported from the
+    // first cell the two ranges share, so nothing is reported twice.
+    template <typename Visit>
+    void forEachOverlap(const SpatialBox& area, Visit visit) const {
+        CellRange range = cellsOf(area);
+        for (int gy = range.y0; gy <= range.y1; gy++) {
+            for (int gx = range.x0; gx <= range.x1; gx++) {
+                auto cell = cells_.find(cellKey(gx, gy));
+                if (cell == cells_.end()) {
+                    continue;
+                }
+                for (int key : cell->second) {
+                    const Entry& entry = entries_.at(key);
+                    if (gx != std::max(range.x0, entry.cells.x0) || gy != std::max(range.y0, entry.cells.y0)) {
+                        continue;
+                    }
+                    const SpatialBox& b = entry.box;
+                    bool overlaps = !(area.x > b.x + b.width || area.x + area.width < b.x ||
+                                      area.y > b.y + b.height || area.y + area.height < b.y);
+                    if (overlaps && !visit(key)) {
+                        return;
+                    }
+                }
+            }
+        }
+    }
+
+    int cellSize_;
+    std::unordered_map<uint64_t, std::vector<int>> cells_;
+    std::unordered_map<int, Entry> entries_;
+};
+
+#endif // SPATIAL_HASH_HPP
@@ -0,0 +1,149 @@
+#ifndef SPAWNER_HPP
+#define SPAWNER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * When a room's enemies appear.
+ *
+ * Each room has a cap on how many enemies it has alive at once and either a
+ * steady rate (one every `interval` seconds) or a list of waves, played in
+ * order and then from the start again. A wave spawns `count` enemies
+ * `interval` apart, then waits `pauseAfter` seconds before the next one.
+ * When the room is full, a wave waits where it is rather than saving up
+ * spawns for later.
+ *
+ * The spawner only decides how many; where they go and what ids they get is
+ * up to the room (see EnemyTable, whose ids come from recycled slots). Spawns
+ * the room found no spot for are handed back and are due again next step.
+ */
+struct SpawnWave {
+    size_t count = 0;
+    float interval = 1.0f;
+    float pauseAfter = 5.0f;
+};
+
+struct SpawnSettings {
+    // 0: the room never spawns enemies
+    size_t cap = 0;
+    // Seconds between spawns when there are no waves; 0 fills the room in one step
+    float interval = 1.0f;
+    std::vector<SpawnWave> waves;
+    // Spawn even with nobody in the room, and anywhere in it, overlapping
+    // or not: for load tests with thousands of enemies
+    bool stress = false;
+};
+
+/**
+ * Waves as "count:interval:pause" separated by commas, e.g.
+ * "5:0.5:10,10:0.25:20". Malformed waves are skipped.
+ */
+inline std::vector<SpawnWave> parseSpawnWaves(const std::string& text) {
+    std::vector<SpawnWave> waves;
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        std::stringstream fields(item);
+        SpawnWave wave;
+        char colon1 = 0;
+        char colon2 = 0;
+        if (fields >> wave.count >> colon1 >> wave.interval >> colon2 >> wave.pauseAfter &&
+            colon1 == ':' && colon2 == ':' && wave.count > 0 && wave.interval >= 0 && wave.pauseAfter >= 0) {
+            waves.push_back(wave);
+        }
+    }
+    return waves;
+}
+
+class EnemySpawner {
+public:
+    explicit EnemySpawner(SpawnSettings settings = {}) : settings_(std::move(settings)) {}
+
+    const SpawnSettings& settings() const { return settings_; }
+    // The wave being spawned or waited after; 0 without waves
+    size_t wave() const { return wave_; }
+
+    // How many enemies to spawn this step, with `alive` already in the room
+    size_t due(float dt, size_t alive) {
+        size_t room = settings_.cap > alive ? settings_.cap - alive : 0;
+        size_t retry = std::min(unplaced_, room);
+        unplaced_ = 0;
+        room -= retry;
+        if (settings_.waves.empty()) {
+            return retry + steady(dt, room);
+        }
+        return retry + waves(dt, room);
+    }
+
+    // Spawns from the last due() that couldn't be placed
+    void unplaced(size_t count) { unplaced_ += count; }
+
+    // The room emptied: the next player starts from the first wave
+    void reset() {
+        unplaced_ = 0;
+        timer_ = 0;
+        wave_ = 0;
+        spawnedInWave_ = 0;
+        pausing_ = false;
+    }
+
+private:
+    size_t steady(float dt, size_t room) {
+        if (settings_.interval <= 0) {
+            return room;
+        }
+        timer_ += dt;
+        if (timer_ < settings_.interval) {
+            return 0;
+        }
+        size_t ready = static_cast<size_t>(timer_ / settings_.interval);
+        timer_ -= static_cast<float>(ready) * settings_.interval;
+        // Like the single timer this replaced, a full room doesn't bank spawns
+        return std::min(ready, room);
+    }
+
+    size_t waves(float dt, size_t room) {
+        timer_ += dt;
+        const SpawnWave* current = &settings_.waves[wave_];
+        if (pausing_) {
+            if (timer_ < current->pauseAfter) {
+                return 0;
+            }
+            timer_ -= current->pauseAfter;
+            wave_ = (wave_ + 1) % settings_.waves.size();
+            spawnedInWave_ = 0;
+            pausing_ = false;
+            current = &settings_.waves[wave_];
+        }
+
+        size_t count = 0;
+        while (spawnedInWave_ < current->count && count < room &&
+               (current->interval <= 0 || timer_ >= current->interval)) {
+            timer_ -= current->interval;
+            spawnedInWave_++;
+            count++;
+        }
+        if (spawnedInWave_ == current->count) {
+            pausing_ = true;
+            timer_ = 0;
+        } else if (count == room) {
+            // Full: wait for a free spot instead of spawning the backlog all at once
+            timer_ = std::min(timer_, current->interval);
+        }
+        return count;
+    }
+
+    SpawnSettings settings_;
+    float timer_ = 0;
+    size_t wave_ = 0;
+    size_t spawnedInWave_ = 0;
+    bool pausing_ = false;
+    size_t unplaced_ = 0;
+};
+
+#endif // SPAWNER_HPP
@@ -0,0 +1,102 @@
+#ifndef TICK_SCHEDULER_HPP
+#define TICK_SCHEDULER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <utility>
+
+/**
+ * Runs a step function at a fixed rate on the calling thread.
+ *
+ * Deadlines are scheduled from the previous deadline rather than from "now",
+ * so the rate does not drift with step cost. A step that runs past its
+ * deadline counts as an overrun; if the loop falls more than one full tick
+ * behind it resynchronizes instead of trying to catch up with a burst.
+ *
+ * Time comes from a TimeSource, the steady clock unless one is passed in, so
+ * tests can run the schedule on a clock they advance themselves.
+ */
+class TickScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stats {
+        uint64_t ticks = 0;
+        uint64_t overruns = 0;
+        double lastStepMs = 0.0;
+        double maxStepMs = 0.0;
+    };
+
+    struct TimeSource {
+        std::function<Clock::time_point()> now;
+        std::function<void(Clock::time_point)> sleepUntil;
+    };
+
+    static TimeSource steadyTime() {
+        return {[]() { return Clock::now(); },
+                [](Clock::time_point t) { std::this_thread::sleep_until(t); }};
+    }
+
+    // (tick number, seconds per tick)
+    using StepFn = std::function<void(uint64_t, float)>;
+    // (tick number, how far past the deadline the step finished)
+    using OverrunFn = std::function<void(uint64_t, std::chrono::microseconds)>;
+
+    explicit TickScheduler(int rateHz, TimeSource time = steadyTime())
+        : rateHz_(rateHz > 0 ? rateHz : 20),
+          period_(std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / rateHz_))),
+          time_(std::move(time)) {}
+
+    int rate() const { return rateHz_; }
+    float dt() const { return 1.0f / static_cast<float>(rateHz_); }
+
+    void onOverrun(OverrunFn fn) { overrunFn_ = std::move(fn); }
+
+    void run(const std::atomic<bool>& stop, const StepFn& step) {
+        Clock::time_point deadline = time_.now() + period_;
+        while (!stop) {
+            Clock::time_point start = time_.now();
+            step(ticks_, dt());
+            Clock::time_point end = time_.now();
+
+            double stepMs = std::chrono::duration<double, std::milli>(end - start).count();
+            lastStepMs_ = stepMs;
+            if (stepMs > maxStepMs_) {
+                maxStepMs_ = stepMs;
+            }
+            ticks_++;
+
+            if (end > deadline) {
+                overruns_++;
+                if (overrunFn_) {
+                    overrunFn_(ticks_ - 1, std::chrono::duration_cast<std::chrono::microseconds>(end - deadline));
+                }
+                if (end - deadline > period_) {
+                    deadline = end;
+                }
+            } else {
+                time_.sleepUntil(deadline);
+            }
+            deadline += period_;
+        }
+    }
+
+    Stats stats() const {
+        return {ticks_.load(), overruns_.load(), lastStepMs_.load(), maxStepMs_.load()};
+    }
+
+private:
+    int rateHz_;
+    Clock::duration period_;
+    TimeSource time_;
+    OverrunFn overrunFn_;
+    std::atomic<uint64_t> ticks_{0};
+    std::atomic<uint64_t> overruns_{0};
+    std::atomic<double> lastStepMs_{0.0};
+    std::atomic<double> maxStepMs_{0.0};
+};
+
+#endif // TICK_SCHEDULER_HPP
@@ -0,0 +1,592 @@
+#ifndef UDP_TRANSPORT_HPP
+#define UDP_TRANSPORT_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/asio.hpp>
+#include "wire.hpp"
+
+/**
+ * Optional UDP transport that runs next to the TCP stream.
+ *
+ * Every datagram carries one message and a 13-byte header:
+ *
+ *   [u32 token][u16 sequence][u16 ack][u32 ack bits][u8 channel]
+ *
+ * The top bit of the channel byte says whether the ack fields are filled in
+ * (they are not until something has arrived from the peer); the next bit asks
+ * for an ack, which a side sends until it knows the peer can hear it.
+ * The token ties the datagram to a TCP session (the server hands it out over
+ * TCP). Sequence numbers count packets per direction, and ack/ack bits
+ * acknowledge the newest packet received plus the 32 before it, so every
+ * packet going one way also reports what arrived from the other.
+ *
+ * Sequenced: newest wins; a packet older than one already delivered is
+ *            dropped. For movement, where a lost update is replaced by the
+ *            next one anyway.
+ * Reliable:  each message has its own id and is resent until a packet
+ *            carrying it is acked; the receiver delivers ids in order. For
+ *            room events and game state. A message too big for one datagram
+ *            goes as several fragments with ids of their own, put back
+ *            together before delivery. At most maxReliableWindow fragments
+ *            are unacked at once, the most the receiver will hold out of
+ *            order; a peer that falls that far behind is cut off.
+ * Ack:       no payload; sent when acks are owed and nothing else went out.
+ *
+ * Payloads are wire frames (see wire.hpp), so they are self-describing.
+ */
+enum class UdpChannel : uint8_t {
+    Sequenced = 0,
+    Reliable = 1,
+    Ack = 2
+};
+
+constexpr uint8_t udpAcksValid = 0x80;
+constexpr uint8_t udpWantsAck = 0x40;
+constexpr uint8_t udpChannelMask = 0x3f;
+
+constexpr size_t udpHeaderSize = 13;
+// Keeps datagrams under common path MTUs. Bigger reliable messages are
+// fragmented; a sequenced one has to fit.
+constexpr size_t maxUdpPayload = 1200;
+// Set on every fragment of a reliable message but the last
+constexpr uint8_t udpMoreFragments = 0x01;
+
+// a is newer than b, allowing for wrap-around
+inline bool sequenceNewer(uint16_t a, uint16_t b) {
+    return a != b && static_cast<uint16_t>(a - b) < 0x8000;
+}
+
+/**
+ * Protocol state for one peer, with no sockets: datagrams go in and come out
+ * as strings, so the same code runs on both ends and in tests.
+ */
+class UdpConnection {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Deliver = std::function<void(UdpChannel, std::string)>;
+
+    // Reliable messages unacked at once, from the oldest to the newest
+    static constexpr uint16_t maxReliableWindow = 1024;
+    // (Re)sends of reliable messages per poll(), oldest first
+    static constexpr size_t maxReliablePerPoll = 64;
+
+    struct Stats {
+        uint64_t sent = 0;
+        uint64_t received = 0;
+        uint64_t resent = 0;
+        uint64_t staleDropped = 0;
+        uint64_t duplicates = 0;
+        uint64_t acked = 0;
+    };
+
+    explicit UdpConnection(uint32_t token, std::chrono::milliseconds resendDelay = std::chrono::milliseconds(100))
+        : token_(token), resendDelay_(resendDelay) {
+        sentPackets_.fill({0, -1});
+    }
+
+    uint32_t token() const { return token_; }
+    const Stats& stats() const { return stats_; }
+    size_t pendingReliable() const { return pending_.size(); }
+    // The peer has reported getting something from us, so the path works both ways
+    bool established() const { return established_; }
+
+    std::string sendSequenced(const std::string& payload) {
+        return packet(UdpChannel::Sequenced, payload, -1);
+    }
+
+    // Also serves as a hello before the peer knows our address
+    std::string sendAck() {
+        return packet(UdpChannel::Ack, "", -1);
+    }
+
+    // Goes out with the next poll(). False, queueing nothing, if its
+    // fragments don't fit in the window: the peer has stopped acking, and UDP
+    // is no use to it for now.
+    bool queueReliable(const std::string& payload) {
+        size_t fragments = payload.empty() ? 1 : (payload.size() + maxUdpPayload - 1) / maxUdpPayload;
+        uint64_t oldest = pending_.empty() ? nextSendId_ : pending_.begin()->first;
+        if (nextSendId_ + fragments - oldest > maxReliableWindow) {
+            return false;
+        }
+        for (size_t i = 0; i < fragments; i++) {
+            std::string fragment(1, static_cast<char>(i + 1 < fragments ? udpMoreFragments : 0));
+            fragment.append(payload, i * maxUdpPayload, maxUdpPayload);
+            pending_[nextSendId_++] = {std::move(fragment), Clock::time_point{}};
+        }
+        return true;
+    }
+
+    /**
+     * Reliable messages due for a (re)send, or a bare ack if one is owed and
+     * nothing else is going out.
+     */
+    std::vector<std::string> poll(Clock::time_point now) {
+        std::vector<std::string> out;
+        for (auto& [id, message] : pending_) {
+            if (out.size() == maxReliablePerPoll) {
+                break;
+            }
+            if (message.lastSent != Clock::time_point{} && now - message.lastSent < resendDelay_) {
+                continue;
+            }
+            if (message.lastSent != Clock::time_point{}) {
+                stats_.resent++;
+            }
+            message.lastSent = now;
+            // Only the low 16 bits go on the wire; the window keeps them unambiguous
+            std::string body(2, '\0');
+            body[0] = static_cast<char>((id >> 8) & 0xff);
+            body[1] = static_cast<char>(id & 0xff);
+            out.push_back(packet(UdpChannel::Reliable, body + message.payload, static_cast<int64_t>(id)));
+        }
+        if (out.empty() && ackOwed_) {
+            out.push_back(sendAck());
+        }
+        return out;
+    }
+
+    /**
+     * Takes one datagram from the peer and hands any messages it makes ready
+     * to `deliver`, in order. Returns false if it is not a packet for this
+     * connection.
+     */
+    bool receive(const char* data, size_t size, const Deliver& deliver) {
+        if (size < udpHeaderSize || readToken(data) != token_) {
+            return false;
+        }
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        uint16_t sequence = static_cast<uint16_t>((bytes[4] << 8) | bytes[5]);
+        uint16_t ack = static_cast<uint16_t>((bytes[6] << 8) | bytes[7]);
+        uint32_t ackBits = (uint32_t(bytes[8]) << 24) | (uint32_t(bytes[9]) << 16) | (uint32_t(bytes[10]) << 8) | uint32_t(bytes[11]);
+        UdpChannel channel = static_cast<UdpChannel>(bytes[12] & udpChannelMask);
+
+        stats_.received++;
+        if (bytes[12] & udpAcksValid) {
+            established_ = true;
+            processAcks(ack, ackBits);
+        }
+        recordReceived(sequence);
+        // A bare ack is not acked back, or two idle peers would trade them forever
+        if (channel != UdpChannel::Ack || (bytes[12] & udpWantsAck)) {
+            ackOwed_ = true;
+        }
+
+        const char* payload = data + udpHeaderSize;
+        size_t payloadSize = size - udpHeaderSize;
+        switch (channel) {
+            case UdpChannel::Sequenced:
+                if (hasSequenced_ && !sequenceNewer(sequence, newestSequenced_)) {
+                    stats_.staleDropped++;
+                    return true;
+                }
+                hasSequenced_ = true;
+                newestSequenced_ = sequence;
+                deliver(UdpChannel::Sequenced, std::string(payload, payloadSize));
+                break;
+            case UdpChannel::Reliable:
+                if (payloadSize >= 2) {
+                    uint16_t id = static_cast<uint16_t>((uint8_t(payload[0]) << 8) | uint8_t(payload[1]));
+                    receiveReliable(id, std::string(payload + 2, payloadSize - 2), deliver);
+                }
+                break;
+            case UdpChannel::Ack:
+                break;
+        }
+        return true;
+    }
+
+    static uint32_t readToken(const char* data) {
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+        return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+    }
+
+private:
+    struct PendingMessage {
+        std::string payload;
+        Clock::time_point lastSent;
+    };
+
+    struct SentPacket {
+        uint16_t sequence;
+        int64_t messageId; // -1: nothing reliable in it
+    };
+
+    std::string packet(UdpChannel channel, const std::string& payload, int64_t messageId) {
+        uint16_t sequence = nextSequence_++;
+        sentPackets_[sequence % sentPackets_.size()] = {sequence, messageId};
+
+        std::string out(udpHeaderSize, '\0');
+        putU32(out, 0, token_);
+        out[4] = static_cast<char>(sequence >> 8);
+        out[5] = static_cast<char>(sequence & 0xff);
+        out[6] = static_cast<char>(remoteSequence_ >> 8);
+        out[7] = static_cast<char>(remoteSequence_ & 0xff);
+        putU32(out, 8, receivedBits_);
+        out[12] = static_cast<char>(static_cast<uint8_t>(channel) | (hasRemote_ ? udpAcksValid : 0) | (established_ ? 0 : udpWantsAck));
+        out += payload;
+
+        ackOwed_ = false;
+        stats_.sent++;
+        return out;
+    }
+
+    static void putU32(std::string& out, size_t at, uint32_t value) {
+        out[at] = static_cast<char>(value >> 24);
+        out[at + 1] = static_cast<char>((value >> 16) & 0xff);
+        out[at + 2] = static_cast<char>((value >> 8) & 0xff);
+        out[at + 3] = static_cast<char>(value & 0xff);
+    }
+
+    void processAcks(uint16_t ack, uint32_t ackBits) {
+        ackPacket(ack);
+        for (uint16_t i = 0; i < 32; i++) {
+            if (ackBits & (1u << i)) {
+                ackPacket(static_cast<uint16_t>(ack - 1 - i));
+            }
+        }
+    }
+
+    void ackPacket(uint16_t sequence) {
+        SentPacket& sent = sentPackets_[sequence % sentPackets_.size()];
+        if (sent.sequence != sequence || sent.messageId < 0) {
+            return;
+        }
+        if (pending_.erase(static_cast<uint64_t>(sent.messageId))) {
+            stats_.acked++;
+        }
+        sent.messageId = -1;
+    }
+
+    void recordReceived(uint16_t sequence) {
+        if (!hasRemote_) {
+            hasRemote_ = true;
+            remoteSequence_ = sequence;
+            receivedBits_ = 0;
+            return;
+        }
+        if (sequenceNewer(sequence, remoteSequence_)) {
+            uint16_t shift = static_cast<uint16_t>(sequence - remoteSequence_);
+            // Bit i stands for remoteSequence_ - 1 - i; the old newest becomes bit shift - 1
+            receivedBits_ = shift < 32 ? receivedBits_ << shift : 0;
+            if (shift <= 32) {
+                receivedBits_ |= 1u << (shift - 1);
+            }
+            remoteSequence_ = sequence;
+        } else if (sequence != remoteSequence_) {
+            uint16_t behind = static_cast<uint16_t>(remoteSequence_ - sequence);
+            if (behind <= 32) {
+                receivedBits_ |= 1u << (behind - 1);
+            }
+        }
+    }
+
+    void receiveReliable(uint16_t id, std::string payload, const Deliver& deliver) {
+        if (id != nextReceiveId_ && !sequenceNewer(id, nextReceiveId_)) {
+            stats_.duplicates++;
+            return;
+        }
+        if (id != nextReceiveId_) {
+            // Too far ahead to buffer; the sender resends it later
+            if (static_cast<uint16_t>(id - nextReceiveId_) > maxReliableWindow) {
+                return;
+            }
+            if (!outOfOrder_.emplace(id, std::move(payload)).second) {
+                stats_.duplicates++;
+            }
+            return;
+        }
+        assemble(payload, deliver);
+        nextReceiveId_++;
+        for (auto it = outOfOrder_.find(nextReceiveId_); it != outOfOrder_.end(); it = outOfOrder_.find(nextReceiveId_)) {
+            assemble(it->second, deliver);
+            outOfOrder_.erase(it);
+            nextReceiveId_++;
+        }
+    }
+
+    // Fragments come in id order; the last one of a message hands it over
+    void assemble(const std::string& fragment, const Deliver& deliver) {
+        if (fragment.empty()) {
+            return;
+        }
+        assembling_.append(fragment, 1, std::string::npos);
+        if (!(static_cast<uint8_t>(fragment[0]) & udpMoreFragments)) {
+            deliver(UdpChannel::Reliable, std::move(assembling_));
+            assembling_.clear();
+        }
+    }
+
+    uint32_t token_;
+    std::chrono::milliseconds resendDelay_;
+    Stats stats_;
+    bool established_ = false;
+
+    uint16_t nextSequence_ = 0;
+    std::array<SentPacket, 1024> sentPackets_;
+
+    bool hasRemote_ = false;
+    uint16_t remoteSequence_ = 0;
+    uint32_t receivedBits_ = 0;
+    bool ackOwed_ = false;
+
+    bool hasSequenced_ = false;
+    uint16_t newestSequenced_ = 0;
+
+    // Counts every reliable message sent, so it never wraps and pending_ stays
+    // in send order
+    uint64_t nextSendId_ = 0;
+    std::map<uint64_t, PendingMessage> pending_;
+    uint16_t nextReceiveId_ = 0;
+    std::map<uint16_t, std::string> outOfOrder_;
+    std::string assembling_;
+};
+
+/**
+ * A UDP socket shared by many peers, with optional simulated packet loss on
+ * the way out. Everything touching the socket or the peers runs on one
+ * strand; a timer drives resends and acks.
+ *
+ * The server keeps one peer per TCP session. A peer's address is learned
+ * from its first datagram carrying the right token.
+ */
+class UdpEndpoint {
+public:
+    using udp = boost::asio::ip::udp;
+    using Handler = std::function<void(int peerId, UdpChannel, json)>;
+    using OverflowHandler = std::function<void(int peerId)>;
+
+    UdpEndpoint(const boost::asio::any_io_executor& executor, const udp::endpoint& bindTo, double simulatedLoss = 0.0,
+                std::chrono::milliseconds flushInterval = std::chrono::milliseconds(20))
+        : strand_(boost::asio::make_strand(executor)),
+          socket_(strand_, bindTo),
+          timer_(strand_),
+          flushInterval_(flushInterval),
+          loss_(simulatedLoss),
+          random_(std::random_device{}()) {}
+
+    UdpEndpoint(const UdpEndpoint&) = delete;
+    UdpEndpoint& operator=(const UdpEndpoint&) = delete;
+
+    uint16_t port() const { return socket_.local_endpoint().port(); }
+
+    void start(Handler handler) {
+        boost::asio::post(strand_, [this, handler = std::move(handler)]() {
+            handler_ = handler;
+            receiveNext();
+            scheduleFlush();
+        });
+    }
+
+    // Called on the endpoint's strand for a peer dropped because its reliable
+    // window filled up; whatever it had unacked is gone with it
+    void onOverflow(OverflowHandler handler) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        overflowHandler_ = std::move(handler);
+    }
+
+    void stop() {
+        boost::asio::post(strand_, [this]() {
+            boost::system::error_code ec;
+            timer_.cancel();
+            socket_.close(ec);
+        });
+    }
+
+    // A peer with a known address (the client side, talking to the server)
+    void addPeer(int peerId, uint32_t token, const udp::endpoint& remote) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Peer& peer = peers_[peerId];
+        peer.connection = std::make_unique<UdpConnection>(token);
+        peer.remote = remote;
+        peer.bound = true;
+        byToken_[token] = peerId;
+    }
+
+    // A peer whose address arrives with its first datagram; returns its token
+    uint32_t expectPeer(int peerId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        removePeerLocked(peerId);
+        uint32_t token;
+        do {
+            token = static_cast<uint32_t>(random_());
+        } while (token == 0 || byToken_.count(token));
+        peers_[peerId].connection = std::make_unique<UdpConnection>(token);
+        byToken_[token] = peerId;
+        return token;
+    }
+
+    void removePeer(int peerId) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        removePeerLocked(peerId);
+    }
+
+    bool established(int peerId) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = peers_.find(peerId);
+        return it != peers_.end() && it->second.connection->established();
+    }
+
+    /**
+     * Sends an encoded wire frame. Returns false if the peer has not been
+     * heard from both ways yet, or a sequenced message is too big for a
+     * datagram; the caller then uses TCP. A reliable message that finds the
+     * peer's window full drops the peer, so it stays on TCP from then on.
+     */
+    bool send(int peerId, const WireMessage::Bytes& payload, UdpChannel channel) {
+        if (channel != UdpChannel::Reliable && payload->size() > maxUdpPayload) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = peers_.find(peerId);
+        if (it == peers_.end() || !it->second.bound || !it->second.connection->established()) {
+            return false;
+        }
+        Peer& peer = it->second;
+        if (channel == UdpChannel::Reliable) {
+            if (peer.connection->queueReliable(*payload)) {
+                return true;
+            }
+            removePeerLocked(peerId);
+            if (overflowHandler_) {
+                boost::asio::post(strand_, [handler = overflowHandler_, peerId]() { handler(peerId); });
+            }
+            return false;
+        }
+        sendDatagram(peer.remote, peer.connection->sendSequenced(*payload));
+        return true;
+    }
+
+    UdpConnection::Stats stats(int peerId) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = peers_.find(peerId);
+        return it != peers_.end() ? it->second.connection->stats() : UdpConnection::Stats{};
+    }
+
+private:
+    struct Peer {
+        std::unique_ptr<UdpConnection> connection;
+        udp::endpoint remote;
+        bool bound = false;
+    };
+
+    void removePeerLocked(int peerId) {
+        auto it = peers_.find(peerId);
+        if (it != peers_.end()) {
+            byToken_.erase(it->second.connection->token());
+            peers_.erase(it);
+        }
+    }
+
+    // Caller holds mutex_
+    void sendDatagram(const udp::endpoint& to, std::string datagram) {
+        if (loss_ > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(random_) < loss_) {
+            return;
+        }
+        auto bytes = std::make_shared<std::string>(std::move(datagram));
+        boost::asio::post(strand_, [this, to, bytes]() {
+            socket_.async_send_to(boost::asio::buffer(*bytes), to, [bytes](boost::system::error_code, std::size_t) {});
+        });
+    }
+
+    void receiveNext() {
+        socket_.async_receive_from(boost::asio::buffer(receiveBuffer_), sender_, [this](boost::system::error_code ec, std::size_t size) {
+            if (ec == boost::asio::error::operation_aborted || !socket_.is_open()) {
+                return;
+            }
+            if (!ec && size >= udpHeaderSize) {
+                handleDatagram(size);
+            }
+            receiveNext();
+        });
+    }
+
+    void handleDatagram(size_t size) {
+        std::vector<std::pair<UdpChannel, std::string>> ready;
+        int peerId = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto token = byToken_.find(UdpConnection::readToken(receiveBuffer_.data()));
+            if (token == byToken_.end()) {
+                return;
+            }
+            peerId = token->second;
+            Peer& peer = peers_[peerId];
+            if (!peer.connection->receive(receiveBuffer_.data(), size, [&ready](UdpChannel channel, std::string payload) {
+                    ready.emplace_back(channel, std::move(payload));
+                })) {
+                return;
+            }
+            // Follows the client if its address changes (NAT rebinding)
+            peer.remote = sender_;
+            peer.bound = true;
+        }
+
+        for (auto& [channel, payload] : ready) {
+            try {
+                if (payload.empty() || wireFrameSize(payload.data(), payload.size()) != payload.size()) {
+                    continue;
+                }
+                handler_(peerId, channel, decodeWireFrame(payload.data(), payload.size()));
+            } catch (const std::exception&) {
+                // A bad datagram only loses itself
+            }
+        }
+    }
+
+    void scheduleFlush() {
+        timer_.expires_after(flushInterval_);
+        timer_.async_wait([this](boost::system::error_code ec) {
+            if (ec) {
+                return;
+            }
+            flush();
+            scheduleFlush();
+        });
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto now = UdpConnection::Clock::now();
+        for (auto& [peerId, peer] : peers_) {
+            if (!peer.bound) {
+                continue;
+            }
+            for (std::string& datagram : peer.connection->poll(now)) {
+                sendDatagram(peer.remote, std::move(datagram));
+            }
+            // Until the peer answers, keep announcing ourselves so its side learns our address
+            if (!peer.connection->established()) {
+                sendDatagram(peer.remote, peer.connection->sendAck());
+            }
+        }
+    }
+
+    boost::asio::strand<boost::asio::any_io_executor> strand_;
+    udp::socket socket_;
+    boost::asio::steady_timer timer_;
+    std::chrono::milliseconds flushInterval_;
+    double loss_;
+
+    mutable std::mutex mutex_;
+    std::mt19937 random_;
+    std::unordered_map<int, Peer> peers_;
+    std::unordered_map<uint32_t, int> byToken_;
+    Handler handler_;
+    OverflowHandler overflowHandler_;
+
+    std::array<char, 2048> receiveBuffer_;
+    udp::endpoint sender_;
+};
+
+#endif // UDP_TRANSPORT_HPP
@@ -0,0 +1,153 @@
+#ifndef WEBSOCKET_SESSION_HPP
+#define WEBSOCKET_SESSION_HPP
+
+#include <exception>
+#include <mutex>
+#include <string>
+#include <websocketpp/server.hpp>
+#include <websocketpp/config/asio_no_tls.hpp>
+#include <websocketpp/extensions/permessage_deflate/enabled.hpp>
+#include "session.hpp"
+
+/**
+ * websocketpp's plain asio config with permessage-deflate turned on. Browsers
+ * offer it on their own; clients that don't get uncompressed messages.
+ */
+struct DeflateConfig : public websocketpp::config::asio {
+    typedef DeflateConfig type;
+    typedef websocketpp::config::asio base;
+
+    typedef base::concurrency_type concurrency_type;
+    typedef base::request_type request_type;
+    typedef base::response_type response_type;
+    typedef base::message_type message_type;
+    typedef base::con_msg_manager_type con_msg_manager_type;
+    typedef base::endpoint_msg_manager_type endpoint_msg_manager_type;
+    typedef base::alog_type alog_type;
+    typedef base::elog_type elog_type;
+    typedef base::rng_type rng_type;
+
+    struct transport_config : public base::transport_config {
+        typedef type::concurrency_type concurrency_type;
+        typedef type::alog_type alog_type;
+        typedef type::elog_type elog_type;
+        typedef type::request_type request_type;
+        typedef type::response_type response_type;
+        typedef websocketpp::transport::asio::basic_socket::endpoint socket_type;
+    };
+    typedef websocketpp::transport::asio::endpoint<transport_config> transport_type;
+
+    struct permessage_deflate_config {};
+    typedef websocketpp::extensions::permessage_deflate::enabled<permessage_deflate_config> permessage_deflate_type;
+};
+
+/**
+ * A browser client. The connection is looked up once, when it opens, and
+ * kept; messages go straight to it instead of through the server's handle
+ * table. JSON goes out as text messages and binary wire formats as binary
+ * messages, one frame each.
+ *
+ * Messages smaller than compressMinBytes() are marked not to be deflated,
+ * like the threshold for LZ4 on TCP.
+ *
+ * websocketpp keeps its own write queue, which can't be edited, so under the
+ * Coalesce policy a keyed message past the high-water mark is dropped rather
+ * than replacing the queued one: keyed messages are whole on their own, so the
+ * next one with that key supersedes it either way.
+ */
+class WebSocketSession : public Session {
+public:
+    using Server = websocketpp::server<DeflateConfig>;
+
+    WebSocketSession(Server::connection_ptr connection, boost::asio::any_io_executor executor, int id,
+                     size_t highWaterBytes, BackpressurePolicy policy, const InboundLimits& inboundLimits = {})
+        : Session(std::move(executor), id, inboundLimits),
+          connection_(std::move(connection)),
+          highWater_(highWaterBytes),
+          policy_(policy) {}
+
+    SessionTransport transport() const override { return SessionTransport::WebSocket; }
+
+    // The closing handshake queues behind everything already sent
+    void closeAfterFlush() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closeLocked(websocketpp::close::status::normal);
+    }
+
+    void close() override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closeLocked(websocketpp::close::status::going_away);
+    }
+
+    Stats stats() const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return {connection_->get_buffered_amount(), sent_, dropped_, coalesced_, sent_};
+    }
+
+private:
+    bool enqueue(const Payload& message, const std::string& coalesceKey) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_) {
+            return false;
+        }
+
+        size_t queued = connection_->get_buffered_amount();
+        if (queued + message->size() > highWater_) {
+            switch (policy_) {
+                case BackpressurePolicy::Drop:
+                    if (!coalesceKey.empty()) {
+                        dropped_++;
+                        return false;
+                    }
+                    break;
+                case BackpressurePolicy::Kick:
+                    closeLocked(websocketpp::close::status::policy_violation);
+                    return false;
+                case BackpressurePolicy::Coalesce:
+                    if (!coalesceKey.empty()) {
+                        coalesced_++;
+                        return false;
+                    }
+                    break;
+            }
+            if (queued + message->size() > 2 * highWater_) {
+                closeLocked(websocketpp::close::status::policy_violation);
+                return false;
+            }
+        }
+
+        auto opcode = wireFormat_ == WireFormat::Json ? websocketpp::frame::opcode::text : websocketpp::frame::opcode::binary;
+        auto frame = std::make_shared<Server::message_ptr::element_type>(nullptr, opcode, message->size());
+        frame->set_payload(message->data(), message->size());
+        frame->set_compressed(message->size() >= compressMinBytes_);
+        if (connection_->send(frame)) {
+            closeLocked(websocketpp::close::status::going_away);
+            return false;
+        }
+        sent_++;
+        return true;
+    }
+
+    void closeLocked(uint16_t status) {
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        try {
+            connection_->close(status, "");
+        } catch (const std::exception&) {
+            // Already closing from the other side; its close handler still runs
+        }
+    }
+
+    Server::connection_ptr connection_;
+    size_t highWater_;
+    BackpressurePolicy policy_;
+
+    mutable std::mutex mutex_;
+    uint64_t sent_ = 0;
+    uint64_t dropped_ = 0;
+    uint64_t coalesced_ = 0;
+};
+
+#endif // WEBSOCKET_SESSION_HPP
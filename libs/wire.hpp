@@ -0,0 +1,406 @@
+#ifndef WIRE_HPP
+#define WIRE_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#ifndef __EMSCRIPTEN__
+#include <lz4.h>
+#endif
+
+using json = nlohmann::json;
+
+/**
+ * How messages are put on the wire.
+ *
+ * Every connection starts out with newline-delimited JSON text. A client can
+ * ask for a binary encoding by sending {"wire": "cbor"} or
+ * {"wire": "msgpack"} as a text line right after connecting; from then on
+ * the server sends it frames:
+ *
+ *   [u32 big-endian length of tag + body][u8 tag][body]
+ *
+ * The tag names the body encoding ('C' CBOR, 'M' MessagePack, 'J' JSON text),
+ * so a frame can still carry readable JSON when debugging. Readers tell text
+ * from frames by the first byte: text messages start with '{', frames with the
+ * top byte of the length, which is always 0 since frames are capped at 16 MiB.
+ * Both can arrive on the same connection (anything sent before the switch is
+ * still text).
+ */
+enum class WireFormat : uint8_t {
+    Json = 'J',
+    Cbor = 'C',
+    MsgPack = 'M'
+};
+
+constexpr size_t wireHeaderSize = 5;
+constexpr size_t maxWireFrame = (1u << 24) - 1;
+
+inline WireFormat parseWireFormat(const std::string& name) {
+    if (name == "cbor") return WireFormat::Cbor;
+    if (name == "msgpack") return WireFormat::MsgPack;
+    return WireFormat::Json;
+}
+
+inline const char* wireFormatName(WireFormat format) {
+    switch (format) {
+        case WireFormat::Cbor: return "cbor";
+        case WireFormat::MsgPack: return "msgpack";
+        default: return "json";
+    }
+}
+
+inline std::string encodeWireBody(const json& message, WireFormat format) {
+    std::vector<uint8_t> bytes;
+    switch (format) {
+        case WireFormat::Cbor: bytes = json::to_cbor(message); break;
+        case WireFormat::MsgPack: bytes = json::to_msgpack(message); break;
+        default: return message.dump();
+    }
+    return std::string(bytes.begin(), bytes.end());
+}
+
+// Always a frame; with WireFormat::Json the body is JSON text
+inline std::string encodeWireFrame(const json& message, WireFormat format) {
+    std::string body = encodeWireBody(message, format);
+    size_t length = body.size() + 1;
+    if (length > maxWireFrame) {
+        throw std::length_error("message too large for a wire frame");
+    }
+    std::string frame;
+    frame.reserve(wireHeaderSize + body.size());
+    frame.push_back(static_cast<char>((length >> 24) & 0xff));
+    frame.push_back(static_cast<char>((length >> 16) & 0xff));
+    frame.push_back(static_cast<char>((length >> 8) & 0xff));
+    frame.push_back(static_cast<char>(length & 0xff));
+    frame.push_back(static_cast<char>(format));
+    frame += body;
+    return frame;
+}
+
+// A JSON text line for WireFormat::Json, a frame otherwise
+inline std::string encodeWire(const json& message, WireFormat format) {
+    if (format == WireFormat::Json) {
+        return message.dump() + "\n";
+    }
+    return encodeWireFrame(message, format);
+}
+
+inline bool isWireFrameStart(char first) {
+    return first == 0;
+}
+
+/**
+ * Size of the whole frame (header included) given its first wireHeaderSize
+ * bytes. Throws if the header is not a valid frame, after which the stream
+ * can't be resynchronised.
+ */
+inline size_t wireFrameSizeFromHeader(const char* data) {
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(data);
+    size_t length = (size_t(header[0]) << 24) | (size_t(header[1]) << 16) | (size_t(header[2]) << 8) | size_t(header[3]);
+    if (length == 0 || length > maxWireFrame) {
+        throw std::runtime_error("invalid wire frame length " + std::to_string(length));
+    }
+    return 4 + length;
+}
+
+// Size of the frame at the front of `data`, or 0 if it has not fully arrived yet
+inline size_t wireFrameSize(const char* data, size_t size) {
+    if (size < wireHeaderSize) {
+        return 0;
+    }
+    size_t frameSize = wireFrameSizeFromHeader(data);
+    return size >= frameSize ? frameSize : 0;
+}
+
+/**
+ * Compression, for connections that ask for it with
+ * {"wire": ..., "compress": "lz4"}. Only messages of at least the server's
+ * COMPRESS_MIN_BYTES are compressed, and only when that makes them smaller,
+ * so positions and ticks go out as before while a getGame of a busy world
+ * shrinks to a fraction. A compressed message is always a frame, whatever the
+ * format, with the top bit of the tag set and the body
+ *
+ *   [u8 codec][u32 big-endian size of the uncompressed body][compressed body]
+ *
+ * Web builds have no LZ4; browsers get permessage-deflate from the WebSocket
+ * server instead.
+ */
+enum class WireCompression : uint8_t {
+    None = 0,
+    Lz4 = 1
+};
+
+constexpr uint8_t wireCompressedFlag = 0x80;
+constexpr size_t wireCompressionHeaderSize = 5;
+
+inline WireCompression parseWireCompression(const std::string& name) {
+    return name == "lz4" ? WireCompression::Lz4 : WireCompression::None;
+}
+
+inline const char* wireCompressionName(WireCompression codec) {
+    return codec == WireCompression::Lz4 ? "lz4" : "none";
+}
+
+// What compression has cost and saved so far in this process
+struct WireCompressionStats {
+    std::atomic<uint64_t> messages{0};
+    // Compressed but sent as they were, because they didn't get smaller
+    std::atomic<uint64_t> incompressible{0};
+    std::atomic<uint64_t> rawBytes{0};
+    std::atomic<uint64_t> wireBytes{0};
+    std::atomic<uint64_t> nanoseconds{0};
+};
+
+inline WireCompressionStats& wireCompressionStats() {
+    static WireCompressionStats stats;
+    return stats;
+}
+
+inline bool isCompressedWireFrame(const char* data, size_t size) {
+    return size >= wireHeaderSize && isWireFrameStart(data[0]) && (static_cast<uint8_t>(data[4]) & wireCompressedFlag);
+}
+
+inline void putWireLength(char* out, size_t value) {
+    for (int i = 0; i < 4; i++) {
+        out[i] = static_cast<char>((value >> (24 - 8 * i)) & 0xff);
+    }
+}
+
+// A compressed frame, or encodeWire()'s output when compressing doesn't make it smaller
+inline std::string encodeCompressedWire(const json& message, WireFormat format, WireCompression codec) {
+#ifndef __EMSCRIPTEN__
+    if (codec == WireCompression::Lz4) {
+        auto start = std::chrono::steady_clock::now();
+        std::string body = encodeWireBody(message, format);
+        size_t plainSize = format == WireFormat::Json ? body.size() + 1 : wireHeaderSize + body.size();
+        size_t prefix = wireHeaderSize + wireCompressionHeaderSize;
+        int bound = LZ4_compressBound(static_cast<int>(body.size()));
+        std::string frame(prefix + static_cast<size_t>(bound), '\0');
+        int compressed = LZ4_compress_default(body.data(), &frame[prefix], static_cast<int>(body.size()), bound);
+
+        WireCompressionStats& stats = wireCompressionStats();
+        stats.messages++;
+        stats.rawBytes += plainSize;
+        if (compressed > 0 && prefix + static_cast<size_t>(compressed) < plainSize) {
+            frame.resize(prefix + static_cast<size_t>(compressed));
+            putWireLength(&frame[0], frame.size() - 4);
+            frame[4] = static_cast<char>(static_cast<uint8_t>(format) | wireCompressedFlag);
+            frame[wireHeaderSize] = static_cast<char>(codec);
+            putWireLength(&frame[wireHeaderSize + 1], body.size());
+        } else {
+            stats.incompressible++;
+            if (format == WireFormat::Json) {
+                frame = body + "\n";
+            } else {
+                frame.assign(wireHeaderSize, '\0');
+                putWireLength(&frame[0], body.size() + 1);
+                frame[4] = static_cast<char>(format);
+                frame += body;
+            }
+        }
+        stats.wireBytes += frame.size();
+        stats.nanoseconds += static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+        return frame;
+    }
+#endif
+    return encodeWire(message, format);
+}
+
+// The uncompressed body of a compressed frame's body (what follows the tag)
+inline std::string decompressWireBody(const char* data, size_t size) {
+    if (size < wireCompressionHeaderSize) {
+        throw std::runtime_error("truncated compressed wire frame");
+    }
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(data);
+    size_t rawSize = (size_t(header[1]) << 24) | (size_t(header[2]) << 16) | (size_t(header[3]) << 8) | size_t(header[4]);
+    if (rawSize > maxWireFrame) {
+        throw std::length_error("compressed wire frame too large");
+    }
+#ifndef __EMSCRIPTEN__
+    if (static_cast<WireCompression>(header[0]) == WireCompression::Lz4) {
+        std::string raw(rawSize, '\0');
+        int written = LZ4_decompress_safe(data + wireCompressionHeaderSize, &raw[0],
+                                          static_cast<int>(size - wireCompressionHeaderSize), static_cast<int>(rawSize));
+        if (written < 0 || static_cast<size_t>(written) != rawSize) {
+            throw std::runtime_error("corrupt LZ4 wire frame");
+        }
+        return raw;
+    }
+#endif
+    throw std::runtime_error("unsupported wire compression " + std::to_string(static_cast<int>(header[0])));
+}
+
+// Decodes a frame body given its (uncompressed) tag
+template <typename It>
+json decodeWireBody(uint8_t tag, It first, It last) {
+    switch (static_cast<WireFormat>(tag)) {
+        case WireFormat::Cbor: return json::from_cbor(first, last);
+        case WireFormat::MsgPack: return json::from_msgpack(first, last);
+        case WireFormat::Json: return json::parse(first, last);
+    }
+    throw std::runtime_error("unknown wire frame tag " + std::to_string(static_cast<int>(tag)));
+}
+
+// Decodes a whole frame as measured by wireFrameSize()
+inline json decodeWireFrame(const char* data, size_t frameSize) {
+    const uint8_t* body = reinterpret_cast<const uint8_t*>(data) + wireHeaderSize;
+    size_t bodySize = frameSize - wireHeaderSize;
+    uint8_t tag = static_cast<uint8_t>(data[4]);
+    if (tag & wireCompressedFlag) {
+        std::string raw = decompressWireBody(data + wireHeaderSize, bodySize);
+        return decodeWireBody(tag & ~wireCompressedFlag, raw.begin(), raw.end());
+    }
+    return decodeWireBody(tag, body, body + bodySize);
+}
+
+/**
+ * Splits an inbound byte stream into messages, text lines and frames alike.
+ *
+ * next() takes a message off the buffer before decoding it, so a message
+ * that fails to decode (json::exception) can be skipped and reading goes on.
+ * Any other exception means the framing is lost and the connection should be
+ * dropped. nextRaw() only splits, for callers that look at a message's size
+ * before paying for the decode.
+ */
+class WireReader {
+public:
+    // Points into the reader's buffer; valid until the next append()
+    struct RawMessage {
+        const char* data = nullptr;
+        size_t size = 0;
+        bool frame = false;
+    };
+
+    static json decode(const char* data, size_t size) {
+        if (size > 0 && isWireFrameStart(data[0])) {
+            return decodeWireFrame(data, size);
+        }
+        return json::parse(data, data + size);
+    }
+
+    void append(const char* data, size_t size) {
+        // Drop what has been consumed before growing
+        if (pos_ > 0 && pos_ >= buffer_.size() / 2) {
+            buffer_.erase(0, pos_);
+            scanned_ = scanned_ > pos_ ? scanned_ - pos_ : 0;
+            pos_ = 0;
+        }
+        buffer_.append(data, size);
+    }
+
+    // False when no whole message is buffered
+    bool next(json& out) {
+        RawMessage raw;
+        if (!nextRaw(raw)) {
+            return false;
+        }
+        out = decode(raw.data, raw.size);
+        return true;
+    }
+
+    bool nextRaw(RawMessage& out) {
+        while (pos_ < buffer_.size() && (buffer_[pos_] == '\n' || buffer_[pos_] == '\r' || buffer_[pos_] == ' ')) {
+            pos_++;
+        }
+        scanned_ = std::max(scanned_, pos_);
+        if (pos_ >= buffer_.size()) {
+            return false;
+        }
+
+        if (isWireFrameStart(buffer_[pos_])) {
+            size_t frameSize = wireFrameSize(buffer_.data() + pos_, buffer_.size() - pos_);
+            if (frameSize == 0) {
+                return false;
+            }
+            out = {buffer_.data() + pos_, frameSize, true};
+            pos_ += frameSize;
+            scanned_ = pos_;
+            return true;
+        }
+
+        // Text: one JSON document per line. Resume the newline search where the
+        // last call left off so a long line arriving in pieces is scanned once.
+        size_t end = buffer_.find('\n', scanned_);
+        if (end == std::string::npos) {
+            scanned_ = buffer_.size();
+            if (scanned_ - pos_ > maxWireFrame) {
+                throw std::length_error("text message too long");
+            }
+            return false;
+        }
+        out = {buffer_.data() + pos_, end - pos_, false};
+        pos_ = end + 1;
+        scanned_ = pos_;
+        return true;
+    }
+
+    size_t buffered() const { return buffer_.size() - pos_; }
+
+private:
+    std::string buffer_;
+    size_t pos_ = 0;
+    size_t scanned_ = 0;
+};
+
+/**
+ * An outbound message that is encoded at most once per wire format, however
+ * many connections it goes to. Safe to share between threads.
+ */
+class WireMessage {
+public:
+    using Bytes = std::shared_ptr<const std::string>;
+
+    explicit WireMessage(json body) : body_(std::move(body)) {}
+
+    const json& body() const { return body_; }
+
+    const Bytes& encoded(WireFormat format) const {
+        Slot& slot = slots_[slotIndex(format)];
+        std::call_once(slot.once, [&]() { slot.bytes = std::make_shared<const std::string>(encodeWire(body_, format)); });
+        return slot.bytes;
+    }
+
+    // As encodeCompressedWire(); LZ4 is the only codec, so one slot per format is enough
+    const Bytes& compressed(WireFormat format, WireCompression codec) const {
+        if (codec == WireCompression::None) {
+            return encoded(format);
+        }
+        Slot& slot = compressedSlots_[slotIndex(format)];
+        std::call_once(slot.once, [&]() { slot.bytes = std::make_shared<const std::string>(encodeCompressedWire(body_, format, codec)); });
+        return slot.bytes;
+    }
+
+private:
+    struct Slot {
+        std::once_flag once;
+        Bytes bytes;
+    };
+
+    static size_t slotIndex(WireFormat format) {
+        switch (format) {
+            case WireFormat::Cbor: return 1;
+            case WireFormat::MsgPack: return 2;
+            default: return 0;
+        }
+    }
+
+    json body_;
+    mutable std::array<Slot, 3> slots_;
+    mutable std::array<Slot, 3> compressedSlots_;
+};
+
+inline std::shared_ptr<const WireMessage> makeWireMessage(json body) {
+    return std::make_shared<const WireMessage>(std::move(body));
+}
+
+#endif // WIRE_HPP
@@ -0,0 +1,573 @@
+#ifndef WORLD_HPP
+#define WORLD_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+/**
+ * Stable reference to an entity stored in one of the room tables.
+ *
+ * The slot stays the same while the entity moves around inside the dense
+ * arrays; the generation is bumped whenever the slot is freed so a handle to
+ * a removed entity never resolves to whatever reused the slot.
+ */
+struct EntityHandle {
+    static constexpr uint32_t INVALID_SLOT = std::numeric_limits<uint32_t>::max();
+
+    uint32_t slot = INVALID_SLOT;
+    uint32_t generation = 0;
+
+    bool valid() const { return slot != INVALID_SLOT; }
+    bool operator==(const EntityHandle& other) const {
+        return slot == other.slot && generation == other.generation;
+    }
+    bool operator!=(const EntityHandle& other) const { return !(*this == other); }
+};
+
+/**
+ * Maps handles to dense indices for a table that removes by swapping the last
+ * row into the hole (so iteration stays a tight loop over contiguous arrays).
+ */
+class HandleMap {
+public:
+    EntityHandle add(uint32_t denseIndex) {
+        uint32_t slot;
+        if (!freeSlots_.empty()) {
+            slot = freeSlots_.back();
+            freeSlots_.pop_back();
+        } else {
+            slot = static_cast<uint32_t>(slotToDense_.size());
+            slotToDense_.push_back(0);
+            generations_.push_back(0);
+        }
+        slotToDense_[slot] = denseIndex;
+        if (denseToSlot_.size() <= denseIndex) {
+            denseToSlot_.resize(denseIndex + 1);
+        }
+        denseToSlot_[denseIndex] = slot;
+        return {slot, generations_[slot]};
+    }
+
+    // Returns -1 for stale or invalid handles.
+    int indexOf(EntityHandle handle) const {
+        if (!handle.valid() || handle.slot >= slotToDense_.size() ||
+            generations_[handle.slot] != handle.generation) {
+            return -1;
+        }
+        return static_cast<int>(slotToDense_[handle.slot]);
+    }
+
+    EntityHandle handleAt(size_t denseIndex) const {
+        uint32_t slot = denseToSlot_[denseIndex];
+        return {slot, generations_[slot]};
+    }
+
+    // Frees the slot of dense row `index` and records that row `last` now lives at `index`.
+    void removeAt(size_t index, size_t last) {
+        uint32_t slot = denseToSlot_[index];
+        generations_[slot]++;
+        freeSlots_.push_back(slot);
+        if (index != last) {
+            uint32_t movedSlot = denseToSlot_[last];
+            denseToSlot_[index] = movedSlot;
+            slotToDense_[movedSlot] = static_cast<uint32_t>(index);
+        }
+        denseToSlot_.pop_back();
+    }
+
+    // Room for `count` entities without allocating again
+    void reserve(size_t count) {
+        slotToDense_.reserve(count);
+        generations_.reserve(count);
+        denseToSlot_.reserve(count);
+        freeSlots_.reserve(count);
+    }
+
+    void clear() {
+        for (uint32_t slot : denseToSlot_) {
+            generations_[slot]++;
+            freeSlots_.push_back(slot);
+        }
+        denseToSlot_.clear();
+    }
+
+private:
+    std::vector<uint32_t> slotToDense_;
+    std::vector<uint32_t> generations_;
+    std::vector<uint32_t> denseToSlot_;
+    std::vector<uint32_t> freeSlots_;
+};
+
+template <typename T>
+inline void swapPop(std::vector<T>& column, size_t index) {
+    if (index + 1 != column.size()) {
+        column[index] = std::move(column.back());
+    }
+    column.pop_back();
+}
+
+/**
+ * One player as a value, used when creating a player or moving it between
+ * rooms. Inside a room the fields live in PlayerTable columns instead.
+ */
+struct PlayerRecord {
+    int socket = 0;
+    std::string name;
+    int x = 0;
+    int y = 0;
+    int speed = 5;
+    int score = 0;
+    int width = 64;
+    int height = 64;
+    int shields = 0;
+    int bananas = 0;
+    int spriteState = 1;
+    int skin = 1;
+    int room = 1;
+
+    json toJson(bool local = false) const {
+        return {
+            {"name", name},
+            {"x", x},
+            {"y", y},
+            {"speed", speed},
+            {"score", score},
+            {"width", width},
+            {"height", height},
+            {"inventory", {{"shields", shields}, {"bananas", bananas}}},
+            {"socket", socket},
+            {"spriteState", spriteState},
+            {"skin", skin},
+            {"local", local},
+            {"room", room}};
+    }
+};
+
+struct EnemyRecord {
+    int id = 0;
+    float x = 0.0f;
+    float y = 0.0f;
+    int width = 64;
+    int height = 64;
+    int speed = 50;
+    int room = 1;
+
+    json toJson() const {
+        return {
+            {"x", static_cast<int>(x)},
+            {"y", static_cast<int>(y)},
+            {"width", width},
+            {"height", height},
+            {"room", room},
+            {"speed", speed},
+            {"id", id}};
+    }
+};
+
+struct ObjectRecord {
+    int objID = 0;
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+    // objID is a type (several objects can share it); uid names one object. 0 = assign on add.
+    int uid = 0;
+
+    json toJson() const {
+        return {{"x", x}, {"y", y}, {"width", width}, {"height", height}, {"objID", objID}, {"uid", uid}};
+    }
+};
+
+/**
+ * Struct-of-arrays player storage for one room.
+ */
+struct PlayerTable {
+    HandleMap handles;
+    std::vector<int> socket;
+    std::vector<std::string> name;
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> speed;
+    std::vector<int> score;
+    std::vector<int> width;
+    std::vector<int> height;
+    std::vector<int> shields;
+    std::vector<int> bananas;
+    std::vector<int> spriteState;
+    std::vector<int> skin;
+
+    size_t size() const { return socket.size(); }
+    bool empty() const { return socket.empty(); }
+
+    EntityHandle add(const PlayerRecord& p) {
+        EntityHandle handle = handles.add(static_cast<uint32_t>(size()));
+        socket.push_back(p.socket);
+        name.push_back(p.name);
+        x.push_back(p.x);
+        y.push_back(p.y);
+        speed.push_back(p.speed);
+        score.push_back(p.score);
+        width.push_back(p.width);
+        height.push_back(p.height);
+        shields.push_back(p.shields);
+        bananas.push_back(p.bananas);
+        spriteState.push_back(p.spriteState);
+        skin.push_back(p.skin);
+        return handle;
+    }
+
+    void removeAt(size_t i) {
+        handles.removeAt(i, size() - 1);
+        swapPop(socket, i);
+        swapPop(name, i);
+        swapPop(x, i);
+        swapPop(y, i);
+        swapPop(speed, i);
+        swapPop(score, i);
+        swapPop(width, i);
+        swapPop(height, i);
+        swapPop(shields, i);
+        swapPop(bananas, i);
+        swapPop(spriteState, i);
+        swapPop(skin, i);
+    }
+
+    // Returns -1 if no player in this room owns the socket.
+    int indexOfSocket(int socketId) const {
+        for (size_t i = 0; i < socket.size(); ++i) {
+            if (socket[i] == socketId) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    PlayerRecord record(size_t i, int room) const {
+        PlayerRecord p;
+        p.socket = socket[i];
+        p.name = name[i];
+        p.x = x[i];
+        p.y = y[i];
+        p.speed = speed[i];
+        p.score = score[i];
+        p.width = width[i];
+        p.height = height[i];
+        p.shields = shields[i];
+        p.bananas = bananas[i];
+        p.spriteState = spriteState[i];
+        p.skin = skin[i];
+        p.room = room;
+        return p;
+    }
+
+    void clear() {
+        handles.clear();
+        socket.clear();
+        name.clear();
+        x.clear();
+        y.clear();
+        speed.clear();
+        score.clear();
+        width.clear();
+        height.clear();
+        shields.clear();
+        bananas.clear();
+        spriteState.clear();
+        skin.clear();
+    }
+};
+
+/**
+ * Struct-of-arrays enemy storage for one room. Positions are kept as floats so
+ * slow enemies still make progress between ticks; they are truncated to ints
+ * when serialized, same as before.
+ *
+ * An enemy added with id 0 gets its id from its handle: the slot (plus one,
+ * so no id is 0) in the low 16 bits and the slot's generation above them. Slots are recycled when
+ * enemies go, so ids stay small, and a recycled slot never repeats the id of
+ * the enemy that had it last. reserve() sets the pool up front so spawning
+ * and despawning don't allocate.
+ */
+struct EnemyTable {
+    // Most enemies one table can hand out ids to
+    static constexpr size_t maxPooled = 0xffff;
+
+    static int idFor(EntityHandle handle) {
+        return static_cast<int>(((handle.generation & 0x7fffu) << 16) | (handle.slot + 1));
+    }
+
+    HandleMap handles;
+    std::vector<int> id;
+    std::vector<float> x;
+    std::vector<float> y;
+    std::vector<int> width;
+    std::vector<int> height;
+    std::vector<int> speed;
+
+    size_t size() const { return id.size(); }
+    bool empty() const { return id.empty(); }
+
+    EntityHandle add(const EnemyRecord& e) {
+        EntityHandle handle = handles.add(static_cast<uint32_t>(size()));
+        id.push_back(e.id != 0 ? e.id : idFor(handle));
+        x.push_back(e.x);
+        y.push_back(e.y);
+        width.push_back(e.width);
+        height.push_back(e.height);
+        speed.push_back(e.speed);
+        return handle;
+    }
+
+    void reserve(size_t count) {
+        handles.reserve(count);
+        id.reserve(count);
+        x.reserve(count);
+        y.reserve(count);
+        width.reserve(count);
+        height.reserve(count);
+        speed.reserve(count);
+    }
+
+    void removeAt(size_t i) {
+        handles.removeAt(i, size() - 1);
+        swapPop(id, i);
+        swapPop(x, i);
+        swapPop(y, i);
+        swapPop(width, i);
+        swapPop(height, i);
+        swapPop(speed, i);
+    }
+
+    EnemyRecord record(size_t i, int room) const {
+        EnemyRecord e;
+        e.id = id[i];
+        e.x = x[i];
+        e.y = y[i];
+        e.width = width[i];
+        e.height = height[i];
+        e.speed = speed[i];
+        e.room = room;
+        return e;
+    }
+
+    void clear() {
+        handles.clear();
+        id.clear();
+        x.clear();
+        y.clear();
+        width.clear();
+        height.clear();
+        speed.clear();
+    }
+};
+
+struct ObjectTable {
+    HandleMap handles;
+    std::vector<int> uid;
+    std::vector<int> objID;
+    std::vector<int> x;
+    std::vector<int> y;
+    std::vector<int> width;
+    std::vector<int> height;
+
+    size_t size() const { return objID.size(); }
+    bool empty() const { return objID.empty(); }
+
+    EntityHandle add(const ObjectRecord& o) {
+        EntityHandle handle = handles.add(static_cast<uint32_t>(size()));
+        lastUid_ = o.uid != 0 ? std::max(lastUid_, o.uid) : lastUid_ + 1;
+        uid.push_back(o.uid != 0 ? o.uid : lastUid_);
+        objID.push_back(o.objID);
+        x.push_back(o.x);
+        y.push_back(o.y);
+        width.push_back(o.width);
+        height.push_back(o.height);
+        return handle;
+    }
+
+    void removeAt(size_t i) {
+        handles.removeAt(i, size() - 1);
+        swapPop(uid, i);
+        swapPop(objID, i);
+        swapPop(x, i);
+        swapPop(y, i);
+        swapPop(width, i);
+        swapPop(height, i);
+    }
+
+    int indexOfType(int type) const {
+        for (size_t i = 0; i < objID.size(); ++i) {
+            if (objID[i] == type) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    ObjectRecord record(size_t i) const {
+        return {objID[i], x[i], y[i], width[i], height[i], uid[i]};
+    }
+
+    void clear() {
+        handles.clear();
+        uid.clear();
+        objID.clear();
+        x.clear();
+        y.clear();
+        width.clear();
+        height.clear();
+    }
+
+private:
+    // uids only name objects within their room, so each room counts its own;
+    // a replayed room hands out the same ones. Not reset by clear().
+    int lastUid_ = 0;
+};
+
+struct Room {
+    int roomID = 0;
+    PlayerTable players;
+    EnemyTable enemies;
+    ObjectTable objects;
+
+    json playerJson(size_t i, bool local = false) const {
+        return players.record(i, roomID).toJson(local);
+    }
+
+    json playersJson() const {
+        json out = json::array();
+        for (size_t i = 0; i < players.size(); ++i) {
+            out.push_back(playerJson(i));
+        }
+        return out;
+    }
+
+    json enemiesJson() const {
+        json out = json::array();
+        for (size_t i = 0; i < enemies.size(); ++i) {
+            out.push_back(enemies.record(i, roomID).toJson());
+        }
+        return out;
+    }
+
+    json objectsJson() const {
+        json out = json::array();
+        for (size_t i = 0; i < objects.size(); ++i) {
+            out.push_back(objects.record(i).toJson());
+        }
+        return out;
+    }
+
+    json toJson() const {
+        return {
+            {"roomID", roomID},
+            {"players", playersJson()},
+            {"objects", objectsJson()},
+            {"enemies", enemiesJson()}};
+    }
+};
+
+inline std::string roomName(int roomID) {
+    return "room" + std::to_string(roomID);
+}
+
+/**
+ * Same edge-inclusive AABB test as the client's JSON checkCollision.
+ */
+inline bool rectsOverlap(int x1, int y1, int w1, int h1, int x2, int y2, int w2, int h2) {
+    return !(x1 > x2 + w2 || x1 + w1 < x2 || y1 > y2 + h2 || y1 + h1 < y2);
+}
+
+/**
+ * Socket id -> (room, name) and name -> socket id: which room's actor a player
+ * belongs to, and which names are taken. The player's row is found through
+ * its room, which keeps its own handles.
+ */
+class PlayerIndex {
+public:
+    struct Entry {
+        int roomID = 0;
+        std::string name;
+    };
+
+    // False, changing nothing, if the socket is already indexed or the name is taken
+    bool insert(int socketId, const std::string& name, int roomID) {
+        if (bySocket_.count(socketId) || byName_.count(name)) {
+            return false;
+        }
+        bySocket_[socketId] = {roomID, name};
+        byName_[name] = socketId;
+        return true;
+    }
+
+    void move(int socketId, int roomID) {
+        auto it = bySocket_.find(socketId);
+        if (it != bySocket_.end()) {
+            it->second.roomID = roomID;
+        }
+    }
+
+    void erase(int socketId, const std::string& name) {
+        bySocket_.erase(socketId);
+        auto it = byName_.find(name);
+        if (it != byName_.end() && it->second == socketId) {
+            byName_.erase(it);
+        }
+    }
+
+    void erase(int socketId) {
+        auto it = bySocket_.find(socketId);
+        if (it != bySocket_.end()) {
+            erase(socketId, std::string(it->second.name));
+        }
+    }
+
+    const Entry* find(int socketId) const {
+        auto it = bySocket_.find(socketId);
+        return it == bySocket_.end() ? nullptr : &it->second;
+    }
+
+    // Returns -1 when nobody has the name.
+    int socketForName(const std::string& name) const {
+        auto it = byName_.find(name);
+        return it == byName_.end() ? -1 : it->second;
+    }
+
+    // First free name out of `requested`, `requested1` .. `requested99`.
+    std::string uniqueName(const std::string& requested) const {
+        if (socketForName(requested) < 0) {
+            return requested;
+        }
+        for (int i = 1; i < 100; i++) {
+            std::string candidate = requested + std::to_string(i);
+            if (socketForName(candidate) < 0) {
+                return candidate;
+            }
+        }
+        return requested;
+    }
+
+    size_t size() const { return bySocket_.size(); }
+
+    const std::unordered_map<int, Entry>& entries() const { return bySocket_; }
+    const std::unordered_map<std::string, int>& names() const { return byName_; }
+
+    void clear() {
+        bySocket_.clear();
+        byName_.clear();
+    }
+
+private:
+    std::unordered_map<int, Entry> bySocket_;
+    std::unordered_map<std::string, int> byName_;
+};
+
+#endif // WORLD_HPP
@@ -5,6 +5,7 @@
 #include <thread>
 #include <random>
 #include <vector>
+#include <array>
 #include <set>
 #include <mutex>
 #include <cstdlib>
@@ -13,14 +14,29 @@
 #include <chrono>
 #include <filesystem>
 #include <map>
+#include <unordered_map>
 #include <algorithm>
 #include <string>
 
 #include "libs/enemy.hpp"
+#include "libs/world.hpp"
+#include "libs/tick_scheduler.hpp"
+#include "libs/snapshot.hpp"
+#include "libs/wire.hpp"
+#include "libs/session.hpp"
+#include "libs/websocket_session.hpp"
+#include "libs/interest.hpp"
+#include "libs/actor.hpp"
+#include "libs/udp_transport.hpp"
+#include "libs/rate_limit.hpp"
+#include "libs/movement.hpp"
+#include "libs/clock_sync.hpp"
+#include "libs/lag_compensation.hpp"
+#include "libs/spatial_hash.hpp"
+#include "libs/spawner.hpp"
+#include "libs/replay.hpp"
 #include "coolfunctions.hpp"
-#include <websocketpp/server.hpp>
 #include <boost/asio/signal_set.hpp>
-#include <websocketpp/config/asio_no_tls.hpp>
 
 #ifdef _WIN32
 #include <winsock2.h>
@@ -32,33 +48,484 @@ using SocketHandle = int;
 using json = nlohmann::json;
 using boost::asio::ip::tcp;
 
-typedef websocketpp::server<websocketpp::config::asio> WebSocketServer;
+typedef WebSocketSession::Server WebSocketServer;
 
 std::atomic<bool> shouldClose{false};
 std::mutex socket_mutex;
-std::mutex game_mutex;
 boost::asio::io_context io_context;
 
-std::vector<std::shared_ptr<tcp::socket>> connected_sockets;
+// Connected clients by session id, over TCP and WebSocket alike (guarded by socket_mutex)
+std::map<int, std::shared_ptr<Session>> sessions;
+// Session ids are handed out in order and never reused, so a late message can't reach a newer client
+std::atomic<int> nextSessionId{1};
+// WebSocket clients that haven't logged in watch every room (guarded by socket_mutex)
+std::set<int> spectators;
+// Outbound queue limit per client, and what happens to a client that stays past it
+const size_t outboundHighWater = static_cast<size_t>(getEnvVar<int>("OUTBOUND_HIGH_WATER", 256 * 1024));
+const BackpressurePolicy outboundPolicy = parseBackpressurePolicy(getEnvVar<std::string>("OUTBOUND_POLICY", "coalesce"));
+// What each client may send, checked before its messages are parsed (0 = no limit).
+// Over the message rate movement checklists coalesce to the newest; anything else waits in turn.
+const InboundLimits inboundLimits{
+    getEnvVar<double>("INBOUND_MESSAGES_PER_SEC", 30), getEnvVar<double>("INBOUND_MESSAGE_BURST", 60),
+    getEnvVar<double>("INBOUND_BYTES_PER_SEC", 64 * 1024), getEnvVar<double>("INBOUND_BYTE_BURST", 256 * 1024)};
+// Compression a client may ask for (WIRE_COMPRESSION=none turns it off), and the
+// smallest message worth compressing; positions and ticks stay well under it.
+// WebSocket clients get permessage-deflate instead, with the same threshold.
+const WireCompression allowedCompression = parseWireCompression(getEnvVar<std::string>("WIRE_COMPRESSION", "lz4"));
+const size_t compressMinBytes = static_cast<size_t>(getEnvVar<int>("COMPRESS_MIN_BYTES", 512));
+// Room-local events only go to the sessions subscribed to that room (guarded by socket_mutex)
+RoomSubscriptions roomSubscriptions;
+// The shared timeline (see libs/clock_sync.hpp): seconds since the server started
+const std::chrono::steady_clock::time_point serverEpoch = std::chrono::steady_clock::now();
+
+double serverSeconds()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - serverEpoch).count();
+}
 
-json game = {
-    {"room1", {{"roomID", 1}, {"players", json::array()}, {"objects", json::array({{{"x", 123}, {"y", 144}, {"width", 228}, {"height", 60}, {"objID", 1}}, {{"x", 350}, {"y", 159}, {"width", 177}, {"height", 74}, {"objID", 2}}, {{"x", 524}, {"y", 162}, {"width", 205}, {"height", 60}, {"objID", 3}}})}, {"enemies", json::array()}}},
-    {"room2", {{"roomID", 2}, {"players", json::array()}, {"objects", json::array({{{"x", 410}, {"y", 0}, {"width", 93}, {"height", 260}, {"objID", 4}}})}, {"enemies", json::array()}}}};
+// Enemy hits are checked against enemies as each player saw them: rewound by
+// half their round trip plus the delay clients render at, up to MAX_REWIND_MS
+const LagCompensationSettings lagCompensation{
+    getEnvVar<double>("INTERPOLATION_DELAY_MS", 100) / 1000.0,
+    getEnvVar<double>("MAX_REWIND_MS", 300) / 1000.0};
+const int tickRate = getEnvVar<int>("TICK_RATE", 20);
+// Cell size of each room's spatial grids (see libs/spatial_hash.hpp), in pixels
+const int spatialCellSize = getEnvVar<int>("SPATIAL_CELL_SIZE", SpatialHash::defaultCellSize);
+// The rooms initWorld creates
+const std::vector<int> worldRoomIDs = {1, 2};
+
+// Where every room's randomness starts from (see libs/replay.hpp): SIM_SEED,
+// or a random one. Printed at startup, so a run can be repeated.
+uint64_t chooseSimulationSeed()
+{
+    std::string seed = getEnvVar<std::string>("SIM_SEED", "");
+    if (!seed.empty())
+    {
+        return std::strtoull(seed.c_str(), nullptr, 0);
+    }
+    std::random_device rd;
+    return (static_cast<uint64_t>(rd()) << 32) | rd();
+}
+const uint64_t simulationSeed = chooseSimulationSeed();
+// With RECORD_SIMULATION=<file>, everything that happens to a room goes to the
+// file, for REPLAY_SIMULATION=<file> to step through again offline
+SimulationRecorder simulationRecorder;
+
+// Every session is pinged this often, and disconnected after this long without a word from it
+const HeartbeatSettings heartbeatSettings{
+    std::chrono::milliseconds(getEnvVar<int>("HEARTBEAT_INTERVAL_MS", 2000)),
+    std::chrono::milliseconds(getEnvVar<int>("IDLE_TIMEOUT_MS", 15000))};
+
+// Optional UDP side channel, on when UDP_PORT is set. Each logged-in session
+// gets a token over TCP; once its client is heard from over UDP, positions
+// take the sequenced channel and room events and game states the reliable
+// one, however big. Each kind stays on that one path until the session ends
+// or its UDP peer is dropped, so none of them overtakes another. Anything
+// else, or a session without UDP, stays on TCP.
+std::unique_ptr<UdpEndpoint> udpEndpoint;
+
+enum class Delivery
+{
+    Stream,    // TCP only
+    Sequenced, // UDP if possible, one datagram each; a newer one replaces it, so only for messages whole on their own
+    Reliable   // UDP if possible, resent until acked and delivered in order
+};
 
-int enemyNewId = 1;
+// Which room each player is in and which names are taken (guarded by directory_mutex).
+// Everything else about a player lives in its room's actor.
+std::mutex directory_mutex;
+PlayerIndex directory;
+// Players between leaving one room actor and arriving in the next (guarded by directory_mutex)
+std::set<int> playersInTransit;
 
-int castWinsock(tcp::socket &socket)
+struct GameBaseline
 {
-    auto nativeHandle = socket.native_handle();
-    int intHandle;
-#ifdef _WIN32
-    intHandle = static_cast<int>(reinterpret_cast<intptr_t>(nativeHandle));
-#else
-    intHandle = nativeHandle;
-#endif
-    return intHandle;
+    uint32_t acked = 0; // 0: nothing usable
+    uint32_t floor = 0; // acks below this describe a room the client has since left
+};
+
+// Snapshot versions come from one counter so a version names a single room state
+std::atomic<uint32_t> gameVersionCounter{0};
+const size_t snapshotHistorySize = static_cast<size_t>(getEnvVar<int>("SNAPSHOT_HISTORY", 32));
+
+// How far the server has got with a player's input commands (see libs/movement.hpp).
+// Travels with the player between rooms so no command is applied twice.
+struct PlayerInput
+{
+    uint32_t lastSequence = 0;
+    // Once a client sends commands, positions it sends are ignored
+    bool commanded = false;
+    int facing = 3;
+    // Commands are applied no faster than the client can produce them
+    TokenBucket budget{inputStepsPerSecond, inputStepsPerSecond};
+    // Smoothed round trip from the session's heartbeat, updated on every pong
+    double rttMs = 0;
+};
+
+// Enemy spawning for a room (see libs/spawner.hpp). ENEMY_CAP_ROOM<n> is how
+// many it has at once, ENEMY_SPAWN_INTERVAL_ROOM<n> the seconds between
+// spawns and ENEMY_WAVES_ROOM<n> waves to spawn instead. Only room 2 has
+// enemies unless told otherwise. ENEMY_STRESS=<count> fills room 2 with that
+// many enemies straight away, whether anyone is there or not.
+SpawnSettings spawnSettingsFor(int roomID)
+{
+    std::string suffix = "_ROOM" + std::to_string(roomID);
+    SpawnSettings settings;
+    settings.cap = static_cast<size_t>(std::max(0, getEnvVar<int>("ENEMY_CAP" + suffix, roomID == 2 ? 3 : 0)));
+    settings.interval = getEnvVar<float>("ENEMY_SPAWN_INTERVAL" + suffix, 1.0f);
+    settings.waves = parseSpawnWaves(getEnvVar<std::string>("ENEMY_WAVES" + suffix, ""));
+    int stress = getEnvVar<int>("ENEMY_STRESS", 0);
+    if (stress > 0 && roomID == 2)
+    {
+        settings.cap = static_cast<size_t>(stress);
+        settings.interval = 0;
+        settings.waves.clear();
+        settings.stress = true;
+    }
+    settings.cap = std::min(settings.cap, EnemyTable::maxPooled);
+    return settings;
+}
+
+// Everything one room owns; only touched by messages running on the room's actor
+struct RoomState
+{
+    Room room;
+    // Socket -> row, so per-player messages don't scan the table
+    std::unordered_map<int, EntityHandle> handles;
+    // Events from player messages since the last tick; they go out inside the
+    // next tick message instead of as broadcasts of their own
+    json pendingEvents = json::array();
+    EnemySpawner spawner;
+    float shieldSpawnTimer = 0.0f;
+    // Where players, enemies and shields spawn; the room's own stream from the simulation seed
+    SimRandom rng;
+    // Published states of this room; players get deltas from the version they
+    // acked while it is still in the history, the whole room otherwise
+    SnapshotHistory history{snapshotHistorySize};
+    uint32_t version = 0;
+    std::map<int, GameBaseline> baselines;
+    std::map<int, PlayerInput> inputs;
+    // Where everything was over the last few ticks, for lag-compensated hits
+    PositionHistory positions{PositionHistory::framesFor(lagCompensation.maxRewind, tickRate)};
+    // Server time until which a player can't be hit again (after a hit, or while respawning)
+    std::map<int, double> hitImmunity;
+    // Scratch space for the enemy step (see libs/enemy.hpp)
+    TargetSet targets;
+    std::vector<EnemyMoved> enemyMoves;
+    std::vector<EnemyHit> enemyHits;
+    // Objects by uid and enemies by id, kept in step with the tables by the
+    // methods below and by stepEnemies; for spawn checks and hits
+    SpatialHash objectGrid{spatialCellSize};
+    SpatialHash enemyGrid{spatialCellSize};
+    std::vector<int> nearby;
+    // Enemy pathfinding around the room's walls (see libs/pathfinding.hpp);
+    // the grid is rebuilt before the next enemy step once walls change
+    RoomNavigation navigation;
+    bool wallsChanged = true;
+
+    explicit RoomState(int roomID, uint64_t seed = simulationSeed)
+        : spawner(spawnSettingsFor(roomID)), rng(roomSeed(seed, roomID))
+    {
+        room.roomID = roomID;
+        // The whole pool up front, so spawning never allocates
+        room.enemies.reserve(spawner.settings().cap);
+        enemyGrid.reserve(spawner.settings().cap);
+    }
+
+    // -1 when the player is not (or no longer) in this room
+    int playerIndex(int socketId) const
+    {
+        auto it = handles.find(socketId);
+        return it != handles.end() ? room.players.handles.indexOf(it->second) : -1;
+    }
+
+    // False, adding nothing, if the socket already has a player here
+    bool addPlayer(const PlayerRecord &player)
+    {
+        if (handles.count(player.socket))
+        {
+            return false;
+        }
+        handles[player.socket] = room.players.add(player);
+        return true;
+    }
+
+    bool removePlayer(int socketId, PlayerRecord *removed = nullptr)
+    {
+        int index = playerIndex(socketId);
+        if (index < 0)
+        {
+            return false;
+        }
+        if (removed)
+        {
+            *removed = room.players.record(index, room.roomID);
+        }
+        room.players.removeAt(index);
+        handles.erase(socketId);
+        baselines.erase(socketId);
+        inputs.erase(socketId);
+        hitImmunity.erase(socketId);
+        return true;
+    }
+
+    void addObject(const ObjectRecord &object)
+    {
+        room.objects.add(object);
+        const ObjectTable &objects = room.objects;
+        objectGrid.update(objects.uid.back(), {objects.x.back(), objects.y.back(), objects.width.back(), objects.height.back()});
+        wallsChanged = wallsChanged || isSolidObject(object.objID);
+    }
+
+    void removeObjectAt(size_t index)
+    {
+        wallsChanged = wallsChanged || isSolidObject(room.objects.objID[index]);
+        objectGrid.remove(room.objects.uid[index]);
+        room.objects.removeAt(index);
+    }
+
+    std::vector<MoveBox> solids() const
+    {
+        std::vector<MoveBox> out;
+        const ObjectTable &objects = room.objects;
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            if (isSolidObject(objects.objID[i]))
+            {
+                out.push_back({objects.x[i], objects.y[i], objects.width[i], objects.height[i]});
+            }
+        }
+        return out;
+    }
+
+    // Returns the id the enemy got from the pool
+    int addEnemy(const EnemyRecord &enemy)
+    {
+        room.enemies.add(enemy);
+        int id = room.enemies.id.back();
+        enemyGrid.update(id, {static_cast<int>(enemy.x), static_cast<int>(enemy.y), enemy.width, enemy.height});
+        return id;
+    }
+
+    void clearEnemies()
+    {
+        room.enemies.clear();
+        enemyGrid.clear();
+    }
+};
+
+// The room's tables plus everything else its next steps depend on: its
+// random stream, shield timer, player inputs and hit immunity
+uint64_t hashRoomState(const RoomState &state)
+{
+    StateHash h;
+    hashRoom(state.room, h);
+    h.add(state.rng.state());
+    h.add(state.shieldSpawnTimer);
+    for (const auto &[socketId, input] : state.inputs)
+    {
+        h.add(socketId);
+        h.add(static_cast<uint64_t>(input.lastSequence));
+        h.add(input.commanded);
+        h.add(input.facing);
+        h.add(input.rttMs);
+    }
+    for (const auto &[socketId, until] : state.hitImmunity)
+    {
+        h.add(socketId);
+        h.add(until);
+    }
+    return h.value();
+}
+
+// Writes down something that happened to the room, for replaying it
+void recordRoomEvent(const RoomState &state, json event)
+{
+    event["room"] = state.room.roomID;
+    simulationRecorder.record(event);
+}
+
+// What a room's steps depend on besides its events; a replay needs the same
+json simulationSettings()
+{
+    json rooms = json::object();
+    for (int roomID : worldRoomIDs)
+    {
+        SpawnSettings spawn = spawnSettingsFor(roomID);
+        json waves = json::array();
+        for (const SpawnWave &wave : spawn.waves)
+        {
+            waves.push_back({wave.count, wave.interval, wave.pauseAfter});
+        }
+        rooms[std::to_string(roomID)] = {{"enemyCap", spawn.cap}, {"spawnInterval", spawn.interval}, {"waves", waves}, {"stress", spawn.stress}};
+    }
+    return {{"tickRate", tickRate},
+            {"interpolationDelay", lagCompensation.interpolationDelay},
+            {"maxRewind", lagCompensation.maxRewind},
+            {"spatialCellSize", spatialCellSize},
+            {"rooms", rooms}};
+}
+
+typedef Actor<RoomState> RoomActor;
+// One actor per room; created by initWorld and never removed, so lookups need no lock
+std::map<int, std::unique_ptr<RoomActor>> roomActors;
+
+RoomActor *findRoomActor(int roomID)
+{
+    auto it = roomActors.find(roomID);
+    return it != roomActors.end() ? it->second.get() : nullptr;
+}
+
+// The objects a room starts with
+void furnishRoom(RoomState &state)
+{
+    if (simulationRecorder.recording())
+    {
+        recordRoomEvent(state, {{"event", "furnish"}});
+    }
+    if (state.room.roomID == 1)
+    {
+        state.addObject({1, 123, 144, 228, 60});
+        state.addObject({2, 350, 159, 177, 74});
+        state.addObject({3, 524, 162, 205, 60});
+    }
+    else if (state.room.roomID == 2)
+    {
+        state.addObject({4, 410, 0, 93, 260});
+    }
 }
 
+void initWorld()
+{
+    for (int roomID : worldRoomIDs)
+    {
+        roomActors[roomID] = std::make_unique<RoomActor>(io_context, roomID);
+        // Runs once the I/O threads start, ahead of anything a client can send
+        roomActors[roomID]->post([](RoomState &state)
+                                 { furnishRoom(state); });
+    }
+}
+
+// 0 when the player is not logged in
+int roomOfPlayer(int socketId)
+{
+    std::lock_guard<std::mutex> lock(directory_mutex);
+    const PlayerIndex::Entry *entry = directory.find(socketId);
+    return entry ? entry->roomID : 0;
+}
+
+// Hands a message to the actor of the room the player is in
+template <typename Fn>
+bool postToPlayerRoom(int socketId, Fn fn)
+{
+    RoomActor *actor = findRoomActor(roomOfPlayer(socketId));
+    if (!actor)
+    {
+        return false;
+    }
+    actor->post(std::move(fn));
+    return true;
+}
+
+// Movement read off the wire; applied on the player's room actor
+struct MovementInput
+{
+    int socket;
+    bool hasX;
+    int x;
+    bool hasY;
+    int y;
+    bool hasSpriteState;
+    int spriteState;
+};
+
+// Runs on the player's room actor; the position goes out with the next tick
+void applyMovement(RoomState &state, const MovementInput &input)
+{
+    int index = state.playerIndex(input.socket);
+    if (index < 0)
+    {
+        return;
+    }
+    if (simulationRecorder.recording())
+    {
+        recordRoomEvent(state, {{"event", "move"}, {"socket", input.socket}, {"hasX", input.hasX}, {"x", input.x}, {"hasY", input.hasY}, {"y", input.y}, {"hasSpriteState", input.hasSpriteState}, {"spriteState", input.spriteState}});
+    }
+    PlayerTable &players = state.room.players;
+    auto commands = state.inputs.find(input.socket);
+    if (commands != state.inputs.end() && commands->second.commanded)
+    {
+        // The server works positions out from this player's commands
+        return;
+    }
+    if (input.hasSpriteState)
+    {
+        players.spriteState[index] = input.spriteState;
+    }
+    if (input.hasX)
+    {
+        players.x[index] = input.x;
+    }
+    if (input.hasY)
+    {
+        players.y[index] = input.y;
+    }
+}
+
+// Runs the player's new commands; the position and the last applied command
+// go out with the next tick. `clock` is the server time they are run at.
+void applyInputCommands(RoomState &state, int socketId, const json &commands, double clock)
+{
+    int index = state.playerIndex(socketId);
+    if (index < 0)
+    {
+        return;
+    }
+    if (simulationRecorder.recording())
+    {
+        recordRoomEvent(state, {{"event", "input"}, {"socket", socketId}, {"commands", commands}, {"clock", clock}});
+    }
+    PlayerTable &players = state.room.players;
+    PlayerInput &input = state.inputs[socketId];
+
+    std::vector<MoveBox> solids = state.solids();
+
+    MoveState move;
+    move.x = players.x[index];
+    move.y = players.y[index];
+    move.width = players.width[index];
+    move.height = players.height[index];
+    move.facing = input.facing;
+    move.crouched = players.spriteState[index] == crouchSpriteState;
+
+    // Back on the steady clock from the server's timeline; a replay with the
+    // same clocks gets the same budget
+    auto now = serverEpoch + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(clock));
+    bool overBudget = false;
+    bool valid = forEachInputCommand(commands, input.lastSequence, [&](const InputCommand &command)
+                                     {
+        // Whatever is over budget stays unacked; the client sends it again
+        if (overBudget || !input.budget.available(1, now)) {
+            overBudget = true;
+            return;
+        }
+        input.budget.take(1);
+        move = stepMovement(move, command.bits, solids);
+        input.lastSequence = command.sequence; });
+    if (!valid)
+    {
+        return;
+    }
+
+    input.commanded = true;
+    input.facing = move.facing;
+    players.x[index] = move.x;
+    players.y[index] = move.y;
+    players.spriteState[index] = move.spriteState();
+}
+
+TickScheduler simulation(tickRate);
+
 enum LogLevel
 {
     INFO,
@@ -69,6 +536,9 @@ void logToFile(const std::string &message, LogLevel level = INFO)
 {
     static const std::map<LogLevel, std::string> levelNames = {
         {INFO, "INFO"}, {ERROR, "ERROR"}, {DEBUG, "DEBUG"}};
+    // Called from every I/O thread; keep lines from interleaving
+    static std::mutex log_mutex;
+    std::lock_guard<std::mutex> lock(log_mutex);
 
     std::ofstream logFile("err.log", std::ios::app);
     auto now = std::chrono::system_clock::now();
@@ -79,262 +549,436 @@ void logToFile(const std::string &message, LogLevel level = INFO)
     logFile << "[" << levelNames.at(level) << "] " << timeStr << " " << message << std::endl;
 }
 
-bool checkCollision(const json &object1, const json &object2)
+bool findPlayer(const std::string &name)
 {
-    if (!object1.contains("x") || !object1.contains("y") ||
-        !object2.contains("x") || !object2.contains("y") ||
-        !object1.contains("width") || !object1.contains("height") ||
-        !object2.contains("width") || !object2.contains("height"))
+    std::lock_guard<std::mutex> lock(directory_mutex);
+    return directory.socketForName(name) >= 0;
+}
+
+WebSocketServer wss;
+
+// Forward declarations
+void eraseUser(int id);
+
+std::shared_ptr<Session> findSession(int socketId)
+{
+    std::lock_guard<std::mutex> lock(socket_mutex);
+    auto it = sessions.find(socketId);
+    return it != sessions.end() ? it->second : nullptr;
+}
+
+// UDP always carries CBOR frames, whatever the session negotiated for TCP
+bool sendOverUdp(int socketId, const WireMessage::Bytes &frame, Delivery delivery)
+{
+    if (delivery == Delivery::Stream || !udpEndpoint)
     {
         return false;
     }
+    return udpEndpoint->send(socketId, frame, delivery == Delivery::Sequenced ? UdpChannel::Sequenced : UdpChannel::Reliable);
+}
 
-    int left1 = object1["x"].get<int>();
-    int right1 = left1 + object1["width"].get<int>();
-    int top1 = object1["y"].get<int>();
-    int bottom1 = top1 + object1["height"].get<int>();
+bool sendOverUdp(int socketId, const WireMessage &message, Delivery delivery)
+{
+    return delivery != Delivery::Stream && udpEndpoint && sendOverUdp(socketId, message.encoded(WireFormat::Cbor), delivery);
+}
 
-    int left2 = object2["x"].get<int>();
-    int right2 = left2 + object2["width"].get<int>();
-    int top2 = object2["y"].get<int>();
-    int bottom2 = top2 + object2["height"].get<int>();
+// Queues a message for one client in its wire format; never blocks on the network
+void sendToSession(int socketId, const std::shared_ptr<const WireMessage> &message, const std::string &coalesceKey = "",
+                   Delivery delivery = Delivery::Stream)
+{
+    std::shared_ptr<Session> session = findSession(socketId);
+    if (session && !sendOverUdp(socketId, *message, delivery))
+    {
+        session->send(message, coalesceKey);
+    }
+}
 
-    return !(left1 > right2 || right1 < left2 || top1 > bottom2 || bottom1 < top2);
+void sendToSession(int socketId, const json &message, const std::string &coalesceKey = "", Delivery delivery = Delivery::Stream)
+{
+    sendToSession(socketId, makeWireMessage(message), coalesceKey, delivery);
 }
 
-bool findPlayer(const std::string &name)
+// Spectators have no room, so they get every room's broadcasts. Needs socket_mutex.
+void sendToSpectatorsLocked(const std::shared_ptr<const WireMessage> &message, const std::string &coalesceKey = "")
 {
-    for (auto &room : game.items())
+    for (int socketId : spectators)
     {
-        if (room.value().contains("players"))
+        auto it = sessions.find(socketId);
+        if (it != sessions.end())
         {
-            for (auto &player : room.value()["players"])
-            {
-                if (player["name"] == name)
-                {
-                    return true;
-                }
-            }
+            it->second->send(message, coalesceKey);
         }
     }
-    return false;
 }
 
-WebSocketServer wss;
-std::vector<websocketpp::connection_hdl> ws_connections;
-std::mutex ws_mutex;
-
-// Forward declarations
-void eraseUser(int id);
-
-// Function to send messages over WebSockets
-void sendWebSocketMessage(websocketpp::connection_hdl hdl, const std::string &message)
+// Each client gets the message in its own wire format, encoded once per format.
+// Messages with a coalesce key may replace an older queued one for slow clients,
+// so only key messages that are whole on their own (positions, a game state, a ping).
+void broadcastMessage(const json &message, const std::string &coalesceKey = "")
 {
-    try
+    std::shared_ptr<const WireMessage> shared = makeWireMessage(message);
     {
-        wss.send(hdl, message, websocketpp::frame::opcode::text);
-    }
-    catch (const std::exception &e)
-    {
-        logToFile("WebSocket send error: " + std::string(e.what()), ERROR);
+        std::lock_guard<std::mutex> lock(socket_mutex);
+        for (const auto &[socketId, session] : sessions)
+        {
+            session->send(shared, coalesceKey);
+        }
     }
 }
 
-void broadcastMessage(const json &message)
+// For events only players in `roomID` can see
+void broadcastToRoom(int roomID, const json &message, const std::string &coalesceKey = "", Delivery delivery = Delivery::Stream)
 {
-    std::string compact = message.dump() + "\n";
-    std::vector<int> invalidSockets;
-
-    std::lock_guard<std::mutex> lock(socket_mutex);
-    for (const auto &socket : connected_sockets)
+    std::shared_ptr<const WireMessage> shared = makeWireMessage(message);
     {
-        try
+        std::lock_guard<std::mutex> lock(socket_mutex);
+        for (int socketId : roomSubscriptions.subscribers(roomID))
         {
-            if (socket && socket->is_open())
+            auto it = sessions.find(socketId);
+            if (it != sessions.end() && !sendOverUdp(socketId, *shared, delivery))
             {
-                boost::system::error_code ec;
-                boost::asio::write(*socket, boost::asio::buffer(compact), ec);
-                if (ec)
-                {
-                    invalidSockets.push_back(castWinsock(*socket));
-                }
-            }
-            else if (socket)
-            {
-                invalidSockets.push_back(castWinsock(*socket));
+                it->second->send(shared, coalesceKey);
             }
         }
-        catch (const std::exception &e)
+        sendToSpectatorsLocked(shared, coalesceKey);
+    }
+}
+
+// A room's positions cut into messages that each fit a datagram and stand on
+// their own: every entity is in one of them, with the tick's time.
+std::vector<WireMessage::Bytes> positionDatagrams(const json &message)
+{
+    // Room for the updates array's header to grow
+    const size_t budget = maxUdpPayload - 8;
+    std::vector<WireMessage::Bytes> out;
+    json part = {{"tick", message["tick"]}, {"time", message["time"]}, {"updates", json::array()}};
+    const size_t empty = encodeWireFrame(part, WireFormat::Cbor).size();
+    size_t size = empty;
+    for (const json &update : message["updates"])
+    {
+        size_t updateSize = json::to_cbor(update).size();
+        if (size + updateSize > budget && !part["updates"].empty())
         {
-            if (socket)
-            {
-                invalidSockets.push_back(castWinsock(*socket));
-            }
-            logToFile("Error broadcasting TCP message: " + std::string(e.what()), ERROR);
+            out.push_back(std::make_shared<const std::string>(encodeWireFrame(part, WireFormat::Cbor)));
+            part["updates"] = json::array();
+            size = empty;
         }
+        part["updates"].push_back(update);
+        size += updateSize;
     }
+    if (!part["updates"].empty())
+    {
+        out.push_back(std::make_shared<const std::string>(encodeWireFrame(part, WireFormat::Cbor)));
+    }
+    return out;
+}
 
-    // WebSocket broadcast
+// Positions for everyone watching a room: in datagrams for sessions on UDP,
+// as one message that a newer one can replace for everyone else
+void broadcastPositions(int roomID, const json &message)
+{
+    std::shared_ptr<const WireMessage> shared = makeWireMessage(message);
+    std::vector<WireMessage::Bytes> datagrams;
+    if (udpEndpoint)
     {
-        std::lock_guard<std::mutex> lock(ws_mutex);
-        auto it = ws_connections.begin();
-        while (it != ws_connections.end())
+        datagrams = positionDatagrams(message);
+    }
+    std::lock_guard<std::mutex> lock(socket_mutex);
+    for (int socketId : roomSubscriptions.subscribers(roomID))
+    {
+        auto it = sessions.find(socketId);
+        if (it == sessions.end())
+        {
+            continue;
+        }
+        if (udpEndpoint && udpEndpoint->established(socketId))
         {
-            try
+            bool sent = true;
+            for (const WireMessage::Bytes &datagram : datagrams)
             {
-                if (wss.get_con_from_hdl(*it)->get_state() == websocketpp::session::state::open)
-                {
-                    sendWebSocketMessage(*it, compact);
-                    ++it;
-                }
-                else
-                {
-                    it = ws_connections.erase(it);
-                }
+                sent = sendOverUdp(socketId, datagram, Delivery::Sequenced) && sent;
             }
-            catch (...)
+            if (sent)
             {
-                it = ws_connections.erase(it);
+                continue;
             }
         }
+        it->second->send(shared, "positions");
     }
+    sendToSpectatorsLocked(shared, "positions");
+}
 
-    // Clean up invalid TCP sockets
-    for (int socketId : invalidSockets)
+// Takes the room as a new version. Runs on the room's actor.
+std::shared_ptr<const WorldSnapshot> publishSnapshot(RoomState &state)
+{
+    state.version = ++gameVersionCounter;
+    auto snapshot = captureRoomSnapshot(state.room, state.version);
+    state.history.push(snapshot);
+    return snapshot;
+}
+
+// Sent at login. Only the player's own room is filled in; the client gets the
+// others in full when it enters them.
+json fullGameMessage(const RoomState &state, const WorldSnapshot &snapshot)
+{
+    json game = json::object();
+    for (const auto &[roomID, actor] : roomActors)
     {
-        eraseUser(socketId);
+        Room empty;
+        empty.roomID = roomID;
+        game[roomName(roomID)] = empty.toJson();
     }
+    game[roomName(state.room.roomID)] = state.room.toJson();
+    return {{"getGame", game}, {"gameVersion", snapshot.version}, {"time", serverSeconds()}};
 }
 
-json createUserRaw(const std::string &name, int fid)
+json roomStateMessage(const RoomState &state, const WorldSnapshot &snapshot)
 {
-    std::random_device rd;
-    json newPlayer = {
-        {"name", name},
-        {"x", rd() % 600},
-        {"y", rd() % 300},
-        {"speed", 5},
-        {"score", 0},
-        {"width", 64},
-        {"height", 64},
-        {"inventory", {{"shields", 0}, {"bananas", 0}}},
-        {"socket", fid},
-        {"spriteState", 1},
-        {"skin", 1},
-        {"local", false},
-        {"room", 1}};
+    return {{"getRoom", state.room.toJson()}, {"room", roomName(state.room.roomID)}, {"gameVersion", snapshot.version}, {"time", serverSeconds()}};
+}
+
+// What a player needs to reach `snapshot`: a delta of the room from its acked
+// baseline, or the whole room when it has none. Messages are cached per baseline
+// since most players ack the same versions. Runs on the room's actor.
+std::shared_ptr<const WireMessage> gameMessageFor(RoomState &state, int socketId, const WorldSnapshot &snapshot,
+                                                  std::map<uint32_t, std::shared_ptr<const WireMessage>> &cache)
+{
+    auto known = state.baselines.find(socketId);
+    uint32_t acked = known != state.baselines.end() ? known->second.acked : 0;
+    std::shared_ptr<const WorldSnapshot> from = acked ? state.history.find(acked) : nullptr;
+    if (!from)
+    {
+        acked = 0;
+    }
+
+    auto cached = cache.find(acked);
+    if (cached != cache.end())
+    {
+        return cached->second;
+    }
+
+    std::shared_ptr<const WireMessage> message;
+    if (from)
+    {
+        message = makeWireMessage({{"gameDelta", diffSnapshots(*from, snapshot)}, {"time", serverSeconds()}});
+    }
+    else
+    {
+        message = makeWireMessage(roomStateMessage(state, snapshot));
+    }
+    cache[acked] = message;
+    return message;
+}
+
+// Sends the room's new state to everyone in it. Runs on the room's actor.
+void broadcastRoomState(RoomState &state)
+{
+    auto snapshot = publishSnapshot(state);
+    std::map<uint32_t, std::shared_ptr<const WireMessage>> cache;
+    for (size_t i = 0; i < state.room.players.size(); i++)
+    {
+        int socketId = state.room.players.socket[i];
+        // A newer game state supersedes any still queued for a slow client.
+        // Reliable, so it keeps its place among the room's events.
+        sendToSession(socketId, gameMessageFor(state, socketId, *snapshot, cache), "game", Delivery::Reliable);
+    }
+    std::lock_guard<std::mutex> lock(socket_mutex);
+    if (!spectators.empty())
+    {
+        sendToSpectatorsLocked(makeWireMessage(roomStateMessage(state, *snapshot)));
+    }
+}
+
+// What a client gets at login: its own player and the whole game. Runs on the room's actor.
+void welcomePlayer(RoomState &state, int socketId)
+{
+    int index = state.playerIndex(socketId);
+    if (index < 0)
+    {
+        return;
+    }
+    json gameMessage = fullGameMessage(state, *publishSnapshot(state));
+    {
+        std::lock_guard<std::mutex> lock(socket_mutex);
+        roomSubscriptions.subscribe(socketId, state.room.roomID);
+        spectators.erase(socketId);
+    }
+    sendToSession(socketId, state.room.players.record(index, state.room.roomID).toJson(true), "", Delivery::Reliable);
+    sendToSession(socketId, gameMessage, "game", Delivery::Reliable);
+}
 
-    for (auto &o : game["room1"]["objects"])
+// Runs on the room's actor
+void sendGameState(RoomState &state, int socketId)
+{
+    if (state.playerIndex(socketId) < 0)
     {
-        if (checkCollision(newPlayer, o))
+        return;
+    }
+    auto snapshot = publishSnapshot(state);
+    std::map<uint32_t, std::shared_ptr<const WireMessage>> cache;
+    sendToSession(socketId, gameMessageFor(state, socketId, *snapshot, cache), "game", Delivery::Reliable);
+}
+
+// New players and shields get a random spot clear of the room's objects. A
+// room too full to find one in this many tries uses the top-left corner.
+const int spawnAttempts = 64;
+
+PlayerRecord createUserRaw(const std::string &name, int fid, RoomState &state)
+{
+    PlayerRecord newPlayer;
+    newPlayer.name = name;
+    newPlayer.socket = fid;
+    newPlayer.room = state.room.roomID;
+
+    for (int i = 0; i < spawnAttempts; i++)
+    {
+        newPlayer.x = state.rng.uniform(0, 599);
+        newPlayer.y = state.rng.uniform(0, 299);
+        if (!state.objectGrid.anyOverlap({newPlayer.x, newPlayer.y, newPlayer.width, newPlayer.height}))
         {
-            return createUserRaw(name, fid); // recreate if colliding
+            return newPlayer;
         }
     }
+    newPlayer.x = 0;
+    newPlayer.y = 0;
     return newPlayer;
 }
 
-json createUser(const std::string &name, tcp::socket &socket)
+// A player that just logged in, at a free spot. Runs on the room's actor.
+bool joinRoom(RoomState &state, int socketId, const std::string &name)
+{
+    if (state.playerIndex(socketId) >= 0)
+    {
+        return false;
+    }
+    if (simulationRecorder.recording())
+    {
+        recordRoomEvent(state, {{"event", "join"}, {"socket", socketId}, {"name", name}});
+    }
+    state.addPlayer(createUserRaw(name, socketId, state));
+    state.baselines.erase(socketId);
+    return true;
+}
+
+// Takes the player out of the room, with what it carries to another room;
+// false if it isn't here. Runs on the room's actor.
+bool leaveRoom(RoomState &state, int socketId, PlayerRecord *removed = nullptr, PlayerInput *input = nullptr)
 {
-    int fid = castWinsock(socket);
-    return createUserRaw(name, fid);
+    if (state.playerIndex(socketId) < 0)
+    {
+        return false;
+    }
+    if (simulationRecorder.recording())
+    {
+        recordRoomEvent(state, {{"event", "leave"}, {"socket", socketId}});
+    }
+    if (input)
+    {
+        auto it = state.inputs.find(socketId);
+        *input = it != state.inputs.end() ? it->second : PlayerInput{};
+    }
+    return state.removePlayer(socketId, removed);
 }
 
-json createEnemy(int room)
+// A player arriving from another room. Runs on the room's actor.
+bool enterRoom(RoomState &state, const PlayerRecord &player, const PlayerInput &input)
 {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> x_dis(50, 550);
-    std::uniform_int_distribution<> y_dis(50, 250);
+    if (state.playerIndex(player.socket) >= 0)
+    {
+        return false;
+    }
+    if (simulationRecorder.recording())
+    {
+        recordRoomEvent(state, {{"event", "enter"}, {"socket", player.socket}, {"x", player.x}, {"y", player.y}});
+    }
+    state.addPlayer(player);
+    state.inputs[player.socket] = input;
+    return true;
+}
 
-    json newEnemy = {
-        {"x", x_dis(gen)},
-        {"y", y_dis(gen)},
-        {"width", 64},
-        {"height", 64},
-        {"room", room},
-        {"speed", 50},
-        {"id", enemyNewId++}};
-    for (auto &e : game["room" + std::to_string(room)]["enemies"])
+// Picks a free spot for a new enemy: not on another enemy, and not in a wall
+// where there's no path out. Gives up after a few tries, when the room is too
+// crowded; the caller hands the spawn back to the spawner to try again next
+// step. The id comes from the pool.
+bool placeEnemy(RoomState &state, EnemyRecord &newEnemy)
+{
+    const int attempts = 16;
+    bool stress = state.spawner.settings().stress;
+    // Stress tests spread out over the whole room and may stack up
+    int maxX = stress ? movementBoundsWidth - 100 : 550;
+    int maxY = stress ? movementBoundsHeight - 100 : 250;
+
+    newEnemy = EnemyRecord{};
+    newEnemy.room = state.room.roomID;
+    for (int i = 0; i < attempts; i++)
     {
-        if (checkCollision(newEnemy, e))
+        newEnemy.x = static_cast<float>(state.rng.uniform(50, maxX));
+        newEnemy.y = static_cast<float>(state.rng.uniform(50, maxY));
+        SpatialBox box{static_cast<int>(newEnemy.x), static_cast<int>(newEnemy.y), newEnemy.width, newEnemy.height};
+        if ((stress || !state.enemyGrid.anyOverlap(box)) && !state.objectGrid.anyOverlap(box))
         {
-            return createEnemy(room);
+            return true;
         }
     }
-    return newEnemy;
+    return false;
 }
 
 void eraseUser(int id)
 {
     try
     {
-        // First send quit message to the disconnecting player
+        // Let the quit message go out, then close; the session leaves the table now
+        std::shared_ptr<Session> session;
         {
             std::lock_guard<std::mutex> socket_lock(socket_mutex);
-            auto it = std::find_if(connected_sockets.begin(), connected_sockets.end(),
-                                   [id](const std::shared_ptr<tcp::socket> &socket)
-                                   {
-                                       return socket && castWinsock(*socket) == id;
-                                   });
-
-            if (it != connected_sockets.end() && (*it)->is_open())
+            auto it = sessions.find(id);
+            if (it != sessions.end())
             {
-                try
-                {
-                    json quitMessage = {{"quitGame", true}};
-                    boost::asio::write(**it, boost::asio::buffer(quitMessage.dump() + "\n"));
-                }
-                catch (...)
-                {
-                    // Ignore write errors during disconnect
-                }
+                session = it->second;
+                sessions.erase(it);
             }
+            roomSubscriptions.unsubscribe(id);
+            spectators.erase(id);
+        }
+        if (udpEndpoint)
+        {
+            udpEndpoint->removePeer(id);
+        }
+        if (session)
+        {
+            session->send(makeWireMessage({{"quitGame", true}}));
+            session->closeAfterFlush();
         }
 
-        // Remove from game state
+        // Remove from game state; the room actor tells the rest of the room
+        int roomID = 0;
         {
-            std::lock_guard<std::mutex> lock(game_mutex);
-            for (auto &room : game.items())
+            std::lock_guard<std::mutex> lock(directory_mutex);
+            const PlayerIndex::Entry *entry = directory.find(id);
+            if (entry)
             {
-                if (room.value().contains("players"))
-                {
-                    auto &players = room.value()["players"];
-                    players.erase(
-                        std::remove_if(players.begin(), players.end(),
-                                       [id](const json &p)
-                                       {
-                                           return p.contains("socket") && p["socket"].get<int>() == id;
-                                       }),
-                        players.end());
-                }
+                roomID = entry->roomID;
+                directory.erase(id);
             }
+            playersInTransit.erase(id);
         }
 
-        // Clean up socket and remove from connected_sockets
+        if (!session && roomID == 0)
         {
-            std::lock_guard<std::mutex> socket_lock(socket_mutex);
-            auto it = std::find_if(connected_sockets.begin(), connected_sockets.end(),
-                                   [id](const std::shared_ptr<tcp::socket> &socket)
-                                   {
-                                       return socket && castWinsock(*socket) == id;
-                                   });
-
-            if (it != connected_sockets.end())
-            {
-                if ((*it)->is_open())
-                {
-                    boost::system::error_code ec;
-                    (*it)->shutdown(tcp::socket::shutdown_both, ec);
-                    (*it)->close(ec);
-                }
-                connected_sockets.erase(it);
-            }
+            return;
         }
 
-        // Notify remaining players about the disconnection
-        json playerLeftMessage = {{"playerLeft", id}};
-        broadcastMessage(playerLeftMessage);
+        RoomActor *actor = findRoomActor(roomID);
+        if (actor)
+        {
+            // Only the room it was in hears that it left, with the next tick
+            actor->post([id](RoomState &state)
+                        {
+                if (leaveRoom(state, id)) {
+                    state.pendingEvents.push_back({{"playerLeft", id}});
+                    broadcastRoomState(state);
+                } });
+        }
 
         logToFile("User " + std::to_string(id) + " disconnected and removed successfully", INFO);
     }
@@ -344,409 +988,599 @@ void eraseUser(int id)
     }
 }
 
-std::string lookForRoom(tcp::socket &socket)
+std::string lookForRoom(const Session &session)
+{
+    int roomID = roomOfPlayer(session.id());
+    return roomName(roomID != 0 ? roomID : 1);
+}
+
+void printCurrentPlayers()
+{
+    std::lock_guard<std::mutex> lock(directory_mutex);
+    std::cout << "Current players:\n";
+    for (const auto &[name, socketId] : directory.names())
+    {
+        std::cout << name << " - " << socketId << std::endl;
+    }
+}
+
+// Second half of a room transfer, on the target room's actor. The mover gets
+// the room in full; everyone already there sees it arrive in their delta.
+void admitPlayer(RoomState &state, const PlayerRecord &player, const PlayerInput &input)
 {
-    int sockID = castWinsock(socket);
-    for (auto &room : game.items())
     {
-        if (room.value().contains("players"))
+        std::lock_guard<std::mutex> lock(directory_mutex);
+        playersInTransit.erase(player.socket);
+        // The player may have quit while the handoff was in flight
+        const PlayerIndex::Entry *entry = directory.find(player.socket);
+        if (!entry || entry->roomID != state.room.roomID)
         {
-            for (auto &player : room.value()["players"])
-            {
-                if (player["socket"].get<int>() == sockID)
-                {
-                    return room.key();
-                }
-            }
+            return;
         }
     }
-    return "room1";
+
+    if (!enterRoom(state, player, input))
+    {
+        return;
+    }
+    // Nothing it acked describes this room, and acks still in flight never will
+    state.baselines[player.socket] = {0, gameVersionCounter + 1};
+    {
+        std::lock_guard<std::mutex> lock(socket_mutex);
+        roomSubscriptions.subscribe(player.socket, state.room.roomID);
+    }
+    broadcastRoomState(state);
 }
 
-json lookForPlayer(tcp::socket &socket)
+// Room transfers are a handoff between actors: the source room removes the
+// player and posts it to the target room, which admits it.
+void switchRoom(int socketId, int newRoom)
 {
-    int sockID = castWinsock(socket);
-    for (auto &room : game.items())
+    RoomActor *target = findRoomActor(newRoom);
+    RoomActor *source = nullptr;
     {
-        if (room.value().contains("players"))
+        std::lock_guard<std::mutex> lock(directory_mutex);
+        const PlayerIndex::Entry *entry = directory.find(socketId);
+        // Clients repeat their room in every message; the next one retries a move made mid-transfer
+        if (!entry || entry->roomID == newRoom || !target || playersInTransit.count(socketId))
         {
-            for (auto &player : room.value()["players"])
-            {
-                if (player["socket"].get<int>() == sockID)
-                {
-                    return player;
-                }
-            }
+            return;
         }
+        source = findRoomActor(entry->roomID);
+        directory.move(socketId, newRoom);
+        playersInTransit.insert(socketId);
     }
-    return {{"error", "player not found"}};
+
+    source->post([socketId, newRoom, target](RoomState &state)
+                 {
+        PlayerRecord player;
+        PlayerInput input;
+        if (!leaveRoom(state, socketId, &player, &input)) {
+            std::lock_guard<std::mutex> lock(directory_mutex);
+            playersInTransit.erase(socketId);
+            return;
+        }
+        broadcastRoomState(state);
+
+        player.room = newRoom;
+        player.x = newRoom == 1 ? 90 : 100;
+        player.y = newRoom == 1 ? 90 : 100;
+        target->post([player, input](RoomState &targetState)
+                     { admitPlayer(targetState, player, input); }); });
 }
 
-void printCurrentPlayers()
+// Shield logic
+ObjectRecord createShield(RoomState &state)
 {
-    std::cout << "Current players:\n";
-    for (auto &room : game.items())
+    ObjectRecord shield{10, 0, 0, 32, 32};
+    for (int i = 0; i < spawnAttempts; i++)
     {
-        if (room.value().contains("players"))
+        shield.x = state.rng.uniform(0, 699);
+        shield.y = state.rng.uniform(0, 599);
+        if (!state.objectGrid.anyOverlap({shield.x, shield.y, shield.width, shield.height}))
         {
-            for (auto &player : room.value()["players"])
+            return shield;
+        }
+    }
+    shield.x = 0;
+    shield.y = 0;
+    return shield;
+}
+
+bool shieldExists(const Room &room)
+{
+    return room.objects.indexOfType(10) >= 0;
+}
+
+// Only the shield in the player's own room can be picked up. Runs on the room's actor.
+void pickUpShield(RoomState &state, int socketId)
+{
+    Room &room = state.room;
+    int shieldIndex = room.objects.indexOfType(10);
+    if (shieldIndex < 0)
+    {
+        return;
+    }
+    if (simulationRecorder.recording())
+    {
+        recordRoomEvent(state, {{"event", "shield"}, {"socket", socketId}});
+    }
+    json shieldData = room.objects.record(shieldIndex).toJson();
+    state.removeObjectAt(shieldIndex);
+
+    json message = {
+        {"updateShield", true},
+        {"action", "delete"},
+        {"room", room.roomID},
+        {"shield", shieldData}};
+
+    // add shield to player
+    int playerIndex = state.playerIndex(socketId);
+    if (playerIndex >= 0)
+    {
+        room.players.shields[playerIndex]++;
+        json playerItems = {
+            {"playerItems", {{"socket", socketId}, {"get", 1}, {"shields", room.players.shields[playerIndex]}, {"bananas", room.players.bananas[playerIndex]}}}};
+        state.pendingEvents.push_back(std::move(playerItems));
+    }
+
+    state.pendingEvents.push_back(std::move(message));
+}
+
+// The player's smoothed round trip, for rewinding its hits. Runs on the room's actor.
+void updateRtt(RoomState &state, int socketId, double rttMs)
+{
+    if (state.playerIndex(socketId) < 0)
+    {
+        return;
+    }
+    if (simulationRecorder.recording())
+    {
+        recordRoomEvent(state, {{"event", "rtt"}, {"socket", socketId}, {"rttMs", rttMs}});
+    }
+    state.inputs[socketId].rttMs = rttMs;
+}
+
+// Every client message, whatever transport it came over, on the session's strand
+void handleMessage(const json &messageJson, Session &session)
+{
+    try
+    {
+        int sockID = session.id();
+
+        // Switches what this client gets from now on; the reply is the first message in the new format.
+        // LZ4 frames are only for TCP: a browser can't tell them from text.
+        if (messageJson.contains("wire"))
+        {
+            WireFormat format = parseWireFormat(messageJson["wire"].get<std::string>());
+            WireCompression codec = parseWireCompression(messageJson.value("compress", "none"));
+            if (codec != allowedCompression || session.transport() != SessionTransport::Tcp)
+            {
+                codec = WireCompression::None;
+            }
+            session.setWireFormat(format);
+            session.setCompression(codec, compressMinBytes);
+            session.send(makeWireMessage(json{{"wire", wireFormatName(format)}, {"compress", wireCompressionName(codec)}}));
+            return;
+        }
+
+        // Initial connection
+        if (messageJson.contains("currentName"))
+        {
+            std::string requestedName = messageJson["currentName"].get<std::string>();
+            std::string name;
+            bool loggedIn;
+            {
+                std::lock_guard<std::mutex> lock(directory_mutex);
+                loggedIn = directory.find(sockID) != nullptr;
+                if (!loggedIn)
+                {
+                    // If name exists, find a unique variant
+                    name = directory.uniqueName(requestedName);
+                    directory.insert(sockID, name, 1);
+                }
+            }
+
+            // Clients may log in again on the same connection (the bundled one
+            // does); they get the player they already have, not a second one
+            if (loggedIn)
+            {
+                postToPlayerRoom(sockID, [sockID](RoomState &state)
+                                 { welcomePlayer(state, sockID); });
+                return;
+            }
+
+            // Anything else this client sends is posted to room 1 after this
+            roomActors[1]->post([sockID, name](RoomState &state)
+                                {
+                if (joinRoom(state, sockID, name)) {
+                    welcomePlayer(state, sockID);
+                } });
+
+            // Browsers can't send datagrams
+            if (udpEndpoint && session.transport() == SessionTransport::Tcp)
+            {
+                uint32_t token = udpEndpoint->expectPeer(sockID);
+                sendToSession(sockID, {{"udp", {{"port", udpEndpoint->port()}, {"token", token}}}});
+            }
+            return;
+        }
+
+        // The client now holds this version and it can be used as a delta baseline
+        if (messageJson.contains("ackGame"))
+        {
+            uint32_t version = messageJson["ackGame"].get<uint32_t>();
+            postToPlayerRoom(sockID, [sockID, version](RoomState &state)
+                             {
+                if (state.playerIndex(sockID) < 0) {
+                    return;
+                }
+                GameBaseline &baseline = state.baselines[sockID];
+                if (version <= state.version && version >= baseline.floor) {
+                    baseline.acked = std::max(baseline.acked, version);
+                } });
+            return;
+        }
+
+        if (messageJson.contains("quitGame") && messageJson["quitGame"].get<bool>())
+        {
+            eraseUser(sockID);
+            return;
+        }
+
+        if (messageJson.contains("x") || messageJson.contains("y") || messageJson.contains("spriteState") || messageJson.contains("input"))
+        {
+            if (messageJson.contains("input"))
             {
-                // Print player's name and socket (instead of id which doesn't exist)
-                std::cout << player["name"].get<std::string>() << " - "
-                          << player["socket"].get<int>() << std::endl;
+                json commands = messageJson["input"];
+                postToPlayerRoom(sockID, [sockID, commands](RoomState &state)
+                                 { applyInputCommands(state, sockID, commands, serverSeconds()); });
             }
+
+            MovementInput input{sockID,
+                                messageJson.contains("x"), messageJson.value("x", -1),
+                                messageJson.contains("y"), messageJson.value("y", -1),
+                                messageJson.contains("spriteState"), messageJson.value("spriteState", 1)};
+            postToPlayerRoom(sockID, [input](RoomState &state)
+                             { applyMovement(state, input); });
+
+            if (messageJson.contains("shieldTouched") && messageJson["shieldTouched"].get<bool>()) {
+                postToPlayerRoom(sockID, [sockID](RoomState &state)
+                                 { pickUpShield(state, sockID); });
+            }
+
+            if (messageJson.contains("room"))
+            {
+                switchRoom(sockID, messageJson["room"].get<int>());
+            }
+        }
+
+        if (messageJson.contains("requestGame") && !messageJson.contains("x") && !messageJson.contains("y"))
+        {
+            // "full" drops the baseline, for a client that lost track of its copy
+            bool full = messageJson.value("full", false);
+            postToPlayerRoom(sockID, [sockID, full](RoomState &state)
+                             {
+                if (full) {
+                    state.baselines[sockID].acked = 0;
+                }
+                sendGameState(state, sockID); });
         }
     }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Error in handleMessage: " << e.what() << std::endl;
+        logToFile(std::string("Error in handleMessage: ") + e.what(), ERROR);
+    }
 }
 
-void sendWebSocketMessage(websocketpp::connection_hdl, const std::string &);
+// One connection's read loop state
+struct InboundStream
+{
+    WireReader reader;
+    // Fires when a message held back by the rate limit may go through
+    boost::asio::steady_timer deferTimer;
+    bool deferArmed = false;
 
-void onWebSocketMessage(websocketpp::connection_hdl hdl, WebSocketServer::message_ptr msg);
+    explicit InboundStream(const Session::Strand &strand) : deferTimer(strand) {}
+};
 
-void onWebSocketOpen(websocketpp::connection_hdl hdl)
+// Answered on the session's strand without going near the game: clock sync
+// requests, and pongs, which update the session's round trip and the copy the
+// player's room keeps for the simulation. False for anything else.
+bool handleLinkMessage(Session &session, const json &message)
 {
-    std::lock_guard<std::mutex> lock(ws_mutex);
-    ws_connections.push_back(hdl);
-    std::cout << "New WebSocket connection!" << std::endl;
+    if (message.contains("timeSync"))
+    {
+        double received = serverSeconds();
+        session.send(makeWireMessage(clockSyncReply(message["timeSync"], received, serverSeconds())));
+        return true;
+    }
+    if (!message.contains("pong"))
+    {
+        return false;
+    }
+    if (session.heartbeat().pong(message["pong"], std::chrono::steady_clock::now()))
+    {
+        int sockID = session.id();
+        double rttMs = session.rtt().smoothedMs;
+        postToPlayerRoom(sockID, [sockID, rttMs](RoomState &state)
+                         { updateRtt(state, sockID, rttMs); });
+    }
+    return true;
 }
 
-void onWebSocketClose(websocketpp::connection_hdl hdl)
+void handleRawMessage(Session &session, const char *data, size_t size)
 {
-    std::lock_guard<std::mutex> lock(ws_mutex);
-    ws_connections.erase(
-        std::remove_if(ws_connections.begin(), ws_connections.end(),
-                       [hdl](websocketpp::connection_hdl h)
-                       { return !h.owner_before(hdl) && !hdl.owner_before(h); }),
-        ws_connections.end());
+    // Compression only goes from the server out; a client's messages are small
+    if (isCompressedWireFrame(data, size))
+    {
+        logToFile("Dropping compressed message from " + std::to_string(session.id()), ERROR);
+        return;
+    }
+    json message;
+    try
+    {
+        message = WireReader::decode(data, size);
+    }
+    catch (const json::exception &e)
+    {
+        // Only this message was bad; the reader is already past it
+        logToFile("Dropping undecodable message from " + std::to_string(session.id()) + ": " + e.what(), ERROR);
+        return;
+    }
+    if (!handleLinkMessage(session, message))
+    {
+        handleMessage(message, session);
+    }
 }
 
-void switchRoom(json &player, const std::string &newRoom)
+// A movement checklist carries an absolute position and input commands that are
+// resent until acked, so a newer one stands in for it. Not one that also asks
+// for something (a game, quitting, the shield), nor anything that isn't a checklist.
+bool isCoalescibleInput(const json &message)
 {
-    std::lock_guard<std::mutex> lock(game_mutex);
-    for (auto &room : game.items())
+    if (!message.is_object() || !(message.contains("x") || message.contains("y") || message.contains("spriteState") || message.contains("input")))
     {
-        if (room.value().contains("players"))
+        return false;
+    }
+    for (const char *request : {"requestGame", "quitGame", "shieldTouched"})
+    {
+        if (message.contains(request) && message[request] != false)
         {
-            auto &players = room.value()["players"];
-            auto it = std::remove_if(players.begin(), players.end(),
-                                     [&player](const json &p)
-                                     {
-                                         return p["socket"] == player["socket"];
-                                     });
-            players.erase(it, players.end());
+            return false;
         }
     }
-    game[newRoom]["players"].push_back(player);
-    json updateMessage = {{"switchRoom", {{"socket", player["socket"]}, {"room", std::stoi(newRoom.substr(4))}}}};
-    broadcastMessage(updateMessage);
+    return true;
 }
 
-bool playersInRoom(const std::string &roomName)
+bool isCoalescibleInput(const char *data, size_t size)
 {
-    if (!game.contains(roomName))
+    if (isCompressedWireFrame(data, size))
+    {
+        return false;
+    }
+    try
+    {
+        json message = WireReader::decode(data, size);
+        return isCoalescibleInput(message);
+    }
+    catch (const json::exception &)
     {
         return false;
     }
-    return game[roomName].contains("players") && !game[roomName]["players"].empty();
 }
 
-// Shield logic
-json createShield()
+// Charges one raw message to the session's inbound budget, and handles it if it fits
+void admitRawMessage(Session &session, const char *data, size_t size, std::chrono::steady_clock::time_point now)
 {
-    std::random_device rd;
-    json shield{
-        {"x", rd() % 700},
-        {"y", rd() % 600},
-        {"width", 32},
-        {"height", 32},
-        {"objID", 10}};
-    // check objects for collision
-    for (auto &r : game)
-    {
-        for (auto &o : r["objects"])
-        {
-            if (checkCollision(shield, o))
-            {
-                return createShield();
-            }
-        }
+    switch (session.inbound().admit(data, size, now, [](const char *d, size_t s)
+                                    { return isCoalescibleInput(d, s); }))
+    {
+    case InboundLimiter::Verdict::Accept:
+        handleRawMessage(session, data, size);
+        break;
+    case InboundLimiter::Verdict::Reject:
+        logToFile("Dropping message from " + std::to_string(session.id()) + ": " + std::to_string(InboundLimiter::maxDeferred) + " already held back by the rate limit", ERROR);
+        break;
+    default:
+        break;
     }
-    return shield;
 }
 
-bool shieldExists() {
-    for (auto &o : game["room2"]["objects"]) {
-        if (o["objID"] == 10) {
-            return true;
-        }
+// Pings the session every heartbeatSettings.interval on its strand, and closes
+// it once it has been silent for the idle timeout. The read then fails and the
+// usual disconnect path runs. Stops by itself when the session closes.
+void startHeartbeat(std::shared_ptr<Session> session, std::shared_ptr<boost::asio::steady_timer> timer = nullptr)
+{
+    if (!timer)
+    {
+        timer = std::make_shared<boost::asio::steady_timer>(session->strand());
     }
-    return false;
+    timer->expires_after(heartbeatSettings.interval);
+    timer->async_wait(boost::asio::bind_executor(session->strand(), [session, timer](boost::system::error_code ec)
+                                                 {
+        if (ec || !session->open()) {
+            return;
+        }
+        auto now = std::chrono::steady_clock::now();
+        auto silent = std::chrono::duration_cast<std::chrono::milliseconds>(session->heartbeat().silentFor(now));
+        if (silent >= heartbeatSettings.idleTimeout) {
+            logToFile("Closing " + std::to_string(session->id()) + ": silent for " + std::to_string(silent.count()) + " ms", INFO);
+            session->close();
+            return;
+        }
+        // One pending ping is enough for a client that is behind
+        session->send(makeWireMessage(session->heartbeat().ping(now)), "ping");
+        startHeartbeat(session, timer); }));
 }
 
-void handleMessage(const std::string &message, tcp::socket &socket);
-
-void shieldThread() {
-    while (!shouldClose) {
-        if (playersInRoom("room2") && !shieldExists()) {
-           std::lock_guard<std::mutex> lock(game_mutex);
-           json shield = createShield();
-           game["room2"]["objects"].push_back(shield);
-           json message = {{"updateShield", true}, {"shield", shield}, {"room", 2}, {"action", "add"}};
-           json sUpdate = message;
-           broadcastMessage(sUpdate);
+// Handles the message the rate limit held back once a token is free, or waits for one
+void scheduleDeferred(std::shared_ptr<Session> session, std::shared_ptr<InboundStream> stream)
+{
+    if (stream->deferArmed || !session->inbound().hasPending())
+    {
+        return;
+    }
+    stream->deferArmed = true;
+    stream->deferTimer.expires_after(session->inbound().untilPending(std::chrono::steady_clock::now()));
+    stream->deferTimer.async_wait(boost::asio::bind_executor(session->strand(), [session, stream](boost::system::error_code ec)
+                                                              {
+        stream->deferArmed = false;
+        if (ec || !session->open()) {
+            return;
+        }
+        std::string pending;
+        while (session->inbound().takePending(pending, std::chrono::steady_clock::now())) {
+            handleRawMessage(*session, pending.data(), pending.size());
         }
-        std::this_thread::sleep_for(std::chrono::seconds(5));
+        scheduleDeferred(session, stream); }));
+}
+
+// Runs on the session's strand, so one client's messages are handled in order
+// while other clients are handled in parallel on the rest of the I/O pool
+// Inbound bytes may hold any mix of JSON lines and binary frames (see libs/wire.hpp).
+// Each message is charged to the session's inbound budget before it is decoded.
+void startReading(std::shared_ptr<TcpSession> session, std::shared_ptr<InboundStream> stream = nullptr)
+{
+    if (!stream)
+    {
+        stream = std::make_shared<InboundStream>(session->strand());
     }
+    auto chunk = std::make_shared<std::array<char, 4096>>();
+    session->socket().async_read_some(boost::asio::buffer(*chunk), boost::asio::bind_executor(session->strand(), [session, stream, chunk](boost::system::error_code ec, std::size_t bytes)
+                                  {
+        if (!ec) {
+            auto now = std::chrono::steady_clock::now();
+            session->heartbeat().heard(now);
+            stream->reader.append(chunk->data(), bytes);
+            try {
+                std::string pending;
+                while (session->inbound().takePending(pending, now)) {
+                    handleRawMessage(*session, pending.data(), pending.size());
+                }
+                WireReader::RawMessage raw;
+                while (stream->reader.nextRaw(raw)) {
+                    admitRawMessage(*session, raw.data, raw.size, now);
+                }
+                scheduleDeferred(session, stream);
+            } catch (const std::exception &e) {
+                // Framing is lost; nothing after this can be trusted
+                logToFile("Closing " + std::to_string(session->id()) + ": " + e.what(), ERROR);
+                session->close();
+            }
+            startReading(session, stream);
+        } else {
+            // The id may already belong to a newer connection if this one was erased earlier
+            if (findSession(session->id()) == session) {
+                eraseUser(session->id());
+            }
+            session->close();
+        } }));
 }
 
-void onWebSocketMessage(websocketpp::connection_hdl hdl, WebSocketServer::message_ptr msg)
+// A WebSocket message arrives already delimited: a text one is a JSON message
+// and a binary one exactly one wire frame. From there it is handled like a TCP
+// message, on the session's strand and charged to the same inbound budget.
+void onWebSocketMessage(std::shared_ptr<Session> session, std::shared_ptr<InboundStream> stream, const std::string &payload, bool binary)
 {
     try
     {
-        // Create a dummy TCP socket for compatibility with existing code
-        tcp::socket dummy_socket(io_context);
-        handleMessage(msg->get_payload(), dummy_socket);
+        auto now = std::chrono::steady_clock::now();
+        session->heartbeat().heard(now);
+        if (binary && wireFrameSize(payload.data(), payload.size()) != payload.size())
+        {
+            throw std::runtime_error("binary message is not one wire frame");
+        }
+        std::string pending;
+        while (session->inbound().takePending(pending, now))
+        {
+            handleRawMessage(*session, pending.data(), pending.size());
+        }
+        admitRawMessage(*session, payload.data(), payload.size(), now);
+        scheduleDeferred(session, stream);
     }
     catch (const std::exception &e)
     {
-        logToFile("WebSocket message handling error: " + std::string(e.what()), ERROR);
+        logToFile("WebSocket message handling error from " + std::to_string(session->id()) + ": " + e.what(), ERROR);
     }
 }
 
-void handleMessage(const std::string &message, tcp::socket &socket)
+// The connection is looked up once, here. Its handlers only hold the session
+// weakly, so it goes away with the sessions table entry like a TCP one.
+void onWebSocketOpen(websocketpp::connection_hdl hdl)
 {
-    try
+    WebSocketServer::connection_ptr connection = wss.get_con_from_hdl(hdl);
+    auto session = std::make_shared<WebSocketSession>(connection, io_context.get_executor(), nextSessionId++,
+                                                      outboundHighWater, outboundPolicy, inboundLimits);
+    session->setCompression(WireCompression::None, compressMinBytes);
+    auto stream = std::make_shared<InboundStream>(session->strand());
     {
-        json messageJson = json::parse(message);
-        int sockID = castWinsock(socket);
-
-        // Initial connection
-        if (messageJson.contains("currentName"))
-        {
-            std::string requestedName = messageJson["currentName"].get<std::string>();
-            std::string name = requestedName;
-            if (findPlayer(requestedName))
-            {
-                // If name exists, find a unique variant
-                for (int i = 1; i < 100; i++)
-                {
-                    std::string newName = requestedName + std::to_string(i);
-                    if (!findPlayer(newName))
-                    {
-                        name = newName;
-                        break;
-                    }
-                }
-            }
-
-            json newPlayer = createUser(name, socket);
-            newPlayer["local"] = true;
-            {
-                std::lock_guard<std::mutex> lock(game_mutex);
-                game["room1"]["players"].push_back(newPlayer);
-            }
-
-            json localResponse = newPlayer;
-            boost::asio::write(socket, boost::asio::buffer(localResponse.dump() + "\n"));
+        std::lock_guard<std::mutex> lock(socket_mutex);
+        sessions[session->id()] = session;
+        spectators.insert(session->id());
+    }
 
-            json gameUpdate = {{"getGame", game}};
-            boost::asio::write(socket, boost::asio::buffer(gameUpdate.dump() + "\n"));
+    std::weak_ptr<Session> weak = session;
+    connection->set_message_handler([weak, stream](websocketpp::connection_hdl, WebSocketServer::message_ptr msg)
+                                    {
+        std::shared_ptr<Session> session = weak.lock();
+        if (!session) {
             return;
         }
-
-        if (messageJson.contains("quitGame") && messageJson["quitGame"].get<bool>())
-        {
-            eraseUser(socket.native_handle());
-            json gameUpdate = {{"getGame", game}};
-            broadcastMessage(gameUpdate);
+        boost::asio::post(session->strand(), [session, stream, msg]() {
+            onWebSocketMessage(session, stream, msg->get_payload(), msg->get_opcode() == websocketpp::frame::opcode::binary);
+        }); });
+    connection->set_close_handler([weak](websocketpp::connection_hdl)
+                                  {
+        std::shared_ptr<Session> session = weak.lock();
+        if (!session) {
             return;
         }
-
-        if (messageJson.contains("x") || messageJson.contains("y") || messageJson.contains("spriteState"))
-        {
-            std::string roomName = lookForRoom(socket);
-            bool changed = false;
-            int newX = messageJson.value("x", -1);
-            int newY = messageJson.value("y", -1);
-            int spriteState = messageJson.value("spriteState", 1);
-
-            {
-                std::lock_guard<std::mutex> lock(game_mutex);
-                for (auto &p : game[roomName]["players"])
-                {
-                    if (p["socket"].get<int>() == sockID)
-                    {
-                        if (messageJson.contains("spriteState"))
-                        {
-                            p["spriteState"] = spriteState;
-                            changed = true;
-                        }
-                        if (messageJson.contains("x"))
-                        {
-                            p["x"] = newX;
-                            changed = true;
-                        }
-                        if (messageJson.contains("y"))
-                        {
-                            p["y"] = newY;
-                            changed = true;
-                        }
-                        break;
-                    }
-                }
-            }
-
-            if (messageJson.contains("shieldCount")) {
-                std::lock_guard<std::mutex> lock(game_mutex);
-                for (auto& player : game[roomName]["players"]) {
-                    if (player["socket"] == sockID) {
-                        int beforeshield = player["inventory"]["shields"].get<int>();
-                        player["inventory"]["shields"] = messageJson["shieldCount"];
-                        int aftershield = player["inventory"]["shields"].get<int>();
-                        json playerItems = {
-                            {"playerItems", {
-                                {"socket", sockID},
-                                {"get", 1},
-                                {"shields", player["inventory"]["shields"].get<int>()},
-                                {"bananas", player["inventory"]["bananas"].get<int>()}
-                            }}
-                        };
-                        if (beforeshield != aftershield) {
-                            broadcastMessage(playerItems);
-                        }
-                        break;
-                    }
-                }
-            }
-
-            if (messageJson.contains("shieldTouched") && messageJson["shieldTouched"].get<bool>()) {
-                std::lock_guard<std::mutex> lock(game_mutex);
-            
-                for (auto& roomEntry : game.items()) {
-                    auto& objects = roomEntry.value()["objects"];
-                    for (auto it = objects.begin(); it != objects.end(); ++it) {
-                        
-                        if (it->contains("objID") && (*it)["objID"] == 10) {
-                            json shieldData = *it;
-                            objects.erase(it);
-            
-                            json message = {
-                                {"updateShield", true},
-                                {"action", "delete"},
-                                {"room", roomEntry.value()["roomID"]}, // or just 2 if you only spawn in room2
-                                {"shield", shieldData}
-                            };
-
-                            //add shield to player
-                            for (auto& player : roomEntry.value()["players"]) {
-                                if (player["socket"] == sockID) {
-                                    player["inventory"]["shields"] = player["inventory"]["shields"].get<int>() + 1;
-                                    json playerItems = {
-                                        {"playerItems", {
-                                            {"socket", sockID},
-                                            {"get", 1},
-                                            {"shields", player["inventory"]["shields"].get<int>()},
-                                            {"bananas", player["inventory"]["bananas"].get<int>()}
-                                        }}
-                                    };
-                                    broadcastMessage(playerItems);
-                                    break;
-                                }
-                            }
-
-                            broadcastMessage(message);
-                            break;
-                        }
-                    }
-                }
-            }   
-
-            if (messageJson.contains("room") && lookForPlayer(socket)["room"].get<int>() != messageJson["room"].get<int>())
-            {
-                json player = lookForPlayer(socket);
-                std::string newRoomName = "room" + std::to_string(messageJson["room"].get<int>());
-                {
-                    std::lock_guard<std::mutex> lock(game_mutex);
-                    player["room"] = messageJson["room"].get<int>();
-                    if (player["room"].get<int>() == 1)
-                    {
-                        player["x"] = 90;
-                        player["y"] = 90;
-                    }
-                    else
-                    {
-                        player["x"] = 100;
-                        player["y"] = 100;
-                    }
-
-                    if (!game.contains(newRoomName))
-                    {
-                        game[newRoomName] = {
-                            {"players", json::array()},
-                            {"objects", json::array()},
-                            {"enemies", json::array()}};
-                    }
-
-                    // Remove from old room
-                    std::string oldRoomName = roomName;
-                    auto &oldRoomPlayers = game[oldRoomName]["players"];
-                    oldRoomPlayers.erase(
-                        std::remove_if(oldRoomPlayers.begin(), oldRoomPlayers.end(),
-                                       [&socket](const json &p)
-                                       {
-                                           return p["socket"] == castWinsock(socket);
-                                       }),
-                        oldRoomPlayers.end());
-
-                    // Add to new room
-                    game[newRoomName]["players"].push_back(player);
-                }
-
-                json gameUpdate = {{"getGame", game}};
-                broadcastMessage(gameUpdate);
-                changed = true;
-            }
-
-            if (changed)
-            {
-                bool crouched = (spriteState == 5);
-                int widthToSet = crouched ? 48 : 32;
-                int heightToSet = crouched ? 48 : 32;
-
-                json positionUpdate = {
-                    {"updatePosition", {{"socket", socket.native_handle()}, {"x", newX}, {"y", newY}, {"width", widthToSet}, {"height", heightToSet}, {"spriteState", spriteState}}}};
-                broadcastMessage(positionUpdate);
-            }
+        if (findSession(session->id()) == session) {
+            eraseUser(session->id());
         }
+        session->close(); });
 
-        if (messageJson.contains("requestGame") && !messageJson.contains("x") && !messageJson.contains("y"))
-        {
-            json gameUpdate = {{"getGame", game}};
-            boost::asio::write(socket, boost::asio::buffer(gameUpdate.dump() + "\n"));
-        }
+    std::cout << "New WebSocket connection!" << std::endl;
+    boost::asio::post(session->strand(), [session]()
+                      { startHeartbeat(session); });
+}
+
+// Datagrams are handled like the session's TCP messages, on its strand
+void onUdpMessage(int socketId, UdpChannel channel, json message)
+{
+    std::shared_ptr<Session> session = findSession(socketId);
+    if (!session)
+    {
+        return;
     }
-    catch (const std::exception &e)
+    // The handshake and login only happen over TCP
+    if (message.contains("wire") || message.contains("currentName"))
     {
-        std::cerr << "Error in handleMessage: " << e.what() << std::endl;
-        logToFile(std::string("Error in handleMessage: ") + e.what(), ERROR);
+        return;
     }
+    // Only what may be lost anyway is dropped over the message budget
+    bool coalescible = channel != UdpChannel::Reliable && isCoalescibleInput(message);
+    boost::asio::post(session->strand(), [session, coalescible, message = std::move(message)]()
+                      {
+        auto now = std::chrono::steady_clock::now();
+        session->heartbeat().heard(now);
+        // Datagrams are at most maxUdpPayload bytes; charged as that much
+        if (session->inbound().admitDecoded(maxUdpPayload, now, coalescible) && !handleLinkMessage(*session, message)) {
+            handleMessage(message, *session);
+        } });
 }
 
-void startReading(std::shared_ptr<tcp::socket> socket)
+// A client that stopped acking lost its UDP path along with the room events
+// still unacked on it; the whole room over TCP puts it right again
+void onUdpOverflow(int socketId)
 {
-    auto buffer = std::make_shared<boost::asio::streambuf>();
-    boost::asio::async_read_until(*socket, *buffer, "\n", [socket, buffer](boost::system::error_code ec, std::size_t)
-                                  {
-        if (!ec) {
-            std::istream is(buffer.get());
-            std::string message;
-            std::getline(is, message);
-            handleMessage(message, *socket);
-            startReading(socket);
-        } else {
-            eraseUser(castWinsock(*socket));
-            socket->close();
-        } });
+    logToFile("Reliable UDP window full for " + std::to_string(socketId) + ", back to TCP", INFO);
+    postToPlayerRoom(socketId, [socketId](RoomState &state)
+                     {
+        state.baselines[socketId].acked = 0;
+        sendGameState(state, socketId); });
 }
 
 void acceptConnections(tcp::acceptor &acceptor)
@@ -755,12 +1589,16 @@ void acceptConnections(tcp::acceptor &acceptor)
     acceptor.async_accept(*socket, [socket, &acceptor](boost::system::error_code ec)
                           {
         if (!ec) {
+            auto session = std::make_shared<TcpSession>(socket, nextSessionId++, outboundHighWater, outboundPolicy, inboundLimits);
             {
                 std::lock_guard<std::mutex> lock(socket_mutex);
-                connected_sockets.push_back(socket);
+                sessions[session->id()] = session;
             }
             std::cout << "New connection accepted!" << std::endl;
-            startReading(socket);
+            boost::asio::post(session->strand(), [session]() {
+                startReading(session);
+                startHeartbeat(session);
+            });
             acceptConnections(acceptor);
         } else {
             logToFile("Error accepting connection: " + ec.message(), ERROR);
@@ -783,152 +1621,315 @@ void cleanup()
     // Give threads time to cleanup
     std::this_thread::sleep_for(std::chrono::seconds(2));
 
-    // Close all sockets
+    // Close all sockets once their last messages are out
     {
         std::lock_guard<std::mutex> lock(socket_mutex);
-        for (auto &socket : connected_sockets)
+        std::shared_ptr<const WireMessage> quitMessage = makeWireMessage({{"quitGame", true}});
+        for (auto &[socketId, session] : sessions)
         {
-            try
-            {
-                if (socket && socket->is_open())
-                {
-                    json quitMessage = {{"quitGame", true}};
-                    boost::asio::write(*socket, boost::asio::buffer(quitMessage.dump() + "\n"));
-                    socket->shutdown(tcp::socket::shutdown_both);
-                    socket->close();
-                }
-            }
-            catch (const std::exception &e)
-            {
-                logToFile("Socket cleanup error: " + std::string(e.what()), ERROR);
-            }
+            session->send(quitMessage);
+            session->closeAfterFlush();
         }
-        connected_sockets.clear();
+        sessions.clear();
+        spectators.clear();
     }
 
     // Clear game state
     {
-        std::lock_guard<std::mutex> game_lock(game_mutex);
-        game = json::object();
+        std::lock_guard<std::mutex> lock(directory_mutex);
+        directory.clear();
+        playersInTransit.clear();
+    }
+    for (auto &[roomID, actor] : roomActors)
+    {
+        actor->post([](RoomState &state)
+                    {
+            state.room.players.clear();
+            state.clearEnemies();
+            state.handles.clear();
+            state.pendingEvents = json::array();
+            state.baselines.clear();
+            state.positions.clear();
+            state.hitImmunity.clear(); });
     }
 
     logToFile("Server cleanup completed", INFO);
 }
 
-void heartbeatThread()
+// What one room's subscribers get this tick: events (joins, spawns, deaths)
+// have to arrive, once each. Positions go out separately.
+struct RoomUpdates
 {
-    const int HEARTBEAT_INTERVAL = 5000; // 5 seconds
+    json updates = json::array();
+};
 
-    while (!shouldClose)
+// Where everyone in the room is, players and enemies. Each one stands on its
+// own, so a newer one can take the place of one that is late or lost. Runs on
+// the room's actor.
+json roomPositions(const RoomState &state)
+{
+    const PlayerTable &players = state.room.players;
+    const EnemyTable &enemies = state.room.enemies;
+    json updates = json::array();
+    for (size_t index = 0; index < players.size(); index++)
+    {
+        int socketId = players.socket[index];
+        int spriteState = players.spriteState[index];
+        bool crouched = (spriteState == 5);
+        int widthToSet = crouched ? 48 : 32;
+        int heightToSet = crouched ? 48 : 32;
+        json update = {{"socket", socketId}, {"x", players.x[index]}, {"y", players.y[index]}, {"width", widthToSet}, {"height", heightToSet}, {"spriteState", spriteState}};
+        // The owner replays its commands after this one on top of the position
+        auto input = state.inputs.find(socketId);
+        if (input != state.inputs.end() && input->second.commanded)
+        {
+            update["seq"] = input->second.lastSequence;
+        }
+        updates.push_back({{"updatePosition", std::move(update)}});
+    }
+    for (size_t i = 0; i < enemies.size(); i++)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(HEARTBEAT_INTERVAL));
+        updates.push_back({{"updateEPosition", true},
+                           {"x", static_cast<int>(enemies.x[i])},
+                           {"y", static_cast<int>(enemies.y[i])},
+                           {"width", enemies.width[i]},
+                           {"height", enemies.height[i]},
+                           {"enemyId", enemies.id[i]}});
+    }
+    return updates;
+}
 
-        std::lock_guard<std::mutex> lock(socket_mutex);
-        auto it = connected_sockets.begin();
+// Runs on the room's actor; the kernel's buffers are the room's, so a step doesn't allocate
+void stepEnemies(RoomState &state, float dt)
+{
+    Room &room = state.room;
+    if (state.wallsChanged)
+    {
+        // Every enemy is the default size, so one grid fits them all
+        EnemyRecord shape;
+        state.navigation.rebuild(state.solids(), shape.width, shape.height);
+        state.wallsChanged = false;
+    }
+    state.targets.assign(room.players);
+    state.enemyMoves.clear();
+    stepEnemyKernel(room.enemies, state.targets, dt, state.enemyMoves, &state.navigation);
+    for (const EnemyMoved &move : state.enemyMoves)
+    {
+        state.enemyGrid.update(move.enemyId, {move.x, move.y, move.width, move.height});
+    }
+}
+
+// Checks every player against the enemies where that player saw them (see
+// libs/lag_compensation.hpp). A hit costs a shield; without one the player
+// dies, and the client plays its death and respawns in room 1. Either way the
+// player can't be hit again for a while. Runs on the room's actor.
+//
+// Only enemies near the player now are rewound: ones the enemy grid finds
+// within the furthest any enemy can have moved since the oldest view time.
+void resolveEnemyHits(RoomState &state, double time, RoomUpdates &out)
+{
+    const double hitGrace = 1.0;
+    const double respawnGrace = 6.0;
 
-        while (it != connected_sockets.end())
+    PlayerTable &players = state.room.players;
+    const EnemyTable &enemies = state.room.enemies;
+    state.enemyHits.clear();
+    if (enemies.empty())
+    {
+        return;
+    }
+    // Walking for the whole rewind, plus a snap onto a player at either end
+    int fastest = *std::max_element(enemies.speed.begin(), enemies.speed.end());
+    int reach = static_cast<int>(std::ceil(fastest * (lagCompensation.maxRewind + 1.0 / tickRate))) + 2 * static_cast<int>(enemySnapDistance) + 2;
+    for (size_t i = 0; i < players.size(); i++)
+    {
+        int socketId = players.socket[i];
+        auto immune = state.hitImmunity.find(socketId);
+        if (immune != state.hitImmunity.end() && immune->second > time)
         {
-            try
-            {
-                if ((*it)->is_open())
-                {
-                    json heartbeat = {{"type", "heartbeat"}};
-                    boost::asio::write(**it, boost::asio::buffer(heartbeat.dump() + "\n"));
-                    ++it;
-                }
-                else
-                {
-                    eraseUser(castWinsock(**it));
-                    it = connected_sockets.erase(it);
-                }
-            }
-            catch (...)
+            continue;
+        }
+        auto input = state.inputs.find(socketId);
+        double rttMs = input != state.inputs.end() ? input->second.rttMs : 0;
+        double seenAt = viewTime(time, rttMs, lagCompensation);
+
+        state.enemyGrid.queryAabb({players.x[i] - reach, players.y[i] - reach, players.width[i] + 2 * reach, players.height[i] + 2 * reach}, state.nearby);
+        TrackedBox player{socketId, static_cast<float>(players.x[i]), static_cast<float>(players.y[i]), players.width[i], players.height[i]};
+        // Lowest id first, the order the whole table used to be checked in
+        int hitId = -1;
+        TrackedBox enemy;
+        for (int enemyId : state.nearby)
+        {
+            if ((hitId < 0 || enemyId < hitId) && state.positions.enemyAt(seenAt, enemyId, enemy) && touches(enemy, player))
             {
-                eraseUser(castWinsock(**it));
-                it = connected_sockets.erase(it);
+                hitId = enemyId;
             }
         }
+        if (hitId >= 0)
+        {
+            state.enemyHits.push_back({socketId, hitId});
+        }
+    }
+
+    for (const EnemyHit &hit : state.enemyHits)
+    {
+        int i = state.playerIndex(hit.socket);
+        if (players.shields[i] > 0)
+        {
+            players.shields[i]--;
+            state.hitImmunity[hit.socket] = time + hitGrace;
+            out.updates.push_back({{"playerItems", {{"socket", hit.socket}, {"get", 1}, {"shields", players.shields[i]}, {"bananas", players.bananas[i]}}}});
+        }
+        else
+        {
+            state.hitImmunity[hit.socket] = time + respawnGrace;
+            out.updates.push_back({{"playerDead", {{"socket", hit.socket}, {"enemyId", hit.enemyId}}}});
+        }
     }
 }
 
-void enemyThread()
+// One tick of one room, on the room's actor. Sends the room's subscribers two
+// {"tick", "time", "updates"} messages: the tick's events, if it had any, and
+// where everything in the room is now. "time" is when the tick started on the
+// server's clock, which clients stamp positions with.
+void stepRoom(RoomState &state, uint64_t tick, float dt, double time)
 {
-    int enemiesAllowed = 3;
-    std::cout << "Enemy thread started" << std::endl;
-    logToFile("Enemy thread started", INFO);
-    while (!shouldClose)
+    const float shieldSpawnInterval = 5.0f;
+
+    Room &room = state.room;
+    RoomUpdates out;
+
+    if (!state.pendingEvents.empty())
     {
-        try
+        out.updates = std::move(state.pendingEvents);
+        state.pendingEvents = json::array();
+    }
+
+    // An empty room lets its enemies go back to the pool and starts its waves over
+    if (room.players.empty() && !state.spawner.settings().stress)
+    {
+        state.spawner.reset();
+        if (!room.enemies.empty())
         {
-            for (int i = 0; i < 10 && !shouldClose; i++)
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            }
+            state.clearEnemies();
+        }
+    }
+    else
+    {
+        size_t due = state.spawner.due(dt, room.enemies.size());
+        EnemyRecord newEnemy;
+        size_t placed = 0;
+        for (; placed < due && placeEnemy(state, newEnemy); placed++)
+        {
+            newEnemy.id = state.addEnemy(newEnemy);
+            out.updates.push_back({{"getEnemy", newEnemy.toJson()}});
+        }
+        state.spawner.unplaced(due - placed);
+    }
 
-            {
-                std::lock_guard<std::mutex> lock(game_mutex);
-                if (!game["room2"]["players"].empty())
-                {
-                    if (game["room2"]["enemies"].size() < enemiesAllowed)
-                    {
-                        json newEnemy = createEnemy(2);
-                        game["room2"]["enemies"].push_back(newEnemy);
+    // Shields only spawn in room 2
+    if (room.roomID == 2)
+    {
+        state.shieldSpawnTimer += dt;
 
-                        json message = {{"getEnemy", newEnemy}};
-                        broadcastMessage(message);
-                    }
-                }
-                // update enemies
-                for (auto &enemy : game["room2"]["enemies"])
-                {
-                    json beforePosition = {
-                        {"x", enemy["x"]},
-                        {"y", enemy["y"]}
-                    };
-                    
-                    updateEnemy(game["room2"]["players"], enemy);
-                    
-                    // Only send update if position changed
-                    if (beforePosition["x"] != enemy["x"] || beforePosition["y"] != enemy["y"])
-                    {
-                        json message = {{"updateEPosition", true},
-                                      {"x", enemy["x"]},
-                                      {"y", enemy["y"]},
-                                      {"width", enemy["width"]},
-                                      {"height", enemy["height"]},
-                                      {"enemyId", enemy["id"]}};
-                        broadcastMessage(message);
-                    }
-                }
-            }
-        }
-        catch (const std::exception &e)
+        if (state.shieldSpawnTimer >= shieldSpawnInterval)
         {
-            std::cerr << "Error in enemy thread: " << e.what() << std::endl;
-            logToFile(std::string("Error in enemy thread: ") + e.what(), ERROR);
+            state.shieldSpawnTimer = 0.0f;
+            if (!room.players.empty() && !shieldExists(room))
+            {
+                ObjectRecord shield = createShield(state);
+                state.addObject(shield);
+                out.updates.push_back({{"updateShield", true}, {"shield", shield.toJson()}, {"room", room.roomID}, {"action", "add"}});
+            }
         }
     }
-    if (game["room2"]["players"].empty())
+
+    stepEnemies(state, dt);
+    state.positions.record(time, room.enemies, room.players);
+    resolveEnemyHits(state, time, out);
+    if (simulationRecorder.recording())
+    {
+        recordRoomEvent(state, {{"event", "step"}, {"tick", tick}, {"dt", dt}, {"time", time}, {"hash", hashRoomState(state)}});
+    }
+
+    // Events first, so a player's first position never arrives before it does
+    if (!out.updates.empty())
+    {
+        json message = {{"tick", tick}, {"time", time}, {"updates", std::move(out.updates)}};
+        broadcastToRoom(room.roomID, message, "", Delivery::Reliable);
+    }
+    if (!room.players.empty() || !room.enemies.empty())
     {
-        game["room2"]["enemies"] = json::array();
+        json message = {{"tick", tick}, {"time", time}, {"updates", roomPositions(state)}};
+        broadcastPositions(room.roomID, message);
     }
-    std::cout << "Enemy thread stopping" << std::endl;
-    logToFile("Enemy thread stopping", INFO);
 }
 
-std::shared_ptr<tcp::socket> getSocketFromId(int socketId)
+// One fixed-rate clock for every room: each tick posts a step to every room
+// actor, and the rooms step in parallel on the I/O pool. A room still busy
+// with its last step skips this one and catches up on elapsed time next time.
+void simulationThread()
 {
-    std::lock_guard<std::mutex> lock(socket_mutex);
-    auto it = std::find_if(connected_sockets.begin(), connected_sockets.end(),
-                           [socketId](const std::shared_ptr<tcp::socket> &s)
-                           {
-                               return s && s->is_open() && castWinsock(*s) == socketId;
-                           });
-    if (it != connected_sockets.end())
+    auto lastOverrunLog = std::chrono::steady_clock::time_point{};
+    std::map<int, uint64_t> skippedTicks;
+
+    simulation.onOverrun([&lastOverrunLog](uint64_t tick, std::chrono::microseconds late)
+                         {
+        auto now = std::chrono::steady_clock::now();
+        if (now - lastOverrunLog >= std::chrono::seconds(1)) {
+            lastOverrunLog = now;
+            logToFile("Tick " + std::to_string(tick) + " overran by " + std::to_string(late.count()) +
+                      "us (" + std::to_string(simulation.stats().overruns) + " overruns total)", ERROR);
+        } });
+
+    std::cout << "Simulation started at " << simulation.rate() << " Hz" << std::endl;
+    logToFile("Simulation started at " + std::to_string(simulation.rate()) + " Hz", INFO);
+
+    simulation.run(shouldClose, [&](uint64_t tick, float dt)
+                   {
+        double time = serverSeconds();
+        for (auto &[roomID, actor] : roomActors)
+        {
+            uint64_t &skipped = skippedTicks[roomID];
+            float elapsed = dt * static_cast<float>(1 + skipped);
+            bool posted = actor->postIfIdle([tick, elapsed, time](RoomState &state)
+                                            {
+                try {
+                    stepRoom(state, tick, elapsed, time);
+                } catch (const std::exception &e) {
+                    std::cerr << "Error in simulation tick: " << e.what() << std::endl;
+                    logToFile(std::string("Error in simulation tick: ") + e.what(), ERROR);
+                } });
+            skipped = posted ? 0 : skipped + 1;
+        } });
+
+    RoomActor *room2 = findRoomActor(2);
+    if (room2)
+    {
+        room2->post([](RoomState &state)
+                    {
+            if (state.room.players.empty()) {
+                state.clearEnemies();
+            } });
+    }
+    std::cout << "Simulation stopping" << std::endl;
+    logToFile("Simulation stopping", INFO);
+}
+
+// A handler that throws must not take its I/O thread down with it
+void runIoContext()
+{
+    while (!io_context.stopped())
     {
-        return *it;
+        try
+        {
+            io_context.run();
+        }
+        catch (const std::exception &e)
+        {
+            logToFile("I/O thread error: " + std::string(e.what()), ERROR);
+        }
     }
-    return nullptr;
 }
 
 void startServer(int port)
@@ -967,8 +1968,34 @@ void startServer(int port)
         // Start accepting connections
         acceptConnections(acceptor);
 
-        // Keep io_context running
-        io_context.run();
+        int udpPort = getEnvVar<int>("UDP_PORT", 0);
+        if (udpPort > 0)
+        {
+            // UDP_SIMULATED_LOSS drops that fraction of outgoing datagrams, for testing
+            double simulatedLoss = getEnvVar<double>("UDP_SIMULATED_LOSS", 0.0);
+            udpEndpoint = std::make_unique<UdpEndpoint>(io_context.get_executor(), boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::any(), udpPort), simulatedLoss);
+            udpEndpoint->onOverflow(onUdpOverflow);
+            udpEndpoint->start(onUdpMessage);
+            std::cout << "UDP transport on port " << udpEndpoint->port() << std::endl;
+            logToFile("UDP transport on port " + std::to_string(udpEndpoint->port()) + " (simulated loss " + std::to_string(simulatedLoss) + ")", INFO);
+        }
+
+        // Reads, parsing and writes for different clients (and the websocket
+        // server, which shares io_context) run on a pool of threads
+        int ioThreads = std::max(1, getEnvVar<int>("IO_THREADS", static_cast<int>(std::max(1u, std::thread::hardware_concurrency()))));
+        std::cout << "Running I/O on " << ioThreads << " threads" << std::endl;
+        logToFile("Running I/O on " + std::to_string(ioThreads) + " threads", INFO);
+
+        std::vector<std::thread> pool;
+        for (int i = 1; i < ioThreads; i++)
+        {
+            pool.emplace_back(runIoContext);
+        }
+        runIoContext();
+        for (auto &thread : pool)
+        {
+            thread.join();
+        }
     }
     catch (const std::exception &e)
     {
@@ -979,14 +2006,9 @@ void startServer(int port)
 
 void kickPlayer(int playerId)
 {
-    std::shared_ptr<tcp::socket> socket = getSocketFromId(playerId);
-    if (socket)
+    if (findSession(playerId))
     {
-        json leaveMessage = {{"quitGame", true}};
-        json othermessage = {{"playerLeft", playerId}};
-        boost::asio::write(*socket, boost::asio::buffer(leaveMessage.dump() + "\n"));
-        socket->close();
-        broadcastMessage(othermessage);
+        // Sends quitGame to the player and playerLeft to the rest of its room
         eraseUser(playerId);
     }
     else
@@ -1090,9 +2112,59 @@ void cliThread()
             // Don't print the normal prompt here, we are now waiting for ID
             continue;
         }
+        else if (input == "tick")
+        {
+            TickScheduler::Stats stats = simulation.stats();
+            std::cout << "Tick rate: " << simulation.rate() << " Hz, ticks: " << stats.ticks
+                      << ", overruns: " << stats.overruns << ", last step: " << stats.lastStepMs
+                      << " ms, worst step: " << stats.maxStepMs << " ms\n";
+        }
+        else if (input == "sessions")
+        {
+            std::lock_guard<std::mutex> lock(socket_mutex);
+            std::cout << "Outbound policy: " << backpressurePolicyName(outboundPolicy)
+                      << ", high-water mark: " << outboundHighWater << " bytes\n";
+            for (const auto &[socketId, session] : sessions)
+            {
+                Session::Stats stats = session->stats();
+                InboundLimiter::Stats inbound = session->inboundStats();
+                RttStats rtt = session->rtt();
+                std::cout << "  " << socketId << " (" << sessionTransportName(session->transport()) << "): queued " << stats.queuedBytes << " bytes, sent " << stats.sent
+                          << " in " << stats.writes << " writes, dropped " << stats.dropped << ", coalesced " << stats.coalesced
+                          << "; received " << inbound.accepted << ", coalesced " << inbound.coalesced
+                          << ", dropped " << inbound.dropped << " (" << inbound.droppedBytes << " bytes)"
+                          << "; rtt " << rtt.smoothedMs << " ms (min " << rtt.minMs << ", jitter " << rtt.jitterMs
+                          << ", " << rtt.samples << " pongs)\n";
+            }
+        }
+        else if (input == "compression")
+        {
+            WireCompressionStats &stats = wireCompressionStats();
+            uint64_t messages = stats.messages, rawBytes = stats.rawBytes, wireBytes = stats.wireBytes;
+            double ms = stats.nanoseconds / 1e6;
+            std::cout << "Compression: " << wireCompressionName(allowedCompression) << " from " << compressMinBytes << " bytes; "
+                      << messages << " messages (" << stats.incompressible << " sent as they were), "
+                      << rawBytes << " -> " << wireBytes << " bytes";
+            if (rawBytes > 0)
+            {
+                std::cout << " (" << 100.0 * wireBytes / rawBytes << "%)";
+            }
+            std::cout << ", " << ms << " ms";
+            if (rawBytes > wireBytes)
+            {
+                std::cout << " (" << stats.nanoseconds / double(rawBytes - wireBytes) << " ns per byte saved)";
+            }
+            std::cout << "\n";
+        }
         else if (input == "game")
         {
-            std::lock_guard<std::mutex> lock(game_mutex);
+            // The CLI thread is not an I/O thread, so it can wait on each room
+            json game = json::object();
+            for (auto &[roomID, actor] : roomActors)
+            {
+                game[roomName(roomID)] = actor->ask([](RoomState &state)
+                                                    { return state.room.toJson(); });
+            }
             std::cout << "\n=== CURRENT GAME STATE ===\n";
             std::cout << game.dump(2) << std::endl;
             std::cout << "========================\n\n";
@@ -1145,11 +2217,167 @@ void setupSignalHandlers()
         } });
 }
 
+// Prints the seed, and opens RECORD_SIMULATION if set. Before initWorld, so
+// the recording starts with the rooms being furnished.
+void startSimulationRecording()
+{
+    std::cout << "Simulation seed " << simulationSeed << std::endl;
+    logToFile("Simulation seed " + std::to_string(simulationSeed), INFO);
+    std::string path = getEnvVar<std::string>("RECORD_SIMULATION", "");
+    if (path.empty())
+    {
+        return;
+    }
+    if (simulationRecorder.open(path, {{"seed", simulationSeed}, {"settings", simulationSettings()}}))
+    {
+        std::cout << "Recording the simulation to " << path << std::endl;
+        logToFile("Recording the simulation to " + path, INFO);
+    }
+    else
+    {
+        logToFile("Can't record the simulation to " + path, ERROR);
+    }
+}
+
+// REPLAY_SIMULATION=<file>: steps the rooms through a recorded session
+// offline, with no clients and no clock, and checks every tick against the
+// state hash recorded for it. The first tick that differs is reported and the
+// exit code is 1; otherwise it prints how long the replay took, for timing
+// changes against the same session.
+int replaySimulation(const std::string &path)
+{
+    json header;
+    std::vector<json> events;
+    if (!readSimulationLog(path, header, events))
+    {
+        std::cerr << "Can't read a simulation recording from " << path << std::endl;
+        return 1;
+    }
+    if (header.value("settings", json()) != simulationSettings())
+    {
+        std::cerr << "Recorded with other settings; set the same environment to replay it:\n"
+                  << header.value("settings", json()).dump() << std::endl;
+        return 1;
+    }
+
+    uint64_t seed = header.value("seed", uint64_t{0});
+    std::map<int, std::unique_ptr<RoomState>> rooms;
+    for (int roomID : worldRoomIDs)
+    {
+        rooms[roomID] = std::make_unique<RoomState>(roomID, seed);
+    }
+    // What left one room and hasn't arrived in the next yet
+    std::map<int, std::pair<PlayerRecord, PlayerInput>> inTransit;
+
+    uint64_t steps = 0;
+    auto started = std::chrono::steady_clock::now();
+    for (size_t line = 0; line < events.size(); line++)
+    {
+        const json &event = events[line];
+        // The header is line 1
+        std::string where = "line " + std::to_string(line + 2);
+        auto room = rooms.find(event.value("room", 0));
+        if (room == rooms.end())
+        {
+            std::cerr << where << ": no such room" << std::endl;
+            return 1;
+        }
+        RoomState &state = *room->second;
+        std::string type = event.value("event", "");
+        int socketId = event.value("socket", 0);
+
+        if (type == "furnish")
+        {
+            furnishRoom(state);
+        }
+        else if (type == "join")
+        {
+            joinRoom(state, socketId, event.value("name", ""));
+        }
+        else if (type == "leave")
+        {
+            auto &carried = inTransit[socketId];
+            leaveRoom(state, socketId, &carried.first, &carried.second);
+        }
+        else if (type == "enter")
+        {
+            auto carried = inTransit.find(socketId);
+            if (carried == inTransit.end())
+            {
+                std::cerr << where << ": player " << socketId << " enters without having left a room" << std::endl;
+                return 1;
+            }
+            PlayerRecord player = carried->second.first;
+            player.room = state.room.roomID;
+            player.x = event.value("x", 0);
+            player.y = event.value("y", 0);
+            enterRoom(state, player, carried->second.second);
+            inTransit.erase(carried);
+        }
+        else if (type == "move")
+        {
+            applyMovement(state, {socketId,
+                                  event.value("hasX", false), event.value("x", -1),
+                                  event.value("hasY", false), event.value("y", -1),
+                                  event.value("hasSpriteState", false), event.value("spriteState", 1)});
+        }
+        else if (type == "input")
+        {
+            applyInputCommands(state, socketId, event.value("commands", json()), event.value("clock", 0.0));
+        }
+        else if (type == "shield")
+        {
+            pickUpShield(state, socketId);
+        }
+        else if (type == "rtt")
+        {
+            updateRtt(state, socketId, event.value("rttMs", 0.0));
+        }
+        else if (type == "step")
+        {
+            uint64_t tick = event.value("tick", uint64_t{0});
+            stepRoom(state, tick, event.value("dt", 0.0f), event.value("time", 0.0));
+            steps++;
+            uint64_t expected = event.value("hash", uint64_t{0});
+            uint64_t actual = hashRoomState(state);
+            if (actual != expected)
+            {
+                std::cerr << where << ": room " << state.room.roomID << " differs after tick " << tick
+                          << " (hash " << actual << ", recorded " << expected << ")" << std::endl;
+                return 1;
+            }
+        }
+        else
+        {
+            std::cerr << where << ": unknown event \"" << type << "\"" << std::endl;
+            return 1;
+        }
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cout << "Replayed " << events.size() << " events and " << steps << " room steps in " << seconds
+              << "s; every tick matched" << std::endl;
+    for (const auto &[roomID, state] : rooms)
+    {
+        std::cout << "Room " << roomID << ": " << state->room.players.size() << " players, "
+                  << state->room.enemies.size() << " enemies, hash " << hashRoomState(*state) << std::endl;
+    }
+    return 0;
+}
+
 int main()
 {
+    std::string replayPath = getEnvVar<std::string>("REPLAY_SIMULATION", "");
+    if (!replayPath.empty())
+    {
+        return replaySimulation(replayPath);
+    }
+
     try
     {
         int port = getEnvVar<int>("PORT", 5766);
+        startSimulationRecording();
+        initWorld();
         std::cout << "Starting server on port " + std::to_string(port) << std::endl;
         logToFile("Initializing server on port " + std::to_string(port), INFO);
 
@@ -1159,9 +2387,7 @@ int main()
         wss.set_access_channels(websocketpp::log::alevel::app);
 
         wss.init_asio(&io_context);
-        wss.set_message_handler(std::bind(&onWebSocketMessage, std::placeholders::_1, std::placeholders::_2));
         wss.set_open_handler(std::bind(&onWebSocketOpen, std::placeholders::_1));
-        wss.set_close_handler(std::bind(&onWebSocketClose, std::placeholders::_1));
 
         wss.listen(port + 1); // WebSocket port is HTTP port + 1
         wss.start_accept();
@@ -1182,9 +2408,7 @@ int main()
                 logToFile("Server thread error: " + std::string(e.what()), ERROR);
             } });
 
-        threads.emplace_back(enemyThread);
-        threads.emplace_back(shieldThread);
-        threads.emplace_back(heartbeatThread);
+        threads.emplace_back(simulationThread);
 
         while (!isShuttingDown)
         {
@@ -1207,6 +2431,7 @@ int main()
                 }
             }
         }
+        simulationRecorder.close();
         return 0;
     }
     catch (const std::exception &e)
@@ -0,0 +1,1778 @@
+#include <gtest/gtest.h>
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "libs/world.hpp"
+#include "libs/tick_scheduler.hpp"
+#include "libs/snapshot.hpp"
+#include "libs/session.hpp"
+#include "libs/interest.hpp"
+#include "libs/actor.hpp"
+#include "libs/wire.hpp"
+#include "libs/frame_parser.hpp"
+#include "libs/udp_transport.hpp"
+#include "libs/rate_limit.hpp"
+#include "libs/movement.hpp"
+#include "libs/interpolation.hpp"
+#include "libs/heartbeat.hpp"
+#include "libs/clock_sync.hpp"
+#include "libs/lag_compensation.hpp"
+#include "libs/enemy.hpp"
+#include "libs/spatial_hash.hpp"
+#include "libs/spawner.hpp"
+#include "libs/replay.hpp"
+
+using json = nlohmann::json;
+
+class WorldTest : public ::testing::Test {
+protected:
+    std::map<int, Room> rooms;
+
+    Room& room(int roomID) {
+        Room& r = rooms[roomID];
+        r.roomID = roomID;
+        return r;
+    }
+
+    PlayerRecord makePlayer(int socket, const std::string& name, int room = 1) {
+        PlayerRecord p;
+        p.socket = socket;
+        p.name = name;
+        p.room = room;
+        return p;
+    }
+
+    void addPlayer(const PlayerRecord& player) {
+        room(player.room).players.add(player);
+    }
+
+    void removePlayer(int roomID, int socket) {
+        PlayerTable& players = room(roomID).players;
+        players.removeAt(players.indexOfSocket(socket));
+    }
+
+    // What the room actors do between them when a player changes rooms
+    void movePlayer(int from, int to, int socket) {
+        PlayerTable& players = room(from).players;
+        int i = players.indexOfSocket(socket);
+        PlayerRecord player = players.record(i, to);
+        players.removeAt(i);
+        room(to).players.add(player);
+    }
+
+    // Every room, in the layout clients keep the game in
+    json gameJson() const {
+        json out = json::object();
+        for (const auto& [id, r] : rooms) {
+            out[roomName(id)] = r.toJson();
+        }
+        return out;
+    }
+
+    std::shared_ptr<const WorldSnapshot> snapshot(uint32_t version) const {
+        auto out = std::make_shared<WorldSnapshot>();
+        out->version = version;
+        for (const auto& [id, r] : rooms) {
+            captureRoom(r, out->rooms[id]);
+        }
+        return out;
+    }
+};
+
+// Removing a row swaps the last one into its place; handles must follow it
+TEST_F(WorldTest, HandlesSurviveSwapRemove) {
+    PlayerTable& players = room(1).players;
+    EntityHandle a = players.add(makePlayer(10, "a"));
+    EntityHandle b = players.add(makePlayer(11, "b"));
+    EntityHandle c = players.add(makePlayer(12, "c"));
+
+    players.removeAt(players.handles.indexOf(a));
+
+    EXPECT_EQ(players.handles.indexOf(a), -1);
+    EXPECT_EQ(players.socket[players.handles.indexOf(b)], 11);
+    EXPECT_EQ(players.socket[players.handles.indexOf(c)], 12);
+}
+
+// A reused slot must not resolve through a stale handle
+TEST_F(WorldTest, StaleHandleAfterSlotReuse) {
+    EnemyTable& enemies = room(2).enemies;
+    EnemyRecord e;
+    e.id = 1;
+    EntityHandle first = enemies.add(e);
+    enemies.removeAt(0);
+    e.id = 2;
+    EntityHandle second = enemies.add(e);
+
+    EXPECT_EQ(first.slot, second.slot);
+    EXPECT_EQ(enemies.handles.indexOf(first), -1);
+    EXPECT_EQ(enemies.id[enemies.handles.indexOf(second)], 2);
+}
+
+// The serialized form keeps the layout clients already parse
+TEST_F(WorldTest, JsonMatchesLegacyLayout) {
+    room(1).objects.add({2, 350, 159, 177, 74});
+    addPlayer(makePlayer(7, "legacy"));
+
+    json game = gameJson();
+    ASSERT_TRUE(game.contains("room1"));
+    EXPECT_EQ(game["room1"]["roomID"].get<int>(), 1);
+    EXPECT_EQ(game["room1"]["objects"][0]["objID"].get<int>(), 2);
+
+    const json& player = game["room1"]["players"][0];
+    EXPECT_EQ(player["socket"].get<int>(), 7);
+    EXPECT_EQ(player["inventory"]["shields"].get<int>(), 0);
+    EXPECT_FALSE(player["local"].get<bool>());
+}
+
+// The directory has to follow every login, room change and logout
+TEST(PlayerIndexTest, TracksRoomsAndNames) {
+    PlayerIndex index;
+    index.insert(1, "one", 1);
+    index.insert(2, "two", 1);
+    index.insert(3, "three", 1);
+
+    index.move(2, 2);
+    index.erase(1);
+
+    ASSERT_NE(index.find(2), nullptr);
+    EXPECT_EQ(index.find(2)->roomID, 2);
+    EXPECT_EQ(index.socketForName("three"), 3);
+    EXPECT_EQ(index.find(1), nullptr);
+    EXPECT_EQ(index.socketForName("one"), -1);
+    EXPECT_EQ(index.size(), 2u);
+}
+
+// A client that logs in twice on one socket keeps one entry, and nothing is
+// left of it once it disconnects
+TEST(PlayerIndexTest, RepeatLoginLeavesNothingBehind) {
+    PlayerIndex index;
+    EXPECT_TRUE(index.insert(1, "bob", 1));
+    EXPECT_FALSE(index.insert(1, index.uniqueName("bob"), 1));
+    EXPECT_FALSE(index.insert(2, "bob", 1));
+    EXPECT_EQ(index.socketForName("bob1"), -1);
+    EXPECT_EQ(index.size(), 1u);
+
+    index.erase(1);
+    EXPECT_EQ(index.socketForName("bob"), -1);
+    EXPECT_EQ(index.size(), 0u);
+}
+
+TEST(PlayerIndexTest, UniqueNameSkipsTakenVariants) {
+    PlayerIndex index;
+    index.insert(1, "bob", 1);
+    index.insert(2, "bob1", 1);
+
+    EXPECT_EQ(index.uniqueName("alice"), "alice");
+    EXPECT_EQ(index.uniqueName("bob"), "bob2");
+}
+
+// A client holding the baseline must end up with exactly the newer game
+TEST_F(WorldTest, DeltaRebuildsNewerGame) {
+    room(1).objects.add({2, 350, 159, 177, 74});
+    addPlayer(makePlayer(1, "stays"));
+    addPlayer(makePlayer(2, "leaves"));
+    addPlayer(makePlayer(3, "mover"));
+    auto baseline = snapshot(1);
+    json clientGame = gameJson();
+
+    PlayerTable& players = room(1).players;
+    players.x[players.indexOfSocket(1)] = 200;
+    players.shields[players.indexOfSocket(1)] = 2;
+    removePlayer(1, 2);
+    movePlayer(1, 2, 3);
+    addPlayer(makePlayer(4, "joins"));
+    room(2).objects.add({10, 40, 40, 32, 32});
+    auto current = snapshot(2);
+
+    json delta = diffSnapshots(*baseline, *current);
+    EXPECT_EQ(delta["from"].get<int>(), 1);
+    EXPECT_EQ(delta["to"].get<int>(), 2);
+
+    // Unchanged fields stay out of the delta
+    const json& room1 = delta["rooms"]["room1"];
+    ASSERT_EQ(room1["players"].size(), 2u);
+    EXPECT_FALSE(room1["players"][0].contains("name"));
+    EXPECT_TRUE(room1["objects"].empty());
+
+    EXPECT_TRUE(applyGameDelta(clientGame, delta));
+    EXPECT_EQ(clientGame, gameJson());
+}
+
+// Changed fields alone can't rebuild a player the client has dropped since the baseline
+TEST_F(WorldTest, DeltaSkipsPartialUpsertsForMissingEntities) {
+    addPlayer(makePlayer(1, "moves"));
+    auto baseline = snapshot(1);
+    json clientGame = gameJson();
+    clientGame["room1"]["players"] = json::array();
+
+    room(1).players.x[0] = 80;
+    addPlayer(makePlayer(2, "joins"));
+    json delta = diffSnapshots(*baseline, *snapshot(2));
+
+    EXPECT_FALSE(applyGameDelta(clientGame, delta));
+    // The newcomer is sent whole, so it still gets in
+    const json& players = clientGame["room1"]["players"];
+    ASSERT_EQ(players.size(), 1u);
+    EXPECT_EQ(players[0]["socket"].get<int>(), 2);
+    EXPECT_EQ(players[0]["name"].get<std::string>(), "joins");
+}
+
+// A player that came and went since the baseline isn't in either snapshot, so
+// only a copy at exactly the baseline may take the delta
+TEST_F(WorldTest, DeltaOnlyAppliesAtItsBaseline) {
+    addPlayer(makePlayer(1, "stays"));
+    auto v1 = snapshot(1);
+    json clientGame = gameJson();
+
+    addPlayer(makePlayer(2, "visits"));
+    auto v2 = snapshot(2);
+    json step = diffSnapshots(*v1, *v2);
+    ASSERT_TRUE(deltaAppliesTo(step, 1));
+    EXPECT_TRUE(applyGameDelta(clientGame, step));
+
+    removePlayer(1, 2);
+    auto v3 = snapshot(3);
+    json stale = diffSnapshots(*v1, *v3);
+    EXPECT_TRUE(stale["rooms"].empty());
+    EXPECT_FALSE(deltaAppliesTo(stale, 2));
+
+    json next = diffSnapshots(*v2, *v3);
+    ASSERT_TRUE(deltaAppliesTo(next, 2));
+    EXPECT_TRUE(applyGameDelta(clientGame, next));
+    EXPECT_EQ(clientGame, gameJson());
+}
+
+TEST_F(WorldTest, RoomDeltaLeavesOtherRoomsOut) {
+    addPlayer(makePlayer(1, "one", 1));
+    addPlayer(makePlayer(2, "two", 2));
+    auto baseline = snapshot(1);
+
+    room(1).players.x[0] = 50;
+    room(2).players.x[0] = 60;
+    json delta = diffSnapshots(*baseline, *snapshot(2), 2);
+
+    EXPECT_FALSE(delta["rooms"].contains("room1"));
+    ASSERT_TRUE(delta["rooms"].contains("room2"));
+    EXPECT_EQ(delta["rooms"]["room2"]["players"][0]["x"].get<int>(), 60);
+}
+
+TEST_F(WorldTest, HistoryForgetsOldBaselines) {
+    SnapshotHistory history(2);
+    history.push(snapshot(1));
+    history.push(snapshot(2));
+    history.push(snapshot(3));
+
+    EXPECT_EQ(history.find(1), nullptr);
+    ASSERT_NE(history.find(2), nullptr);
+    EXPECT_EQ(history.latest()->version, 3u);
+}
+
+// A clock that only moves when a step says it took time, or the scheduler sleeps
+struct FakeTime {
+    TickScheduler::Clock::time_point now{};
+
+    TickScheduler::TimeSource source() {
+        return {[this]() { return now; },
+                [this](TickScheduler::Clock::time_point t) { now = std::max(now, t); }};
+    }
+};
+
+// Steps that take most of a tick still start on the tick: deadlines follow
+// each other, not the end of the last step
+TEST(TickSchedulerTest, SlowStepsDoNotDrift) {
+    FakeTime time;
+    TickScheduler scheduler(50, time.source());
+    const auto period = std::chrono::milliseconds(20);
+    std::atomic<bool> stop{false};
+    std::vector<TickScheduler::Clock::time_point> starts;
+    scheduler.run(stop, [&](uint64_t tick, float dt) {
+        EXPECT_EQ(tick, starts.size());
+        EXPECT_FLOAT_EQ(dt, 0.02f);
+        starts.push_back(time.now);
+        time.now += std::chrono::milliseconds(12);
+        if (tick == 24) {
+            stop = true;
+        }
+    });
+
+    ASSERT_EQ(starts.size(), 25u);
+    EXPECT_EQ(scheduler.stats().ticks, 25u);
+    EXPECT_EQ(scheduler.stats().overruns, 0u);
+    EXPECT_DOUBLE_EQ(scheduler.stats().maxStepMs, 12.0);
+    for (size_t i = 1; i < starts.size(); i++) {
+        EXPECT_EQ(starts[i] - starts[i - 1], period);
+    }
+}
+
+// A step past its deadline is an overrun; one more than a tick late starts
+// the schedule over from there rather than running the missed ticks back to back
+TEST(TickSchedulerTest, OverrunsAreCountedAndResynchronize) {
+    FakeTime time;
+    TickScheduler scheduler(50, time.source());
+    const auto period = std::chrono::milliseconds(20);
+    std::atomic<bool> stop{false};
+    std::vector<uint64_t> overran;
+    std::vector<std::chrono::microseconds> lateness;
+    scheduler.onOverrun([&](uint64_t tick, std::chrono::microseconds late) {
+        overran.push_back(tick);
+        lateness.push_back(late);
+    });
+    std::vector<TickScheduler::Clock::time_point> starts;
+    scheduler.run(stop, [&](uint64_t tick, float) {
+        starts.push_back(time.now);
+        // Tick 3 runs 30 ms past its deadline, tick 7 only 5 ms
+        if (tick == 3) {
+            time.now += std::chrono::milliseconds(50);
+        } else if (tick == 7) {
+            time.now += std::chrono::milliseconds(25);
+        } else {
+            time.now += std::chrono::milliseconds(5);
+        }
+        if (tick == 11) {
+            stop = true;
+        }
+    });
+
+    EXPECT_EQ(scheduler.stats().ticks, 12u);
+    EXPECT_EQ(scheduler.stats().overruns, 2u);
+    EXPECT_EQ(overran, (std::vector<uint64_t>{3, 7}));
+    EXPECT_EQ(lateness, (std::vector<std::chrono::microseconds>{std::chrono::milliseconds(30), std::chrono::milliseconds(5)}));
+    EXPECT_DOUBLE_EQ(scheduler.stats().maxStepMs, 50.0);
+    // More than a tick late: the next tick runs at once, the one after a full period later
+    EXPECT_EQ(starts[4] - starts[3], std::chrono::milliseconds(50));
+    EXPECT_EQ(starts[5] - starts[4], period);
+    // Less than a tick late: the missed deadline is made up on the next one
+    EXPECT_EQ(starts[8] - starts[7], std::chrono::milliseconds(25));
+    EXPECT_EQ(starts[9] - starts[8], std::chrono::milliseconds(15));
+}
+
+// The io_context is never run, so everything sent stays queued
+class SessionTest : public ::testing::Test {
+protected:
+    boost::asio::io_context io;
+
+    std::shared_ptr<Session> makeSession(BackpressurePolicy policy, size_t highWater = 100) {
+        auto socket = std::make_shared<boost::asio::ip::tcp::socket>(io);
+        return std::make_shared<TcpSession>(socket, 1, highWater, policy);
+    }
+};
+
+// Keyed messages can be sent again newer; unkeyed ones would be lost for good
+TEST_F(SessionTest, DropPolicyDiscardsOnlyKeyedPastHighWater) {
+    auto session = makeSession(BackpressurePolicy::Drop);
+    EXPECT_TRUE(session->send(std::string(60, 'a'), "positions"));
+    EXPECT_FALSE(session->send(std::string(60, 'b'), "positions"));
+    EXPECT_TRUE(session->send(std::string(60, 'c')));
+
+    Session::Stats stats = session->stats();
+    EXPECT_EQ(stats.queuedBytes, 120u);
+    EXPECT_EQ(stats.dropped, 1u);
+    EXPECT_TRUE(session->open());
+}
+
+TEST_F(SessionTest, CoalescePolicyReplacesSameKey) {
+    auto session = makeSession(BackpressurePolicy::Coalesce);
+    EXPECT_TRUE(session->send(std::string(60, 'a'), "game"));
+    EXPECT_TRUE(session->send(std::string(70, 'b'), "game"));
+
+    Session::Stats stats = session->stats();
+    EXPECT_EQ(stats.queuedBytes, 70u);
+    EXPECT_EQ(stats.coalesced, 1u);
+
+    // Unkeyed messages queue up to twice the mark, then the client is cut off
+    EXPECT_TRUE(session->send(std::string(60, 'c')));
+    EXPECT_FALSE(session->send(std::string(80, 'd')));
+    EXPECT_FALSE(session->open());
+}
+
+// Event ticks go unkeyed: each carries only what happened in it, so none may stand in for another
+TEST_F(SessionTest, CoalescePolicyKeepsEveryUnkeyedMessage) {
+    auto session = makeSession(BackpressurePolicy::Coalesce);
+    EXPECT_TRUE(session->send(std::string(60, 'a')));
+    EXPECT_TRUE(session->send(std::string(50, 'b')));
+    EXPECT_TRUE(session->send(std::string(50, 'c')));
+
+    Session::Stats stats = session->stats();
+    EXPECT_EQ(stats.queuedBytes, 160u);
+    EXPECT_EQ(stats.coalesced, 0u);
+    EXPECT_TRUE(session->open());
+}
+
+// A client that stops reading keeps getting ticks: each tick's positions
+// replace the last ones still queued, and its events queue behind them
+TEST_F(SessionTest, StalledSessionKeepsTakingTicks) {
+    auto session = makeSession(BackpressurePolicy::Coalesce, 200);
+    for (int tick = 0; tick < 1000; tick++) {
+        if (tick % 100 == 0) {
+            EXPECT_TRUE(session->send("event" + std::to_string(tick)));
+        }
+        EXPECT_TRUE(session->send(std::string(80, 'p'), "positions"));
+    }
+
+    Session::Stats stats = session->stats();
+    EXPECT_TRUE(session->open());
+    EXPECT_GT(stats.coalesced, 0u);
+    // All ten events ("event0" and nine of "event100"..), and at most the two
+    // newest positions that fit under the mark
+    EXPECT_LE(stats.queuedBytes, 6u + 9 * 8u + 2 * 80u);
+    EXPECT_GE(stats.queuedBytes, 6u + 9 * 8u + 80u);
+}
+
+TEST_F(SessionTest, KickPolicyClosesPastHighWater) {
+    auto session = makeSession(BackpressurePolicy::Kick);
+    EXPECT_TRUE(session->send(std::string(60, 'a')));
+    EXPECT_FALSE(session->send(std::string(60, 'b')));
+    EXPECT_FALSE(session->open());
+    EXPECT_FALSE(session->send("late"));
+}
+
+// Several threads sending at once on a pooled io_context; every line arrives intact
+TEST(SessionLoopbackTest, ConcurrentSendsArriveWhole) {
+    using boost::asio::ip::tcp;
+    boost::asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io);
+    client.connect(acceptor.local_endpoint());
+    auto serverSocket = std::make_shared<tcp::socket>(io);
+    acceptor.accept(*serverSocket);
+
+    auto session = std::make_shared<TcpSession>(serverSocket, 1, 1 << 20, BackpressurePolicy::Coalesce);
+    auto guard = boost::asio::make_work_guard(io);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < 4; i++) {
+        pool.emplace_back([&io]() { io.run(); });
+    }
+
+    const int senders = 4;
+    const int perSender = 250;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < senders; t++) {
+        threads.emplace_back([&session, t]() {
+            for (int i = 0; i < perSender; i++) {
+                session->send("{\"sender\":" + std::to_string(t) + ",\"i\":" + std::to_string(i) + "}\n");
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    boost::asio::streambuf buffer;
+    std::istream in(&buffer);
+    std::vector<int> next(senders, 0);
+    for (int received = 0; received < senders * perSender; received++) {
+        boost::asio::read_until(client, buffer, "\n");
+        std::string line;
+        std::getline(in, line);
+        json message = json::parse(line);
+        // Order per sending thread is preserved
+        int sender = message["sender"].get<int>();
+        EXPECT_EQ(message["i"].get<int>(), next[sender]++);
+    }
+
+    guard.reset();
+    session->close();
+    io.stop();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+}
+
+TEST(SessionLoopbackTest, QueuedMessagesShareAWrite) {
+    using boost::asio::ip::tcp;
+    boost::asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io);
+    client.connect(acceptor.local_endpoint());
+    auto serverSocket = std::make_shared<tcp::socket>(io);
+    acceptor.accept(*serverSocket);
+
+    // Everything is queued before the I/O thread gets to write any of it
+    auto session = std::make_shared<TcpSession>(serverSocket, 1, 1 << 20, BackpressurePolicy::Coalesce);
+    const int messages = 100;
+    for (int i = 0; i < messages; i++) {
+        session->send("{\"i\":" + std::to_string(i) + "}\n");
+    }
+    auto guard = boost::asio::make_work_guard(io);
+    std::thread ioThread([&io]() { io.run(); });
+
+    boost::asio::streambuf buffer;
+    std::istream in(&buffer);
+    for (int i = 0; i < messages; i++) {
+        boost::asio::read_until(client, buffer, "\n");
+        std::string line;
+        std::getline(in, line);
+        EXPECT_EQ(json::parse(line)["i"].get<int>(), i);
+    }
+
+    // The bytes can arrive before the write's completion handler has run
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (session->stats().sent < messages && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    Session::Stats stats = session->stats();
+    EXPECT_EQ(stats.sent, static_cast<uint64_t>(messages));
+    EXPECT_EQ(stats.writes, (messages + TcpSession::maxBatch - 1) / TcpSession::maxBatch);
+    EXPECT_EQ(stats.queuedBytes, 0u);
+
+    guard.reset();
+    session->close();
+    io.stop();
+    ioThread.join();
+}
+
+namespace {
+const auto allCoalescible = [](const char*, size_t) { return true; };
+const auto noneCoalescible = [](const char*, size_t) { return false; };
+}
+
+TEST(InboundLimiterTest, ExcessMessagesCoalesceToTheNewest) {
+    InboundLimiter limiter({10, 2, 0, 0});
+    auto now = InboundLimiter::Clock::now();
+    std::string messages[] = {"{\"x\":1}", "{\"x\":2}", "{\"x\":3}", "{\"x\":4}"};
+    EXPECT_EQ(limiter.admit(messages[0].data(), messages[0].size(), now, allCoalescible), InboundLimiter::Verdict::Accept);
+    EXPECT_EQ(limiter.admit(messages[1].data(), messages[1].size(), now, allCoalescible), InboundLimiter::Verdict::Accept);
+    EXPECT_EQ(limiter.admit(messages[2].data(), messages[2].size(), now, allCoalescible), InboundLimiter::Verdict::Defer);
+    EXPECT_EQ(limiter.admit(messages[3].data(), messages[3].size(), now, allCoalescible), InboundLimiter::Verdict::Defer);
+
+    std::string pending;
+    EXPECT_FALSE(limiter.takePending(pending, now));
+    EXPECT_GT(limiter.untilPending(now), InboundLimiter::Clock::duration::zero());
+    EXPECT_TRUE(limiter.takePending(pending, now + std::chrono::milliseconds(100)));
+    EXPECT_EQ(pending, messages[3]);
+    EXPECT_FALSE(limiter.hasPending());
+
+    InboundLimiter::Stats stats = limiter.stats();
+    EXPECT_EQ(stats.accepted, 3u);
+    EXPECT_EQ(stats.coalesced, 1u);
+    EXPECT_EQ(stats.dropped, 0u);
+}
+
+TEST(InboundLimiterTest, OtherMessagesWaitInTurn) {
+    InboundLimiter limiter({10, 1, 0, 0});
+    auto now = InboundLimiter::Clock::now();
+    auto isChecklist = [](const char* data, size_t size) { return std::string(data, size).rfind("move", 0) == 0; };
+    std::string messages[] = {"first", "move1", "requestGame", "move2", "ackGame", "move3"};
+    EXPECT_EQ(limiter.admit(messages[0].data(), messages[0].size(), now, isChecklist), InboundLimiter::Verdict::Accept);
+    for (int i = 1; i < 6; i++) {
+        EXPECT_EQ(limiter.admit(messages[i].data(), messages[i].size(), now, isChecklist), InboundLimiter::Verdict::Defer);
+    }
+
+    // Only the newest checklist is left, behind everything that came before it
+    std::vector<std::string> handled;
+    std::string pending;
+    for (int i = 1; limiter.hasPending(); i++) {
+        ASSERT_TRUE(limiter.takePending(pending, now + i * std::chrono::milliseconds(100)));
+        handled.push_back(pending);
+    }
+    EXPECT_EQ(handled, (std::vector<std::string>{"requestGame", "ackGame", "move3"}));
+    EXPECT_EQ(limiter.stats().coalesced, 2u);
+}
+
+TEST(InboundLimiterTest, RejectsOnceTooManyAreWaiting) {
+    InboundLimiter limiter({10, 1, 0, 0});
+    auto now = InboundLimiter::Clock::now();
+    std::string message = "ackGame";
+    EXPECT_EQ(limiter.admit(message.data(), message.size(), now, noneCoalescible), InboundLimiter::Verdict::Accept);
+    for (size_t i = 0; i < InboundLimiter::maxDeferred; i++) {
+        EXPECT_EQ(limiter.admit(message.data(), message.size(), now, noneCoalescible), InboundLimiter::Verdict::Defer);
+    }
+    EXPECT_EQ(limiter.admit(message.data(), message.size(), now, noneCoalescible), InboundLimiter::Verdict::Reject);
+    // A checklist still gets its place
+    EXPECT_EQ(limiter.admit(message.data(), message.size(), now, allCoalescible), InboundLimiter::Verdict::Defer);
+    EXPECT_EQ(limiter.stats().dropped, 1u);
+}
+
+TEST(InboundLimiterTest, DecodedMessagesOverBudgetAreOnlyDroppedIfCoalescible) {
+    InboundLimiter limiter({10, 1, 0, 0});
+    auto now = InboundLimiter::Clock::now();
+    EXPECT_TRUE(limiter.admitDecoded(100, now, true));
+    EXPECT_FALSE(limiter.admitDecoded(100, now, true));
+    EXPECT_TRUE(limiter.admitDecoded(100, now, false));
+    // The one let through is paid for out of the next token
+    EXPECT_FALSE(limiter.admitDecoded(100, now + std::chrono::milliseconds(150), true));
+    EXPECT_TRUE(limiter.admitDecoded(100, now + std::chrono::milliseconds(250), true));
+}
+
+TEST(InboundLimiterTest, ByteBudgetDropsBeforeParsing) {
+    InboundLimiter limiter({0, 0, 100, 100});
+    auto now = InboundLimiter::Clock::now();
+    std::string big(80, 'x');
+    EXPECT_EQ(limiter.admit(big.data(), big.size(), now, allCoalescible), InboundLimiter::Verdict::Accept);
+    EXPECT_EQ(limiter.admit(big.data(), big.size(), now, allCoalescible), InboundLimiter::Verdict::Drop);
+    EXPECT_EQ(limiter.admit(big.data(), big.size(), now + std::chrono::seconds(1), allCoalescible), InboundLimiter::Verdict::Accept);
+    EXPECT_EQ(limiter.stats().dropped, 1u);
+    EXPECT_EQ(limiter.stats().droppedBytes, 80u);
+}
+
+TEST(MovementTest, StopsFlushAgainstWallsAndSlides) {
+    std::vector<MoveBox> walls = {{100, 0, 50, 200}};
+    MoveState state;
+    state.x = 30;
+    state.y = 50;
+    for (int i = 0; i < 10; i++) {
+        state = stepMovement(state, MoveRight | MoveDown, walls);
+    }
+    EXPECT_EQ(state.x, 100 - state.width);
+    EXPECT_EQ(state.y, 100);
+    EXPECT_EQ(state.spriteState(), 2);
+
+    state = stepMovement(state, MoveUp | MoveCrouch, walls);
+    EXPECT_EQ(state.y, 100 - crouchSpeed);
+    EXPECT_EQ(state.spriteState(), crouchSpriteState);
+}
+
+TEST(MovementTest, ServerAndClientAgreeAfterReplay) {
+    std::vector<MoveBox> walls = {{200, 0, 20, 400}};
+    InputPredictor client;
+    MoveState start;
+    start.x = 100;
+    client.reset(start);
+    uint8_t pattern[] = {MoveRight, MoveRight, MoveRight | MoveCrouch, 0, MoveDown, MoveDown, MoveLeft};
+    for (int round = 0; round < 10; round++) {
+        for (uint8_t bits : pattern) {
+            client.apply(bits, walls);
+        }
+    }
+
+    // The server has only seen the first message's worth, and skips what it has already applied
+    json sent = client.message();
+    MoveState server = start;
+    uint32_t applied = 0;
+    ASSERT_TRUE(forEachInputCommand(sent, 0, [&](const InputCommand& command) {
+        if (command.sequence <= 40) {
+            server = stepMovement(server, command.bits, walls);
+            applied = command.sequence;
+        }
+    }));
+    int calls = 0;
+    forEachInputCommand(sent, applied, [&](const InputCommand&) { calls++; });
+    EXPECT_EQ(calls, 70 - 40);
+
+    MoveState predicted = client.predicted();
+    MoveState replayed = client.reconcile(server, applied, walls);
+    EXPECT_EQ(replayed.x, predicted.x);
+    EXPECT_EQ(replayed.y, predicted.y);
+    // Only the commands after the ack are still being sent
+    json resend = client.message();
+    int unacked = 0;
+    for (const auto& run : resend["runs"]) {
+        unacked += run[1].get<int>();
+    }
+    EXPECT_EQ(resend["seq"].get<uint32_t>(), 70u);
+    EXPECT_EQ(unacked, 30);
+}
+
+TEST(MovementTest, RejectsOverlongInput) {
+    json input = {{"seq", 1000}, {"runs", {{MoveUp, maxInputBacklog + 1}}}};
+    EXPECT_FALSE(forEachInputCommand(input, 0, [](const InputCommand&) {}));
+    json underflow = {{"seq", 3}, {"runs", {{MoveUp, 5}}}};
+    EXPECT_FALSE(forEachInputCommand(underflow, 0, [](const InputCommand&) {}));
+}
+
+TEST(InterpolationTest, KeepsServerPaceDespiteJitter) {
+    SnapshotBuffer buffer;
+    // Ticks 50ms apart, arriving out of order and with a duplicate
+    buffer.push({0.10, 100, 0, 64, 64});
+    buffer.push({0.20, 200, 0, 64, 64});
+    buffer.push({0.15, 150, 0, 64, 64});
+    buffer.push({0.20, 200, 0, 64, 64});
+    EXPECT_EQ(buffer.size(), 3u);
+
+    EXPECT_FLOAT_EQ(buffer.sample(0.125, 0.25).x, 125);
+    EXPECT_FLOAT_EQ(buffer.sample(0.175, 0.25).x, 175);
+    EXPECT_FLOAT_EQ(buffer.sample(0.0, 0.25).x, 100);
+
+    // Past the newest sample it keeps going, but only so far
+    EXPECT_FLOAT_EQ(buffer.sample(0.25, 0.1).x, 250);
+    EXPECT_FLOAT_EQ(buffer.sample(1.0, 0.1).x, 300);
+    EXPECT_FLOAT_EQ(buffer.sample(1.0, 0).x, 200);
+
+    buffer.reset({0.30, 10, 10, 64, 64});
+    EXPECT_FLOAT_EQ(buffer.sample(0.5, 0.25).x, 10);
+}
+
+TEST(InterpolationTest, DropsOldestWhenFull) {
+    SnapshotBuffer buffer;
+    for (size_t i = 0; i < SnapshotBuffer::capacity + 4; i++) {
+        buffer.push({static_cast<double>(i), static_cast<float>(i), 0, 64, 64});
+    }
+    EXPECT_EQ(buffer.size(), SnapshotBuffer::capacity);
+    EXPECT_FLOAT_EQ(buffer.sample(0, 0).x, 4);
+    // Older than everything kept
+    buffer.push({1.0, -1, 0, 64, 64});
+    EXPECT_FLOAT_EQ(buffer.sample(0, 0).x, 4);
+    EXPECT_FLOAT_EQ(buffer.newest().x, SnapshotBuffer::capacity + 3);
+}
+
+TEST(InterpolationTest, ClockFollowsTheLeastDelayedTick) {
+    SnapshotClock clock;
+    clock.observe(10.0, 100.0);
+    EXPECT_DOUBLE_EQ(clock.now(100.0), 10.0);
+    // Arrived early: adopted at once
+    clock.observe(10.1, 100.05);
+    EXPECT_NEAR(clock.now(100.05), 10.1, 1e-9);
+    // Arrived late: barely moves the estimate
+    clock.observe(10.2, 100.35);
+    EXPECT_NEAR(clock.now(100.35), 10.4 - 0.2 * SnapshotClock::driftRate, 1e-9);
+    // Server restarted
+    clock.observe(0.05, 101.0);
+    EXPECT_NEAR(clock.now(101.0), 0.05, 1e-9);
+}
+
+TEST(HeartbeatTest, MatchesPongsToPings) {
+    using namespace std::chrono;
+    Heartbeat::Clock::time_point start{seconds(100)};
+    Heartbeat heartbeat(start);
+
+    json first = heartbeat.ping(start);
+    json second = heartbeat.ping(start + milliseconds(10));
+    EXPECT_TRUE(heartbeat.pong(second["ping"], start + milliseconds(60)));
+    EXPECT_TRUE(heartbeat.pong(first["ping"], start + milliseconds(80)));
+    // Answered already, never sent, or forged
+    EXPECT_FALSE(heartbeat.pong(first["ping"], start + milliseconds(90)));
+    EXPECT_FALSE(heartbeat.pong({{"id", 99}}, start + milliseconds(90)));
+    EXPECT_FALSE(heartbeat.pong({{"t", 0}}, start + milliseconds(90)));
+
+    RttStats rtt = heartbeat.rtt();
+    EXPECT_EQ(rtt.samples, 2u);
+    EXPECT_DOUBLE_EQ(rtt.lastMs, 80);
+    EXPECT_DOUBLE_EQ(rtt.minMs, 50);
+    EXPECT_DOUBLE_EQ(rtt.smoothedMs, 50 + (80 - 50) / 8.0);
+    EXPECT_DOUBLE_EQ(rtt.jitterMs, 30 / 16.0);
+
+    // Only the newest few pings can still be answered
+    json old = heartbeat.ping(start);
+    for (size_t i = 0; i < Heartbeat::maxOutstanding; i++) {
+        heartbeat.ping(start);
+    }
+    EXPECT_FALSE(heartbeat.pong(old["ping"], start + milliseconds(100)));
+}
+
+TEST(HeartbeatTest, TracksSilence) {
+    using namespace std::chrono;
+    Heartbeat::Clock::time_point start{seconds(100)};
+    Heartbeat heartbeat(start);
+    EXPECT_EQ(heartbeat.silentFor(start + seconds(3)), seconds(3));
+    heartbeat.heard(start + seconds(2));
+    EXPECT_EQ(heartbeat.silentFor(start + seconds(3)), seconds(1));
+}
+
+TEST(ClockSyncTest, ConvergesDespiteQueueingDelay) {
+    // The server's clock is 5 s ahead and runs 100 ppm fast; the path is 20 ms
+    // each way plus up to 80 ms of queueing, mostly on the way back
+    const double offset = 5.0, drift = 100e-6;
+    auto serverAt = [&](double local) { return local * (1 + drift) + offset; };
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> queueing(0.0, 0.08);
+
+    ClockSync sync(1.0);
+    double local = 1000.0;
+    for (int i = 0; i < 300; i++) {
+        ASSERT_TRUE(sync.due(local));
+        json request = sync.request(local);
+        double up = 0.02 + 0.2 * queueing(rng), down = 0.02 + queueing(rng);
+        double received = serverAt(local + up);
+        json reply = clockSyncReply(request["timeSync"], received, received + 0.001);
+        local += up + 0.001 + down;
+        ASSERT_TRUE(sync.reply(reply["timeSync"], local));
+        local += 1.0;
+    }
+    EXPECT_TRUE(sync.synced());
+    EXPECT_NEAR(sync.serverNow(local), serverAt(local), 0.005);
+    // A minute on without another exchange, the drift keeps it close
+    EXPECT_NEAR(sync.serverNow(local + 60), serverAt(local + 60), 0.01);
+
+    ClockSync::Stats stats = sync.takeStats();
+    EXPECT_EQ(stats.requests, 300u);
+    EXPECT_NEAR(stats.roundTrip, 0.04, 0.01);
+    EXPECT_NEAR(stats.drift, drift, 100e-6);
+}
+
+TEST(ClockSyncTest, RejectsNonsenseAndMeasuresOneWay) {
+    ClockSync sync;
+    EXPECT_FALSE(sync.reply({{"c", 1.0}}, 2.0));
+    // Sent after it arrived
+    EXPECT_FALSE(sync.reply({{"c", 3.0}, {"s", 0.0}, {"r", 0.0}}, 2.0));
+    EXPECT_FALSE(sync.synced());
+
+    EXPECT_TRUE(sync.reply({{"c", 10.0}, {"s", 110.05}, {"r", 110.05}}, 10.1));
+    EXPECT_NEAR(sync.serverNow(20.0), 120.0, 1e-9);
+    sync.arrived(119.97, 20.0);
+    sync.arrived(119.99, 20.0);
+    ClockSync::Stats stats = sync.takeStats();
+    EXPECT_NEAR(stats.oneWayMax, 0.03, 1e-9);
+    EXPECT_NEAR(stats.oneWayMean, 0.02, 1e-9);
+    EXPECT_EQ(sync.takeStats().oneWayMax, 0);
+}
+
+TEST(LagCompensationTest, RewindIsCappedAndNeverNegative) {
+    LagCompensationSettings settings{0.1, 0.3};
+    EXPECT_NEAR(viewTime(10.0, 100, settings), 9.85, 1e-9);
+    EXPECT_NEAR(viewTime(10.0, 2000, settings), 9.7, 1e-9);
+    EXPECT_NEAR(viewTime(10.0, -50, settings), 9.9, 1e-9);
+}
+
+TEST(LagCompensationTest, HistoryInterpolatesBetweenTicks) {
+    PositionHistory history(4);
+    EnemyTable enemies;
+    PlayerTable players;
+    enemies.add(EnemyRecord{1, 0, 0, 64, 64});
+    history.record(1.0, enemies, players);
+    enemies.x[0] = 100;
+    enemies.add(EnemyRecord{2, 500, 500, 64, 64});
+    history.record(1.1, enemies, players);
+
+    std::vector<TrackedBox> out;
+    history.enemiesAt(1.05, out);
+    // Enemy 2 only appeared in the later frame, so it wasn't there yet
+    ASSERT_EQ(out.size(), 1u);
+    EXPECT_EQ(out[0].id, 1);
+    EXPECT_NEAR(out[0].x, 50, 1e-3);
+
+    history.enemiesAt(0.5, out);
+    ASSERT_EQ(out.size(), 1u);
+    EXPECT_NEAR(out[0].x, 0, 1e-3);
+    history.enemiesAt(2.0, out);
+    EXPECT_EQ(out.size(), 2u);
+}
+
+TEST(LagCompensationTest, HistoryForgetsOldestFrames) {
+    PositionHistory history(2);
+    EnemyTable enemies;
+    PlayerTable players;
+    enemies.add(EnemyRecord{1, 0, 0, 64, 64});
+    for (int i = 0; i < 5; i++) {
+        enemies.x[0] = static_cast<float>(i * 10);
+        history.record(i, enemies, players);
+    }
+    EXPECT_EQ(history.size(), 2u);
+    std::vector<TrackedBox> out;
+    history.enemiesAt(0.0, out);
+    ASSERT_EQ(out.size(), 1u);
+    EXPECT_NEAR(out[0].x, 30, 1e-3);
+    EXPECT_TRUE(touches({0, 0, 0, 10, 10}, {1, 10, 10, 10, 10}));
+    EXPECT_FALSE(touches({0, 0, 0, 10, 10}, {1, 11, 0, 10, 10}));
+}
+
+TEST(LagCompensationTest, OneEnemyRewindsLikeAll) {
+    PositionHistory history(4);
+    EnemyTable enemies;
+    PlayerTable players;
+    enemies.add(EnemyRecord{1, 0, 0, 64, 64});
+    enemies.add(EnemyRecord{3, 10, 10, 64, 64});
+    history.record(1.0, enemies, players);
+    enemies.x[0] = 100;
+    enemies.add(EnemyRecord{2, 500, 500, 64, 64});
+    history.record(1.1, enemies, players);
+
+    std::vector<TrackedBox> all;
+    for (double time : {0.5, 1.05, 2.0}) {
+        history.enemiesAt(time, all);
+        for (int id : {1, 2, 3, 4}) {
+            TrackedBox one;
+            auto it = std::find_if(all.begin(), all.end(), [id](const TrackedBox& box) { return box.id == id; });
+            ASSERT_EQ(history.enemyAt(time, id, one), it != all.end()) << "id " << id << " at " << time;
+            if (it != all.end()) {
+                EXPECT_EQ(one.x, it->x);
+                EXPECT_EQ(one.y, it->y);
+            }
+        }
+    }
+}
+
+// Same answers as checking every box, as boxes are added, moved and removed
+TEST(SpatialHashTest, QueriesMatchBruteForce) {
+    std::mt19937 rng(3);
+    std::uniform_int_distribution<int> coord(-300, 1500);
+    std::uniform_int_distribution<int> size(0, 300);
+    SpatialHash grid(64);
+    std::map<int, SpatialBox> boxes;
+    auto overlaps = [](const SpatialBox& a, const SpatialBox& b) {
+        return rectsOverlap(a.x, a.y, a.width, a.height, b.x, b.y, b.width, b.height);
+    };
+
+    for (int round = 0; round < 40; round++) {
+        for (int change = 0; change < 25; change++) {
+            int key = static_cast<int>(rng() % 200);
+            if (rng() % 5 == 0) {
+                EXPECT_EQ(grid.remove(key), boxes.erase(key) == 1);
+            } else {
+                SpatialBox box{coord(rng), coord(rng), size(rng), size(rng)};
+                grid.update(key, box);
+                boxes[key] = box;
+            }
+        }
+        ASSERT_EQ(grid.size(), boxes.size());
+
+        SpatialBox area{coord(rng), coord(rng), size(rng), size(rng)};
+        std::vector<int> found;
+        grid.queryAabb(area, found);
+        std::sort(found.begin(), found.end());
+        std::vector<int> expected;
+        for (const auto& [key, box] : boxes) {
+            if (overlaps(area, box)) {
+                expected.push_back(key);
+            }
+        }
+        EXPECT_EQ(found, expected);
+        EXPECT_EQ(grid.anyOverlap(area), !expected.empty());
+
+        float x = static_cast<float>(coord(rng));
+        float y = static_cast<float>(coord(rng));
+        float radius = static_cast<float>(size(rng));
+        grid.queryRange(x, y, radius, found);
+        std::sort(found.begin(), found.end());
+        expected.clear();
+        std::vector<std::pair<float, int>> byDistance;
+        for (const auto& [key, box] : boxes) {
+            float d2 = SpatialHash::distanceSquared(box, x, y);
+            if (d2 <= radius * radius) {
+                expected.push_back(key);
+            }
+            byDistance.push_back({d2, key});
+        }
+        EXPECT_EQ(found, expected);
+
+        std::sort(byDistance.begin(), byDistance.end());
+        for (size_t k : {1u, 5u, 500u}) {
+            grid.queryNearest(x, y, k, found);
+            ASSERT_EQ(found.size(), std::min(k, byDistance.size()));
+            for (size_t i = 0; i < found.size(); i++) {
+                EXPECT_EQ(found[i], byDistance[i].second);
+            }
+        }
+    }
+}
+
+TEST(SpatialHashTest, MovingWithinACellOnlyUpdatesTheBox) {
+    SpatialHash grid(100);
+    grid.update(7, {10, 10, 20, 20});
+    grid.update(7, {40, 40, 20, 20});
+    EXPECT_EQ(grid.size(), 1u);
+    EXPECT_EQ(grid.find(7)->x, 40);
+    EXPECT_FALSE(grid.anyOverlap({0, 0, 5, 5}));
+    // Touching edges count, as they do for rectsOverlap
+    EXPECT_TRUE(grid.anyOverlap({60, 60, 5, 5}));
+
+    grid.update(7, {250, 250, 20, 20});
+    EXPECT_FALSE(grid.anyOverlap({40, 40, 20, 20}));
+    std::vector<int> found;
+    grid.queryNearest(0, 0, 3, found);
+    EXPECT_EQ(found, std::vector<int>{7});
+    EXPECT_TRUE(grid.remove(7));
+    EXPECT_TRUE(grid.empty());
+}
+
+TEST(EnemyKernelTest, VectorSearchMatchesScalarSearch) {
+    // Coarse coordinates so equal distances (ties) come up often
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> coord(0, 8);
+    for (int players = 0; players <= 11; players++) {
+        PlayerTable table;
+        for (int p = 0; p < players; p++) {
+            PlayerRecord record;
+            record.socket = p;
+            record.x = coord(rng) * 10;
+            record.y = coord(rng) * 10;
+            table.add(record);
+        }
+        TargetSet targets;
+        targets.assign(table);
+        for (int probe = 0; probe < 50; probe++) {
+            float x = static_cast<float>(coord(rng) * 10);
+            float y = static_cast<float>(coord(rng) * 10);
+            NearestTarget vector = nearestTarget(targets, x, y);
+            NearestTarget scalar = nearestTargetScalar(targets, x, y);
+            EXPECT_EQ(vector.index, scalar.index);
+            EXPECT_EQ(vector.distanceSquared, scalar.distanceSquared);
+        }
+    }
+}
+
+TEST(EnemyKernelTest, StepsTowardNearestAndSnapsWhenClose) {
+    PlayerTable players;
+    PlayerRecord near;
+    near.socket = 1;
+    near.x = 1000;
+    players.add(near);
+    PlayerRecord far;
+    far.socket = 2;
+    far.x = 5000;
+    players.add(far);
+
+    EnemyTable enemies;
+    enemies.add(EnemyRecord{1, 0, 0, 64, 64, 100});
+    enemies.add(EnemyRecord{2, 980, 10, 64, 64, 100});
+    TargetSet targets;
+    targets.assign(players);
+
+    std::vector<EnemyMoved> moved;
+    stepEnemyKernel(enemies, targets, 0.5f, moved);
+    EXPECT_NEAR(enemies.x[0], 50, 1e-3);
+    EXPECT_NEAR(enemies.y[0], 0, 1e-3);
+    EXPECT_EQ(enemies.x[1], 1000);
+    EXPECT_EQ(enemies.y[1], 0);
+    ASSERT_EQ(moved.size(), 2u);
+    EXPECT_EQ(moved[0].enemyId, 1);
+    EXPECT_EQ(moved[0].x, 50);
+
+    // A step shorter than a pixel moves the enemy but isn't reported
+    moved.clear();
+    stepEnemyKernel(enemies, targets, 0.001f, moved);
+    EXPECT_GT(enemies.x[0], 50);
+    EXPECT_TRUE(moved.empty());
+}
+
+TEST(EnemyKernelTest, NoPlayersNoMovement) {
+    EnemyTable enemies;
+    enemies.add(EnemyRecord{1, 40, 40, 64, 64, 100});
+    TargetSet targets;
+    targets.assign(PlayerTable{});
+    std::vector<EnemyMoved> moved;
+    stepEnemyKernel(enemies, targets, 1.0f, moved);
+    EXPECT_EQ(enemies.x[0], 40);
+    EXPECT_TRUE(moved.empty());
+}
+
+TEST(PathfindingTest, FlowLeadsAroundAWall) {
+    // A wall from the top down to y = 400 between the enemy and the player
+    std::vector<MoveBox> walls = {{400, 0, 100, 400}};
+    RoomNavigation navigation;
+    navigation.rebuild(walls, 64, 64);
+
+    PlayerTable players;
+    PlayerRecord player;
+    player.socket = 9;
+    player.x = 700;
+    player.y = 100;
+    players.add(player);
+    TargetSet targets;
+    targets.assign(players);
+
+    EnemyTable enemies;
+    enemies.add(EnemyRecord{1, 100, 100, 64, 64, 200});
+    std::vector<EnemyMoved> moved;
+    MoveState enemy;
+    bool reached = false;
+    for (int step = 0; step < 400 && !reached; step++) {
+        stepEnemyKernel(enemies, targets, 0.05f, moved, &navigation);
+        enemy.x = static_cast<int>(enemies.x[0]);
+        enemy.y = static_cast<int>(enemies.y[0]);
+        ASSERT_FALSE(overlaps(enemy, walls[0])) << "walked into the wall at " << enemy.x << "," << enemy.y;
+        reached = enemies.x[0] == 700 && enemies.y[0] == 100;
+    }
+    EXPECT_TRUE(reached);
+    // The player never changed cells, so that was one search for the whole walk
+    EXPECT_EQ(navigation.searches(), 1u);
+}
+
+TEST(PathfindingTest, EnemiesChasingOnePlayerShareAField) {
+    RoomNavigation navigation;
+    navigation.rebuild({}, 64, 64);
+    PlayerTable players;
+    PlayerRecord near;
+    near.socket = 1;
+    near.x = 100;
+    players.add(near);
+    PlayerRecord far;
+    far.socket = 2;
+    far.x = 1400;
+    far.y = 900;
+    players.add(far);
+    TargetSet targets;
+    targets.assign(players);
+
+    EnemyTable enemies;
+    for (int i = 0; i < 50; i++) {
+        enemies.add(EnemyRecord{i, 300.0f + i, 300.0f, 64, 64});
+    }
+    std::vector<EnemyMoved> moved;
+    stepEnemyKernel(enemies, targets, 0.05f, moved, &navigation);
+    EXPECT_EQ(navigation.searches(), 1u);
+    EXPECT_EQ(navigation.fieldCount(), 1u);
+
+    // The chased player moves to another cell: one more search, still one field
+    players.x[0] = 300;
+    targets.assign(players);
+    stepEnemyKernel(enemies, targets, 0.05f, moved, &navigation);
+    EXPECT_EQ(navigation.searches(), 2u);
+    EXPECT_EQ(navigation.fieldCount(), 1u);
+
+    // New walls invalidate every field
+    navigation.rebuild({{0, 600, 50, 50}}, 64, 64);
+    stepEnemyKernel(enemies, targets, 0.05f, moved, &navigation);
+    EXPECT_EQ(navigation.searches(), 3u);
+}
+
+TEST(SpawnerTest, SteadyRateStopsAtTheCap) {
+    SpawnSettings settings;
+    settings.cap = 3;
+    settings.interval = 1.0f;
+    EnemySpawner spawner(settings);
+    EXPECT_EQ(spawner.due(0.5f, 0), 0u);
+    EXPECT_EQ(spawner.due(0.5f, 0), 1u);
+    // A long step catches up, but never past the cap
+    EXPECT_EQ(spawner.due(2.0f, 1), 2u);
+    EXPECT_EQ(spawner.due(5.0f, 3), 0u);
+    // ...and a full room doesn't save spawns for later
+    EXPECT_EQ(spawner.due(0.5f, 0), 0u);
+
+    settings.interval = 0;
+    EnemySpawner fill(settings);
+    EXPECT_EQ(fill.due(0.05f, 1), 2u);
+}
+
+TEST(SpawnerTest, WavesRunInOrderAndWaitWhenFull) {
+    SpawnSettings settings;
+    settings.cap = 10;
+    settings.waves = parseSpawnWaves("2:0.5:3, 3:0:1,bad:1:1");
+    ASSERT_EQ(settings.waves.size(), 2u);
+    EnemySpawner spawner(settings);
+
+    EXPECT_EQ(spawner.due(0.5f, 0), 1u);
+    EXPECT_EQ(spawner.due(0.5f, 1), 1u);
+    // Wave one is done; three seconds' pause before wave two, which comes all at once
+    EXPECT_EQ(spawner.due(2.0f, 2), 0u);
+    EXPECT_EQ(spawner.wave(), 0u);
+    EXPECT_EQ(spawner.due(1.0f, 2), 3u);
+    EXPECT_EQ(spawner.wave(), 1u);
+
+    // Back to wave one with only one free spot: one now, the other once there's room
+    EXPECT_EQ(spawner.due(1.0f, 5), 0u);
+    EXPECT_EQ(spawner.due(0.5f, 9), 1u);
+    EXPECT_EQ(spawner.wave(), 0u);
+    EXPECT_EQ(spawner.due(5.0f, 10), 0u);
+    EXPECT_EQ(spawner.due(0.0f, 9), 1u);
+
+    spawner.reset();
+    EXPECT_EQ(spawner.wave(), 0u);
+}
+
+TEST(SpawnerTest, UnplacedSpawnsAreDueAgain) {
+    SpawnSettings settings;
+    settings.cap = 5;
+    settings.waves = parseSpawnWaves("3:0:10");
+    EnemySpawner spawner(settings);
+
+    // Only one of the wave found a spot; the other two come next step, not after the pause
+    EXPECT_EQ(spawner.due(0.05f, 0), 3u);
+    spawner.unplaced(2);
+    EXPECT_EQ(spawner.due(0.05f, 1), 2u);
+    EXPECT_EQ(spawner.due(0.05f, 3), 0u);
+
+    // ...but never past the cap, and a full room drops them like any other spawn
+    settings.waves.clear();
+    settings.interval = 1.0f;
+    EnemySpawner steady(settings);
+    EXPECT_EQ(steady.due(1.0f, 0), 1u);
+    steady.unplaced(1);
+    EXPECT_EQ(steady.due(1.0f, 4), 1u);
+    steady.unplaced(1);
+    EXPECT_EQ(steady.due(0.5f, 5), 0u);
+    EXPECT_EQ(steady.due(0.5f, 4), 1u);
+}
+
+TEST(EnemyPoolTest, IdsAreRecycledWithANewGeneration) {
+    EnemyTable enemies;
+    enemies.reserve(4);
+    const float* columnBefore = enemies.x.data();
+    for (int i = 0; i < 4; i++) {
+        enemies.add(EnemyRecord{});
+    }
+    EXPECT_EQ(enemies.x.data(), columnBefore);
+    int first = enemies.id[0];
+    EXPECT_NE(first, 0);
+    std::set<int> ids(enemies.id.begin(), enemies.id.end());
+    EXPECT_EQ(ids.size(), 4u);
+
+    // The freed slot comes back with a different id
+    enemies.removeAt(0);
+    enemies.add(EnemyRecord{});
+    EXPECT_EQ(enemies.id.back() & 0xffff, first & 0xffff);
+    EXPECT_NE(enemies.id.back(), first);
+
+    enemies.clear();
+    for (int i = 0; i < 4; i++) {
+        enemies.add(EnemyRecord{});
+        EXPECT_EQ(ids.count(enemies.id.back()), 0u);
+    }
+    EXPECT_EQ(enemies.x.data(), columnBefore);
+}
+
+// What ENEMY_STRESS=10000 runs every tick: the pool, the kernel with flow fields and the grid
+TEST(EnemyPoolTest, StressTenThousandEnemies) {
+    const size_t count = 10000;
+    EnemyTable enemies;
+    enemies.reserve(count);
+    SpatialHash grid;
+    grid.reserve(count);
+    std::mt19937 rng(5);
+    std::uniform_int_distribution<int> x(50, movementBoundsWidth - 100);
+    std::uniform_int_distribution<int> y(50, movementBoundsHeight - 100);
+    for (size_t i = 0; i < count; i++) {
+        EnemyRecord enemy;
+        enemy.x = static_cast<float>(x(rng));
+        enemy.y = static_cast<float>(y(rng));
+        enemies.add(enemy);
+        grid.update(enemies.id.back(), {static_cast<int>(enemy.x), static_cast<int>(enemy.y), enemy.width, enemy.height});
+    }
+    std::set<int> ids(enemies.id.begin(), enemies.id.end());
+    EXPECT_EQ(ids.size(), count);
+
+    PlayerTable players;
+    for (int i = 0; i < 8; i++) {
+        PlayerRecord player;
+        player.socket = i + 1;
+        player.x = x(rng);
+        player.y = y(rng);
+        players.add(player);
+    }
+    TargetSet targets;
+    targets.assign(players);
+    RoomNavigation navigation;
+    navigation.rebuild({{410, 0, 93, 260}}, 64, 64);
+    std::vector<EnemyMoved> moved;
+    for (int tick = 0; tick < 20; tick++) {
+        moved.clear();
+        stepEnemyKernel(enemies, targets, 0.05f, moved, &navigation);
+        for (const EnemyMoved& move : moved) {
+            grid.update(move.enemyId, {move.x, move.y, move.width, move.height});
+        }
+    }
+    EXPECT_EQ(grid.size(), count);
+    EXPECT_LE(navigation.fieldCount(), players.size());
+}
+
+TEST(ReplayTest, SeedsGiveTheSameNumbersEverywhere) {
+    SimRandom a(42);
+    SimRandom b(42);
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(a.next(), b.next());
+    }
+    // Known SplitMix64 output, so no library or platform can drift from it
+    EXPECT_EQ(SimRandom(0).next(), 0xe220a8397b1dcdafULL);
+    EXPECT_NE(roomSeed(42, 1), roomSeed(42, 2));
+
+    SimRandom spots(roomSeed(42, 1));
+    std::set<int> seen;
+    for (int i = 0; i < 1000; i++) {
+        int v = spots.uniform(50, 59);
+        ASSERT_GE(v, 50);
+        ASSERT_LE(v, 59);
+        seen.insert(v);
+    }
+    EXPECT_EQ(seen.size(), 10u);
+    EXPECT_EQ(spots.uniform(7, 7), 7);
+}
+
+TEST(ReplayTest, RoomHashIgnoresRowOrderButNotOneBit) {
+    Room first;
+    Room second;
+    first.roomID = second.roomID = 2;
+    for (int socket : {3, 1, 2}) {
+        PlayerRecord p;
+        p.socket = socket;
+        p.name = "p" + std::to_string(socket);
+        first.players.add(p);
+    }
+    for (int socket : {1, 2, 3}) {
+        PlayerRecord p;
+        p.socket = socket;
+        p.name = "p" + std::to_string(socket);
+        second.players.add(p);
+    }
+    EnemyRecord e;
+    e.x = 10.5f;
+    first.enemies.add(e);
+    second.enemies.add(e);
+    EXPECT_EQ(hashRoom(first), hashRoom(second));
+
+    second.enemies.x[0] = std::nextafter(second.enemies.x[0], 11.0f);
+    EXPECT_NE(hashRoom(first), hashRoom(second));
+
+    // Object uids are counted per room, so a replayed room gets the same ones
+    ObjectTable roomA;
+    ObjectTable roomB;
+    roomA.add({1, 0, 0, 10, 10});
+    roomA.add({2, 0, 0, 10, 10});
+    roomB.add({1, 0, 0, 10, 10});
+    EXPECT_EQ(roomA.uid[0], 1);
+    EXPECT_EQ(roomA.uid[1], 2);
+    EXPECT_EQ(roomB.uid[0], 1);
+}
+
+TEST(ReplayTest, RecordedStepsReplayToTheSameHash) {
+    // A room spawning from its seed and chasing a player that moves by event
+    auto run = [](uint64_t seed, const std::vector<json>& events, SimulationRecorder* recorder) {
+        Room room;
+        room.roomID = 2;
+        SimRandom rng(roomSeed(seed, room.roomID));
+        TargetSet targets;
+        std::vector<EnemyMoved> moved;
+        std::vector<uint64_t> hashes;
+        for (const json& event : events) {
+            if (recorder) {
+                recorder->record(event);
+            }
+            if (event["event"] == "join") {
+                PlayerRecord p;
+                p.socket = event["socket"];
+                room.players.add(p);
+            } else if (event["event"] == "move") {
+                room.players.x[0] = event["x"];
+            } else {
+                EnemyRecord e;
+                e.x = static_cast<float>(rng.uniform(50, 550));
+                e.y = static_cast<float>(rng.uniform(50, 250));
+                room.enemies.add(e);
+                targets.assign(room.players);
+                moved.clear();
+                stepEnemyKernel(room.enemies, targets, event["dt"].get<float>(), moved);
+                hashes.push_back(hashRoom(room));
+            }
+        }
+        return hashes;
+    };
+
+    std::vector<json> events = {{{"event", "join"}, {"socket", 1}}};
+    for (int tick = 0; tick < 50; tick++) {
+        events.push_back({{"event", "step"}, {"dt", 0.05f + 0.001f * static_cast<float>(tick % 3)}});
+        if (tick % 7 == 0) {
+            events.push_back({{"event", "move"}, {"x", tick * 13}});
+        }
+    }
+
+    std::string path = (std::filesystem::temp_directory_path() / "replay_test.jsonl").string();
+    SimulationRecorder recorder;
+    ASSERT_TRUE(recorder.open(path, {{"seed", 99}}));
+    std::vector<uint64_t> live = run(99, events, &recorder);
+    recorder.close();
+
+    json header;
+    std::vector<json> read;
+    ASSERT_TRUE(readSimulationLog(path, header, read));
+    std::remove(path.c_str());
+    ASSERT_EQ(read.size(), events.size());
+    EXPECT_EQ(run(header["seed"].get<uint64_t>(), read, nullptr), live);
+    // Another seed spawns elsewhere
+    EXPECT_NE(run(100, events, nullptr).back(), live.back());
+}
+
+TEST(RoomSubscriptionsTest, SubscribeMovesBetweenRooms) {
+    RoomSubscriptions subscriptions;
+    subscriptions.subscribe(1, 1);
+    subscriptions.subscribe(2, 1);
+    subscriptions.subscribe(1, 2);
+
+    EXPECT_EQ(subscriptions.roomOf(1), 2);
+    EXPECT_EQ(subscriptions.subscribers(1), std::set<int>({2}));
+    EXPECT_EQ(subscriptions.subscribers(2), std::set<int>({1}));
+
+    subscriptions.unsubscribe(2);
+    EXPECT_TRUE(subscriptions.subscribers(1).empty());
+    EXPECT_EQ(subscriptions.roomOf(2), 0);
+}
+
+TEST(ActorTest, MessagesRunInOrderAcrossThreads) {
+    boost::asio::io_context io;
+    auto work = boost::asio::make_work_guard(io);
+    std::vector<std::thread> pool;
+    for (int i = 0; i < 4; i++) {
+        pool.emplace_back([&io]() { io.run(); });
+    }
+
+    Actor<std::vector<int>> actor(io);
+    for (int i = 0; i < 1000; i++) {
+        actor.post([i](std::vector<int>& seen) { seen.push_back(i); });
+    }
+    std::vector<int> seen = actor.ask([](std::vector<int>& state) { return state; });
+
+    ASSERT_EQ(seen.size(), 1000u);
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ(seen[i], i);
+    }
+
+    work.reset();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+}
+
+TEST(ActorTest, PostIfIdleDropsWhileOnePending) {
+    boost::asio::io_context io;
+    Actor<int> actor(io, 0);
+
+    EXPECT_TRUE(actor.postIfIdle([](int& count) { count++; }));
+    EXPECT_FALSE(actor.postIfIdle([](int& count) { count++; }));
+    io.run();
+    io.restart();
+    EXPECT_TRUE(actor.postIfIdle([](int& count) { count++; }));
+    io.run();
+
+    int count = -1;
+    actor.post([&count](int& state) { count = state; });
+    io.restart();
+    io.run();
+    EXPECT_EQ(count, 2);
+}
+
+TEST(WireTest, ReaderSplitsMixedTextAndFrames) {
+    json position = {{"updatePosition", {{"socket", 7}, {"x", 120}, {"y", 45}, {"spriteState", 2}}}};
+    std::string stream = encodeWire({{"wire", "cbor"}}, WireFormat::Json) +
+                         encodeWire(position, WireFormat::Cbor) +
+                         encodeWire(position, WireFormat::MsgPack) +
+                         encodeWireFrame(position, WireFormat::Json);
+
+    // Byte at a time, so every message arrives split
+    WireReader reader;
+    std::vector<json> messages;
+    for (char byte : stream) {
+        reader.append(&byte, 1);
+        json out;
+        while (reader.next(out)) {
+            messages.push_back(out);
+        }
+    }
+
+    ASSERT_EQ(messages.size(), 4u);
+    EXPECT_EQ(messages[0]["wire"], "cbor");
+    EXPECT_EQ(messages[1], position);
+    EXPECT_EQ(messages[2], position);
+    EXPECT_EQ(messages[3], position);
+    EXPECT_EQ(reader.buffered(), 0u);
+    EXPECT_LT(encodeWire(position, WireFormat::Cbor).size(), encodeWire(position, WireFormat::Json).size());
+}
+
+TEST(WireTest, BadMessageIsSkipped) {
+    std::string stream = "{not json}\n" + encodeWire({{"ok", true}}, WireFormat::Json);
+    WireReader reader;
+    reader.append(stream.data(), stream.size());
+
+    json out;
+    EXPECT_THROW(reader.next(out), json::exception);
+    ASSERT_TRUE(reader.next(out));
+    EXPECT_TRUE(out["ok"].get<bool>());
+}
+
+TEST(WireTest, SessionEncodesInItsFormat) {
+    boost::asio::io_context io;
+    auto session = std::make_shared<TcpSession>(std::make_shared<boost::asio::ip::tcp::socket>(io), 1, 1024, BackpressurePolicy::Drop);
+    auto message = makeWireMessage({{"tick", 1}});
+
+    session->setWireFormat(WireFormat::MsgPack);
+    ASSERT_TRUE(session->send(message));
+    EXPECT_EQ(session->stats().queuedBytes, message->encoded(WireFormat::MsgPack)->size());
+    // Encoded once per format no matter how many sessions share it
+    EXPECT_EQ(message->encoded(WireFormat::MsgPack), message->encoded(WireFormat::MsgPack));
+}
+
+// A room's worth of players: the same keys over and over, which is what compresses
+json repetitiveRoom(int players) {
+    json room = {{"roomID", 1}, {"players", json::array()}};
+    for (int i = 0; i < players; i++) {
+        room["players"].push_back({{"name", "player" + std::to_string(i)}, {"socket", i}, {"x", i * 3}, {"y", i * 7},
+                                   {"width", 64}, {"height", 64}, {"inventory", {{"shields", 0}, {"bananas", 0}}}});
+    }
+    return {{"getRoom", room}};
+}
+
+TEST(WireTest, CompressedFramesRoundTrip) {
+    json message = repetitiveRoom(50);
+    for (WireFormat format : {WireFormat::Json, WireFormat::Cbor, WireFormat::MsgPack}) {
+        std::string compressed = encodeCompressedWire(message, format, WireCompression::Lz4);
+        ASSERT_TRUE(isCompressedWireFrame(compressed.data(), compressed.size()));
+        EXPECT_LT(compressed.size(), encodeWire(message, format).size() / 2);
+
+        WireReader reader;
+        reader.append(compressed.data(), compressed.size());
+        json out;
+        ASSERT_TRUE(reader.next(out));
+        EXPECT_EQ(out, message);
+
+        // Split across the ring's wrap, as the client reads it
+        FrameParser parser(64);
+        parser.append(std::string(40, ' ').data(), 40);
+        ASSERT_FALSE(parser.next(out));
+        parser.append(compressed.data(), compressed.size());
+        ASSERT_TRUE(parser.next(out));
+        EXPECT_EQ(out, message);
+    }
+}
+
+TEST(WireTest, IncompressibleMessagesGoOutAsTheyWere) {
+    json tick = {{"tick", 1}};
+    EXPECT_EQ(encodeCompressedWire(tick, WireFormat::Json, WireCompression::Lz4), encodeWire(tick, WireFormat::Json));
+    EXPECT_EQ(encodeCompressedWire(tick, WireFormat::Cbor, WireCompression::Lz4), encodeWire(tick, WireFormat::Cbor));
+
+    std::string corrupt = encodeCompressedWire(repetitiveRoom(20), WireFormat::Cbor, WireCompression::Lz4);
+    corrupt[corrupt.size() / 2] ^= 0x5a;
+    corrupt.resize(corrupt.size() - 3);
+    corrupt[3] -= 3;
+    EXPECT_ANY_THROW(decodeWireFrame(corrupt.data(), corrupt.size()));
+}
+
+TEST(WireTest, SessionCompressesOnlyPastTheThreshold) {
+    boost::asio::io_context io;
+    auto session = std::make_shared<TcpSession>(std::make_shared<boost::asio::ip::tcp::socket>(io), 1, 1 << 20, BackpressurePolicy::Drop);
+    session->setCompression(WireCompression::Lz4, 256);
+    auto small = makeWireMessage({{"updatePosition", {{"socket", 1}, {"x", 10}, {"y", 20}}}});
+    auto big = makeWireMessage(repetitiveRoom(50));
+
+    ASSERT_TRUE(session->send(small));
+    EXPECT_EQ(session->stats().queuedBytes, small->encoded(WireFormat::Json)->size());
+    ASSERT_TRUE(session->send(big));
+    EXPECT_EQ(session->stats().queuedBytes, small->encoded(WireFormat::Json)->size() + big->compressed(WireFormat::Json, WireCompression::Lz4)->size());
+    EXPECT_LT(big->compressed(WireFormat::Json, WireCompression::Lz4)->size(), big->encoded(WireFormat::Json)->size());
+}
+
+TEST(FrameParserTest, BracesInsideStringsDontSplitObjects) {
+    json player = {{"local", false}, {"name", "}{ \\\"tricky\\\" {{"}, {"socket", 4}};
+    std::string stream = player.dump() + "\n" + json{{"playerLeft", 4}}.dump() + "\n";
+
+    FrameParser parser(16);
+    std::vector<json> messages;
+    for (char byte : stream) {
+        parser.append(&byte, 1);
+        json out;
+        while (parser.next(out)) {
+            messages.push_back(out);
+        }
+    }
+
+    ASSERT_EQ(messages.size(), 2u);
+    EXPECT_EQ(messages[0], player);
+    EXPECT_EQ(messages[1]["playerLeft"], 4);
+}
+
+TEST(FrameParserTest, WrapsAndGrowsAcrossMixedEncodings) {
+    FrameParser parser(32);
+    json tick = {{"tick", 3}, {"updates", json::array({{{"updatePosition", {{"socket", 1}, {"x", 10}, {"y", 20}}}}})}};
+    int received = 0;
+    // Enough traffic to wrap the ring many times, with messages bigger than it
+    for (int round = 0; round < 50; round++) {
+        std::string chunk = encodeWire(tick, WireFormat::Json) + encodeWire(tick, WireFormat::Cbor);
+        parser.append(chunk.data(), chunk.size());
+        json out;
+        while (parser.next(out)) {
+            EXPECT_EQ(out, tick);
+            received++;
+        }
+    }
+    EXPECT_EQ(received, 100);
+    EXPECT_EQ(parser.buffered(), 0u);
+    EXPECT_EQ(parser.stats().skippedBytes, 0u);
+}
+
+TEST(UdpTest, StaleSequencedPacketsAreDropped) {
+    UdpConnection sender(42), receiver(42);
+    std::string first = sender.sendSequenced("1");
+    std::string second = sender.sendSequenced("2");
+    std::string third = sender.sendSequenced("3");
+
+    std::vector<std::string> delivered;
+    auto deliver = [&delivered](UdpChannel, std::string payload) { delivered.push_back(payload); };
+    EXPECT_TRUE(receiver.receive(first.data(), first.size(), deliver));
+    EXPECT_TRUE(receiver.receive(third.data(), third.size(), deliver));
+    EXPECT_TRUE(receiver.receive(second.data(), second.size(), deliver));
+    EXPECT_EQ(delivered, (std::vector<std::string>{"1", "3"}));
+    EXPECT_EQ(receiver.stats().staleDropped, 1u);
+
+    // Someone else's token is not ours to read
+    UdpConnection stranger(7);
+    std::string foreign = stranger.sendSequenced("4");
+    EXPECT_FALSE(receiver.receive(foreign.data(), foreign.size(), deliver));
+}
+
+TEST(UdpTest, ReliableSurvivesLossAndReordering) {
+    UdpConnection sender(1, std::chrono::milliseconds(10)), receiver(1, std::chrono::milliseconds(10));
+    for (int i = 0; i < 20; i++) {
+        sender.queueReliable(std::to_string(i));
+    }
+
+    std::vector<std::string> delivered;
+    auto deliver = [&delivered](UdpChannel channel, std::string payload) {
+        EXPECT_EQ(channel, UdpChannel::Reliable);
+        delivered.push_back(payload);
+    };
+    auto ignore = [](UdpChannel, std::string) {};
+    auto now = UdpConnection::Clock::now();
+    std::mt19937 random(7);
+    std::bernoulli_distribution lost(0.3);
+    for (int round = 0; round < 50 && sender.pendingReliable() > 0; round++) {
+        std::vector<std::string> outbound = sender.poll(now);
+        // A third of the datagrams are lost and the rest arrive newest first
+        std::reverse(outbound.begin(), outbound.end());
+        for (const std::string& datagram : outbound) {
+            if (!lost(random)) {
+                receiver.receive(datagram.data(), datagram.size(), deliver);
+            }
+        }
+        for (const std::string& datagram : receiver.poll(now)) {
+            if (!lost(random)) {
+                sender.receive(datagram.data(), datagram.size(), ignore);
+            }
+        }
+        now += std::chrono::milliseconds(20);
+    }
+
+    ASSERT_EQ(delivered.size(), 20u);
+    for (int i = 0; i < 20; i++) {
+        EXPECT_EQ(delivered[i], std::to_string(i));
+    }
+    EXPECT_EQ(sender.pendingReliable(), 0u);
+    EXPECT_GT(sender.stats().resent, 0u);
+}
+
+// A peer that never acks can't make the sender hold more than the receiver
+// would buffer, or get more than a poll's worth of datagrams at a time
+TEST(UdpTest, ReliableWindowIsCapped) {
+    UdpConnection sender(3, std::chrono::milliseconds(10));
+    for (int i = 0; i < UdpConnection::maxReliableWindow; i++) {
+        EXPECT_TRUE(sender.queueReliable(std::to_string(i)));
+    }
+    EXPECT_FALSE(sender.queueReliable("one too many"));
+    EXPECT_EQ(sender.pendingReliable(), size_t{UdpConnection::maxReliableWindow});
+
+    auto now = UdpConnection::Clock::now();
+    EXPECT_EQ(sender.poll(now).size(), UdpConnection::maxReliablePerPoll);
+    EXPECT_EQ(sender.poll(now).size(), UdpConnection::maxReliablePerPoll);
+    EXPECT_EQ(sender.stats().resent, 0u);
+}
+
+// A reliable message bigger than a datagram goes in fragments and comes out
+// whole, in order with the messages around it, whatever order they arrive in
+TEST(UdpTest, ReliableMessagesAreFragmented) {
+    UdpConnection sender(5), receiver(5);
+    std::string big(3 * maxUdpPayload + 17, 'x');
+    for (size_t i = 0; i < big.size(); i++) {
+        big[i] = static_cast<char>('a' + i % 26);
+    }
+    EXPECT_TRUE(sender.queueReliable("before"));
+    EXPECT_TRUE(sender.queueReliable(big));
+    EXPECT_TRUE(sender.queueReliable("after"));
+    EXPECT_EQ(sender.pendingReliable(), 6u);
+
+    std::vector<std::string> outbound = sender.poll(UdpConnection::Clock::now());
+    ASSERT_EQ(outbound.size(), 6u);
+    for (const std::string& datagram : outbound) {
+        EXPECT_LE(datagram.size(), udpHeaderSize + 3 + maxUdpPayload);
+    }
+    std::reverse(outbound.begin(), outbound.end());
+    std::vector<std::string> delivered;
+    for (const std::string& datagram : outbound) {
+        receiver.receive(datagram.data(), datagram.size(), [&delivered](UdpChannel, std::string payload) {
+            delivered.push_back(std::move(payload));
+        });
+    }
+    EXPECT_EQ(delivered, (std::vector<std::string>{"before", big, "after"}));
+
+    // One message can't take more than the whole window
+    UdpConnection small(6);
+    EXPECT_FALSE(small.queueReliable(std::string(UdpConnection::maxReliableWindow * maxUdpPayload + 1, 'y')));
+    EXPECT_EQ(small.pendingReliable(), 0u);
+}
+
+// Ids are 16 bits on the wire; well past the wrap they still arrive once
+// each and in order, and an acked window opens up again
+TEST(UdpTest, ReliableIdsWrapAround) {
+    UdpConnection sender(4, std::chrono::milliseconds(10)), receiver(4, std::chrono::milliseconds(10));
+    const int total = 70000;
+    int queued = 0;
+    int delivered = 0;
+    bool inOrder = true;
+    auto deliver = [&](UdpChannel, std::string payload) {
+        inOrder = inOrder && payload == std::to_string(delivered);
+        delivered++;
+    };
+    auto ignore = [](UdpChannel, std::string) {};
+    auto now = UdpConnection::Clock::now();
+    while (delivered < total) {
+        while (queued < total && sender.queueReliable(std::to_string(queued))) {
+            queued++;
+        }
+        for (const std::string& datagram : sender.poll(now)) {
+            receiver.receive(datagram.data(), datagram.size(), deliver);
+            std::string ack = receiver.sendAck();
+            sender.receive(ack.data(), ack.size(), ignore);
+        }
+        now += std::chrono::milliseconds(20);
+    }
+
+    EXPECT_TRUE(inOrder);
+    EXPECT_EQ(delivered, total);
+    EXPECT_EQ(sender.pendingReliable(), 0u);
+    EXPECT_EQ(receiver.stats().duplicates, 0u);
+}
+
+TEST(UdpLoopbackTest, ChannelsHoldUpUnderSimulatedLoss) {
+    using boost::asio::ip::udp;
+    boost::asio::io_context io;
+    udp::endpoint loopback(boost::asio::ip::address_v4::loopback(), 0);
+    UdpEndpoint server(io.get_executor(), loopback, 0.3, std::chrono::milliseconds(5));
+    UdpEndpoint client(io.get_executor(), loopback, 0.3, std::chrono::milliseconds(5));
+
+    std::mutex mutex;
+    std::vector<int> reliable, sequenced;
+    server.start([](int, UdpChannel, json) {});
+    client.start([&](int, UdpChannel channel, json message) {
+        std::lock_guard<std::mutex> lock(mutex);
+        (channel == UdpChannel::Reliable ? reliable : sequenced).push_back(message["i"].get<int>());
+    });
+    uint32_t token = server.expectPeer(7);
+    client.addPeer(0, token, udp::endpoint(boost::asio::ip::address_v4::loopback(), server.port()));
+
+    std::vector<std::thread> pool;
+    for (int i = 0; i < 2; i++) {
+        pool.emplace_back([&io]() { io.run(); });
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!(server.established(7) && client.established(0)) && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    ASSERT_TRUE(server.established(7));
+
+    const int messages = 50;
+    for (int i = 0; i < messages; i++) {
+        EXPECT_TRUE(server.send(7, std::make_shared<const std::string>(encodeWireFrame(json{{"i", i}}, WireFormat::Cbor)), UdpChannel::Reliable));
+        EXPECT_TRUE(server.send(7, std::make_shared<const std::string>(encodeWireFrame(json{{"i", i}}, WireFormat::Cbor)), UdpChannel::Sequenced));
+    }
+    // Too big for a datagram; the caller has to fall back to TCP
+    EXPECT_FALSE(server.send(7, std::make_shared<const std::string>(maxUdpPayload + 1, 'x'), UdpChannel::Sequenced));
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (reliable.size() == messages) {
+                break;
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+
+    server.stop();
+    client.stop();
+    io.stop();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    ASSERT_EQ(reliable.size(), static_cast<size_t>(messages));
+    for (int i = 0; i < messages; i++) {
+        EXPECT_EQ(reliable[i], i);
+    }
+    // Some movement is lost, but what arrives never goes backwards
+    EXPECT_LT(sequenced.size(), static_cast<size_t>(messages));
+    for (size_t i = 1; i < sequenced.size(); i++) {
+        EXPECT_GT(sequenced[i], sequenced[i - 1]);
+    }
+}
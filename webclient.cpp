@@ -14,6 +14,8 @@
 #include <cstring>
 #include <atomic>
 #include "coolfunctions.hpp"
+#include "libs/wire.hpp"
+#include "libs/interpolation.hpp"
 #include "raylib.h"
 
 EM_BOOL onWebSocketOpen(int eventType, const EmscriptenWebSocketOpenEvent* e, void* userData) {
@@ -299,24 +301,32 @@ struct Position {
         : x(x_), y(y_), width(width_), height(height_) {}
 };
 
+// Same settings as the native client: others are drawn this far behind the server's time
+const InterpolationSettings interpolation{
+    getEnvVar<double>("INTERPOLATION_DELAY_MS", 100) / 1000.0,
+    getEnvVar<double>("EXTRAPOLATION_LIMIT_MS", 250) / 1000.0
+};
+SnapshotClock serverClock;
+
+double localSeconds() {
+    return emscripten_get_now() / 1000.0;
+}
+
 struct PlayerState {
     Position current;
-    Position target;
-    float interpolation = 0;
+    SnapshotBuffer samples;
     int spriteState = 0;
     std::string name;
     int socketId;
-    
-    void update(float dt) {
-        if (interpolation < 1.0f) {
-            interpolation += dt * 10.0f; // Adjust this multiplier to control smoothing speed
-            if (interpolation > 1.0f) interpolation = 1.0f;
-            
-            current.x = current.x + (target.x - current.x) * interpolation;
-            current.y = current.y + (target.y - current.y) * interpolation;
-            current.width = current.width + (target.width - current.width) * interpolation;
-            current.height = current.height + (target.height - current.height) * interpolation;
-        }
+
+    void record(const Position& position, double time) {
+        samples.push(Snapshot{time, position.x, position.y, position.width, position.height});
+    }
+
+    void update(double renderTime) {
+        if (samples.empty()) return;
+        Snapshot s = samples.sample(renderTime, interpolation.maxExtrapolation);
+        current = Position(s.x, s.y, s.width, s.height);
     }
 };
 
@@ -360,6 +370,11 @@ json game; // Game state
 std::map<int, PlayerState> playerStates; // Player states
 std::map<std::string, Texture2D> spriteSheet; // Sprite sheet map
 int preferredLatency = 255; // Default interval
+WireFormat wireFormat = parseWireFormat(getEnvVar<std::string>("WIRE_FORMAT", "json")); // Binary frames once negotiated
+
+void writeMessage(const json& message) {
+    boost::asio::write(socket, boost::asio::buffer(encodeWire(message, wireFormat)));
+}
 
 // Modify the main function to initialize variables
 int screenWidth;
@@ -613,11 +628,15 @@ void mainLoop() {
     }
     // Send initialization message only once at start
     if (!initGame) {
+        // The server reads text until it is told to switch
+        if (wireFormat != WireFormat::Json) {
+            json hello = {{"wire", wireFormatName(wireFormat)}};
+            boost::asio::write(socket, boost::asio::buffer(hello.dump() + "\n"));
+        }
         json newMessage = {
             {"currentName", LocalName}
         };
-        std::string messageStr = newMessage.dump() + "\n";
-        boost::asio::write(socket, boost::asio::buffer(messageStr));
+        writeMessage(newMessage);
         std::cout << "Sent player creation request" << std::endl;
         initGame = true;
     }
@@ -795,8 +814,7 @@ void mainLoop() {
         // Only send if checklist has changed and interval has passed
         auto now = std::chrono::steady_clock::now();
         if (send && (now - lastSendTime) >= std::chrono::milliseconds(sendInterval) && checklist != previousChecklist) {
-            std::string messageStr = checklist.dump() + "\n";
-            boost::asio::write(socket, boost::asio::buffer(messageStr));
+            writeMessage(checklist);
             lastSendTime = now;
             previousChecklist = checklist; // Update previous checklist
         }
@@ -821,12 +839,11 @@ void mainLoop() {
         }
         DrawButton(buttonW);DrawButton(buttonA);DrawButton(buttonS);DrawButton(buttonD); DrawButton(buttonShift); DrawButton(buttonQuit);
 
-        float deltaTime = GetFrameTime();
-        
-        // Update all player states
+        double renderTime = serverClock.now(localSeconds()) - interpolation.delay;
+
         // Update and draw all players
         for (auto& [socketId, state] : playerStates) {
-            state.update(deltaTime);  // Updates interpolation for smooth movement
+            state.update(renderTime);
 
             // Draw player sprite based on interpolated position
             if (spriteSheet.find(std::to_string(state.spriteState)) != spriteSheet.end()) {
@@ -880,15 +897,49 @@ void mainLoop() {
 
 // WebSocket message handling
 EM_BOOL onWebSocketMessage(int eventType, const EmscriptenWebSocketMessageEvent* e, void* userData) {
-    // Handle incoming messages
+    // Handle incoming messages; binary ones are wire frames, one per message
     std::string message((char*)e->data, e->numBytes);
     
-    // Check for the specific string to stop reading
-    if (message.find("{") != std::string::npos) { //see if its json message or faulty message
+    try {
+        json messageJson;
+        if (e->isText) {
+            messageJson = json::parse(message);
+        } else if (wireFrameSize(message.data(), message.size()) == message.size()) {
+            messageJson = decodeWireFrame(message.data(), message.size());
+        } else {
+            return EM_TRUE;
+        }
         keepReading = false;
-        //do stuff here
-        std::cout << "client message received:" << message << std::endl;
 
+        // The server drops connections that never answer its pings
+        if (messageJson.contains("ping")) {
+            emscripten_websocket_send_utf8_text(wsocket, json{{"pong", messageJson["ping"]}}.dump().c_str());
+            return EM_TRUE;
+        }
+
+        // Positions are stamped with their tick's server time, or our estimate of it
+        double time = serverClock.now(localSeconds());
+        json updates = json::array({messageJson});
+        if (messageJson.contains("updates")) {
+            if (messageJson.contains("time")) {
+                time = messageJson["time"].get<double>();
+                serverClock.observe(time, localSeconds());
+            }
+            updates = messageJson["updates"];
+        }
+        for (auto& update : updates) {
+            if (update.contains("updatePosition")) {
+                auto& data = update["updatePosition"];
+                PlayerState& state = playerStates[data["socket"].get<int>()];
+                state.socketId = data["socket"].get<int>();
+                state.spriteState = data.value("spriteState", state.spriteState);
+                state.record(Position(data["x"].get<float>(), data["y"].get<float>()), time);
+            }
+        }
+        std::cout << "client message received:" << messageJson.dump() << std::endl;
+    } catch (const std::exception& ex) {
+        // Faulty message
+        std::cerr << "Bad message from server: " << ex.what() << std::endl;
     }
     
     return EM_TRUE;